@@ -23,6 +23,9 @@
 #include <poll.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
@@ -84,6 +87,14 @@ void CheckMarked(fd_set* in_out_mask, SharedFDSet* in_out_set) {
 # endif
 #endif
 
+// Linux 5.1 and 5.3 respectively, numbered the same on all architectures
+#ifndef __NR_pidfd_send_signal
+# define __NR_pidfd_send_signal 424
+#endif
+#ifndef __NR_pidfd_open
+# define __NR_pidfd_open 434
+#endif
+
 int memfd_create_wrapper(const char* name, unsigned int flags) {
 #ifdef __linux__
 #ifdef CUTTLEFISH_HOST
@@ -107,50 +118,178 @@ bool IsRegularFile(const int fd) {
 }
 
 constexpr size_t kPreferredBufferSize = 8192;
+// What CopyAllFrom asks for at once when the data doesn't go through a buffer
+constexpr size_t kMaxCopyChunkSize = 1 << 20;
+
+// How data is copied between two files, from the fastest to the most general
+enum class CopyMethod {
+  // Between regular files, possibly without reading the data at all
+  kCopyFileRange,
+  // From a regular file, without copying the data to user space
+  kSendfile,
+  // From or to a pipe, without copying the data to user space
+  kSplice,
+  kBuffer,
+};
+
+CopyMethod PreferredCopyMethod(int in_fd, int out_fd) {
+#ifdef __linux__
+  struct stat in_info;
+  struct stat out_info;
+  if (fstat(in_fd, &in_info) < 0 || fstat(out_fd, &out_info) < 0) {
+    return CopyMethod::kBuffer;
+  }
+  if (S_ISREG(in_info.st_mode) && S_ISREG(out_info.st_mode)) {
+    return CopyMethod::kCopyFileRange;
+  }
+  if (S_ISREG(in_info.st_mode)) {
+    return CopyMethod::kSendfile;
+  }
+  if (S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode)) {
+    return CopyMethod::kSplice;
+  }
+#else
+  (void)in_fd;
+  (void)out_fd;
+#endif
+  return CopyMethod::kBuffer;
+}
 
-}  // namespace
+// Whether the files don't support the method, e.g. copy_file_range across
+// file systems on older kernels, or an output opened with O_APPEND
+bool IsUnsupportedCopy(int error) {
+  return error == EINVAL || error == EXDEV || error == ENOSYS ||
+         error == EOPNOTSUPP || error == EBADF;
+}
 
-bool FileInstance::CopyFrom(FileInstance& in, size_t length) {
-  std::vector<char> buffer(kPreferredBufferSize);
-  while (length > 0) {
-    // Wait until either in becomes readable or our fd closes.
-    constexpr ssize_t IN = 0;
-    constexpr ssize_t OUT = 1;
-    struct pollfd pollfds[2];
-    pollfds[IN].fd = in.fd_;
-    pollfds[IN].events = POLLIN;
-    pollfds[IN].revents = 0;
-    pollfds[OUT].fd = fd_;
-    pollfds[OUT].events = 0;
-    pollfds[OUT].revents = 0;
-    int res = poll(pollfds, 2, -1 /* indefinitely */);
-    if (res < 0) {
-      errno_ = errno;
-      return false;
+/*
+ * Copies between two files with the fastest method they support, and falls
+ * back to copying through a buffer. The buffer is allocated on the first use
+ * and reused for the following chunks.
+ */
+class Copier {
+ public:
+  Copier(int in_fd, int out_fd)
+      : in_fd_(in_fd),
+        out_fd_(out_fd),
+        method_(PreferredCopyMethod(in_fd, out_fd)) {}
+
+  // Copies up to length bytes, returns 0 at the end of the input and -1 with
+  // errno set on failure
+  ssize_t Copy(size_t length) {
+    input_failed_ = false;
+    while (method_ != CopyMethod::kBuffer) {
+      errno = 0;
+      auto copied = CopyWithoutBuffer(length);
+      if (copied >= 0 || !IsUnsupportedCopy(errno)) {
+        return copied;
+      }
+      // Nothing was copied, so the next method can take over
+      method_ = method_ == CopyMethod::kCopyFileRange ? CopyMethod::kSendfile
+                                                      : CopyMethod::kBuffer;
     }
-    if (pollfds[OUT].revents != 0) {
-      // destination was either closed, invalid or errored, either way there is no
-      // point in continuing.
-      return false;
+    return CopyWithBuffer(length);
+  }
+
+  // Whether the last failure comes from the input rather than the output
+  bool InputFailed() const { return input_failed_; }
+
+ private:
+  ssize_t CopyWithoutBuffer(size_t length) {
+#ifdef __linux__
+    switch (method_) {
+      case CopyMethod::kCopyFileRange:
+        return TEMP_FAILURE_RETRY(
+            copy_file_range(in_fd_, nullptr, out_fd_, nullptr, length, 0));
+      case CopyMethod::kSendfile:
+        return TEMP_FAILURE_RETRY(sendfile(out_fd_, in_fd_, nullptr, length));
+      case CopyMethod::kSplice:
+        return TEMP_FAILURE_RETRY(
+            splice(in_fd_, nullptr, out_fd_, nullptr, length, SPLICE_F_MOVE));
+      case CopyMethod::kBuffer:
+        break;
     }
+#else
+    (void)length;
+#endif
+    errno = EINVAL;
+    return -1;
+  }
 
-    ssize_t num_read = in.Read(buffer.data(), std::min(buffer.size(), length));
+  ssize_t CopyWithBuffer(size_t length) {
+    buffer_.resize(kPreferredBufferSize);
+    errno = 0;
+    ssize_t num_read = TEMP_FAILURE_RETRY(
+        read(in_fd_, buffer_.data(), std::min(buffer_.size(), length)));
     if (num_read <= 0) {
-      return false;
+      input_failed_ = true;
+      return num_read;
     }
-    length -= num_read;
-
     ssize_t written = 0;
     do {
       // No need to use poll for writes: even if the source closes, the data
       // needs to be delivered to the other side.
-      auto res = Write(buffer.data(), num_read);
+      auto res = TEMP_FAILURE_RETRY(
+          write(out_fd_, buffer_.data() + written, num_read - written));
       if (res <= 0) {
         // The caller will have to log an appropriate message.
-        return false;
+        return -1;
       }
       written += res;
-    } while(written < num_read);
+    } while (written < num_read);
+    return num_read;
+  }
+
+  int in_fd_;
+  int out_fd_;
+  CopyMethod method_;
+  std::vector<char> buffer_;
+  bool input_failed_ = false;
+};
+
+}  // namespace
+
+bool FileInstance::CopyFrom(FileInstance& in, size_t length) {
+  Copier copier(in.fd_, fd_);
+  while (length > 0) {
+    // Regular files are always readable, there is nothing to wait for.
+    if (!in.IsRegular()) {
+      // Wait until either in becomes readable or our fd closes.
+      constexpr ssize_t IN = 0;
+      constexpr ssize_t OUT = 1;
+      struct pollfd pollfds[2];
+      pollfds[IN].fd = in.fd_;
+      pollfds[IN].events = POLLIN;
+      pollfds[IN].revents = 0;
+      pollfds[OUT].fd = fd_;
+      pollfds[OUT].events = 0;
+      pollfds[OUT].revents = 0;
+      int res = poll(pollfds, 2, -1 /* indefinitely */);
+      if (res < 0) {
+        errno_ = errno;
+        return false;
+      }
+      if (pollfds[OUT].revents != 0) {
+        // destination was either closed, invalid or errored, either way there is no
+        // point in continuing.
+        return false;
+      }
+    }
+
+    ssize_t copied = copier.Copy(length);
+    if (copied < 0) {
+      // splice and friends don't tell which file failed, it's reported on
+      // the output
+      if (copier.InputFailed()) {
+        in.errno_ = errno;
+      } else {
+        errno_ = errno;
+      }
+    }
+    if (copied <= 0) {
+      return false;
+    }
+    length -= copied;
   }
   return true;
 }
@@ -160,25 +299,28 @@ bool FileInstance::CopyAllFrom(FileInstance& in) {
   // the errno variable is not zeroed out before.
   errno_ = 0;
   in.errno_ = 0;
-  while (CopyFrom(in, kPreferredBufferSize)) {
+  // Chunks as large as possible when the copy doesn't go through a buffer,
+  // the buffer limits the size of the others anyway.
+  while (CopyFrom(in, kMaxCopyChunkSize)) {
   }
   // Only return false if there was an actual error.
   return !GetErrno() && !in.GetErrno();
 }
 
 void FileInstance::Close() {
-  std::stringstream message;
   if (fd_ == -1) {
     errno_ = EBADF;
   } else if (close(fd_) == -1) {
     errno_ = errno;
     if (identity_.size()) {
+      std::stringstream message;
       message << __FUNCTION__ << ": " << identity_ << " failed (" << StrError() << ")";
       std::string message_str = message.str();
       Log(message_str.c_str());
     }
   } else {
     if (identity_.size()) {
+      std::stringstream message;
       message << __FUNCTION__ << ": " << identity_ << "succeeded";
       std::string message_str = message.str();
       Log(message_str.c_str());
@@ -361,7 +503,7 @@ static void MakeAddress(const char* name, bool abstract,
 SharedFD SharedFD::Accept(const FileInstance& listener, struct sockaddr* addr,
                           socklen_t* addrlen) {
   return SharedFD(
-      std::shared_ptr<FileInstance>(listener.Accept(addr, addrlen)));
+      listener.Accept(addr, addrlen));
 }
 
 SharedFD SharedFD::Accept(const FileInstance& listener) {
@@ -371,15 +513,15 @@ SharedFD SharedFD::Accept(const FileInstance& listener) {
 SharedFD SharedFD::Dup(int unmanaged_fd) {
   int fd = fcntl(unmanaged_fd, F_DUPFD_CLOEXEC, 3);
   int error_num = errno;
-  return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, error_num)));
+  return SharedFD(FileInstance::Create(fd, error_num));
 }
 
 bool SharedFD::Pipe(SharedFD* fd0, SharedFD* fd1) {
   int fds[2];
   int rval = pipe(fds);
   if (rval != -1) {
-    (*fd0) = std::shared_ptr<FileInstance>(new FileInstance(fds[0], errno));
-    (*fd1) = std::shared_ptr<FileInstance>(new FileInstance(fds[1], errno));
+    (*fd0) = FileInstance::Create(fds[0], errno);
+    (*fd1) = FileInstance::Create(fds[1], errno);
     return true;
   }
   return false;
@@ -388,14 +530,25 @@ bool SharedFD::Pipe(SharedFD* fd0, SharedFD* fd1) {
 #ifdef __linux__
 SharedFD SharedFD::Event(int initval, int flags) {
   int fd = eventfd(initval, flags);
-  return std::shared_ptr<FileInstance>(new FileInstance(fd, errno));
+  return FileInstance::Create(fd, errno);
+}
+
+SharedFD SharedFD::Inotify(int flags) {
+  int fd = inotify_init1(flags | IN_CLOEXEC);
+  return FileInstance::Create(fd, errno);
+}
+
+SharedFD SharedFD::PidFdOpen(pid_t pid, unsigned int flags) {
+  // pidfds are always close-on-exec
+  int fd = syscall(__NR_pidfd_open, pid, flags);
+  return FileInstance::Create(fd, errno);
 }
 #endif
 
 SharedFD SharedFD::MemfdCreate(const std::string& name, unsigned int flags) {
   int fd = memfd_create_wrapper(name.c_str(), flags);
   int error_num = errno;
-  return std::shared_ptr<FileInstance>(new FileInstance(fd, error_num));
+  return FileInstance::Create(fd, error_num);
 }
 
 SharedFD SharedFD::MemfdCreateWithData(const std::string& name, const std::string& data, unsigned int flags) {
@@ -417,8 +570,8 @@ bool SharedFD::SocketPair(int domain, int type, int protocol,
   int fds[2];
   int rval = socketpair(domain, type, protocol, fds);
   if (rval != -1) {
-    (*fd0) = std::shared_ptr<FileInstance>(new FileInstance(fds[0], errno));
-    (*fd1) = std::shared_ptr<FileInstance>(new FileInstance(fds[1], errno));
+    (*fd0) = FileInstance::Create(fds[0], errno);
+    (*fd1) = FileInstance::Create(fds[1], errno);
     return true;
   }
   return false;
@@ -431,9 +584,9 @@ SharedFD SharedFD::Open(const std::string& path, int flags, mode_t mode) {
 SharedFD SharedFD::Open(const char* path, int flags, mode_t mode) {
   int fd = TEMP_FAILURE_RETRY(open(path, flags, mode));
   if (fd == -1) {
-    return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, errno)));
+    return SharedFD(FileInstance::Create(fd, errno));
   } else {
-    return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, 0)));
+    return SharedFD(FileInstance::Create(fd, 0));
   }
 }
 
@@ -469,23 +622,23 @@ SharedFD SharedFD::Fifo(const std::string& path, mode_t mode) {
 SharedFD SharedFD::Socket(int domain, int socket_type, int protocol) {
   int fd = TEMP_FAILURE_RETRY(socket(domain, socket_type, protocol));
   if (fd == -1) {
-    return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, errno)));
+    return SharedFD(FileInstance::Create(fd, errno));
   } else {
-    return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, 0)));
+    return SharedFD(FileInstance::Create(fd, 0));
   }
 }
 
 SharedFD SharedFD::Mkstemp(std::string* path) {
   int fd = mkstemp(path->data());
   if (fd == -1) {
-    return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, errno)));
+    return SharedFD(FileInstance::Create(fd, errno));
   } else {
-    return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(fd, 0)));
+    return SharedFD(FileInstance::Create(fd, 0));
   }
 }
 
 SharedFD SharedFD::ErrorFD(int error) {
-  return SharedFD(std::shared_ptr<FileInstance>(new FileInstance(-1, error)));
+  return SharedFD(FileInstance::Create(-1, error));
 }
 
 SharedFD SharedFD::SocketLocalClient(const std::string& name, bool abstract,
@@ -726,7 +879,7 @@ ScopedMMap::~ScopedMMap() {
 }
 
 /* static */ std::shared_ptr<FileInstance> FileInstance::ClosedInstance() {
-  return std::shared_ptr<FileInstance>(new FileInstance(-1, EBADF));
+  return FileInstance::Create(-1, EBADF);
 }
 
 int FileInstance::Bind(const struct sockaddr* addr, socklen_t addrlen) {
@@ -764,6 +917,13 @@ int FileInstance::Fcntl(int command, int value) {
   return rval;
 }
 
+int FileInstance::Fstat(struct stat* buf) {
+  errno = 0;
+  int rval = TEMP_FAILURE_RETRY(fstat(fd_, buf));
+  errno_ = errno;
+  return rval;
+}
+
 int FileInstance::Fsync() {
   errno = 0;
   int rval = TEMP_FAILURE_RETRY(fsync(fd_));
@@ -856,6 +1016,27 @@ int FileInstance::EventfdRead(eventfd_t* value) {
   errno_ = errno;
   return rval;
 }
+
+int FileInstance::InotifyAddWatch(const std::string& pathname, uint32_t mask) {
+  errno = 0;
+  int rval = inotify_add_watch(fd_, pathname.c_str(), mask);
+  errno_ = errno;
+  return rval;
+}
+
+int FileInstance::InotifyRmWatch(int wd) {
+  errno = 0;
+  int rval = inotify_rm_watch(fd_, wd);
+  errno_ = errno;
+  return rval;
+}
+
+int FileInstance::PidFdSendSignal(int sig) {
+  errno = 0;
+  int rval = syscall(__NR_pidfd_send_signal, fd_, sig, nullptr, 0);
+  errno_ = errno;
+  return rval;
+}
 #endif
 
 ssize_t FileInstance::Send(const void* buf, size_t len, int flags) {
@@ -879,6 +1060,17 @@ int FileInstance::Shutdown(int how) {
   return rval;
 }
 
+#ifdef __linux__
+ssize_t FileInstance::SpliceFrom(FileInstance& in, size_t length,
+                                 unsigned int flags) {
+  errno = 0;
+  ssize_t rval = TEMP_FAILURE_RETRY(
+      splice(in.fd_, nullptr, fd_, nullptr, length, flags));
+  errno_ = errno;
+  return rval;
+}
+#endif
+
 int FileInstance::SetSockOpt(int level, int optname, const void* optval,
                              socklen_t optlen) {
   errno = 0;
@@ -969,22 +1161,43 @@ Result<std::string> FileInstance::ProcFdLinkTarget() const {
 #endif
 
 FileInstance::FileInstance(int fd, int in_errno)
-    : fd_(fd), errno_(in_errno), is_regular_file_(IsRegularFile(fd_)) {
+    : fd_(fd), errno_(in_errno) {
+  // Closed instances are created for every default SharedFD and every
+  // failure, and have nothing to set up
+  if (fd_ == -1) {
+    return;
+  }
   // Ensure every file descriptor managed by a FileInstance has the CLOEXEC
   // flag
   TEMP_FAILURE_RETRY(fcntl(fd, F_SETFD, FD_CLOEXEC));
+#if ENABLE_GCE_SHARED_FD_LOGGING
+  // Only logged, not worth formatting otherwise
   std::stringstream identity;
   identity << "fd=" << fd << " @" << this;
   identity_ = identity.str();
+#endif
+}
+
+bool FileInstance::IsRegular() const {
+  int is_regular = is_regular_file_.load(std::memory_order_relaxed);
+  if (is_regular < 0) {
+    is_regular = IsRegularFile(fd_);
+    is_regular_file_.store(is_regular, std::memory_order_relaxed);
+  }
+  return is_regular;
+}
+
+std::shared_ptr<FileInstance> FileInstance::Create(int fd, int in_errno) {
+  return std::make_shared<FileInstance>(ConstructorKey(), fd, in_errno);
 }
 
-FileInstance* FileInstance::Accept(struct sockaddr* addr,
-                                   socklen_t* addrlen) const {
+std::shared_ptr<FileInstance> FileInstance::Accept(struct sockaddr* addr,
+                                                   socklen_t* addrlen) const {
   int fd = TEMP_FAILURE_RETRY(accept(fd_, addr, addrlen));
   if (fd == -1) {
-    return new FileInstance(fd, errno);
+    return Create(fd, errno);
   } else {
-    return new FileInstance(fd, 0);
+    return Create(fd, 0);
   }
 }
 
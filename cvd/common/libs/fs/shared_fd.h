@@ -22,6 +22,7 @@
 #ifdef __linux__
 #include <sys/epoll.h>
 #include <sys/eventfd.h>
+#include <sys/inotify.h>
 #endif
 #include <sys/ioctl.h>
 #include <sys/mman.h>
@@ -33,6 +34,7 @@
 #include <sys/uio.h>
 #include <sys/un.h>
 
+#include <atomic>
 #include <chrono>
 #include <memory>
 #include <sstream>
@@ -143,6 +145,9 @@ class SharedFD {
   static bool Pipe(SharedFD* fd0, SharedFD* fd1);
 #ifdef __linux__
   static SharedFD Event(int initval = 0, int flags = 0);
+  static SharedFD Inotify(int flags = 0);
+  // Refers to the process itself, so it is not fooled by a recycled pid
+  static SharedFD PidFdOpen(pid_t pid, unsigned int flags = 0);
 #endif
   static SharedFD MemfdCreate(const std::string& name, unsigned int flags = 0);
   static SharedFD MemfdCreateWithData(const std::string& name, const std::string& data, unsigned int flags = 0);
@@ -262,7 +267,14 @@ class FileInstance {
   friend class SharedFD;
   friend class Epoll;
 
+  // Lets std::make_shared call the constructor, which is private otherwise.
+  struct ConstructorKey {
+    explicit ConstructorKey() = default;
+  };
+
  public:
+  FileInstance(ConstructorKey, int fd, int in_errno)
+      : FileInstance(fd, in_errno) {}
   virtual ~FileInstance() { Close(); }
 
   // This can't be a singleton because our shared_ptr's aren't thread safe.
@@ -288,6 +300,7 @@ class FileInstance {
   int UNMANAGED_Dup2(int newfd);
   int Fchdir();
   int Fcntl(int command, int value);
+  int Fstat(struct stat* buf);
   int Fsync();
 
   Result<void> Flock(int operation);
@@ -305,8 +318,9 @@ class FileInstance {
   // in probably isn't modified, but the API spec doesn't have const.
   bool IsSet(fd_set* in) const;
 
-  // whether this is a regular file or not
-  bool IsRegular() const { return is_regular_file_; }
+  // whether this is a regular file or not. Checked on the first call, so
+  // false when that is after Close(), as for any closed instance.
+  bool IsRegular() const;
 
   /**
    * Adds a hard link to a file descriptor, based on the current working
@@ -326,6 +340,11 @@ class FileInstance {
   ssize_t Read(void* buf, size_t count);
 #ifdef __linux__
   int EventfdRead(eventfd_t* value);
+  // Returns the watch descriptor, or -1 on failure
+  int InotifyAddWatch(const std::string& pathname, uint32_t mask);
+  int InotifyRmWatch(int wd);
+  // For fds from PidFdOpen. Fails with ESRCH once the process is gone.
+  int PidFdSendSignal(int sig);
 #endif
   ssize_t Send(const void* buf, size_t len, int flags);
   ssize_t SendMsg(const struct msghdr* msg, int flags);
@@ -341,6 +360,11 @@ class FileInstance {
   }
 
   int Shutdown(int how);
+#ifdef __linux__
+  // Moves up to length bytes from in to this file without copying them to
+  // user space. One of the two has to be a pipe. Errors are set on this file.
+  ssize_t SpliceFrom(FileInstance& in, size_t length, unsigned int flags);
+#endif
   void Set(fd_set* dest, int* max_index) const;
   int SetSockOpt(int level, int optname, const void* optval, socklen_t optlen);
   int GetSockOpt(int level, int optname, void* optval, socklen_t* optlen);
@@ -368,12 +392,16 @@ class FileInstance {
 
  private:
   FileInstance(int fd, int in_errno);
-  FileInstance* Accept(struct sockaddr* addr, socklen_t* addrlen) const;
+  // The instance and its reference counts in a single allocation
+  static std::shared_ptr<FileInstance> Create(int fd, int in_errno);
+  std::shared_ptr<FileInstance> Accept(struct sockaddr* addr,
+                                       socklen_t* addrlen) const;
 
   int fd_;
   int errno_;
   std::string identity_;
-  bool is_regular_file_;
+  // Checked on the first IsRegular() call, -1 until then
+  mutable std::atomic<int> is_regular_file_{-1};
 };
 
 struct PollSharedFd {
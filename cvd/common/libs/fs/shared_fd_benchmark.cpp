@@ -0,0 +1,123 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Time and heap allocations per file descriptor of creating and closing a
+// SharedFD, against the system calls alone. Run as:
+//   shared_fd_benchmark [iterations]
+
+#include "common/libs/fs/shared_fd.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+
+namespace {
+
+std::size_t allocations = 0;
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  allocations++;
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace cuttlefish {
+namespace {
+
+// One file descriptor's worth of work
+using Operation = std::function<void()>;
+
+void Report(const char* name, const Operation& operation,
+            std::size_t iterations) {
+  // warms up the allocator caches and the dentry of the opened file
+  for (std::size_t i = 0; i < iterations / 10; i++) {
+    operation();
+  }
+  const auto before = allocations;
+  const auto start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < iterations; i++) {
+    operation();
+  }
+  const std::chrono::duration<double, std::nano> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::printf("%-28s %10.0f ns/fd %10.3f allocs/fd\n", name,
+              elapsed.count() / iterations,
+              static_cast<double>(allocations - before) / iterations);
+}
+
+// What a SharedFD costs over these
+void RawDupClose() { CHECK(close(fcntl(0, F_DUPFD_CLOEXEC, 3)) == 0); }
+
+void RawOpenClose() {
+  CHECK(close(open("/dev/null", O_RDONLY | O_CLOEXEC)) == 0);
+}
+
+// A closed one, as for every default SharedFD and every failed call
+void Closed() { SharedFD fd; }
+
+void DupClose() {
+  auto fd = SharedFD::Dup(0);
+  CHECK(fd->IsOpen()) << fd->StrError();
+  fd->Close();
+}
+
+void OpenClose() {
+  auto fd = SharedFD::Open("/dev/null", O_RDONLY);
+  CHECK(fd->IsOpen()) << fd->StrError();
+  fd->Close();
+}
+
+// Closed by the destructor of the last reference instead
+void OpenRelease() {
+  auto fd = SharedFD::Open("/dev/null", O_RDONLY);
+  CHECK(fd->IsOpen()) << fd->StrError();
+}
+
+}  // namespace
+}  // namespace cuttlefish
+
+int main(int argc, char** argv) {
+  using namespace cuttlefish;
+  std::size_t iterations = 200000;
+  if (argc > 1 && (!android::base::ParseUint(argv[1], &iterations) ||
+                   iterations == 0)) {
+    std::fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  std::printf("%zu file descriptors each\n", iterations);
+  Report("dup + close", RawDupClose, iterations);
+  Report("open + close", RawOpenClose, iterations);
+  Report("SharedFD()", Closed, iterations);
+  Report("SharedFD::Dup + Close", DupClose, iterations);
+  Report("SharedFD::Open + Close", OpenClose, iterations);
+  Report("SharedFD::Open + release", OpenRelease, iterations);
+  return 0;
+}
@@ -15,13 +15,16 @@
  */
 
 #include "common/libs/fs/shared_fd.h"
+#include "common/libs/fs/shared_buf.h"
 #include "common/libs/fs/shared_select.h"
 
 #include <stdlib.h>
+#include <sys/socket.h>
 #include <unistd.h>
 #include <gtest/gtest.h>
 
 #include <string>
+#include <thread>
 
 namespace cuttlefish {
 
@@ -38,4 +41,98 @@ TEST(SendFD, Basic) {
   EXPECT_EQ(0, strcmp(buf, pipe_message));
 }
 
+std::string CopyData() {
+  // several chunks of every copy method
+  std::string data(3 << 20, '\0');
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = static_cast<char>(i % 251);
+  }
+  return data;
+}
+
+SharedFD FileWithData(const std::string& data) {
+  auto file = SharedFD::MemfdCreateWithData("copy_source", data);
+  EXPECT_EQ(0, file->LSeek(0, SEEK_SET));
+  return file;
+}
+
+std::string FileData(SharedFD file) {
+  EXPECT_EQ(0, file->LSeek(0, SEEK_SET));
+  std::string data;
+  ReadAll(file, &data);
+  return data;
+}
+
+TEST(CopyAllFrom, FileToFile) {
+  auto data = CopyData();
+  auto in = FileWithData(data);
+  auto out = SharedFD::MemfdCreate("copy_destination");
+  ASSERT_TRUE(out->CopyAllFrom(*in)) << out->StrError();
+  EXPECT_EQ(data, FileData(out));
+}
+
+TEST(CopyAllFrom, FileToAppendOnlyFile) {
+  auto data = CopyData();
+  auto in = FileWithData(data);
+  std::string path = "/tmp/copy_all_from_XXXXXX";
+  auto file = SharedFD::Mkstemp(&path);
+  ASSERT_TRUE(file->IsOpen()) << file->StrError();
+  auto out = SharedFD::Open(path, O_WRONLY | O_APPEND);
+  unlink(path.c_str());
+  ASSERT_TRUE(out->CopyAllFrom(*in)) << out->StrError();
+  EXPECT_EQ(data, FileData(file));
+}
+
+TEST(CopyAllFrom, FileToSocket) {
+  auto data = CopyData();
+  auto in = FileWithData(data);
+  SharedFD sockets[2];
+  ASSERT_TRUE(SharedFD::SocketPair(AF_UNIX, SOCK_STREAM, 0, sockets, sockets + 1));
+  std::thread copier([&]() {
+    EXPECT_TRUE(sockets[0]->CopyAllFrom(*in)) << sockets[0]->StrError();
+    sockets[0]->Close();
+  });
+  std::string received;
+  ReadAll(sockets[1], &received);
+  copier.join();
+  EXPECT_EQ(data, received);
+}
+
+TEST(CopyAllFrom, PipeToFile) {
+  auto data = CopyData();
+  SharedFD pipe[2];
+  ASSERT_TRUE(SharedFD::Pipe(pipe, pipe + 1));
+  std::thread writer([&]() {
+    EXPECT_EQ(data.size(), WriteAll(pipe[1], data));
+    pipe[1]->Close();
+  });
+  auto out = SharedFD::MemfdCreate("copy_destination");
+  ASSERT_TRUE(out->CopyAllFrom(*pipe[0])) << out->StrError();
+  writer.join();
+  EXPECT_EQ(data, FileData(out));
+}
+
+TEST(CopyAllFrom, SocketToFile) {
+  auto data = CopyData();
+  SharedFD sockets[2];
+  ASSERT_TRUE(SharedFD::SocketPair(AF_UNIX, SOCK_STREAM, 0, sockets, sockets + 1));
+  std::thread writer([&]() {
+    EXPECT_EQ(data.size(), WriteAll(sockets[1], data));
+    sockets[1]->Close();
+  });
+  auto out = SharedFD::MemfdCreate("copy_destination");
+  ASSERT_TRUE(out->CopyAllFrom(*sockets[0])) << out->StrError();
+  writer.join();
+  EXPECT_EQ(data, FileData(out));
+}
+
+TEST(CopyFrom, StopsAtLength) {
+  auto data = CopyData();
+  auto in = FileWithData(data);
+  auto out = SharedFD::MemfdCreate("copy_destination");
+  ASSERT_TRUE(out->CopyFrom(*in, 12345)) << out->StrError();
+  EXPECT_EQ(data.substr(0, 12345), FileData(out));
+  EXPECT_FALSE(out->CopyFrom(*in, data.size()));
+}
+
 }
@@ -71,4 +71,32 @@ std::vector<std::string> GetFileListFromInotifyFd(int fd, uint32_t mask) {
   return result;
 }
 
+std::vector<InotifyEvent> GetEventsFromInotifyFd(SharedFD fd) {
+  // Large enough to hold many events, aligned as inotify(7) recommends
+  alignas(struct inotify_event) char buffer[4096];
+  std::vector<InotifyEvent> result;
+  auto length = fd->Read(buffer, sizeof(buffer));
+  if (length == -1 && fd->GetErrno() == EAGAIN) {
+    return result;  // non-blocking, and nothing happened
+  }
+  if (length == -1) {
+    LOG(ERROR) << __FUNCTION__
+               << ": Couldn't read out inotify events due to error: '"
+               << fd->StrError() << "'";
+    return result;
+  }
+  ssize_t bytes_parsed = 0;
+  while (bytes_parsed < length) {
+    auto* event = reinterpret_cast<inotify_event*>(buffer + bytes_parsed);
+    bytes_parsed += sizeof(struct inotify_event) + event->len;
+    result.push_back(InotifyEvent{
+        .wd = event->wd,
+        .mask = event->mask,
+        // event->name is null-padded up to event->len
+        .name = event->len ? std::string(event->name) : std::string(),
+    });
+  }
+  return result;
+}
+
 }  // namespace cuttlefish
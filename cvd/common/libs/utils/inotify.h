@@ -15,12 +15,24 @@
  */
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+#include "common/libs/fs/shared_fd.h"
+
 namespace cuttlefish {
 
+struct InotifyEvent {
+  int wd;
+  uint32_t mask;
+  // empty if the event is about the watched path itself
+  std::string name;
+};
+
 std::vector<std::string> GetCreatedFileListFromInotifyFd(int fd);
 std::vector<std::string> GetFileListFromInotifyFd(int fd, uint32_t mask);
+// Drains all the events that can be read at once, without filtering
+std::vector<InotifyEvent> GetEventsFromInotifyFd(SharedFD fd);
 
 }  // namespace cuttlefish
@@ -29,25 +29,31 @@
 #include <fcntl.h>
 #include <ifaddrs.h>
 #include <net/if.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <functional>
 #include <iomanip>
 #include <ios>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <ostream>
 #include <set>
 #include <sstream>
 #include <streambuf>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
 #include <android-base/strings.h>
-
-#include "common/libs/utils/subprocess.h"
+#include <android-base/unique_fd.h>
 
 namespace cuttlefish {
 namespace {
@@ -67,6 +73,88 @@ namespace {
 // u16 num_buffers;
 // };
 static constexpr int SIZE_OF_VIRTIO_NET_HDR_V1 = 12;
+
+constexpr char kTunDevice[] = "/dev/net/tun";
+// Scanning /proc takes a while on a busy host, the callers do not need it to
+// be more up to date than that
+constexpr auto kTapCacheMaxAge = std::chrono::seconds(1);
+
+struct TapCache {
+  std::chrono::steady_clock::time_point scanned_at;
+  std::set<std::string> interfaces;
+};
+std::mutex tap_cache_mutex;
+std::optional<TapCache> tap_cache;
+
+// As the kernel fills the buffer of getdents64
+struct LinuxDirent64 {
+  std::uint64_t d_ino;
+  std::int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+android::base::unique_fd OpenDirectoryAt(int dir_fd, const std::string& path) {
+  return android::base::unique_fd(
+      openat(dir_fd, path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+}
+
+// Without the allocations and the stat calls of readdir based walks
+void ForEachEntry(int dir_fd, const std::function<void(const char*)>& callback) {
+  alignas(LinuxDirent64) char buffer[16384];
+  while (true) {
+    const long size = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+    if (size <= 0) {
+      return;
+    }
+    for (long offset = 0; offset < size;) {
+      const auto entry = reinterpret_cast<LinuxDirent64*>(buffer + offset);
+      callback(entry->d_name);
+      offset += entry->d_reclen;
+    }
+  }
+}
+
+bool IsNumber(const char* name) {
+  if (*name == '\0') {
+    return false;
+  }
+  for (; *name != '\0'; name++) {
+    if (*name < '0' || *name > '9') {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IsTunFd(int fds_dir_fd, const char* fd) {
+  char target[sizeof(kTunDevice)];
+  const auto size = readlinkat(fds_dir_fd, fd, target, sizeof(target));
+  return size == static_cast<ssize_t>(sizeof(kTunDevice) - 1) &&
+         memcmp(target, kTunDevice, size) == 0;
+}
+
+// The "iff:" line of the fdinfo of a tun fd, absent before TUNSETIFF
+std::optional<std::string> TapOfFd(int proc_fd, const std::string& fdinfo) {
+  android::base::unique_fd info(
+      openat(proc_fd, fdinfo.c_str(), O_RDONLY | O_CLOEXEC));
+  if (info.get() < 0) {
+    return std::nullopt;
+  }
+  char buffer[512];
+  const auto size = TEMP_FAILURE_RETRY(read(info.get(), buffer, sizeof(buffer)));
+  if (size <= 0) {
+    return std::nullopt;
+  }
+  constexpr std::string_view kIffPrefix = "iff:\t";
+  for (auto line : android::base::Split(std::string(buffer, size), "\n")) {
+    if (android::base::StartsWith(line, kIffPrefix)) {
+      return line.substr(kIffPrefix.size());
+    }
+  }
+  return std::nullopt;
+}
 #endif
 
 /**
@@ -104,9 +192,7 @@ bool NetworkInterfaceExists(const std::string& interface_name) {
 
 #ifdef __linux__
 SharedFD OpenTapInterface(const std::string& interface_name) {
-  constexpr auto TUNTAP_DEV = "/dev/net/tun";
-
-  auto tap_fd = SharedFD::Open(TUNTAP_DEV, O_RDWR | O_NONBLOCK);
+  auto tap_fd = SharedFD::Open(kTunDevice, O_RDWR | O_NONBLOCK);
   if (!tap_fd->IsOpen()) {
     LOG(ERROR) << "Unable to open tun device: " << tap_fd->StrError();
     return tap_fd;
@@ -134,29 +220,49 @@ SharedFD OpenTapInterface(const std::string& interface_name) {
                                         TUN_F_TSO6));
   int len = SIZE_OF_VIRTIO_NET_HDR_V1;
   tap_fd->Ioctl(TUNSETVNETHDRSZ, &len);
+  InvalidateTapInterfacesInUse();
   return tap_fd;
 }
 
 std::set<std::string> TapInterfacesInUse() {
-  Command cmd("/bin/bash");
-  cmd.AddParameter("-c");
-  cmd.AddParameter("egrep -h -e \"^iff:.*\" /proc/*/fdinfo/*");
-  std::string stdin_str, stdout_str, stderr_str;
-  RunWithManagedStdio(std::move(cmd), &stdin_str, &stdout_str, &stderr_str);
-  auto lines = android::base::Split(stdout_str, "\n");
+  std::lock_guard lock(tap_cache_mutex);
+  const auto now = std::chrono::steady_clock::now();
+  if (tap_cache && now - tap_cache->scanned_at < kTapCacheMaxAge) {
+    return tap_cache->interfaces;
+  }
+  const auto proc = OpenDirectoryAt(AT_FDCWD, "/proc");
+  if (proc.get() < 0) {
+    PLOG(ERROR) << "Failed to open /proc";
+    return {};
+  }
   std::set<std::string> tap_interfaces;
-  for (const auto& line : lines) {
-    if (line == "") {
-      continue;
+  ForEachEntry(proc.get(), [&proc, &tap_interfaces](const char* pid) {
+    if (!IsNumber(pid)) {
+      return;
     }
-    if (!android::base::StartsWith(line, "iff:\t")) {
-      LOG(ERROR) << "Unexpected line \"" << line << "\"";
-      continue;
+    const auto fds = OpenDirectoryAt(proc.get(), std::string(pid) + "/fd");
+    if (fds.get() < 0) {
+      // gone, or not ours to look at
+      return;
     }
-    tap_interfaces.insert(line.substr(std::string("iff:\t").size()));
-  }
+    ForEachEntry(fds.get(), [&](const char* fd) {
+      if (!IsNumber(fd) || !IsTunFd(fds.get(), fd)) {
+        return;
+      }
+      auto iface = TapOfFd(proc.get(), std::string(pid) + "/fdinfo/" + fd);
+      if (iface) {
+        tap_interfaces.insert(std::move(*iface));
+      }
+    });
+  });
+  tap_cache = TapCache{.scanned_at = now, .interfaces = tap_interfaces};
   return tap_interfaces;
 }
+
+void InvalidateTapInterfacesInUse() {
+  std::lock_guard lock(tap_cache_mutex);
+  tap_cache.reset();
+}
 #endif
 
 std::string MacAddressToString(const std::uint8_t mac[6]) {
@@ -31,8 +31,11 @@ bool NetworkInterfaceExists(const std::string& interface_name);
 // to one.
 SharedFD OpenTapInterface(const std::string& interface_name);
 
-// Returns a list of TAP devices that have open file descriptors
+// Returns a list of TAP devices that have open file descriptors, as found in
+// the processes the caller may inspect. Cached for up to a second.
 std::set<std::string> TapInterfacesInUse();
+// For the next TapInterfacesInUse call to scan again, e.g. after closing a tap
+void InvalidateTapInterfacesInUse();
 #endif
 
 void GenerateCorrespondingIpv6ForMac(const std::uint8_t mac[6], std::uint8_t out[16]);
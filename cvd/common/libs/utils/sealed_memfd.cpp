@@ -0,0 +1,75 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "common/libs/utils/sealed_memfd.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <cstring>
+
+namespace cuttlefish {
+namespace {
+
+constexpr int kSeals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL;
+
+}  // namespace
+
+Result<SharedFD> SealedMemfd(const std::string& name, size_t size,
+                             const std::function<Result<void>(char*)>& fill) {
+  CF_EXPECT(size > 0, "Empty memfds can't be mapped");
+  auto memfd = SharedFD::MemfdCreate(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  CF_EXPECT(memfd->IsOpen(), "MemfdCreate failed: " << memfd->StrError());
+  CF_EXPECT(memfd->Truncate(size) == 0,
+            "Failed to resize the memfd to " << size
+                                             << " bytes: " << memfd->StrError());
+  {
+    // F_SEAL_WRITE fails while there are writable shared mappings
+    auto mapping =
+        memfd->MMap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+    CF_EXPECT(mapping.get() != MAP_FAILED,
+              "Failed to map the memfd: " << memfd->StrError());
+    CF_EXPECT(fill(static_cast<char*>(mapping.get())));
+  }
+  CF_EXPECT(memfd->Fcntl(F_ADD_SEALS, kSeals) == 0,
+            "Failed to seal the memfd: " << memfd->StrError());
+  return memfd;
+}
+
+Result<SharedFD> SealedMemfdWithData(const std::string& name,
+                                     const std::string& data) {
+  auto copy = [&data](char* out) -> Result<void> {
+    std::memcpy(out, data.data(), data.size());
+    return {};
+  };
+  return CF_EXPECT(SealedMemfd(name, data.size(), copy));
+}
+
+Result<ScopedMMap> MapSealedMemfd(SharedFD memfd) {
+  CF_EXPECT(memfd->IsOpen(), memfd->StrError());
+  int seals = memfd->Fcntl(F_GET_SEALS, 0);
+  CF_EXPECT(seals >= 0, "Failed to get the memfd seals: " << memfd->StrError());
+  CF_EXPECTF((seals & kSeals) == kSeals,
+             "The memfd is not sealed, it has seals {:#x}", seals);
+  auto size = memfd->LSeek(0, SEEK_END);
+  CF_EXPECT(size >= 0, "LSeek on the memfd failed: " << memfd->StrError());
+  CF_EXPECT(size > 0, "Empty memfds can't be mapped");
+  auto mapping = memfd->MMap(nullptr, size, PROT_READ, MAP_SHARED, 0);
+  CF_EXPECT(mapping.get() != MAP_FAILED,
+            "Failed to map the memfd: " << memfd->StrError());
+  return mapping;
+}
+
+}  // namespace cuttlefish
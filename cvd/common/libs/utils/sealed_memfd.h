@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/*
+ * Creates a memfd of `size` bytes, lets `fill` write its contents through a
+ * shared mapping and seals it against writes and resizing.
+ *
+ * The receiver of a sealed memfd can map it without copying and without
+ * worrying about the sender changing or truncating it under the mapping.
+ */
+Result<SharedFD> SealedMemfd(const std::string& name, size_t size,
+                             const std::function<Result<void>(char*)>& fill);
+Result<SharedFD> SealedMemfdWithData(const std::string& name,
+                                     const std::string& data);
+
+/*
+ * Maps the contents of a memfd created by SealedMemfd read only. Fails if the
+ * memfd is empty or isn't sealed.
+ */
+Result<ScopedMMap> MapSealedMemfd(SharedFD memfd);
+
+}  // namespace cuttlefish
@@ -0,0 +1,65 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/sealed_memfd.h"
+
+#include <sys/mman.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+TEST(SealedMemfdTest, MapsTheData) {
+  std::string data(1 << 20, 'x');
+  data[12345] = 'y';
+  auto memfd = SealedMemfdWithData("sealed_memfd_test", data);
+  ASSERT_TRUE(memfd.ok()) << memfd.error().Trace();
+  auto mapping = MapSealedMemfd(*memfd);
+  ASSERT_TRUE(mapping.ok()) << mapping.error().Trace();
+  ASSERT_EQ(mapping->len(), data.size());
+  EXPECT_EQ(std::string(static_cast<const char*>(mapping->get()),
+                        mapping->len()),
+            data);
+}
+
+TEST(SealedMemfdTest, CantBeChanged) {
+  auto memfd = SealedMemfdWithData("sealed_memfd_test", "data");
+  ASSERT_TRUE(memfd.ok()) << memfd.error().Trace();
+  EXPECT_LT((*memfd)->Write("x", 1), 0);
+  EXPECT_LT((*memfd)->Truncate(1), 0);
+  EXPECT_LT((*memfd)->Truncate(100), 0);
+  auto mapping =
+      (*memfd)->MMap(nullptr, 4, PROT_READ | PROT_WRITE, MAP_SHARED, 0);
+  EXPECT_EQ(mapping.get(), MAP_FAILED);
+}
+
+TEST(SealedMemfdTest, RejectsUnsealedMemfds) {
+  auto memfd = SharedFD::MemfdCreateWithData("sealed_memfd_test", "data");
+  ASSERT_TRUE(memfd->IsOpen()) << memfd->StrError();
+  EXPECT_FALSE(MapSealedMemfd(memfd).ok());
+}
+
+TEST(SealedMemfdTest, RejectsEmptyData) {
+  EXPECT_FALSE(SealedMemfdWithData("sealed_memfd_test", "").ok());
+}
+
+}  // namespace
+}  // namespace cuttlefish
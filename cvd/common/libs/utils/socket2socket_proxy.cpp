@@ -16,12 +16,16 @@
 
 #include "common/libs/utils/socket2socket_proxy.h"
 
-#include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 
-#include <cstring>
+#include <array>
+#include <cstdint>
 #include <functional>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <utility>
@@ -29,84 +33,446 @@
 
 #include <android-base/logging.h>
 
+#include "common/libs/fs/epoll.h"
+#include "common/libs/utils/result.h"
+
 namespace cuttlefish {
 namespace {
 
-void Forward(const std::string& label, SharedFD from, SharedFD to) {
-  LOG(DEBUG) << label << ": Proxy thread started. Starting copying data";
-  auto success = to->CopyAllFrom(*from);
-  if (!success) {
-    if (from->GetErrno()) {
-      LOG(ERROR) << label << ": Error reading: " << from->StrError();
+// So that a busy connection does not starve the others
+constexpr size_t kMaxBytesPerEvent = 1 << 20;
+// For the files that can't be spliced from, e.g. vsock on older kernels
+constexpr size_t kFallbackBufferSize = 8192;
+
+Result<void> SetNonBlocking(SharedFD fd) {
+  int flags = fd->Fcntl(F_GETFL, 0);
+  CF_EXPECTF(flags >= 0, "fcntl(F_GETFL) failed: {}", fd->StrError());
+  CF_EXPECTF(fd->Fcntl(F_SETFL, flags | O_NONBLOCK) >= 0,
+             "fcntl(F_SETFL) failed: {}", fd->StrError());
+  return {};
+}
+
+/*
+ * One way of a proxied connection. The data goes from one socket to the
+ * other through a pipe with splice, without being copied to user space, and
+ * the pipe holds what the destination did not accept yet.
+ */
+class Direction {
+ public:
+  Direction(std::string label, SharedFD from, SharedFD to)
+      : label_(std::move(label)), from_(std::move(from)), to_(std::move(to)) {}
+
+  Result<void> Init() {
+    CF_EXPECTF(SharedFD::Pipe(&pipe_read_, &pipe_write_),
+               "{}: Failed to create a pipe: {}", label_, strerror(errno));
+    CF_EXPECT(SetNonBlocking(pipe_read_));
+    CF_EXPECT(SetNonBlocking(pipe_write_));
+    return {};
+  }
+
+  // Moves what can be moved without blocking
+  void Pump() {
+    size_t moved = 0;
+    while (!done_ && moved < kMaxBytesPerEvent) {
+      // The pipe is drained before reading again, so that the read only
+      // fails with EAGAIN when the source has nothing to read
+      while (buffered_ > 0) {
+        auto written = to_->SpliceFrom(*pipe_read_, buffered_,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (written < 0 && to_->GetErrno() == EAGAIN) {
+          blocked_ = true;
+          return;
+        }
+        if (written <= 0) {
+          LOG(ERROR) << label_ << ": Error writing: " << to_->StrError();
+          Finish(/* shutdown= */ false);
+          return;
+        }
+        buffered_ -= written;
+        moved += written;
+      }
+      blocked_ = false;
+      if (eof_) {
+        Finish(/* shutdown= */ true);
+        return;
+      }
+      auto read = Fill();
+      if (read < 0 && errno == EAGAIN) {
+        return;
+      }
+      if (read < 0) {
+        LOG(ERROR) << label_ << ": Error reading: " << strerror(errno);
+      }
+      if (read <= 0) {
+        eof_ = true;
+        continue;
+      }
+      buffered_ += read;
     }
-    if (to->GetErrno()) {
-      LOG(ERROR) << label << ": Error writing: " << to->StrError();
+  }
+
+  // The destination is gone, what it did not receive yet is dropped
+  void Abort() {
+    if (!done_ && buffered_ > 0) {
+      LOG(ERROR) << label_ << ": Dropped " << buffered_
+                 << " bytes, the destination closed";
     }
+    Finish(/* shutdown= */ false);
   }
-  to->Shutdown(SHUT_WR);
-  LOG(DEBUG) << label << ": Proxy thread completed";
-}
 
-void SetupProxying(SharedFD client, SharedFD target) {
-  LOG(DEBUG) << "Launching proxy threads";
-  std::thread client2target(Forward, "c2t", client, target);
-  std::thread target2client(Forward, "t2c", target, client);
-  client2target.detach();
-  target2client.detach();
-}
+  bool WantsRead() const { return !done_ && !eof_ && !blocked_; }
+  bool WantsWrite() const { return !done_ && blocked_; }
+  bool Done() const { return done_; }
 
-}  // namespace
+ private:
+  // Reads into the empty pipe, with errno set on failure
+  ssize_t Fill() {
+    if (!splice_unsupported_) {
+      auto read = pipe_write_->SpliceFrom(*from_, kMaxBytesPerEvent,
+                                          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      errno = pipe_write_->GetErrno();
+      if (read >= 0 || errno != EINVAL) {
+        return read;
+      }
+      LOG(DEBUG) << label_ << ": Can't splice, copying instead";
+      splice_unsupported_ = true;
+    }
+    char buffer[kFallbackBufferSize];
+    auto read = from_->Read(buffer, sizeof(buffer));
+    errno = from_->GetErrno();
+    if (read <= 0) {
+      return read;
+    }
+    // Always fits, the pipe is empty and larger than the buffer
+    auto written = pipe_write_->Write(buffer, read);
+    errno = pipe_write_->GetErrno();
+    return written;
+  }
 
-ProxyServer::ProxyServer(SharedFD server, std::function<SharedFD()> clients_factory)
-    : stop_fd_(SharedFD::Event()) {
+  void Finish(bool shutdown) {
+    if (done_) {
+      return;
+    }
+    if (shutdown) {
+      to_->Shutdown(SHUT_WR);
+    }
+    done_ = true;
+    LOG(DEBUG) << label_ << ": Proxy completed";
+  }
 
-  if (!stop_fd_->IsOpen()) {
-    LOG(FATAL) << "Failed to open eventfd: " << stop_fd_->StrError();
-    return;
+  std::string label_;
+  SharedFD from_;
+  SharedFD to_;
+  SharedFD pipe_read_;
+  SharedFD pipe_write_;
+  size_t buffered_ = 0;
+  // The source has no more data
+  bool eof_ = false;
+  // The destination does not accept more data for now
+  bool blocked_ = false;
+  // The destination was shut down for writing, or is gone
+  bool done_ = false;
+  bool splice_unsupported_ = false;
+};
+
+/*
+ * A client and its target, and the two directions between them. Both sockets
+ * are watched by the same epoll instance, and each event on one of them
+ * pumps the directions it unblocks.
+ */
+class Connection {
+ public:
+  static Result<std::shared_ptr<Connection>> Create(SharedFD client,
+                                                    SharedFD target) {
+    CF_EXPECT(SetNonBlocking(client));
+    CF_EXPECT(SetNonBlocking(target));
+    std::shared_ptr<Connection> connection(new Connection(client, target));
+    for (auto& direction : connection->directions_) {
+      CF_EXPECT(direction.Init());
+    }
+    return connection;
   }
-  server_ = std::thread([&, server_fd = std::move(server),
-                            clients_factory = std::move(clients_factory)]() {
-    constexpr ssize_t SERVER = 0;
-    constexpr ssize_t STOP = 1;
 
-    std::vector<PollSharedFd> server_poll = {
-      {.fd = server_fd, .events = POLLIN},
-      {.fd = stop_fd_, .events = POLLIN}
-    };
+  const std::array<SharedFD, 2>& Ends() const { return ends_; }
 
-    while (server_fd->IsOpen()) {
-      server_poll[SERVER].revents = 0;
-      server_poll[STOP].revents = 0;
+  Result<void> Watch(Epoll& epoll) {
+    for (size_t end = 0; end < ends_.size(); end++) {
+      CF_EXPECT(epoll.Add(ends_[end], EPOLLIN));
+      watched_events_[end] = EPOLLIN;
+      watched_[end] = true;
+    }
+    return {};
+  }
 
-      const int poll_result = SharedFD::Poll(server_poll, -1);
-      if (poll_result < 0) {
-        LOG(ERROR) << "Failed to poll to wait for incoming connection";
-        continue;
+  void Unwatch(Epoll& epoll) {
+    for (size_t end = 0; end < ends_.size(); end++) {
+      if (watched_[end]) {
+        epoll.Delete(ends_[end]);
+        watched_[end] = false;
       }
-      if (server_poll[STOP].revents & POLLIN) {
-        // Stop fd is available to read, so we received a stop event
-        // and must stop the thread
-        break;
+    }
+  }
+
+  // Returns whether both directions completed
+  Result<bool> HandleEvent(Epoll& epoll, const EpollEvent& event) {
+    size_t end = event.fd == ends_[0] ? 0 : 1;
+    // the direction from that end, and the one to it
+    auto& outgoing = directions_[end];
+    auto& incoming = directions_[1 - end];
+    if (event.events & EPOLLERR) {
+      int error = 0;
+      socklen_t length = sizeof(error);
+      event.fd->GetSockOpt(SOL_SOCKET, SO_ERROR, &error, &length);
+      LOG(ERROR) << "Closing the proxied connection: " << strerror(error);
+      return true;
+    }
+    if (event.events & (EPOLLIN | EPOLLHUP)) {
+      outgoing.Pump();
+    }
+    if (event.events & EPOLLOUT) {
+      incoming.Pump();
+    }
+    if (event.events & EPOLLHUP) {
+      hung_up_[end] = true;
+      incoming.Abort();
+    }
+    for (size_t i = 0; i < ends_.size(); i++) {
+      CF_EXPECT(UpdateInterest(epoll, i));
+    }
+    return directions_[0].Done() && directions_[1].Done();
+  }
+
+ private:
+  Connection(SharedFD client, SharedFD target)
+      : ends_({client, target}),
+        directions_({Direction("c2t", client, target),
+                     Direction("t2c", target, client)}) {}
+
+  Result<void> UpdateInterest(Epoll& epoll, size_t end) {
+    uint32_t events = 0;
+    if (directions_[end].WantsRead()) {
+      events |= EPOLLIN;
+    }
+    if (directions_[1 - end].WantsWrite()) {
+      events |= EPOLLOUT;
+    }
+    // EPOLLHUP is reported regardless of the events, and would be reported
+    // again and again, so the end is only watched again once there is
+    // something to read from it again, e.g. when the direction unblocks
+    if (hung_up_[end] && !(events & EPOLLIN)) {
+      if (watched_[end]) {
+        CF_EXPECT(epoll.Delete(ends_[end]));
+        watched_[end] = false;
       }
-      if (!(server_poll[SERVER].revents & POLLIN)) {
-        continue;
+      return {};
+    }
+    if (!watched_[end]) {
+      CF_EXPECT(epoll.Add(ends_[end], events));
+      watched_events_[end] = events;
+      watched_[end] = true;
+    } else if (events != watched_events_[end]) {
+      CF_EXPECT(epoll.Modify(ends_[end], events));
+      watched_events_[end] = events;
+    }
+    return {};
+  }
+
+  std::array<SharedFD, 2> ends_;
+  // directions_[i] goes from ends_[i] to the other end
+  std::array<Direction, 2> directions_;
+  std::array<uint32_t, 2> watched_events_ = {0, 0};
+  std::array<bool, 2> watched_ = {false, false};
+  std::array<bool, 2> hung_up_ = {false, false};
+};
+
+/*
+ * Connects to the targets on threads of their own, as clients_factory blocks
+ * until the target answers, and hands the connections to the proxy thread.
+ */
+class Connector {
+ public:
+  struct Connected {
+    SharedFD client;
+    // not open if the connection failed
+    SharedFD target;
+  };
+
+  Connector(const std::function<SharedFD()>& clients_factory)
+      : clients_factory_(clients_factory),
+        connected_event_(SharedFD::Event()) {}
+
+  // Waits for the connections in progress
+  ~Connector() {
+    std::map<std::uint64_t, std::thread> threads;
+    {
+      std::lock_guard lock(mutex_);
+      threads.swap(threads_);
+    }
+    for (auto& [_, thread] : threads) {
+      thread.join();
+    }
+  }
+
+  // Readable when TakeConnected has something
+  SharedFD ConnectedEvent() const { return connected_event_; }
+
+  void Connect(SharedFD client) {
+    std::lock_guard lock(mutex_);
+    const auto id = next_id_++;
+    threads_.emplace(id, std::thread([this, id, client]() {
+      auto target = clients_factory_();
+      std::lock_guard lock(mutex_);
+      connected_.emplace_back(id, Connected{client, target});
+      connected_event_->EventfdWrite(1);
+    }));
+  }
+
+  std::vector<Connected> TakeConnected() {
+    std::vector<std::pair<std::uint64_t, Connected>> connected;
+    std::vector<std::thread> finished;
+    {
+      std::lock_guard lock(mutex_);
+      eventfd_t unused;
+      connected_event_->EventfdRead(&unused);
+      connected.swap(connected_);
+      for (const auto& [id, _] : connected) {
+        auto it = threads_.find(id);
+        if (it != threads_.end()) {
+          finished.emplace_back(std::move(it->second));
+          threads_.erase(it);
+        }
       }
+    }
+    for (auto& thread : finished) {
+      thread.join();
+    }
+    std::vector<Connected> result;
+    for (auto& [_, connection] : connected) {
+      result.emplace_back(std::move(connection));
+    }
+    return result;
+  }
+
+ private:
+  const std::function<SharedFD()>& clients_factory_;
+  std::mutex mutex_;
+  std::uint64_t next_id_ = 0;
+  std::map<std::uint64_t, std::thread> threads_;
+  std::vector<std::pair<std::uint64_t, Connected>> connected_;
+  SharedFD connected_event_;
+};
+
+Result<void> SetupProxying(Epoll& epoll,
+                           std::map<SharedFD, std::shared_ptr<Connection>>& by_end,
+                           SharedFD client, SharedFD target) {
+  LOG(DEBUG) << "Starting to proxy a connection";
+  auto connection = CF_EXPECT(Connection::Create(client, target));
+  CF_EXPECT(connection->Watch(epoll));
+  for (const auto& end : connection->Ends()) {
+    by_end[end] = connection;
+  }
+  return {};
+}
 
+void CloseConnection(Epoll& epoll,
+                     std::map<SharedFD, std::shared_ptr<Connection>>& by_end,
+                     std::shared_ptr<Connection> connection) {
+  connection->Unwatch(epoll);
+  for (const auto& end : connection->Ends()) {
+    by_end.erase(end);
+  }
+}
+
+// Accepts the connections and proxies all of them, until stop_fd is written
+Result<void> RunProxy(SharedFD server_fd,
+                      const std::function<SharedFD()>& clients_factory,
+                      SharedFD stop_fd) {
+  auto epoll = CF_EXPECT(Epoll::Create());
+  CF_EXPECT(epoll.Add(server_fd, EPOLLIN));
+  CF_EXPECT(epoll.Add(stop_fd, EPOLLIN));
+  std::map<SharedFD, std::shared_ptr<Connection>> by_end;
+  // declared last, so that its threads are done before the rest goes away
+  Connector connector(clients_factory);
+  auto connected_event = connector.ConnectedEvent();
+  CF_EXPECTF(connected_event->IsOpen(), "Failed to open eventfd: {}",
+             connected_event->StrError());
+  CF_EXPECT(epoll.Add(connected_event, EPOLLIN));
+
+  while (server_fd->IsOpen()) {
+    auto event = epoll.Wait();
+    if (!event.ok()) {
+      LOG(ERROR) << "Failed to wait for events: " << event.error().Message();
+      continue;
+    }
+    if (!event->has_value()) {
+      continue;
+    }
+    auto& fd = (*event)->fd;
+    if (fd == stop_fd) {
+      // Stop fd is available to read, so we received a stop event
+      // and must stop the thread
+      break;
+    }
+    if (fd == server_fd) {
       // Server fd is available to read, so we can accept the
       // connection without blocking on that
       auto client = SharedFD::Accept(*server_fd);
       if (!client->IsOpen()) {
-        LOG(ERROR) << "Failed to accept incoming connection: " << client->StrError();
+        LOG(ERROR) << "Failed to accept incoming connection: "
+                   << client->StrError();
         continue;
       }
-      auto target = clients_factory();
-      if (target->IsOpen()) {
-        SetupProxying(client, target);
-      } else {
-        LOG(ERROR) << "Cannot connect to the target to setup proxying: " << target->StrError();
+      // a slow or unreachable target does not hold up the other connections
+      connector.Connect(client);
+      continue;
+    }
+    if (fd == connected_event) {
+      for (const auto& [client, target] : connector.TakeConnected()) {
+        if (!target->IsOpen()) {
+          LOG(ERROR) << "Cannot connect to the target to setup proxying: "
+                     << target->StrError();
+          // The client closes when it goes out of scope here.
+          continue;
+        }
+        auto result = SetupProxying(epoll, by_end, client, target);
+        if (!result.ok()) {
+          LOG(ERROR) << "Failed to setup proxying: "
+                     << result.error().Message();
+        }
       }
-      // The client will close when it goes out of scope here if the target
-      // didn't open.
+      continue;
+    }
+    auto it = by_end.find(fd);
+    if (it == by_end.end()) {
+      continue;
+    }
+    auto connection = it->second;
+    auto completed = connection->HandleEvent(epoll, **event);
+    if (!completed.ok()) {
+      LOG(ERROR) << "Failed to proxy a connection: "
+                 << completed.error().Message();
+    }
+    if (!completed.ok() || *completed) {
+      CloseConnection(epoll, by_end, connection);
+    }
+  }
+  return {};
+}
+
+}  // namespace
+
+ProxyServer::ProxyServer(SharedFD server, std::function<SharedFD()> clients_factory)
+    : stop_fd_(SharedFD::Event()) {
+
+  if (!stop_fd_->IsOpen()) {
+    LOG(FATAL) << "Failed to open eventfd: " << stop_fd_->StrError();
+    return;
+  }
+  server_ = std::thread([&, server_fd = std::move(server),
+                            clients_factory = std::move(clients_factory)]() {
+    auto result = RunProxy(server_fd, clients_factory, stop_fd_);
+    if (!result.ok()) {
+      LOG(ERROR) << "Proxy failed: " << result.error().Message();
     }
   });
 }
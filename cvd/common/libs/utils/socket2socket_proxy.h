@@ -39,6 +39,11 @@ class ProxyServer {
 // Accept() is called on the server in a loop, for every client connection a
 // target connection is created through the conn_factory callback and data is
 // forwarded between the two connections.
+// A single thread serves all the connections with epoll, and moves the data
+// with splice through a pipe per direction, without copying it to user space.
+// When one side shuts down for writing, the other side is shut down for
+// writing once the data in flight is delivered, and the connection is closed
+// when both directions are done. Stopping the proxy closes the connections.
 // This function is meant to execute forever, but will return if the server is
 // closed in another thread. It's recommended the caller disables the default
 // behavior for SIGPIPE before calling this function, otherwise it runs the risk
@@ -0,0 +1,262 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Throughput and round trip latency through ProxyAsync, against the thread
+// pair per connection it replaced. Run as:
+//   socket2socket_proxy_benchmark [megabytes [round_trips [connections]]]
+
+#include "common/libs/utils/socket2socket_proxy.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+struct Options {
+  std::size_t megabytes = 256;
+  std::size_t round_trips = 20000;
+  // at once, sharing the megabytes
+  std::size_t connections = 16;
+};
+
+constexpr std::size_t kChunkSize = 64 << 10;
+constexpr ssize_t kMessageSize = 64;
+
+// How ProxyAsync used to proxy: two threads per connection, copying the data
+// through user space
+class ThreadPairProxy {
+ public:
+  ThreadPairProxy(SharedFD server, std::function<SharedFD()> clients_factory)
+      : server_(std::move(server)) {
+    accept_ = std::thread([this, clients_factory]() {
+      while (true) {
+        auto client = SharedFD::Accept(*server_);
+        if (!client->IsOpen()) {
+          // shut down by the destructor
+          return;
+        }
+        auto target = clients_factory();
+        CHECK(target->IsOpen()) << target->StrError();
+        forward_.emplace_back(Forward, client, target);
+        forward_.emplace_back(Forward, target, client);
+      }
+    });
+  }
+
+  ~ThreadPairProxy() {
+    server_->Shutdown(SHUT_RDWR);
+    accept_.join();
+    for (auto& thread : forward_) {
+      thread.join();
+    }
+  }
+
+ private:
+  static void Forward(SharedFD from, SharedFD to) {
+    to->CopyAllFrom(*from);
+    to->Shutdown(SHUT_WR);
+  }
+
+  SharedFD server_;
+  std::thread accept_;
+  std::vector<std::thread> forward_;
+};
+
+// Keeps the proxy running until released
+using StartProxy =
+    std::function<std::shared_ptr<void>(SharedFD, std::function<SharedFD()>)>;
+
+std::shared_ptr<void> StartThreadPairProxy(
+    SharedFD server, std::function<SharedFD()> clients_factory) {
+  return std::make_shared<ThreadPairProxy>(std::move(server),
+                                           std::move(clients_factory));
+}
+
+std::shared_ptr<void> StartProxyAsync(
+    SharedFD server, std::function<SharedFD()> clients_factory) {
+  return ProxyAsync(std::move(server), std::move(clients_factory));
+}
+
+int LocalPort(SharedFD server) {
+  sockaddr_in addr{};
+  socklen_t length = sizeof(addr);
+  if (server->GetSockName(reinterpret_cast<sockaddr*>(&addr), &length) < 0) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+struct Connection {
+  SharedFD client;
+  SharedFD target;
+};
+
+// Runs the workload on the connections through a proxy started for them
+void WithConnections(
+    const StartProxy& start, std::size_t count,
+    const std::function<void(std::vector<Connection>&)>& workload) {
+  auto server = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+  CHECK(server->IsOpen()) << server->StrError();
+  auto target_server = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+  CHECK(target_server->IsOpen()) << target_server->StrError();
+  const int port = LocalPort(server);
+  const int target_port = LocalPort(target_server);
+  CHECK(port > 0 && target_port > 0) << "No local port";
+  auto proxy = start(server, [target_port]() {
+    return SharedFD::SocketLocalClient(target_port, SOCK_STREAM);
+  });
+
+  std::vector<Connection> connections;
+  for (std::size_t i = 0; i < count; i++) {
+    auto client = SharedFD::SocketLocalClient(port, SOCK_STREAM);
+    CHECK(client->IsOpen()) << client->StrError();
+    auto target = SharedFD::Accept(*target_server);
+    CHECK(target->IsOpen()) << target->StrError();
+    connections.push_back({client, target});
+  }
+  workload(connections);
+  // so that the proxy is done with them
+  for (auto& connection : connections) {
+    connection.client->Close();
+    connection.target->Close();
+  }
+}
+
+// Megabytes per second from the clients to the targets
+double Throughput(const StartProxy& start, std::size_t count,
+                  const Options& options) {
+  const std::size_t bytes = (options.megabytes << 20) / count;
+  std::chrono::duration<double> elapsed;
+  WithConnections(start, count, [&](std::vector<Connection>& connections) {
+    const std::string chunk(kChunkSize, 'x');
+    const auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (auto& connection : connections) {
+      threads.emplace_back([&chunk, bytes, client = connection.client]() {
+        for (std::size_t sent = 0; sent < bytes; sent += chunk.size()) {
+          CHECK(WriteAll(client, chunk) == static_cast<ssize_t>(chunk.size()))
+              << client->StrError();
+        }
+        client->Shutdown(SHUT_WR);
+      });
+      threads.emplace_back([bytes, target = connection.target]() {
+        std::vector<char> buffer(kChunkSize);
+        std::size_t received = 0;
+        ssize_t read;
+        while ((read = target->Read(buffer.data(), buffer.size())) > 0) {
+          received += read;
+        }
+        CHECK(read == 0) << target->StrError();
+        CHECK(received >= bytes) << "Short transfer";
+      });
+    }
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    elapsed = std::chrono::steady_clock::now() - begin;
+  });
+  const auto total = static_cast<double>(bytes * count);
+  return total / (1 << 20) / elapsed.count();
+}
+
+// Round trips of a small message echoed back by the target, in microseconds
+std::vector<double> RoundTrips(const StartProxy& start,
+                               const Options& options) {
+  std::vector<double> round_trips;
+  WithConnections(start, 1, [&](std::vector<Connection>& connections) {
+    auto client = connections[0].client;
+    auto target = connections[0].target;
+    std::thread echo([target]() {
+      std::string message(kMessageSize, '\0');
+      while (ReadExact(target, &message) == kMessageSize) {
+        CHECK(WriteAll(target, message) == kMessageSize) << target->StrError();
+      }
+    });
+    std::string message(kMessageSize, 'x');
+    for (std::size_t i = 0; i < options.round_trips; i++) {
+      const auto begin = std::chrono::steady_clock::now();
+      CHECK(WriteAll(client, message) == kMessageSize) << client->StrError();
+      CHECK(ReadExact(client, &message) == kMessageSize) << client->StrError();
+      const std::chrono::duration<double, std::micro> elapsed =
+          std::chrono::steady_clock::now() - begin;
+      round_trips.push_back(elapsed.count());
+    }
+    client->Shutdown(SHUT_WR);
+    echo.join();
+  });
+  std::sort(round_trips.begin(), round_trips.end());
+  return round_trips;
+}
+
+void Report(const char* name, const StartProxy& start,
+            const Options& options) {
+  const auto single = Throughput(start, 1, options);
+  const auto many = Throughput(start, options.connections, options);
+  const auto round_trips = RoundTrips(start, options);
+  std::printf("%-16s %10.0f MB/s %10.0f MB/s %10.1f us %10.1f us\n", name,
+              single, many, round_trips[round_trips.size() / 2],
+              round_trips[round_trips.size() * 99 / 100]);
+}
+
+bool ParseArg(int argc, char** argv, int index, std::size_t* value) {
+  return index >= argc || (android::base::ParseUint(argv[index], value) &&
+                           *value > 0);
+}
+
+}  // namespace
+}  // namespace cuttlefish
+
+int main(int argc, char** argv) {
+  using namespace cuttlefish;
+  Options options;
+  if (!ParseArg(argc, argv, 1, &options.megabytes) ||
+      !ParseArg(argc, argv, 2, &options.round_trips) ||
+      !ParseArg(argc, argv, 3, &options.connections)) {
+    std::fprintf(stderr,
+                 "usage: %s [megabytes [round_trips [connections]]]\n",
+                 argv[0]);
+    return 1;
+  }
+  // a broken connection fails the CHECKs instead
+  signal(SIGPIPE, SIG_IGN);
+
+  std::printf("%zu MB, %zu round trips of %zd bytes\n", options.megabytes,
+              options.round_trips, kMessageSize);
+  std::printf("%-16s %15s %15s %13s %13s\n", "", "1 connection",
+              (std::to_string(options.connections) + " connections").c_str(),
+              "p50", "p99");
+  Report("thread pair", StartThreadPairProxy, options);
+  Report("ProxyAsync", StartProxyAsync, options);
+  return 0;
+}
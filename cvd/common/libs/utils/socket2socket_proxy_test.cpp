@@ -0,0 +1,219 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/socket2socket_proxy.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <android-base/scopeguard.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+int LocalPort(SharedFD server) {
+  sockaddr_in addr{};
+  socklen_t length = sizeof(addr);
+  if (server->GetSockName(reinterpret_cast<sockaddr*>(&addr), &length) < 0) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+std::string Payload(size_t size) {
+  std::string payload(size, '\0');
+  for (size_t i = 0; i < size; i++) {
+    payload[i] = static_cast<char>(i * 7 + i / 251);
+  }
+  return payload;
+}
+
+class Socket2SocketProxyTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    auto server = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+    ASSERT_TRUE(server->IsOpen()) << server->StrError();
+    target_server_ = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+    ASSERT_TRUE(target_server_->IsOpen()) << target_server_->StrError();
+    proxy_port_ = LocalPort(server);
+    ASSERT_GT(proxy_port_, 0);
+    int target_port = LocalPort(target_server_);
+    ASSERT_GT(target_port, 0);
+    proxy_ = ProxyAsync(server, [target_port]() {
+      return SharedFD::SocketLocalClient(target_port, SOCK_STREAM);
+    });
+  }
+
+  // A client connected through the proxy, and the target it reaches
+  void Connect(SharedFD* client, SharedFD* target) {
+    *client = SharedFD::SocketLocalClient(proxy_port_, SOCK_STREAM);
+    ASSERT_TRUE((*client)->IsOpen()) << (*client)->StrError();
+    *target = SharedFD::Accept(*target_server_);
+    ASSERT_TRUE((*target)->IsOpen()) << (*target)->StrError();
+  }
+
+  int proxy_port_ = -1;
+  SharedFD target_server_;
+  std::unique_ptr<ProxyServer> proxy_;
+};
+
+TEST_F(Socket2SocketProxyTest, ForwardsBothWays) {
+  SharedFD client, target;
+  ASSERT_NO_FATAL_FAILURE(Connect(&client, &target));
+
+  // larger than the socket and pipe buffers
+  auto request = Payload(8 << 20);
+  std::thread writer([&]() {
+    EXPECT_EQ(WriteAll(client, request), request.size());
+    client->Shutdown(SHUT_WR);
+  });
+  std::string received;
+  EXPECT_EQ(ReadAll(target, &received), request.size());
+  writer.join();
+  EXPECT_EQ(received, request);
+
+  auto response = Payload(1 << 20);
+  EXPECT_EQ(WriteAll(target, response), response.size());
+  target->Close();
+  received.clear();
+  EXPECT_EQ(ReadAll(client, &received), response.size());
+  EXPECT_EQ(received, response);
+}
+
+TEST_F(Socket2SocketProxyTest, KeepsTheOtherWayOpenOnHalfClose) {
+  SharedFD client, target;
+  ASSERT_NO_FATAL_FAILURE(Connect(&client, &target));
+
+  ASSERT_EQ(WriteAll(client, "request"), 7);
+  ASSERT_EQ(client->Shutdown(SHUT_WR), 0);
+  std::string received;
+  ASSERT_EQ(ReadAll(target, &received), 7);
+  EXPECT_EQ(received, "request");
+
+  ASSERT_EQ(WriteAll(target, "response"), 8);
+  ASSERT_EQ(target->Shutdown(SHUT_WR), 0);
+  received.clear();
+  ASSERT_EQ(ReadAll(client, &received), 8);
+  EXPECT_EQ(received, "response");
+}
+
+TEST_F(Socket2SocketProxyTest, DeliversAfterHangUp) {
+  SharedFD client, target;
+  ASSERT_NO_FATAL_FAILURE(Connect(&client, &target));
+
+  // the proxy then hangs up on the client too once it closes
+  ASSERT_EQ(target->Shutdown(SHUT_WR), 0);
+  std::string received;
+  ASSERT_EQ(ReadAll(client, &received), 0);
+  // more than the proxy moves per event, while the target is not reading
+  auto request = Payload(16 << 20);
+  std::thread writer([&]() {
+    EXPECT_EQ(WriteAll(client, request), request.size());
+    client->Close();
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  EXPECT_EQ(ReadAll(target, &received), request.size());
+  writer.join();
+  EXPECT_EQ(received, request);
+}
+
+TEST_F(Socket2SocketProxyTest, ServesManyConnections) {
+  constexpr size_t kConnections = 32;
+  std::vector<SharedFD> clients(kConnections), targets(kConnections);
+  for (size_t i = 0; i < kConnections; i++) {
+    ASSERT_NO_FATAL_FAILURE(Connect(&clients[i], &targets[i]));
+  }
+  for (size_t i = 0; i < kConnections; i++) {
+    auto message = std::to_string(i);
+    ASSERT_EQ(WriteAll(clients[i], message), message.size());
+    clients[i]->Shutdown(SHUT_WR);
+  }
+  for (size_t i = kConnections; i-- > 0;) {
+    std::string received;
+    ASSERT_GE(ReadAll(targets[i], &received), 0);
+    EXPECT_EQ(received, std::to_string(i));
+  }
+}
+
+TEST_F(Socket2SocketProxyTest, ConnectsWhileATargetIsSlow) {
+  auto server = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+  ASSERT_TRUE(server->IsOpen()) << server->StrError();
+  const int port = LocalPort(server);
+  ASSERT_GT(port, 0);
+  const int target_port = LocalPort(target_server_);
+  std::promise<void> unblock;
+  auto unblocked = unblock.get_future().share();
+  std::atomic<int> calls = 0;
+  auto proxy = ProxyAsync(server, [&, target_port]() {
+    // the first target takes until the second connection went through
+    if (calls++ == 0) {
+      unblocked.wait();
+    }
+    return SharedFD::SocketLocalClient(target_port, SOCK_STREAM);
+  });
+  // or stopping the proxy waits for the first target forever
+  auto unblock_on_failure =
+      android::base::make_scope_guard([&]() { unblock.set_value(); });
+
+  auto slow_client = SharedFD::SocketLocalClient(port, SOCK_STREAM);
+  ASSERT_TRUE(slow_client->IsOpen()) << slow_client->StrError();
+  while (calls == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  auto client = SharedFD::SocketLocalClient(port, SOCK_STREAM);
+  ASSERT_TRUE(client->IsOpen()) << client->StrError();
+  auto target = SharedFD::Accept(*target_server_);
+  ASSERT_TRUE(target->IsOpen()) << target->StrError();
+  ASSERT_EQ(WriteAll(client, "fast"), 4);
+  ASSERT_EQ(client->Shutdown(SHUT_WR), 0);
+  std::string received;
+  ASSERT_EQ(ReadAll(target, &received), 4);
+  EXPECT_EQ(received, "fast");
+
+  unblock_on_failure.Disable();
+  unblock.set_value();
+  auto slow_target = SharedFD::Accept(*target_server_);
+  ASSERT_TRUE(slow_target->IsOpen()) << slow_target->StrError();
+  ASSERT_EQ(WriteAll(slow_client, "slow"), 4);
+  ASSERT_EQ(slow_client->Shutdown(SHUT_WR), 0);
+  received.clear();
+  ASSERT_EQ(ReadAll(slow_target, &received), 4);
+  EXPECT_EQ(received, "slow");
+}
+
+TEST_F(Socket2SocketProxyTest, ClosesTheConnectionsWhenStopped) {
+  SharedFD client, target;
+  ASSERT_NO_FATAL_FAILURE(Connect(&client, &target));
+
+  proxy_.reset();
+  std::string received;
+  EXPECT_EQ(ReadAll(client, &received), 0);
+  EXPECT_EQ(ReadAll(target, &received), 0);
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -17,7 +17,10 @@
 #include "common/libs/utils/subprocess.h"
 
 #ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sched.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
 #include <errno.h>
@@ -150,6 +153,35 @@ SubprocessOptions SubprocessOptions::InGroup(bool in_group) && {
   return *this;
 }
 
+#ifdef __linux__
+SubprocessOptions& SubprocessOptions::Cgroup(std::string cgroup_path) & {
+  cgroup_path_ = std::move(cgroup_path);
+  return *this;
+}
+SubprocessOptions SubprocessOptions::Cgroup(std::string cgroup_path) && {
+  cgroup_path_ = std::move(cgroup_path);
+  return *this;
+}
+
+SubprocessOptions& SubprocessOptions::CpuAffinity(std::set<int> cpus) & {
+  cpu_affinity_ = std::move(cpus);
+  return *this;
+}
+SubprocessOptions SubprocessOptions::CpuAffinity(std::set<int> cpus) && {
+  cpu_affinity_ = std::move(cpus);
+  return *this;
+}
+
+SubprocessOptions& SubprocessOptions::NumaNode(int node) & {
+  numa_node_ = node;
+  return *this;
+}
+SubprocessOptions SubprocessOptions::NumaNode(int node) && {
+  numa_node_ = node;
+  return *this;
+}
+#endif
+
 Subprocess::Subprocess(Subprocess&& subprocess)
     : pid_(subprocess.pid_.load()),
       started_(subprocess.started_),
@@ -369,6 +401,23 @@ Command Command::AddPrerequisite(
 
 Subprocess Command::Start(SubprocessOptions options) const {
   auto cmd = ToCharPointers(command_);
+  const auto cgroup_procs =
+      options.Cgroup().empty() ? "" : options.Cgroup() + "/cgroup.procs";
+#ifdef __linux__
+  cpu_set_t cpu_affinity;
+  CPU_ZERO(&cpu_affinity);
+  for (const auto cpu : options.CpuAffinity()) {
+    CPU_SET(cpu, &cpu_affinity);
+  }
+  // set_mempolicy takes a bitmask of nodes
+  std::vector<unsigned long> node_mask;
+  if (options.NumaNode()) {
+    const int node = *options.NumaNode();
+    const int bits = 8 * sizeof(unsigned long);
+    node_mask.resize(node / bits + 1);
+    node_mask[node / bits] |= 1UL << (node % bits);
+  }
+#endif
 
   if (!validate_redirects(redirects_, inherited_fds_)) {
     return Subprocess(-1, {});
@@ -400,6 +449,28 @@ Subprocess Command::Start(SubprocessOptions options) const {
         LOG(ERROR) << "setpgid failed (" << strerror(error) << ")";
       }
     }
+#ifdef __linux__
+    if (!cgroup_procs.empty()) {
+      // "0" stands for the writing process
+      int procs_fd = open(cgroup_procs.c_str(), O_WRONLY | O_CLOEXEC);
+      if (procs_fd < 0 || TEMP_FAILURE_RETRY(write(procs_fd, "0", 1)) != 1) {
+        LOG(ERROR) << "Failed to join the cgroup \"" << options.Cgroup()
+                   << "\" (" << strerror(errno) << ")";
+        exit(EXIT_FAILURE);
+      }
+      close(procs_fd);
+    }
+    // Only a hint for placement, the subprocess still runs without it
+    if (!options.CpuAffinity().empty() &&
+        sched_setaffinity(0, sizeof(cpu_affinity), &cpu_affinity) != 0) {
+      LOG(ERROR) << "sched_setaffinity failed (" << strerror(errno) << ")";
+    }
+    if (!node_mask.empty() &&
+        syscall(SYS_set_mempolicy, MPOL_PREFERRED, node_mask.data(),
+                node_mask.size() * 8 * sizeof(unsigned long) + 1) != 0) {
+      LOG(ERROR) << "set_mempolicy failed (" << strerror(errno) << ")";
+    }
+#endif
     for (const auto& entry : inherited_fds_) {
       if (fcntl(entry.second, F_SETFD, 0)) {
         int error_num = errno;
@@ -28,6 +28,7 @@
 #include <map>
 #include <optional>
 #include <ostream>
+#include <set>
 #include <sstream>
 #include <string>
 #include <type_traits>
@@ -116,15 +117,33 @@ class SubprocessOptions {
   // The subprocess runs as head of its own process group.
   SubprocessOptions& InGroup(bool in_group) &;
   SubprocessOptions InGroup(bool in_group) &&;
+#ifdef __linux__
+  // The subprocess joins the cgroup v2 directory before exec, so everything
+  // it forks is in there as well. It exits if it can't.
+  SubprocessOptions& Cgroup(std::string cgroup_path) &;
+  SubprocessOptions Cgroup(std::string cgroup_path) &&;
+  // The subprocess and everything it forks run on these CPUs only.
+  SubprocessOptions& CpuAffinity(std::set<int> cpus) &;
+  SubprocessOptions CpuAffinity(std::set<int> cpus) &&;
+  // The subprocess and everything it forks prefer the memory of the node.
+  SubprocessOptions& NumaNode(int node) &;
+  SubprocessOptions NumaNode(int node) &&;
+#endif
 
   bool Verbose() const { return verbose_; }
   bool ExitWithParent() const { return exit_with_parent_; }
   bool InGroup() const { return in_group_; }
+  const std::string& Cgroup() const { return cgroup_path_; }
+  const std::set<int>& CpuAffinity() const { return cpu_affinity_; }
+  std::optional<int> NumaNode() const { return numa_node_; }
 
  private:
   bool verbose_;
   bool exit_with_parent_;
   bool in_group_;
+  std::string cgroup_path_;
+  std::set<int> cpu_affinity_;
+  std::optional<int> numa_node_;
 };
 
 // An executable command. Multiple subprocesses can be started from the same
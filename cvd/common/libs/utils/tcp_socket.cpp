@@ -16,30 +16,116 @@
 
 #include "common/libs/utils/tcp_socket.h"
 
+#include <limits.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <memory>
 #include <ostream>
 #include <string>
+#include <utility>
 
 #include <android-base/logging.h>
 
 namespace cuttlefish {
+namespace {
+
+/*
+ * The part of a list of buffers that is left to transfer. The list is only
+ * copied, to be modified, when a transfer ends in the middle of a buffer.
+ */
+class IovecCursor {
+ public:
+  IovecCursor(const struct iovec* iov, std::size_t count)
+      : iov_(iov), count_(count) {
+    Advance(0);
+  }
+
+  bool Done() const { return count_ == 0; }
+
+  struct msghdr Header() const {
+    struct msghdr msg {};
+    // sendmsg and recvmsg don't modify the list
+    msg.msg_iov = const_cast<struct iovec*>(iov_);
+    msg.msg_iovlen = std::min<std::size_t>(count_, IOV_MAX);
+    return msg;
+  }
+
+  void Advance(std::size_t bytes) {
+    while (count_ > 0 && bytes >= iov_->iov_len) {
+      bytes -= iov_->iov_len;
+      iov_++;
+      count_--;
+    }
+    if (bytes == 0) {
+      return;
+    }
+    if (!copied_) {
+      copy_.assign(iov_, iov_ + count_);
+      iov_ = copy_.data();
+      copied_ = true;
+    }
+    auto& first = copy_[iov_ - copy_.data()];
+    first.iov_base = static_cast<std::uint8_t*>(first.iov_base) + bytes;
+    first.iov_len -= bytes;
+  }
+
+ private:
+  const struct iovec* iov_;
+  std::size_t count_;
+  std::vector<struct iovec> copy_;
+  bool copied_ = false;
+};
+
+}  // namespace
+
+MessagePool::MessagePool(std::size_t max_buffers)
+    : max_buffers_(max_buffers) {}
+
+Message MessagePool::Get(std::size_t length) {
+  Message buf;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!buffers_.empty()) {
+      buf = std::move(buffers_.back());
+      buffers_.pop_back();
+    }
+  }
+  buf.resize(length);
+  return buf;
+}
+
+void MessagePool::Put(Message message) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (buffers_.size() < max_buffers_) {
+    buffers_.emplace_back(std::move(message));
+  }
+}
 
 ClientSocket::ClientSocket(int port)
     : fd_(SharedFD::SocketLocalClient(port, SOCK_STREAM)) {}
 
 Message ClientSocket::RecvAny(std::size_t length) {
-  Message buf(length);
-  auto read_count = fd_->Read(buf.data(), buf.size());
+  Message buf;
+  RecvAny(buf, length);
+  return buf;
+}
+
+bool ClientSocket::RecvAny(Message& buf, std::size_t length) {
+  buf.resize(length);
+  buf.resize(RecvAny(buf.data(), length));
+  return !buf.empty();
+}
+
+std::size_t ClientSocket::RecvAny(std::uint8_t* data, std::size_t length) {
+  auto read_count = fd_->Read(data, length);
   if (read_count < 0) {
     read_count = 0;
   }
-  buf.resize(read_count);
-  return buf;
+  return read_count;
 }
 
 bool ClientSocket::closed() const {
@@ -47,25 +133,67 @@ bool ClientSocket::closed() const {
   return other_side_closed_;
 }
 
+void ClientSocket::MarkClosed() {
+  std::lock_guard<std::mutex> guard(closed_lock_);
+  other_side_closed_ = true;
+}
+
 Message ClientSocket::Recv(std::size_t length) {
-  Message buf(length);
-  ssize_t total_read = 0;
-  while (total_read < static_cast<ssize_t>(length)) {
-    auto just_read = fd_->Read(&buf[total_read], buf.size() - total_read);
+  Message buf;
+  Recv(buf, length);
+  return buf;
+}
+
+Message ClientSocket::Recv(std::size_t length, MessagePool& pool) {
+  auto buf = pool.Get(length);
+  if (!Recv(buf.data(), length)) {
+    pool.Put(std::move(buf));
+    return Message{};
+  }
+  return buf;
+}
+
+bool ClientSocket::Recv(Message& buf, std::size_t length) {
+  // Doesn't allocate when the buffer is large enough already
+  buf.resize(length);
+  if (!Recv(buf.data(), length)) {
+    buf.clear();
+    return false;
+  }
+  return true;
+}
+
+bool ClientSocket::Recv(std::uint8_t* data, std::size_t length) {
+  std::size_t total_read = 0;
+  while (total_read < length) {
+    auto just_read = fd_->Read(data + total_read, length - total_read);
     if (just_read <= 0) {
       if (just_read < 0) {
-        LOG(ERROR) << "read() error: " << strerror(errno);
-      }
-      {
-        std::lock_guard<std::mutex> guard(closed_lock_);
-        other_side_closed_ = true;
+        LOG(ERROR) << "read() error: " << fd_->StrError();
       }
-      return Message{};
+      MarkClosed();
+      return false;
     }
     total_read += just_read;
   }
-  CHECK(total_read == static_cast<ssize_t>(length));
-  return buf;
+  return true;
+}
+
+bool ClientSocket::Recv(const struct iovec* iov, std::size_t iov_count) {
+  IovecCursor left(iov, iov_count);
+  while (!left.Done()) {
+    auto msg = left.Header();
+    auto just_read = fd_->RecvMsg(&msg, 0);
+    if (just_read <= 0) {
+      if (just_read < 0) {
+        LOG(ERROR) << "recvmsg() error: " << fd_->StrError();
+      }
+      MarkClosed();
+      return false;
+    }
+    left.Advance(just_read);
+  }
+  return true;
 }
 
 ssize_t ClientSocket::SendNoSignal(const uint8_t* data, std::size_t size) {
@@ -78,10 +206,7 @@ ssize_t ClientSocket::SendNoSignal(const uint8_t* data, std::size_t size) {
     auto just_written = fd_->Send(data + written, size - written, MSG_NOSIGNAL);
     if (just_written <= 0) {
       LOG(INFO) << "Couldn't write to client: " << strerror(errno);
-      {
-        std::lock_guard<std::mutex> guard(closed_lock_);
-        other_side_closed_ = true;
-      }
+      MarkClosed();
       return just_written;
     }
     written += just_written;
@@ -93,6 +218,38 @@ ssize_t ClientSocket::SendNoSignal(const Message& message) {
   return SendNoSignal(&message[0], message.size());
 }
 
+ssize_t ClientSocket::SendNoSignal(const std::vector<Message>& messages) {
+  std::vector<struct iovec> iov;
+  iov.reserve(messages.size());
+  for (const auto& message : messages) {
+    iov.push_back({.iov_base = const_cast<std::uint8_t*>(message.data()),
+                   .iov_len = message.size()});
+  }
+  return SendNoSignal(iov.data(), iov.size());
+}
+
+ssize_t ClientSocket::SendNoSignal(const struct iovec* iov,
+                                   std::size_t iov_count) {
+  std::lock_guard<std::mutex> lock(send_lock_);
+  ssize_t written{};
+  IovecCursor left(iov, iov_count);
+  while (!left.Done()) {
+    if (!fd_->IsOpen()) {
+      LOG(ERROR) << "fd_ is closed";
+    }
+    auto msg = left.Header();
+    auto just_written = fd_->SendMsg(&msg, MSG_NOSIGNAL);
+    if (just_written <= 0) {
+      LOG(INFO) << "Couldn't write to client: " << fd_->StrError();
+      MarkClosed();
+      return just_written;
+    }
+    written += just_written;
+    left.Advance(just_written);
+  }
+  return written;
+}
+
 ServerSocket::ServerSocket(int port)
     : fd_{SharedFD::SocketLocalServer(port, SOCK_STREAM)} {
   if (!fd_->IsOpen()) {
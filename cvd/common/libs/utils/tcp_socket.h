@@ -18,6 +18,7 @@
 
 #include "common/libs/fs/shared_fd.h"
 
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cstddef>
@@ -29,8 +30,30 @@
 namespace cuttlefish {
 using Message = std::vector<std::uint8_t>;
 
+// Recycles the buffers of the received messages, so that receiving in a loop
+// stops allocating once the buffers are large enough. Thread safe.
+class MessagePool {
+ public:
+  explicit MessagePool(std::size_t max_buffers = 16);
+
+  MessagePool(const MessagePool&) = delete;
+  MessagePool& operator=(const MessagePool&) = delete;
+
+  // A buffer of that length, recycled if there is one
+  Message Get(std::size_t length);
+  // Keeps the buffer for a later Get, unless the pool is full
+  void Put(Message message);
+
+ private:
+  std::mutex mutex_;
+  std::vector<Message> buffers_;
+  std::size_t max_buffers_;
+};
+
 // Recv and Send wait until all data has been received or sent.
 // Send is thread safe in this regard, Recv is not.
+// The overloads taking a buffer don't allocate, the ones taking several
+// buffers or messages use a single system call when the socket allows it.
 class ClientSocket {
  public:
   ClientSocket(ClientSocket&& other) : fd_{other.fd_} {}
@@ -46,12 +69,25 @@ class ClientSocket {
   ClientSocket& operator=(const ClientSocket&) = delete;
 
   Message Recv(std::size_t length);
+  Message Recv(std::size_t length, MessagePool& pool);
+  // Fills the buffer, resized to length, and returns false on error or close
+  bool Recv(Message& buf, std::size_t length);
+  bool Recv(std::uint8_t* data, std::size_t length);
+  // Fills all the buffers, in order
+  bool Recv(const struct iovec* iov, std::size_t iov_count);
   // RecvAny will receive whatever is available.
   // An empty message returned indicates error or close.
   Message RecvAny(std::size_t length);
+  // Resizes buf to what was received, up to length
+  bool RecvAny(Message& buf, std::size_t length);
+  // Returns the length received, or 0 on error or close
+  std::size_t RecvAny(std::uint8_t* data, std::size_t length);
   // Sends are called with MSG_NOSIGNAL to suppress SIGPIPE
   ssize_t SendNoSignal(const std::uint8_t* data, std::size_t size);
   ssize_t SendNoSignal(const Message& message);
+  // Sends the messages one after the other
+  ssize_t SendNoSignal(const std::vector<Message>& messages);
+  ssize_t SendNoSignal(const struct iovec* iov, std::size_t iov_count);
 
   template <std::size_t N>
   ssize_t SendNoSignal(const std::uint8_t (&data)[N]) {
@@ -64,6 +100,8 @@ class ClientSocket {
   friend class ServerSocket;
   explicit ClientSocket(SharedFD fd) : fd_(fd) {}
 
+  void MarkClosed();
+
   SharedFD fd_;
   bool other_side_closed_{};
   mutable std::mutex closed_lock_;
@@ -0,0 +1,260 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Messages per second and heap allocations per message of the ways
+// ClientSocket receives and sends small messages, e.g. the events forwarded
+// to a device. Run as:
+//   tcp_socket_benchmark [message_size [num_messages [batch_size]]]
+
+#include "common/libs/utils/tcp_socket.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+
+#include "common/libs/fs/shared_fd.h"
+
+namespace {
+
+// of the calling thread, so that each side of a connection counts its own
+thread_local std::size_t allocations = 0;
+
+}  // namespace
+
+void* operator new(std::size_t size) {
+  allocations++;
+  if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+
+namespace cuttlefish {
+namespace {
+
+struct Options {
+  std::size_t message_size = 64;
+  std::size_t num_messages = 200000;
+  // messages per system call on the other side
+  std::size_t batch_size = 16;
+};
+
+// Transfers all the messages on one side of the connection
+using Side = std::function<bool(ClientSocket&, const Options&)>;
+
+struct Measurement {
+  std::chrono::duration<double> elapsed;
+  // of the side measured
+  std::size_t allocations;
+};
+
+int FreePort() {
+  auto server = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+  sockaddr_in addr{};
+  socklen_t length = sizeof(addr);
+  if (server->GetSockName(reinterpret_cast<sockaddr*>(&addr), &length) < 0) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+Measurement Measure(const Side& sender, const Side& receiver,
+                    const bool measure_sender, const Options& options) {
+  const int port = FreePort();
+  CHECK(port > 0) << "No free port";
+  ServerSocket server(port);
+  std::optional<ClientSocket> accepted;
+  std::thread accept([&]() { accepted.emplace(server.Accept()); });
+  ClientSocket client(port);
+  accept.join();
+
+  std::size_t sender_allocations = 0;
+  const auto start = std::chrono::steady_clock::now();
+  std::thread send([&]() {
+    const auto before = allocations;
+    CHECK(sender(client, options)) << "Failed to send";
+    sender_allocations = allocations - before;
+  });
+  const auto before = allocations;
+  CHECK(receiver(*accepted, options)) << "Failed to receive";
+  const auto receiver_allocations = allocations - before;
+  send.join();
+  return Measurement{
+      .elapsed = std::chrono::steady_clock::now() - start,
+      .allocations = measure_sender ? sender_allocations : receiver_allocations,
+  };
+}
+
+// The other side of the ones measured, in batches
+
+bool SendBatches(ClientSocket& socket, const Options& options) {
+  const Message batch(options.message_size * options.batch_size, 1);
+  for (std::size_t i = 0; i < options.num_messages; i += options.batch_size) {
+    if (socket.SendNoSignal(batch) != static_cast<ssize_t>(batch.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecvBatches(ClientSocket& socket, const Options& options) {
+  Message batch(options.message_size * options.batch_size);
+  for (std::size_t i = 0; i < options.num_messages; i += options.batch_size) {
+    if (!socket.Recv(batch.data(), batch.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Receiving one message at a time
+
+bool RecvNew(ClientSocket& socket, const Options& options) {
+  for (std::size_t i = 0; i < options.num_messages; i++) {
+    if (socket.Recv(options.message_size).empty()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecvIntoBuffer(ClientSocket& socket, const Options& options) {
+  Message buffer;
+  for (std::size_t i = 0; i < options.num_messages; i++) {
+    if (!socket.Recv(buffer, options.message_size)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecvFromPool(ClientSocket& socket, const Options& options) {
+  MessagePool pool;
+  for (std::size_t i = 0; i < options.num_messages; i++) {
+    auto message = socket.Recv(options.message_size, pool);
+    if (message.empty()) {
+      return false;
+    }
+    // what a consumer does once done with the message
+    pool.Put(std::move(message));
+  }
+  return true;
+}
+
+// Sending one message or one batch at a time
+
+bool SendEach(ClientSocket& socket, const Options& options) {
+  const Message message(options.message_size, 1);
+  for (std::size_t i = 0; i < options.num_messages; i++) {
+    if (socket.SendNoSignal(message) != static_cast<ssize_t>(message.size())) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SendIovecs(ClientSocket& socket, const Options& options) {
+  Message message(options.message_size, 1);
+  const std::vector<struct iovec> iov(
+      options.batch_size,
+      {.iov_base = message.data(), .iov_len = message.size()});
+  const auto batch_size =
+      static_cast<ssize_t>(options.message_size * options.batch_size);
+  for (std::size_t i = 0; i < options.num_messages; i += options.batch_size) {
+    if (socket.SendNoSignal(iov.data(), iov.size()) != batch_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SendMessages(ClientSocket& socket, const Options& options) {
+  const std::vector<Message> messages(options.batch_size,
+                                      Message(options.message_size, 1));
+  const auto batch_size =
+      static_cast<ssize_t>(options.message_size * options.batch_size);
+  for (std::size_t i = 0; i < options.num_messages; i += options.batch_size) {
+    if (socket.SendNoSignal(messages) != batch_size) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Report(const char* name, const Measurement& measurement,
+            const Options& options) {
+  std::printf("%-36s %12.0f msg/s %10.3f allocs/msg\n", name,
+              options.num_messages / measurement.elapsed.count(),
+              static_cast<double>(measurement.allocations) /
+                  options.num_messages);
+}
+
+bool ParseArg(int argc, char** argv, int index, std::size_t* value) {
+  return index >= argc || (android::base::ParseUint(argv[index], value) &&
+                           *value > 0);
+}
+
+}  // namespace
+}  // namespace cuttlefish
+
+int main(int argc, char** argv) {
+  using namespace cuttlefish;
+  Options options;
+  if (!ParseArg(argc, argv, 1, &options.message_size) ||
+      !ParseArg(argc, argv, 2, &options.num_messages) ||
+      !ParseArg(argc, argv, 3, &options.batch_size)) {
+    std::fprintf(stderr,
+                 "usage: %s [message_size [num_messages [batch_size]]]\n",
+                 argv[0]);
+    return 1;
+  }
+  // whole batches
+  options.num_messages -= options.num_messages % options.batch_size;
+  if (options.num_messages == 0) {
+    options.num_messages = options.batch_size;
+  }
+
+  std::printf("%zu messages of %zu bytes, batches of %zu\n",
+              options.num_messages, options.message_size, options.batch_size);
+  Report("Recv(length)", Measure(SendBatches, RecvNew, false, options),
+         options);
+  Report("Recv(buffer, length)",
+         Measure(SendBatches, RecvIntoBuffer, false, options), options);
+  Report("Recv(length, pool)",
+         Measure(SendBatches, RecvFromPool, false, options), options);
+  Report("SendNoSignal(message)", Measure(SendEach, RecvBatches, true, options),
+         options);
+  Report("SendNoSignal(iovec, count)",
+         Measure(SendIovecs, RecvBatches, true, options), options);
+  Report("SendNoSignal(vector<Message>)",
+         Measure(SendMessages, RecvBatches, true, options), options);
+  return 0;
+}
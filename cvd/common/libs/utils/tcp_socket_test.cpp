@@ -0,0 +1,131 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/tcp_socket.h"
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+int FreePort() {
+  auto server = SharedFD::SocketLocalServer(0, SOCK_STREAM);
+  sockaddr_in addr{};
+  socklen_t length = sizeof(addr);
+  if (server->GetSockName(reinterpret_cast<sockaddr*>(&addr), &length) < 0) {
+    return -1;
+  }
+  return ntohs(addr.sin_port);
+}
+
+Message Pattern(std::size_t size, std::uint8_t seed) {
+  Message message(size);
+  for (std::size_t i = 0; i < size; i++) {
+    message[i] = static_cast<std::uint8_t>(seed + i * 13);
+  }
+  return message;
+}
+
+class TcpSocketTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    int port = FreePort();
+    ASSERT_GT(port, 0);
+    server_ = std::make_unique<ServerSocket>(port);
+    std::thread accept([this]() { accepted_.emplace_back(server_->Accept()); });
+    client_.emplace_back(port);
+    accept.join();
+  }
+
+  ClientSocket& Client() { return client_[0]; }
+  ClientSocket& Accepted() { return accepted_[0]; }
+
+  std::unique_ptr<ServerSocket> server_;
+  std::vector<ClientSocket> client_;
+  std::vector<ClientSocket> accepted_;
+};
+
+TEST_F(TcpSocketTest, RecvIntoBuffer) {
+  auto sent = Pattern(1 << 20, 1);
+  std::thread sender([&]() { EXPECT_EQ(Client().SendNoSignal(sent), sent.size()); });
+  Message received;
+  received.reserve(sent.size());
+  auto data = received.data();
+  ASSERT_TRUE(Accepted().Recv(received, sent.size()));
+  sender.join();
+  EXPECT_EQ(received, sent);
+  // the capacity was reused
+  EXPECT_EQ(received.data(), data);
+}
+
+TEST_F(TcpSocketTest, RecvFromPool) {
+  MessagePool pool(1);
+  auto sent = Pattern(100, 2);
+  ASSERT_EQ(Client().SendNoSignal(sent), sent.size());
+  auto first = Accepted().Recv(sent.size(), pool);
+  EXPECT_EQ(first, sent);
+  auto data = first.data();
+  pool.Put(std::move(first));
+
+  ASSERT_EQ(Client().SendNoSignal(sent), sent.size());
+  auto second = Accepted().Recv(sent.size(), pool);
+  EXPECT_EQ(second, sent);
+  EXPECT_EQ(second.data(), data);
+}
+
+TEST_F(TcpSocketTest, ScatterGather) {
+  // large enough for partial transfers in the middle of a buffer
+  std::vector<Message> sent = {Pattern(3, 3), Message(), Pattern(1 << 20, 4),
+                               Pattern(12345, 5)};
+  std::size_t total = 0;
+  for (const auto& message : sent) {
+    total += message.size();
+  }
+  std::thread sender([&]() { EXPECT_EQ(Client().SendNoSignal(sent), total); });
+
+  std::vector<Message> received;
+  std::vector<struct iovec> iov;
+  for (const auto& message : sent) {
+    received.emplace_back(message.size());
+  }
+  for (auto& message : received) {
+    iov.push_back({.iov_base = message.data(), .iov_len = message.size()});
+  }
+  ASSERT_TRUE(Accepted().Recv(iov.data(), iov.size()));
+  sender.join();
+  EXPECT_EQ(received, sent);
+}
+
+TEST_F(TcpSocketTest, RecvFailsOnClose) {
+  client_.clear();
+  std::uint8_t data[4];
+  EXPECT_FALSE(Accepted().Recv(data, sizeof(data)));
+  EXPECT_TRUE(Accepted().closed());
+  EXPECT_EQ(Accepted().RecvAny(data, sizeof(data)), 0);
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -17,9 +17,12 @@
 #pragma once
 
 #include <functional>
+#include <limits>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <set>
 #include <type_traits>
 #include <unordered_set>
 #include <utility>
@@ -34,6 +37,10 @@ namespace cuttlefish {
 /**
  * Generic allocator that can provide RAII-aware resource reservations.
  *
+ * For integral resources, the free items are also kept as sorted ranges of
+ * consecutive items, so ranges are found in O(log n), and the items are
+ * handed out lowest first.
+ *
  * See go/cf-resource-allocator-utils for more details.
  */
 template <typename T>
@@ -93,6 +100,21 @@ class UniqueResourceAllocator {
     }
   };
   using ReservationSet = std::unordered_set<Reservation, ReservationHash>;
+
+  // How consecutive items are picked among the free ranges that fit
+  enum class RangeFit {
+    // the smallest range, then the lowest: keeps the large ranges whole
+    kBestFit,
+    // the lowest range
+    kFirstFit,
+  };
+
+  struct FragmentationStats {
+    std::size_t free_items;
+    // the free items, as maximal ranges of consecutive items
+    std::size_t free_ranges;
+    std::size_t largest_free_range;
+  };
   /*
    * Creates the singleton object.
    *
@@ -120,6 +142,7 @@ class UniqueResourceAllocator {
         not_selected.emplace_back(std::move(new_item));
         continue;
       }
+      AddFreeRange(new_item);
       available_resources_.insert(std::move(new_item));
     }
     return not_selected;
@@ -139,7 +162,7 @@ class UniqueResourceAllocator {
 
   std::optional<Reservation> UniqueItem() {
     std::lock_guard<std::mutex> lock(mutex_);
-    auto itr = available_resources_.begin();
+    auto itr = AnyAvailable();
     if (itr == available_resources_.end()) {
       return std::nullopt;
     }
@@ -155,7 +178,7 @@ class UniqueResourceAllocator {
     }
     ReservationSet result;
     for (int i = 0; i < n; i++) {
-      auto itr = available_resources_.begin();
+      auto itr = AnyAvailable();
       result.insert(Reservation{*this, *(RemoveFromPool(itr))});
     }
     return {std::move(result)};
@@ -163,23 +186,50 @@ class UniqueResourceAllocator {
 
   template <typename V = T>
   std::enable_if_t<std::is_integral<V>::value, std::optional<ReservationSet>>
-  UniqueConsecutiveItems(const int n) {
+  UniqueConsecutiveItems(const int n, const RangeFit fit = RangeFit::kBestFit) {
     static_assert(std::is_same<T, V>::value);
     std::lock_guard<std::mutex> lock(mutex_);
     if (n <= 0 || available_resources_.size() < n) {
       return std::nullopt;
     }
-
-    for (const auto& available_resource : available_resources_) {
-      auto start_inclusive = available_resource;
-      auto resources_opt =
-          TakeRangeInternal(start_inclusive, start_inclusive + n);
-      if (!resources_opt) {
-        continue;
+    // ranges are keyed by their last item minus the first
+    const T span = static_cast<T>(n - 1);
+    std::optional<T> first;
+    if (fit == RangeFit::kBestFit) {
+      auto itr = free_ranges_by_span_.lower_bound(
+          {span, std::numeric_limits<T>::lowest()});
+      if (itr != free_ranges_by_span_.end()) {
+        first = itr->second;
+      }
+    } else {
+      for (const auto& [range_first, range_last] : free_ranges_) {
+        if (range_last - range_first >= span) {
+          first = range_first;
+          break;
+        }
       }
-      return resources_opt;
     }
-    return std::nullopt;
+    if (!first) {
+      return std::nullopt;
+    }
+    return TakeRangeInternal(*first, *first + n);
+  }
+
+  template <typename V = T>
+  std::enable_if_t<std::is_integral<V>::value, FragmentationStats>
+  Fragmentation() {
+    static_assert(std::is_same<T, V>::value);
+    std::lock_guard<std::mutex> lock(mutex_);
+    FragmentationStats stats{
+        .free_items = available_resources_.size(),
+        .free_ranges = free_ranges_.size(),
+        .largest_free_range = 0,
+    };
+    if (!free_ranges_by_span_.empty()) {
+      stats.largest_free_range =
+          static_cast<std::size_t>(free_ranges_by_span_.rbegin()->first) + 1;
+    }
+    return stats;
   }
 
   // takes t if available
@@ -227,7 +277,11 @@ class UniqueResourceAllocator {
  private:
   template <typename Container>
   UniqueResourceAllocator(const Container& items)
-      : available_resources_{items.cbegin(), items.cend()} {}
+      : available_resources_{items.cbegin(), items.cend()} {
+    for (const auto& item : available_resources_) {
+      AddFreeRange(item);
+    }
+  }
 
   bool operator==(const UniqueResourceAllocator& other) const {
     return std::addressof(*this) == std::addressof(other);
@@ -248,6 +302,7 @@ class UniqueResourceAllocator {
     }
     T tmp = std::move(*itr);
     allocated_resources_.erase(itr);
+    AddFreeRange(tmp);
     available_resources_.insert(std::move(tmp));
   }
 
@@ -261,10 +316,13 @@ class UniqueResourceAllocator {
   std::enable_if_t<std::is_integral<V>::value, std::optional<ReservationSet>>
   TakeRangeInternal(const T& start_inclusive, const T& end_exclusive) {
     static_assert(std::is_same<T, V>::value);
-    for (auto cursor = start_inclusive; cursor < end_exclusive; cursor++) {
-      if (!Contains(available_resources_, cursor)) {
-        return std::nullopt;
-      }
+    if (start_inclusive >= end_exclusive) {
+      return std::nullopt;
+    }
+    auto range = free_ranges_.upper_bound(start_inclusive);
+    if (range == free_ranges_.begin() ||
+        std::prev(range)->second < end_exclusive - 1) {
+      return std::nullopt;
     }
     ReservationSet resources;
     for (auto cursor = start_inclusive; cursor < end_exclusive; cursor++) {
@@ -282,13 +340,77 @@ class UniqueResourceAllocator {
    * The itr must belong to available_resources_.
    */
   const T* RemoveFromPool(const typename std::unordered_set<T>::iterator itr) {
+    RemoveFreeRange(*itr);
     T tmp = std::move(*itr);
     available_resources_.erase(itr);
     const auto [new_itr, _] = allocated_resources_.insert(std::move(tmp));
     return std::addressof(*new_itr);
   }
+
+  // The lowest free item if T is integral, or else any
+  typename std::unordered_set<T>::iterator AnyAvailable() {
+    if constexpr (std::is_integral<T>::value) {
+      if (free_ranges_.empty()) {
+        return available_resources_.end();
+      }
+      return available_resources_.find(free_ranges_.begin()->first);
+    } else {
+      return available_resources_.begin();
+    }
+  }
+
+  // Merges t, which must not be free yet, into the free ranges
+  void AddFreeRange(const T& t) {
+    if constexpr (std::is_integral<T>::value) {
+      T first = t;
+      T last = t;
+      auto next = free_ranges_.upper_bound(t);
+      if (next != free_ranges_.begin()) {
+        auto prev = std::prev(next);
+        if (prev->second + 1 == t) {
+          first = prev->first;
+          EraseFreeRange(prev);
+        }
+      }
+      if (next != free_ranges_.end() && t + 1 == next->first) {
+        last = next->second;
+        EraseFreeRange(next);
+      }
+      free_ranges_.emplace(first, last);
+      free_ranges_by_span_.emplace(last - first, first);
+    }
+  }
+
+  // Splits the free range that holds t, which must be free
+  void RemoveFreeRange(const T& t) {
+    if constexpr (std::is_integral<T>::value) {
+      auto range = std::prev(free_ranges_.upper_bound(t));
+      const auto [first, last] = *range;
+      EraseFreeRange(range);
+      if (first < t) {
+        free_ranges_.emplace(first, t - 1);
+        free_ranges_by_span_.emplace(t - 1 - first, first);
+      }
+      if (t < last) {
+        free_ranges_.emplace(t + 1, last);
+        free_ranges_by_span_.emplace(last - t - 1, t + 1);
+      }
+    }
+  }
+
+  void EraseFreeRange(typename std::map<T, T>::iterator range) {
+    free_ranges_by_span_.erase({range->second - range->first, range->first});
+    free_ranges_.erase(range);
+  }
+
   std::unordered_set<T> available_resources_;
   std::unordered_set<T> allocated_resources_;
+  /*
+   * For integral T only, the available_resources_ as maximal ranges: from
+   * the first item to the last, and by (last - first, first)
+   */
+  std::map<T, T> free_ranges_;
+  std::set<std::pair<T, T>> free_ranges_by_span_;
   std::mutex mutex_;
 };
 
@@ -13,6 +13,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include <set>
 #include <unordered_set>
 #include <vector>
 
@@ -102,6 +103,75 @@ TEST_F(CvdIdAllocatorTest, Consecutive) {
   ASSERT_FALSE(allocator->UniqueItem()) << "one or more left";
 }
 
+TEST_F(CvdIdAllocatorTest, ConsecutiveFit) {
+  std::vector<unsigned> inputs{1, 2, 3, 4, 5, 7, 8, 10, 11, 12};
+  auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
+  if (!allocator) {
+    GTEST_SKIP() << "Memory allocation failed but we aren't testing it.";
+  }
+  using RangeFit = UniqueResourceAllocator<unsigned>::RangeFit;
+
+  auto best_fit = allocator->UniqueConsecutiveItems(2, RangeFit::kBestFit);
+  auto first_fit = allocator->UniqueConsecutiveItems(2, RangeFit::kFirstFit);
+  auto lowest = allocator->UniqueItem();
+
+  auto items = [](const auto& reservations) {
+    std::set<unsigned> items;
+    for (const auto& reservation : reservations) {
+      items.insert(reservation.Get());
+    }
+    return items;
+  };
+  ASSERT_TRUE(best_fit);
+  ASSERT_EQ(items(*best_fit), (std::set<unsigned>{7, 8}));
+  ASSERT_TRUE(first_fit);
+  ASSERT_EQ(items(*first_fit), (std::set<unsigned>{1, 2}));
+  ASSERT_TRUE(lowest);
+  ASSERT_EQ(lowest->Get(), 3);
+}
+
+TEST_F(CvdIdAllocatorTest, ConsecutiveFitNegative) {
+  std::vector<int> inputs{-5, -4, 1, 2, 3};
+  auto allocator = UniqueResourceAllocator<int>::New(inputs);
+  if (!allocator) {
+    GTEST_SKIP() << "Memory allocation failed but we aren't testing it.";
+  }
+  using RangeFit = UniqueResourceAllocator<int>::RangeFit;
+
+  auto best_fit = allocator->UniqueConsecutiveItems(2, RangeFit::kBestFit);
+
+  ASSERT_TRUE(best_fit);
+  std::set<int> items;
+  for (const auto& reservation : *best_fit) {
+    items.insert(reservation.Get());
+  }
+  ASSERT_EQ(items, (std::set<int>{-5, -4}));
+}
+
+TEST_F(CvdIdAllocatorTest, Fragmentation) {
+  std::vector<unsigned> inputs{1, 2, 3, 4, 5, 7, 8, 10};
+  auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
+  if (!allocator) {
+    GTEST_SKIP() << "Memory allocation failed but we aren't testing it.";
+  }
+
+  auto stats = allocator->Fragmentation();
+  ASSERT_EQ(stats.free_items, 8);
+  ASSERT_EQ(stats.free_ranges, 3);
+  ASSERT_EQ(stats.largest_free_range, 5);
+  {
+    auto three = allocator->Take(3);
+    ASSERT_TRUE(three);
+    stats = allocator->Fragmentation();
+    ASSERT_EQ(stats.free_ranges, 4);
+    ASSERT_EQ(stats.largest_free_range, 2);
+  }
+  // merged back when reclaimed
+  stats = allocator->Fragmentation();
+  ASSERT_EQ(stats.free_ranges, 3);
+  ASSERT_EQ(stats.largest_free_range, 5);
+}
+
 TEST_F(CvdIdAllocatorTest, Take) {
   std::vector<unsigned> inputs{4, 5, 9};
   auto allocator = UniqueResourceAllocator<unsigned>::New(inputs);
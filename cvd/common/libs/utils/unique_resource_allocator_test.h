@@ -25,8 +25,8 @@ namespace cuttlefish {
 class OneEachTest : public testing::TestWithParam<std::vector<unsigned>> {};
 
 /*
- * ClaimAll, StrideBeyond, Consecutive, Take, TakeAll, TakeRange,
- * Reclaim
+ * ClaimAll, StrideBeyond, Consecutive, ConsecutiveFit, Fragmentation, Take,
+ * TakeAll, TakeRange, Reclaim
  *
  */
 class CvdIdAllocatorTest : public testing::Test {};
@@ -16,16 +16,23 @@
 
 #include "common/libs/utils/vsock_connection.h"
 
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
 #include <functional>
 #include <future>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <new>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <utility>
 #include <vector>
@@ -33,23 +40,209 @@
 #include <android-base/logging.h>
 #include <json/json.h>
 
+#include "common/libs/fs/epoll.h"
 #include "common/libs/fs/shared_buf.h"
 #include "common/libs/fs/shared_select.h"
+#include "common/libs/utils/result.h"
 
 namespace cuttlefish {
+namespace {
 
-VsockConnection::~VsockConnection() { Disconnect(); }
+// What a read asks for at least, so that small messages take one recv
+constexpr size_t kReadChunkSize = 4096;
+
+/*
+ * Runs the handlers of the watched files, one at a time, in a thread shared
+ * by all the connections.
+ */
+class Reactor {
+ public:
+  using Handler = std::function<void(uint32_t events)>;
+
+  static Reactor& Get() {
+    // never destroyed, its thread may outlive the static destructors
+    static Reactor* reactor = new Reactor();
+    return *reactor;
+  }
+
+  Result<void> Watch(SharedFD fd, uint32_t events, Handler handler) {
+    std::lock_guard lock(mutex_);
+    auto emplaced = handlers_.try_emplace(fd, std::move(handler));
+    if (!emplaced.second) {
+      return CF_ERR("The file is already watched");
+    }
+    auto added = epoll_.Add(fd, events);
+    if (!added.ok()) {
+      handlers_.erase(emplaced.first);
+    }
+    return added;
+  }
+
+  // The handler of fd is not running and won't be called when this returns,
+  // unless called from the handler itself
+  void Unwatch(SharedFD fd) {
+    std::unique_lock lock(mutex_);
+    if (handlers_.erase(fd) > 0) {
+      auto deleted = epoll_.Delete(fd);
+      if (!deleted.ok()) {
+        LOG(ERROR) << "Failed to stop watching: " << deleted.error().Message();
+      }
+    }
+    if (std::this_thread::get_id() != thread_.get_id()) {
+      handler_done_.wait(lock, [this, &fd]() { return running_ != fd; });
+    }
+  }
+
+ private:
+  Reactor() {
+    auto epoll = Epoll::Create();
+    if (!epoll.ok()) {
+      // Watch fails on an invalid instance
+      LOG(ERROR) << "Failed to create the vsock reactor: "
+                 << epoll.error().Message();
+      return;
+    }
+    epoll_ = std::move(*epoll);
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  void Run() {
+    while (true) {
+      auto event = epoll_.Wait();
+      if (!event.ok()) {
+        LOG(ERROR) << "vsock reactor failed: " << event.error().Message();
+        return;
+      }
+      if (!event->has_value()) {
+        continue;
+      }
+      Handler handler;
+      {
+        std::lock_guard lock(mutex_);
+        auto it = handlers_.find((*event)->fd);
+        if (it == handlers_.end()) {
+          // unwatched since epoll returned it
+          continue;
+        }
+        handler = it->second;
+        running_ = (*event)->fd;
+      }
+      handler((*event)->events);
+      {
+        std::lock_guard lock(mutex_);
+        running_ = SharedFD();
+      }
+      handler_done_.notify_all();
+    }
+  }
+
+  Epoll epoll_;
+  std::mutex mutex_;
+  std::condition_variable handler_done_;
+  std::map<SharedFD, Handler> handlers_;
+  SharedFD running_;
+  std::thread thread_;
+};
+
+// The future of the value the callback is called with
+template <typename T>
+std::pair<std::future<T>, std::function<void(T)>> FutureCallback() {
+  auto promise = std::make_shared<std::promise<T>>();
+  auto future = promise->get_future();
+  return {std::move(future),
+          [promise](T value) { promise->set_value(std::move(value)); }};
+}
+
+Json::Value ParseJsonMessage(const std::vector<char>& msg) {
+  Json::CharReaderBuilder builder;
+  std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
+  Json::Value json_msg;
+  std::string errors;
+  if (!reader->parse(msg.data(), msg.data() + msg.size(), &json_msg, &errors)) {
+    return {};
+  }
+  return json_msg;
+}
+
+}  // namespace
+
+VsockConnection::~VsockConnection() {
+  Disconnect();
+  std::thread disconnecting;
+  {
+    std::lock_guard lock(async_mutex_);
+    disconnecting = std::move(disconnect_thread_);
+  }
+  if (disconnecting.joinable()) {
+    disconnecting.join();
+  }
+}
 
 std::future<bool> VsockConnection::ConnectAsync(unsigned int port,
                                                 unsigned int cid) {
-  return std::async(std::launch::async,
-                    [this, port, cid]() { return Connect(port, cid); });
+  auto [future, callback] = FutureCallback<bool>();
+  ConnectAsync(port, cid, std::move(callback));
+  return std::move(future);
+}
+
+void VsockConnection::ConnectAsync(unsigned int port, unsigned int cid,
+                                   std::function<void(bool)> on_connected) {
+  StartConnect(port, cid, std::move(on_connected));
+}
+
+void VsockConnection::WatchConnecting(SharedFD fd, uint32_t events,
+                                      std::function<void(bool)> on_ready) {
+  {
+    std::lock_guard lock(async_mutex_);
+    connecting_fd_ = fd;
+  }
+  auto handler = [fd, on_ready](uint32_t) {
+    Reactor::Get().Unwatch(fd);
+    on_ready(true);
+  };
+  auto watched = Reactor::Get().Watch(fd, events, std::move(handler));
+  if (!watched.ok()) {
+    LOG(ERROR) << "Failed to wait for the connection: "
+               << watched.error().Message();
+    on_ready(false);
+  }
+}
+
+void VsockConnection::UnwatchConnecting() {
+  SharedFD fd;
+  {
+    std::lock_guard lock(async_mutex_);
+    fd = std::move(connecting_fd_);
+    connecting_fd_ = SharedFD();
+  }
+  if (fd->IsOpen()) {
+    Reactor::Get().Unwatch(fd);
+  }
 }
 
 void VsockConnection::Disconnect() {
-  // We need to serialize all accesses to the SharedFD.
-  std::lock_guard<std::recursive_mutex> read_lock(read_mutex_);
-  std::lock_guard<std::recursive_mutex> write_lock(write_mutex_);
+  // The asynchronous operations are stopped first, without holding the
+  // locks: their handler may be disconnecting too.
+  UnwatchConnecting();
+  std::deque<PendingRead> failed;
+  {
+    std::lock_guard lock(async_mutex_);
+    reading_ = false;
+    failed.swap(pending_reads_);
+  }
+  // Even if not reading, so that a read handler still running is done
+  Reactor::Get().Unwatch(fd_);
+  {
+    std::lock_guard lock(async_mutex_);
+    read_start_ = read_end_ = 0;
+  }
+  for (auto& read : failed) {
+    read.on_read({});
+  }
+
+  // We need to serialize all accesses to the SharedFD. Both at once, as a
+  // failed Write disconnects holding write_mutex_ only.
+  std::scoped_lock lock(read_mutex_, write_mutex_);
 
   LOG(INFO) << "Disconnecting with fd status:" << fd_->StrError();
   fd_->Shutdown(SHUT_RDWR);
@@ -65,8 +258,7 @@ void VsockConnection::SetDisconnectCallback(std::function<void()> callback) {
 
 bool VsockConnection::IsConnected() {
   // We need to serialize all accesses to the SharedFD.
-  std::lock_guard<std::recursive_mutex> read_lock(read_mutex_);
-  std::lock_guard<std::recursive_mutex> write_lock(write_mutex_);
+  std::scoped_lock lock(read_mutex_, write_mutex_);
 
   return fd_->IsOpen();
 }
@@ -75,8 +267,7 @@ bool VsockConnection::DataAvailable() {
   SharedFDSet read_set;
 
   // We need to serialize all accesses to the SharedFD.
-  std::lock_guard<std::recursive_mutex> read_lock(read_mutex_);
-  std::lock_guard<std::recursive_mutex> write_lock(write_mutex_);
+  std::scoped_lock lock(read_mutex_, write_mutex_);
 
   read_set.Set(fd_);
   struct timeval timeout = {0, 0};
@@ -86,7 +277,8 @@ bool VsockConnection::DataAvailable() {
 int32_t VsockConnection::Read() {
   std::lock_guard<std::recursive_mutex> lock(read_mutex_);
   int32_t result;
-  if (ReadExactBinary(fd_, &result) != sizeof(result)) {
+  if (ReadExactBuffered(reinterpret_cast<char*>(&result), sizeof(result)) !=
+      sizeof(result)) {
     Disconnect();
     return 0;
   }
@@ -95,7 +287,7 @@ int32_t VsockConnection::Read() {
 
 bool VsockConnection::Read(std::vector<char>& data) {
   std::lock_guard<std::recursive_mutex> lock(read_mutex_);
-  return ReadExact(fd_, &data) == data.size();
+  return ReadExactBuffered(data.data(), data.size()) == data.size();
 }
 
 std::vector<char> VsockConnection::Read(size_t size) {
@@ -104,7 +296,7 @@ std::vector<char> VsockConnection::Read(size_t size) {
   }
   std::lock_guard<std::recursive_mutex> lock(read_mutex_);
   std::vector<char> result(size);
-  if (ReadExact(fd_, &result) != size) {
+  if (ReadExactBuffered(result.data(), size) != size) {
     Disconnect();
     return {};
   }
@@ -112,7 +304,14 @@ std::vector<char> VsockConnection::Read(size_t size) {
 }
 
 std::future<std::vector<char>> VsockConnection::ReadAsync(size_t size) {
-  return std::async(std::launch::async, [this, size]() { return Read(size); });
+  auto [future, callback] = FutureCallback<std::vector<char>>();
+  ReadAsync(size, std::move(callback));
+  return std::move(future);
+}
+
+void VsockConnection::ReadAsync(
+    size_t size, std::function<void(std::vector<char>)> on_read) {
+  QueueRead(PendingRead{.size = size, .on_read = std::move(on_read)});
 }
 
 // Message format is buffer size followed by buffer data
@@ -138,23 +337,196 @@ bool VsockConnection::ReadMessage(std::vector<char>& data) {
 }
 
 std::future<std::vector<char>> VsockConnection::ReadMessageAsync() {
-  return std::async(std::launch::async, [this]() { return ReadMessage(); });
+  auto [future, callback] = FutureCallback<std::vector<char>>();
+  ReadMessageAsync(std::move(callback));
+  return std::move(future);
+}
+
+void VsockConnection::ReadMessageAsync(
+    std::function<void(std::vector<char>)> on_read) {
+  QueueRead(PendingRead{.size = std::nullopt, .on_read = std::move(on_read)});
 }
 
 Json::Value VsockConnection::ReadJsonMessage() {
-  auto msg = ReadMessage();
-  Json::CharReaderBuilder builder;
-  std::unique_ptr<Json::CharReader> reader(builder.newCharReader());
-  Json::Value json_msg;
-  std::string errors;
-  if (!reader->parse(msg.data(), msg.data() + msg.size(), &json_msg, &errors)) {
-    return {};
-  }
-  return json_msg;
+  return ParseJsonMessage(ReadMessage());
 }
 
 std::future<Json::Value> VsockConnection::ReadJsonMessageAsync() {
-  return std::async(std::launch::async, [this]() { return ReadJsonMessage(); });
+  auto [future, callback] = FutureCallback<Json::Value>();
+  ReadJsonMessageAsync(std::move(callback));
+  return std::move(future);
+}
+
+void VsockConnection::ReadJsonMessageAsync(
+    std::function<void(Json::Value)> on_read) {
+  ReadMessageAsync([on_read = std::move(on_read)](std::vector<char> msg) {
+    on_read(ParseJsonMessage(msg));
+  });
+}
+
+void VsockConnection::QueueRead(PendingRead read) {
+  CompletedReads completed;
+  {
+    std::lock_guard lock(async_mutex_);
+    pending_reads_.emplace_back(std::move(read));
+    bool valid = CompleteReads(completed);
+    if (valid && !pending_reads_.empty() && !reading_) {
+      auto handler = [this](uint32_t) { OnReadable(); };
+      auto watched = Reactor::Get().Watch(fd_, EPOLLIN, std::move(handler));
+      reading_ = watched.ok();
+      if (!watched.ok()) {
+        LOG(ERROR) << "Failed to wait for data: " << watched.error().Message();
+      }
+    }
+    if (!valid || !reading_) {
+      for (auto& pending : pending_reads_) {
+        completed.emplace_back(std::move(pending.on_read), std::vector<char>());
+      }
+      pending_reads_.clear();
+    }
+  }
+  for (auto& [on_read, data] : completed) {
+    on_read(std::move(data));
+  }
+}
+
+void VsockConnection::OnReadable() {
+  CompletedReads completed;
+  bool failed = false;
+  {
+    std::lock_guard lock(async_mutex_);
+    while (!pending_reads_.empty()) {
+      ReserveReadSpace();
+      auto received =
+          fd_->Recv(read_buffer_.data() + read_end_,
+                    read_buffer_.size() - read_end_, MSG_DONTWAIT);
+      if (received < 0 &&
+          (fd_->GetErrno() == EAGAIN || fd_->GetErrno() == EWOULDBLOCK)) {
+        break;
+      }
+      if (received <= 0) {
+        failed = true;
+        break;
+      }
+      read_end_ += received;
+      if (!CompleteReads(completed)) {
+        failed = true;
+        break;
+      }
+    }
+    if (failed) {
+      for (auto& pending : pending_reads_) {
+        completed.emplace_back(std::move(pending.on_read), std::vector<char>());
+      }
+      pending_reads_.clear();
+    }
+    if (pending_reads_.empty() && reading_) {
+      // What wasn't asked for yet stays in the socket
+      Reactor::Get().Unwatch(fd_);
+      reading_ = false;
+    }
+  }
+  for (auto& [on_read, data] : completed) {
+    on_read(std::move(data));
+  }
+  if (failed) {
+    // Ends the blocking operations, so that the disconnect gets their locks
+    fd_->Shutdown(SHUT_RDWR);
+    DisconnectLater();
+  }
+}
+
+void VsockConnection::DisconnectLater() {
+  std::thread previous;
+  {
+    std::lock_guard lock(async_mutex_);
+    if (disconnecting_) {
+      return;
+    }
+    disconnecting_ = true;
+    // done, but maybe not returned yet
+    previous = std::move(disconnect_thread_);
+    disconnect_thread_ = std::thread([this]() {
+      // the destructor may be running, waiting for this thread
+      VsockConnection::Disconnect();
+      std::lock_guard lock(async_mutex_);
+      disconnecting_ = false;
+    });
+  }
+  if (previous.joinable()) {
+    previous.join();
+  }
+}
+
+// Message format is buffer size followed by buffer data
+bool VsockConnection::CompleteReads(CompletedReads& completed) {
+  while (!pending_reads_.empty()) {
+    auto& read = pending_reads_.front();
+    if (!read.size) {
+      int32_t size;
+      if (read_end_ - read_start_ < sizeof(size)) {
+        break;
+      }
+      memcpy(&size, read_buffer_.data() + read_start_, sizeof(size));
+      if (size < 0) {
+        return false;
+      }
+      read_start_ += sizeof(size);
+      read.size = size;
+    }
+    if (read_end_ - read_start_ < *read.size) {
+      break;
+    }
+    auto begin = read_buffer_.begin() + read_start_;
+    completed.emplace_back(std::move(read.on_read),
+                           std::vector<char>(begin, begin + *read.size));
+    read_start_ += *read.size;
+    pending_reads_.pop_front();
+  }
+  if (read_start_ == read_end_) {
+    read_start_ = read_end_ = 0;
+  }
+  return true;
+}
+
+void VsockConnection::ReserveReadSpace() {
+  size_t needed = kReadChunkSize;
+  const auto& read = pending_reads_.front();
+  if (read.size) {
+    needed = std::max(needed, *read.size - (read_end_ - read_start_));
+  }
+  if (read_buffer_.size() - read_end_ >= needed) {
+    return;
+  }
+  if (read_start_ > 0) {
+    std::copy(read_buffer_.begin() + read_start_,
+              read_buffer_.begin() + read_end_, read_buffer_.begin());
+    read_end_ -= read_start_;
+    read_start_ = 0;
+  }
+  if (read_buffer_.size() - read_end_ < needed) {
+    read_buffer_.resize(read_end_ + needed);
+  }
+}
+
+size_t VsockConnection::TakeBuffered(char* data, size_t size) {
+  std::lock_guard lock(async_mutex_);
+  size_t taken = std::min(size, read_end_ - read_start_);
+  memcpy(data, read_buffer_.data() + read_start_, taken);
+  read_start_ += taken;
+  if (read_start_ == read_end_) {
+    read_start_ = read_end_ = 0;
+  }
+  return taken;
+}
+
+ssize_t VsockConnection::ReadExactBuffered(char* data, size_t size) {
+  size_t taken = TakeBuffered(data, size);
+  if (taken == size) {
+    return size;
+  }
+  auto read = ReadExact(fd_, data + taken, size - taken);
+  return read < 0 ? read : taken + read;
 }
 
 bool VsockConnection::Write(int32_t data) {
@@ -214,9 +586,42 @@ bool VsockClientConnection::Connect(unsigned int port, unsigned int cid) {
   return fd_->IsOpen();
 }
 
+void VsockClientConnection::StartConnect(
+    unsigned int port, unsigned int cid,
+    std::function<void(bool)> on_connected) {
+  auto fd = SharedFD::Socket(AF_VSOCK, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  sockaddr_vm addr{};
+  addr.svm_family = AF_VSOCK;
+  addr.svm_port = port;
+  addr.svm_cid = cid;
+  if (!fd->IsOpen() ||
+      (fd->Connect(reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 &&
+       fd->GetErrno() != EINPROGRESS)) {
+    LOG(ERROR) << "Failed to connect:" << fd->StrError();
+    on_connected(false);
+    return;
+  }
+  // Writable once connected, or failed to
+  WatchConnecting(fd, EPOLLOUT, [this, fd, on_connected](bool ready) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (ready && fd->GetSockOpt(SOL_SOCKET, SO_ERROR, &error, &length) == 0 &&
+        error == 0) {
+      // The blocking operations expect a blocking socket
+      fd->Fcntl(F_SETFL, fd->Fcntl(F_GETFL, 0) & ~O_NONBLOCK);
+      fd_ = fd;
+      on_connected(true);
+      return;
+    }
+    LOG(ERROR) << "Failed to connect:" << strerror(error);
+    on_connected(false);
+  });
+}
+
 VsockServerConnection::~VsockServerConnection() { ServerShutdown(); }
 
 void VsockServerConnection::ServerShutdown() {
+  UnwatchConnecting();
   if (server_fd_->IsOpen()) {
     LOG(INFO) << __FUNCTION__
               << ": server fd status:" << server_fd_->StrError();
@@ -237,4 +642,23 @@ bool VsockServerConnection::Connect(unsigned int port, unsigned int cid) {
   }
 }
 
+void VsockServerConnection::StartConnect(
+    unsigned int port, unsigned int cid,
+    std::function<void(bool)> on_connected) {
+  if (!server_fd_->IsOpen()) {
+    server_fd_ = cuttlefish::SharedFD::VsockServer(port, SOCK_STREAM, cid);
+  }
+  if (!server_fd_->IsOpen()) {
+    on_connected(false);
+    return;
+  }
+  // Readable once a client is waiting to be accepted
+  WatchConnecting(server_fd_, EPOLLIN, [this, on_connected](bool ready) {
+    if (ready) {
+      fd_ = SharedFD::Accept(*server_fd_);
+    }
+    on_connected(ready && fd_->IsOpen());
+  });
+}
+
 }  // namespace cuttlefish
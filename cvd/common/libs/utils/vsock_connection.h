@@ -17,10 +17,13 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
 #include <functional>
 #include <future>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <json/json.h>
@@ -29,12 +32,25 @@
 
 namespace cuttlefish {
 
+/*
+ * The asynchronous operations of all the connections are run by a single
+ * thread with epoll. Their callbacks are called from that thread, or from the
+ * calling one when the data was already received. A failed read gets an empty
+ * result and disconnects, like the blocking reads do, from a thread of its
+ * own.
+ *
+ * The asynchronous reads are completed in order, and may receive more than
+ * they need. The blocking reads take what they left first, but the two must
+ * not run at the same time.
+ */
 class VsockConnection {
  public:
   virtual ~VsockConnection();
   virtual bool Connect(unsigned int port, unsigned int cid) = 0;
   virtual void Disconnect();
   std::future<bool> ConnectAsync(unsigned int port, unsigned int cid);
+  void ConnectAsync(unsigned int port, unsigned int cid,
+                    std::function<void(bool)> on_connected);
   void SetDisconnectCallback(std::function<void()> callback);
 
   bool IsConnected();
@@ -43,12 +59,16 @@ class VsockConnection {
   bool Read(std::vector<char>& data);
   std::vector<char> Read(size_t size);
   std::future<std::vector<char>> ReadAsync(size_t size);
+  void ReadAsync(size_t size,
+                 std::function<void(std::vector<char>)> on_read);
 
   bool ReadMessage(std::vector<char>& data);
   std::vector<char> ReadMessage();
   std::future<std::vector<char>> ReadMessageAsync();
+  void ReadMessageAsync(std::function<void(std::vector<char>)> on_read);
   Json::Value ReadJsonMessage();
   std::future<Json::Value> ReadJsonMessageAsync();
+  void ReadJsonMessageAsync(std::function<void(Json::Value)> on_read);
 
   bool Write(int32_t data);
   bool Write(const char* data, unsigned int size);
@@ -60,15 +80,64 @@ class VsockConnection {
                     unsigned int num_strides, int stride_size);
 
  protected:
+  // Connects without blocking, and calls on_connected once done
+  virtual void StartConnect(unsigned int port, unsigned int cid,
+                            std::function<void(bool)> on_connected) = 0;
+  /*
+   * Calls on_ready once, from the reactor thread, when fd has one of the
+   * events. It gets false if fd can't be watched.
+   */
+  void WatchConnecting(SharedFD fd, uint32_t events,
+                       std::function<void(bool)> on_ready);
+  void UnwatchConnecting();
+
   std::recursive_mutex read_mutex_;
   std::recursive_mutex write_mutex_;
   std::function<void()> disconnect_callback_;
   SharedFD fd_;
+
+ private:
+  struct PendingRead {
+    // Unknown until the header of a message is received
+    std::optional<size_t> size;
+    std::function<void(std::vector<char>)> on_read;
+  };
+  using CompletedReads =
+      std::vector<std::pair<std::function<void(std::vector<char>)>,
+                            std::vector<char>>>;
+
+  void QueueRead(PendingRead read);
+  void OnReadable();
+  // Disconnects from disconnect_thread_, as Disconnect waits for the blocking
+  // operations and the reactor thread must not
+  void DisconnectLater();
+  // Returns false if a message header is invalid
+  bool CompleteReads(CompletedReads& completed);
+  void ReserveReadSpace();
+  // Takes up to size bytes left by the asynchronous reads
+  size_t TakeBuffered(char* data, size_t size);
+  ssize_t ReadExactBuffered(char* data, size_t size);
+
+  std::mutex async_mutex_;
+  std::deque<PendingRead> pending_reads_;
+  // Reused by all the reads, the received data is in [read_start_, read_end_)
+  std::vector<char> read_buffer_;
+  size_t read_start_ = 0;
+  size_t read_end_ = 0;
+  // Whether fd_ is watched by the reactor
+  bool reading_ = false;
+  SharedFD connecting_fd_;
+  std::thread disconnect_thread_;
+  bool disconnecting_ = false;
 };
 
 class VsockClientConnection : public VsockConnection {
  public:
   bool Connect(unsigned int port, unsigned int cid) override;
+
+ protected:
+  void StartConnect(unsigned int port, unsigned int cid,
+                    std::function<void(bool)> on_connected) override;
 };
 
 class VsockServerConnection : public VsockConnection {
@@ -77,6 +146,10 @@ class VsockServerConnection : public VsockConnection {
   void ServerShutdown();
   bool Connect(unsigned int port, unsigned int cid) override;
 
+ protected:
+  void StartConnect(unsigned int port, unsigned int cid,
+                    std::function<void(bool)> on_connected) override;
+
  private:
   SharedFD server_fd_;
 };
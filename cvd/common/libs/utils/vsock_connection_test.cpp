@@ -0,0 +1,170 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "common/libs/utils/vsock_connection.h"
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <csignal>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+// A connection to the other end of a socket pair
+class PairConnection : public VsockConnection {
+ public:
+  PairConnection(SharedFD fd) { fd_ = fd; }
+  bool Connect(unsigned int, unsigned int) override { return false; }
+
+ protected:
+  void StartConnect(unsigned int, unsigned int,
+                    std::function<void(bool)> on_connected) override {
+    on_connected(false);
+  }
+};
+
+class VsockConnectionTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    SharedFD fds[2];
+    ASSERT_TRUE(SharedFD::SocketPair(AF_UNIX, SOCK_STREAM, 0, fds, fds + 1));
+    local_ = std::make_unique<PairConnection>(fds[0]);
+    remote_ = std::make_unique<PairConnection>(fds[1]);
+  }
+
+  std::vector<char> Data(const std::string& str) {
+    return std::vector<char>(str.begin(), str.end());
+  }
+
+  std::unique_ptr<PairConnection> local_;
+  std::unique_ptr<PairConnection> remote_;
+};
+
+constexpr auto kTimeout = std::chrono::seconds(10);
+
+TEST_F(VsockConnectionTest, ReadMessageAsync) {
+  auto first = local_->ReadMessageAsync();
+  auto second = local_->ReadMessageAsync();
+  ASSERT_TRUE(remote_->WriteMessage(std::string("first")));
+  ASSERT_TRUE(remote_->WriteMessage(std::string("second")));
+
+  ASSERT_EQ(first.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(first.get(), Data("first"));
+  ASSERT_EQ(second.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(second.get(), Data("second"));
+}
+
+TEST_F(VsockConnectionTest, ReadsInOrder) {
+  constexpr int kMessages = 100;
+  std::vector<std::future<std::vector<char>>> reads;
+  for (int i = 0; i < kMessages; i++) {
+    reads.emplace_back(i % 2 ? local_->ReadAsync(3)
+                             : local_->ReadMessageAsync());
+  }
+  for (int i = 0; i < kMessages; i++) {
+    if (i % 2) {
+      ASSERT_TRUE(remote_->Write("abc", 3));
+    } else {
+      ASSERT_TRUE(remote_->WriteMessage(std::string(i * 1000, 'x')));
+    }
+  }
+  for (int i = 0; i < kMessages; i++) {
+    ASSERT_EQ(reads[i].wait_for(kTimeout), std::future_status::ready);
+    EXPECT_EQ(reads[i].get(),
+              i % 2 ? Data("abc") : Data(std::string(i * 1000, 'x')));
+  }
+}
+
+TEST_F(VsockConnectionTest, BlockingReadTakesWhatAsyncReadLeft) {
+  ASSERT_TRUE(remote_->WriteMessage(std::string("async")));
+  ASSERT_TRUE(remote_->WriteMessage(std::string("blocking")));
+  // The asynchronous read likely receives both messages at once
+  auto async = local_->ReadMessageAsync();
+  ASSERT_EQ(async.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(async.get(), Data("async"));
+  EXPECT_EQ(local_->ReadMessage(), Data("blocking"));
+}
+
+TEST_F(VsockConnectionTest, ReadJsonMessageAsync) {
+  Json::Value message;
+  message["key"] = "value";
+  auto read = local_->ReadJsonMessageAsync();
+  ASSERT_TRUE(remote_->WriteMessage(message));
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(read.get(), message);
+}
+
+TEST_F(VsockConnectionTest, FailedReadDisconnects) {
+  // the destructor disconnects again
+  auto disconnected = std::make_shared<std::promise<void>>();
+  auto once = std::make_shared<std::once_flag>();
+  local_->SetDisconnectCallback([disconnected, once]() {
+    std::call_once(*once, [&disconnected]() { disconnected->set_value(); });
+  });
+  auto read = local_->ReadMessageAsync();
+  remote_.reset();
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_TRUE(read.get().empty());
+  auto disconnected_future = disconnected->get_future();
+  ASSERT_EQ(disconnected_future.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_FALSE(local_->IsConnected());
+}
+
+TEST_F(VsockConnectionTest, FailedReadDoesNotHoldUpTheOthers) {
+  // the blocked write fails instead
+  signal(SIGPIPE, SIG_IGN);
+  // blocked, as the remote doesn't read, until the failed read disconnects
+  std::thread writer([this]() {
+    EXPECT_FALSE(local_->Write(std::vector<char>(64 << 20)));
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  auto failed = local_->ReadMessageAsync();
+  // an invalid message size
+  ASSERT_TRUE(remote_->Write(-1));
+  ASSERT_EQ(failed.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_TRUE(failed.get().empty());
+
+  SharedFD fds[2];
+  ASSERT_TRUE(SharedFD::SocketPair(AF_UNIX, SOCK_STREAM, 0, fds, fds + 1));
+  PairConnection other_local(fds[0]);
+  PairConnection other_remote(fds[1]);
+  auto read = other_local.ReadMessageAsync();
+  ASSERT_TRUE(other_remote.WriteMessage(std::string("other")));
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_EQ(read.get(), Data("other"));
+  writer.join();
+  EXPECT_FALSE(local_->IsConnected());
+}
+
+TEST_F(VsockConnectionTest, DisconnectFailsPendingReads) {
+  auto read = local_->ReadAsync(10);
+  local_->Disconnect();
+  ASSERT_EQ(read.wait_for(kTimeout), std::future_status::ready);
+  EXPECT_TRUE(read.get().empty());
+}
+
+}  // namespace
+}  // namespace cuttlefish
@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/admission_controller.h"
+
+#include <stdlib.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/scopeguard.h>
+#include <android-base/strings.h>
+#include <fmt/format.h>
+
+#include "common/libs/utils/files.h"
+
+namespace cuttlefish {
+namespace {
+
+// The live headroom changes without notice, e.g. when a device finishes
+// booting, so the first request in the queue checks it again this often.
+constexpr auto kRecheckPeriod = std::chrono::seconds(1);
+// Until a request was admitted and released, about the boot time of a device
+constexpr auto kInitialHoldEstimate = std::chrono::minutes(2);
+// Well below the number of request handler threads of the server
+constexpr size_t kMaxQueuedRequests = 4;
+
+Result<std::uint64_t> MemAvailableMb() {
+  std::string meminfo;
+  CF_EXPECT(android::base::ReadFileToString("/proc/meminfo", &meminfo),
+            "Failed to read /proc/meminfo");
+  for (const auto& line : android::base::Split(meminfo, "\n")) {
+    // "MemAvailable:   12345678 kB"
+    auto fields = android::base::Tokenize(line, " ");
+    std::uint64_t kb;
+    if (fields.size() == 3 && fields[0] == "MemAvailable:" &&
+        android::base::ParseUint(fields[1], &kb)) {
+      return kb / 1024;
+    }
+  }
+  return CF_ERR("No MemAvailable in /proc/meminfo");
+}
+
+// The path may not exist yet, e.g. the HOME of a new group
+Result<std::uint64_t> FreeDiskMb(std::string path) {
+  while (!path.empty() && path != "/" && !FileExists(path)) {
+    path = cpp_dirname(path);
+  }
+  if (path.empty()) {
+    path = "/";
+  }
+  struct statvfs fs;
+  CF_EXPECTF(statvfs(path.c_str(), &fs) == 0, "statvfs(\"{}\") failed: {}",
+             path, strerror(errno));
+  return static_cast<std::uint64_t>(fs.f_bavail) * fs.f_frsize / 1024 / 1024;
+}
+
+template <typename Requests>
+auto FindRequest(Requests& requests, const std::uint64_t id) {
+  return std::find_if(requests.begin(), requests.end(),
+                      [id](const auto& request) { return request.id == id; });
+}
+
+}  // namespace
+
+Result<HostHeadroom> HostHeadroom::Measure(const std::string& disk_path) {
+  double load;
+  CF_EXPECT(getloadavg(&load, 1) == 1, "getloadavg failed");
+  const long online_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  CF_EXPECT(online_cpus > 0, "sysconf failed: " << strerror(errno));
+  return HostHeadroom{
+      .memory_mb = CF_EXPECT(MemAvailableMb()),
+      .cpus = std::max(0.0, online_cpus - load),
+      .disk_mb = CF_EXPECT(FreeDiskMb(disk_path)),
+  };
+}
+
+AdmissionController::Ticket::Ticket(AdmissionController& controller,
+                                    const std::uint64_t id)
+    : controller_(&controller), id_(id) {}
+
+AdmissionController::Ticket::Ticket(Ticket&& other)
+    : controller_(other.controller_), id_(other.id_) {
+  other.controller_ = nullptr;
+}
+
+AdmissionController::Ticket::~Ticket() {
+  if (controller_) {
+    controller_->Release(id_);
+  }
+}
+
+AdmissionController::AdmissionController()
+    : average_hold_(kInitialHoldEstimate) {}
+
+Result<AdmissionController::Ticket> AdmissionController::Admit(
+    const ResourceDemand& demand, std::function<bool()> interrupted,
+    StatusCallback on_queued) {
+  std::unique_lock lock(mutex_);
+  // the requests ahead are all waiting, so this one would too
+  CF_EXPECTF(queue_.size() < kMaxQueuedRequests,
+             "{} requests are already waiting for host capacity, try again "
+             "once a device has started",
+             queue_.size());
+  const auto id = next_id_++;
+  queue_.push_back(Request{.id = id, .demand = demand, .admitted_at = {}});
+  android::base::ScopeGuard dequeue([this, id]() {
+    auto it = FindRequest(queue_, id);
+    if (it != queue_.end()) {
+      queue_.erase(it);
+      // the requests behind move up
+      admitted_or_released_.notify_all();
+    }
+  });
+
+  size_t reported_position = 0;
+  while (true) {
+    CF_EXPECT(!interrupted(), "Interrupted while waiting for host capacity");
+    auto it = FindRequest(queue_, id);
+    const size_t position = it - queue_.begin() + 1;
+    std::string misfit = "waiting for the requests ahead";
+    if (position == 1) {
+      Result<std::string> fit = std::string();
+      if (!admitted_.empty()) {
+        fit = Misfit(demand);
+      }
+      if (!fit.ok()) {
+        // better late than never
+        LOG(ERROR) << "Admitting without checking the host capacity: "
+                   << fit.error().FormatForEnv();
+        fit = std::string();
+      }
+      misfit = *fit;
+    }
+    if (misfit.empty()) {
+      admitted_.push_back(*it);
+      admitted_.back().admitted_at = Clock::now();
+      queue_.erase(it);
+      admitted_or_released_.notify_all();
+      return Ticket(*this, id);
+    }
+    if (position != reported_position) {
+      reported_position = position;
+      QueueStatus status{
+          .position = position,
+          .expected_wait = ExpectedWait(position),
+          .reason = misfit,
+      };
+      lock.unlock();
+      on_queued(status);
+      lock.lock();
+    }
+    admitted_or_released_.wait_for(lock, kRecheckPeriod);
+  }
+}
+
+Result<std::string> AdmissionController::Misfit(
+    const ResourceDemand& demand) const {
+  const auto headroom = CF_EXPECT(HostHeadroom::Measure(demand.disk_path));
+  ResourceDemand reserved;
+  for (const auto& request : admitted_) {
+    reserved.memory_mb += request.demand.memory_mb;
+    reserved.cpus += request.demand.cpus;
+    reserved.disk_mb += request.demand.disk_mb;
+  }
+  if (demand.memory_mb + reserved.memory_mb > headroom.memory_mb) {
+    return fmt::format(
+        "needs {} MB of memory, {} MB available and {} MB reserved by the "
+        "devices still starting",
+        demand.memory_mb, headroom.memory_mb, reserved.memory_mb);
+  }
+  if (demand.cpus + reserved.cpus > headroom.cpus) {
+    return fmt::format(
+        "needs {} CPUs, {:.1f} idle and {} reserved by the devices still "
+        "starting",
+        demand.cpus, headroom.cpus, reserved.cpus);
+  }
+  if (demand.disk_mb + reserved.disk_mb > headroom.disk_mb) {
+    return fmt::format(
+        "needs {} MB of disk, {} MB free and {} MB reserved by the devices "
+        "still starting",
+        demand.disk_mb, headroom.disk_mb, reserved.disk_mb);
+  }
+  return std::string();
+}
+
+std::chrono::seconds AdmissionController::ExpectedWait(
+    const size_t position) const {
+  // the requests in flight make room for the queued ones in parallel
+  const auto in_flight = std::max<size_t>(admitted_.size(), 1);
+  const auto rounds = std::ceil(static_cast<double>(position) / in_flight);
+  return std::chrono::duration_cast<std::chrono::seconds>(average_hold_ *
+                                                          rounds);
+}
+
+void AdmissionController::Release(const std::uint64_t id) {
+  std::lock_guard lock(mutex_);
+  auto it = FindRequest(admitted_, id);
+  if (it == admitted_.end()) {
+    return;
+  }
+  const std::chrono::duration<double> held = Clock::now() - it->admitted_at;
+  average_hold_ = 0.8 * average_hold_ + 0.2 * held;
+  admitted_.erase(it);
+  admitted_or_released_.notify_all();
+}
+
+fruit::Component<AdmissionController> AdmissionControllerComponent() {
+  return fruit::createComponent();
+}
+
+}  // namespace cuttlefish
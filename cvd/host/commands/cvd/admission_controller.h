@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fruit/fruit.h>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+// What a device group needs from the host while it is assembled and booted
+struct ResourceDemand {
+  std::uint64_t memory_mb = 0;
+  std::uint64_t cpus = 0;
+  std::uint64_t disk_mb = 0;
+  // where the disk space is taken from, e.g. the HOME of the group
+  std::string disk_path;
+};
+
+struct HostHeadroom {
+  std::uint64_t memory_mb = 0;
+  // the online CPUs minus the load average
+  double cpus = 0;
+  std::uint64_t disk_mb = 0;
+
+  static Result<HostHeadroom> Measure(const std::string& disk_path);
+};
+
+/**
+ * Queues the "cvd start" requests that do not fit in what is left of the
+ * host, so that a burst of them does not thrash it during assembly and boot.
+ *
+ * The headroom is measured live, minus the demands of the requests already
+ * admitted: their devices do not use much of the host yet when they start.
+ * The requests are admitted in order. The first in the queue is always
+ * admitted when no other request is in flight, as waiting would not free
+ * anything.
+ *
+ * A queued request holds one of the few request handler threads of the
+ * server, which are also needed to interrupt it or to stop the devices
+ * making room. So only a handful may wait, and the rest are turned away.
+ */
+class AdmissionController {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  struct QueueStatus {
+    // 1 for the next request to be admitted
+    size_t position;
+    std::chrono::seconds expected_wait;
+    // the first resource the request does not fit in
+    std::string reason;
+  };
+  using StatusCallback = std::function<void(const QueueStatus&)>;
+
+  // The demand of an admitted request, given back on destruction
+  class Ticket {
+   public:
+    Ticket(Ticket&&);
+    ~Ticket();
+
+   private:
+    friend class AdmissionController;
+    Ticket(AdmissionController& controller, std::uint64_t id);
+
+    AdmissionController* controller_;
+    std::uint64_t id_;
+  };
+
+  INJECT(AdmissionController());
+
+  /*
+   * Blocks until the demand fits. The callback is called when the request
+   * gets queued and when its position in the queue changes. Fails once
+   * `interrupted` returns true, or right away if the queue is full.
+   */
+  Result<Ticket> Admit(const ResourceDemand& demand,
+                       std::function<bool()> interrupted,
+                       StatusCallback on_queued);
+
+ private:
+  struct Request {
+    std::uint64_t id;
+    ResourceDemand demand;
+    Clock::time_point admitted_at;
+  };
+
+  // Empty if the request fits, or else why not
+  Result<std::string> Misfit(const ResourceDemand& demand) const;
+  std::chrono::seconds ExpectedWait(size_t position) const;
+  void Release(std::uint64_t id);
+
+  mutable std::mutex mutex_;
+  std::condition_variable admitted_or_released_;
+  std::uint64_t next_id_ = 0;
+  std::deque<Request> queue_;
+  std::vector<Request> admitted_;
+  // moving average of how long the requests stay admitted
+  std::chrono::duration<double> average_hold_;
+};
+
+fruit::Component<AdmissionController> AdmissionControllerComponent();
+
+}  // namespace cuttlefish
@@ -34,6 +34,7 @@
 #include "host/commands/cvd/flag.h"
 #include "host/commands/cvd/frontline_parser.h"
 #include "host/commands/cvd/handle_reset.h"
+#include "host/commands/cvd/server_client.h"
 #include "host/libs/config/host_tools_version.h"
 
 namespace cuttlefish {
@@ -371,13 +372,7 @@ Result<cvd::Response> CvdClient::SendRequest(const cvd::Request& request_orig,
       std::vector<char>(serialized.begin(), serialized.end());
   CF_EXPECT(server_->WriteMessage(request_message));
 
-  // Read and parse the response.
-  auto read_result = CF_EXPECT(server_->ReadMessage());
-  serialized = std::string(read_result.data.begin(), read_result.data.end());
-  cvd::Response response;
-  CF_EXPECT(response.ParseFromString(serialized),
-            "Unable to parse serialized response proto.");
-  return response;
+  return CF_EXPECT(ReadResponse(*server_));
 }
 
 Result<void> CvdClient::StartCvdServer() {
@@ -15,6 +15,15 @@
 
 #include "host/commands/cvd/command_sequence.h"
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <optional>
+#include <thread>
+
+#include <android-base/logging.h>
+#include <android-base/scopeguard.h>
 #include <fruit/fruit.h>
 
 #include "common/libs/fs/shared_buf.h"
@@ -72,9 +81,30 @@ std::string FormattedCommand(const cvd::CommandRequest command) {
   return effective_command.str();
 }
 
+// e.g. "Finished `cvd fetch ...` (started at +0.0s, took 12.3s)"
+std::string FormattedCompletion(
+    const cvd::CommandRequest& command,
+    const std::chrono::steady_clock::time_point graph_started_at,
+    const std::chrono::steady_clock::time_point started_at, const bool ok) {
+  using Seconds = std::chrono::duration<double>;
+  const auto now = std::chrono::steady_clock::now();
+  std::stringstream completion;
+  completion << (ok ? "Finished `" : "Failed `");
+  auto args = cvd_common::ConvertToArgs(command.args());
+  for (std::size_t i = 0; i < args.size(); i++) {
+    completion << (i ? " " : "") << BashEscape(args[i]);
+  }
+  completion << std::fixed << std::setprecision(1) << "` (started at +"
+             << Seconds(started_at - graph_started_at).count() << "s, took "
+             << Seconds(now - started_at).count() << "s)\n";
+  return completion.str();
+}
+
 }  // namespace
 
-CommandSequenceExecutor::CommandSequenceExecutor() {}
+CommandSequenceExecutor::CommandSequenceExecutor(CvdServer& server,
+                                                 ServerLogger& server_logger)
+    : server_(server), server_logger_(server_logger) {}
 
 Result<void> CommandSequenceExecutor::LateInject(fruit::Injector<>& injector) {
   server_handlers_ = injector.getMultibindings<CvdServerHandler>();
@@ -82,43 +112,232 @@ Result<void> CommandSequenceExecutor::LateInject(fruit::Injector<>& injector) {
 }
 
 Result<void> CommandSequenceExecutor::Interrupt() {
-  std::unique_lock interrupt_lock(interrupt_mutex_);
-  interrupted_ = true;
-  if (handler_stack_.empty()) {
-    return {};
+  std::vector<std::shared_ptr<RunningHandler>> handlers;
+  {
+    std::lock_guard interrupt_lock(interrupt_mutex_);
+    if (interrupted_) {
+      // e.g. called back by one of the handlers being interrupted
+      return {};
+    }
+    interrupted_ = true;
+    handlers = running_handlers_;
   }
-  CF_EXPECT(handler_stack_.back()->Interrupt());
+  InterruptHandlers(handlers);
   return {};
 }
 
+void CommandSequenceExecutor::InterruptHandlers(
+    const std::vector<std::shared_ptr<RunningHandler>>& handlers) {
+  // Not holding interrupt_mutex_, as handlers may call Interrupt() back
+  for (const auto& running : handlers) {
+    auto result = running->handler->Interrupt();
+    if (!result.ok()) {
+      LOG(ERROR) << "Failed to interrupt a handler: "
+                 << result.error().FormatForEnv();
+    }
+  }
+}
+
 Result<std::vector<cvd::Response>> CommandSequenceExecutor::Execute(
     const std::vector<RequestWithStdio>& requests, SharedFD report) {
-  std::unique_lock interrupt_lock(interrupt_mutex_);
-  CF_EXPECT(!interrupted_, "Interrupted");
+  std::vector<CommandGraphNode> nodes;
+  for (std::size_t i = 0; i < requests.size(); i++) {
+    auto& node = nodes.emplace_back(CommandGraphNode{.request = requests[i]});
+    if (i > 0) {
+      node.dependencies.push_back(i - 1);
+    }
+  }
+  return CF_EXPECT(ExecuteGraph(nodes, report, 1));
+}
 
-  std::vector<cvd::Response> responses;
-  for (const auto& request : requests) {
-    auto& inner_proto = request.Message();
-    if (inner_proto.has_command_request()) {
-      auto& command = inner_proto.command_request();
-      std::string str = FormattedCommand(command);
-      CF_EXPECT(WriteAll(report, str) == str.size(), report->StrError());
+Result<std::vector<cvd::Response>> CommandSequenceExecutor::ExecuteGraph(
+    const std::vector<CommandGraphNode>& nodes, SharedFD report,
+    const std::size_t max_parallelism) {
+  CF_EXPECT(max_parallelism > 0);
+  std::vector<std::vector<std::size_t>> dependents(nodes.size());
+  std::vector<std::size_t> pending_dependencies(nodes.size(), 0);
+  for (std::size_t i = 0; i < nodes.size(); i++) {
+    for (const auto dependency : nodes[i].dependencies) {
+      CF_EXPECTF(dependency < nodes.size() && dependency != i,
+                 "Node {} has an invalid dependency {}", i, dependency);
+      dependents[dependency].push_back(i);
+      pending_dependencies[i]++;
+    }
+  }
+  std::deque<std::size_t> ready;
+  for (std::size_t i = 0; i < nodes.size(); i++) {
+    if (pending_dependencies[i] == 0) {
+      ready.push_back(i);
     }
+  }
+  CF_EXPECT(!ready.empty() || nodes.empty(),
+            "The commands depend on each other");
 
-    auto handler = CF_EXPECT(RequestHandler(request, server_handlers_));
-    handler_stack_.push_back(handler);
-    interrupt_lock.unlock();
-    auto response = CF_EXPECT(handler->Handle(request));
-    interrupt_lock.lock();
-    handler_stack_.pop_back();
+  struct Completion {
+    std::size_t index;
+    Result<cvd::Response> response;
+  };
+  std::mutex completions_mutex;
+  std::condition_variable completions_cv;
+  std::deque<Completion> completions;
+  RunningGraph graph{
+      .report_completion = max_parallelism > 1,
+      .started_at = std::chrono::steady_clock::now(),
+  };
 
-    CF_EXPECT(interrupted_ == false, "Interrupted");
-    CF_EXPECT(response.status().code() == cvd::Status::OK,
-              "Reason: \"" << response.status().message() << "\"");
+  auto run = [this, &nodes, report, &graph, &completions_mutex,
+              &completions_cv, &completions](const std::size_t index,
+                                             const bool use_server_handlers) {
+    auto response =
+        RunNode(nodes[index].request, report, use_server_handlers, graph);
+    std::lock_guard lock(completions_mutex);
+    completions.push_back(Completion{index, std::move(response)});
+    completions_cv.notify_one();
+  };
+  const auto request_thread = std::this_thread::get_id();
+  auto run_in_thread = [this, &run, request_thread](
+                           const std::size_t index,
+                           const bool use_server_handlers) {
+    // so that the LOG()s of the handler still go to the client
+    auto logger = server_logger_.LogThreadLike(request_thread);
+    run(index, use_server_handlers);
+  };
+  std::vector<std::thread> threads;
+  // declared after everything the threads use, so that it runs first
+  android::base::ScopeGuard join_threads([&threads]() {
+    for (auto& thread : threads) {
+      thread.join();
+    }
+  });
 
-    responses.emplace_back(std::move(response));
+  std::vector<std::optional<cvd::Response>> responses(nodes.size());
+  std::optional<Result<cvd::Response>> failure;
+  // The handlers of this request run at most one node at a time. The other
+  // nodes running concurrently get handlers of their own.
+  std::optional<std::size_t> server_handlers_user;
+  std::size_t running = 0;
+  std::size_t finished = 0;
+  while (finished < nodes.size()) {
+    {
+      std::lock_guard interrupt_lock(interrupt_mutex_);
+      if (interrupted_ && !failure) {
+        failure = CF_ERR("Interrupted");
+      }
+    }
+    while (!failure && !ready.empty() && running < max_parallelism) {
+      const auto index = ready.front();
+      ready.pop_front();
+      const bool use_server_handlers = !server_handlers_user.has_value();
+      if (use_server_handlers) {
+        server_handlers_user = index;
+      }
+      running++;
+      if (max_parallelism == 1) {
+        run(index, use_server_handlers);
+      } else {
+        threads.emplace_back(run_in_thread, index, use_server_handlers);
+      }
+    }
+    if (running == 0) {
+      // failed, and the nodes that were running are done
+      break;
+    }
+
+    std::unique_lock completions_lock(completions_mutex);
+    completions_cv.wait(completions_lock,
+                        [&completions]() { return !completions.empty(); });
+    auto completion = std::move(completions.front());
+    completions.pop_front();
+    completions_lock.unlock();
+
+    running--;
+    finished++;
+    if (server_handlers_user == completion.index) {
+      server_handlers_user.reset();
+    }
+    if (!completion.response.ok()) {
+      if (!failure) {
+        failure = std::move(completion.response);
+        std::vector<std::shared_ptr<RunningHandler>> siblings;
+        {
+          std::lock_guard interrupt_lock(interrupt_mutex_);
+          graph.cancelled = true;
+          siblings = graph.handlers;
+        }
+        InterruptHandlers(siblings);
+      }
+      continue;
+    }
+    responses[completion.index] = std::move(*completion.response);
+    for (const auto dependent : dependents[completion.index]) {
+      if (--pending_dependencies[dependent] == 0) {
+        ready.push_back(dependent);
+      }
+    }
+  }
+
+  if (failure) {
+    CF_EXPECT(std::move(*failure));
   }
-  return {responses};
+  std::vector<cvd::Response> ordered_responses;
+  for (auto& response : responses) {
+    CF_EXPECT(response.has_value(), "The commands depend on each other");
+    ordered_responses.emplace_back(std::move(*response));
+  }
+  return ordered_responses;
+}
+
+Result<cvd::Response> CommandSequenceExecutor::RunNode(
+    const RequestWithStdio& request, SharedFD report,
+    const bool use_server_handlers, RunningGraph& graph) {
+  auto& inner_proto = request.Message();
+  if (inner_proto.has_command_request()) {
+    auto& command = inner_proto.command_request();
+    std::string str = FormattedCommand(command);
+    CF_EXPECT(WriteAll(report, str) == str.size(), report->StrError());
+  }
+  const auto started_at = std::chrono::steady_clock::now();
+
+  auto running = std::make_shared<RunningHandler>();
+  if (use_server_handlers) {
+    running->handler = CF_EXPECT(RequestHandler(request, server_handlers_));
+  } else {
+    running->injector = CF_EXPECT(server_.RequestInjector());
+    running->handler = CF_EXPECT(RequestHandler(
+        request, running->injector->getMultibindings<CvdServerHandler>()));
+  }
+  {
+    std::lock_guard interrupt_lock(interrupt_mutex_);
+    CF_EXPECT(!interrupted_, "Interrupted");
+    CF_EXPECT(!graph.cancelled, "Cancelled, as another command failed");
+    running_handlers_.push_back(running);
+    graph.handlers.push_back(running);
+  }
+  auto handled = running->handler->Handle(request);
+  bool interrupted = false;
+  {
+    std::lock_guard interrupt_lock(interrupt_mutex_);
+    running_handlers_.erase(std::remove(running_handlers_.begin(),
+                                        running_handlers_.end(), running),
+                            running_handlers_.end());
+    graph.handlers.erase(
+        std::remove(graph.handlers.begin(), graph.handlers.end(), running),
+        graph.handlers.end());
+    interrupted = interrupted_;
+  }
+
+  if (graph.report_completion && inner_proto.has_command_request()) {
+    std::string str = FormattedCompletion(inner_proto.command_request(),
+                                          graph.started_at, started_at,
+                                          handled.ok());
+    WriteAll(report, str);
+  }
+
+  auto response = CF_EXPECT(std::move(handled));
+  CF_EXPECT(interrupted == false, "Interrupted");
+  CF_EXPECT(response.status().code() == cvd::Status::OK,
+            "Reason: \"" << response.status().message() << "\"");
+  return response;
 }
 
 Result<cvd::Response> CommandSequenceExecutor::ExecuteOne(
@@ -140,7 +359,9 @@ std::vector<std::string> CommandSequenceExecutor::CmdList() const {
   return std::vector<std::string>{subcmds.begin(), subcmds.end()};
 }
 
-fruit::Component<CommandSequenceExecutor> CommandSequenceExecutorComponent() {
+fruit::Component<fruit::Required<CvdServer, ServerLogger>,
+                 CommandSequenceExecutor>
+CommandSequenceExecutorComponent() {
   return fruit::createComponent()
       .addMultibinding<LateInjected, CommandSequenceExecutor>();
 }
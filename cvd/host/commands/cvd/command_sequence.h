@@ -15,38 +15,92 @@
 
 #pragma once
 
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <mutex>
 #include <vector>
 
 #include <fruit/fruit.h>
 
 #include "common/libs/fs/shared_fd.h"
 #include "cvd_server.pb.h"
+#include "host/commands/cvd/logger.h"
 #include "host/commands/cvd/server_client.h"
 #include "host/commands/cvd/server_command/server_handler.h"
 #include "host/libs/config/inject.h"
 
 namespace cuttlefish {
 
+class CvdServer;
+
+struct CommandGraphNode {
+  RequestWithStdio request;
+  // indices of the nodes in the same graph that must succeed first
+  std::vector<std::size_t> dependencies;
+};
+
 class CommandSequenceExecutor : public LateInjected {
  public:
-  INJECT(CommandSequenceExecutor());
+  static constexpr std::size_t kDefaultMaxParallelism = 4;
+
+  INJECT(CommandSequenceExecutor(CvdServer& server,
+                                 ServerLogger& server_logger));
 
   Result<void> LateInject(fruit::Injector<>&) override;
 
   Result<void> Interrupt();
+  // Runs the requests one after another
   Result<std::vector<cvd::Response>> Execute(
       const std::vector<RequestWithStdio>&, SharedFD report);
+  /*
+   * Runs each request once its dependencies succeeded, up to
+   * `max_parallelism` at a time. If one fails, the others still running are
+   * interrupted and nothing else is started. The responses are in the order
+   * of the nodes.
+   */
+  Result<std::vector<cvd::Response>> ExecuteGraph(
+      const std::vector<CommandGraphNode>&, SharedFD report,
+      std::size_t max_parallelism = kDefaultMaxParallelism);
   Result<cvd::Response> ExecuteOne(const RequestWithStdio&, SharedFD report);
 
   std::vector<std::string> CmdList() const;
 
  private:
+  struct RunningHandler {
+    CvdServerHandler* handler;
+    // owns the handler, unless it is one of server_handlers_
+    std::shared_ptr<fruit::Injector<>> injector;
+  };
+
+  // the nodes of one ExecuteGraph call, guarded by interrupt_mutex_
+  struct RunningGraph {
+    std::vector<std::shared_ptr<RunningHandler>> handlers;
+    // set when one of the nodes failed
+    bool cancelled = false;
+    // The output of concurrent commands interleaves, so when each of them
+    // ended is reported as well.
+    bool report_completion = false;
+    std::chrono::steady_clock::time_point started_at;
+  };
+
+  Result<cvd::Response> RunNode(const RequestWithStdio& request,
+                                SharedFD report, bool use_server_handlers,
+                                RunningGraph& graph);
+  void InterruptHandlers(
+      const std::vector<std::shared_ptr<RunningHandler>>& handlers);
+
+  CvdServer& server_;
+  ServerLogger& server_logger_;
   std::vector<CvdServerHandler*> server_handlers_;
-  std::vector<CvdServerHandler*> handler_stack_;
   std::mutex interrupt_mutex_;
   bool interrupted_ = false;
+  // across all the ongoing Execute* calls, including nested ones
+  std::vector<std::shared_ptr<RunningHandler>> running_handlers_;
 };
 
-fruit::Component<CommandSequenceExecutor> CommandSequenceExecutorComponent();
+fruit::Component<fruit::Required<CvdServer, ServerLogger>,
+                 CommandSequenceExecutor>
+CommandSequenceExecutorComponent();
 
 }  // namespace cuttlefish
@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/cpu_placement.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+
+#include "common/libs/utils/contains.h"
+#include "common/libs/utils/files.h"
+
+namespace cuttlefish {
+namespace {
+
+Result<std::set<int>> ReadCpuList(const std::string& path) {
+  std::string content;
+  CF_EXPECTF(android::base::ReadFileToString(path, &content),
+             "Failed to read \"{}\": {}", path, strerror(errno));
+  return CF_EXPECTF(ParseCpuList(android::base::Trim(content)),
+                    "in \"{}\"", path);
+}
+
+// The runs of consecutive CPU numbers, in ascending order
+std::vector<std::vector<int>> ContiguousRuns(const std::set<int>& cpus) {
+  std::vector<std::vector<int>> runs;
+  for (const auto cpu : cpus) {
+    if (runs.empty() || runs.back().back() + 1 != cpu) {
+      runs.emplace_back();
+    }
+    runs.back().push_back(cpu);
+  }
+  return runs;
+}
+
+}  // namespace
+
+Result<std::set<int>> ParseCpuList(const std::string& cpu_list) {
+  std::set<int> cpus;
+  for (const auto& range : android::base::Tokenize(cpu_list, ",")) {
+    auto bounds = android::base::Split(range, "-");
+    int first;
+    int last;
+    CF_EXPECTF(bounds.size() <= 2 &&
+                   android::base::ParseInt(bounds[0], &first, 0) &&
+                   android::base::ParseInt(bounds.back(), &last, first),
+               "Invalid CPU range \"{}\"", range);
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.insert(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::string FormatCpuList(const std::set<int>& cpus) {
+  std::vector<std::string> ranges;
+  for (const auto& run : ContiguousRuns(cpus)) {
+    ranges.push_back(run.size() == 1 ? std::to_string(run.front())
+                                     : std::to_string(run.front()) + "-" +
+                                           std::to_string(run.back()));
+  }
+  return android::base::Join(ranges, ",");
+}
+
+Result<CpuTopology> CpuTopology::Read(const std::string& sysfs_root) {
+  const auto online_cpus = CF_EXPECT(ReadCpuList(sysfs_root + "/cpu/online"));
+  CF_EXPECT(!online_cpus.empty(), "No online CPU");
+
+  CpuTopology topology;
+  const auto online_nodes_path = sysfs_root + "/node/online";
+  // kernels built without CONFIG_NUMA
+  if (!FileExists(online_nodes_path)) {
+    topology.node_cpus[0] = online_cpus;
+    return topology;
+  }
+  for (const auto node : CF_EXPECT(ReadCpuList(online_nodes_path))) {
+    const auto node_cpu_list_path =
+        sysfs_root + "/node/node" + std::to_string(node) + "/cpulist";
+    std::set<int> cpus;
+    for (const auto cpu : CF_EXPECT(ReadCpuList(node_cpu_list_path))) {
+      if (Contains(online_cpus, cpu)) {
+        cpus.insert(cpu);
+      }
+    }
+    // memory-only nodes
+    if (!cpus.empty()) {
+      topology.node_cpus[node] = std::move(cpus);
+    }
+  }
+  CF_EXPECT(!topology.node_cpus.empty(), "No NUMA node with online CPUs");
+  return topology;
+}
+
+Json::Value CpuPlacement::ToJson() const {
+  Json::Value json(Json::objectValue);
+  json["cpus"] = FormatCpuList(cpus);
+  if (node) {
+    json["numa_node"] = *node;
+  }
+  return json;
+}
+
+CpuPlacementAllocator::CpuPlacementAllocator(CpuTopology topology)
+    : topology_(std::move(topology)), free_cpus_(topology_.node_cpus) {}
+
+std::optional<CpuPlacement> CpuPlacementAllocator::Allocate(
+    const std::string& home_dir, const size_t num_cpus) {
+  std::lock_guard lock(mutex_);
+  if (num_cpus == 0 || Contains(placements_, home_dir)) {
+    return std::nullopt;
+  }
+  // best fit
+  std::optional<int> best_node;
+  for (const auto& [node, free_cpus] : free_cpus_) {
+    if (free_cpus.size() < num_cpus) {
+      continue;
+    }
+    if (!best_node || free_cpus.size() < free_cpus_[*best_node].size()) {
+      best_node = node;
+    }
+  }
+  auto placement = best_node ? AllocateOnNode(*best_node, num_cpus)
+                             : AllocateAcrossNodes(num_cpus);
+  if (!placement) {
+    return std::nullopt;
+  }
+  Take(home_dir, *placement);
+  return placement;
+}
+
+Result<void> CpuPlacementAllocator::Reserve(const std::string& home_dir,
+                                            const std::set<int>& cpus) {
+  std::lock_guard lock(mutex_);
+  CF_EXPECTF(!Contains(placements_, home_dir), "\"{}\" is already placed",
+             home_dir);
+  CF_EXPECT(!cpus.empty());
+  std::set<int> nodes;
+  for (const auto cpu : cpus) {
+    auto node_it = std::find_if(free_cpus_.begin(), free_cpus_.end(),
+                                [cpu](const auto& node_free) {
+                                  return Contains(node_free.second, cpu);
+                                });
+    CF_EXPECTF(node_it != free_cpus_.end(), "CPU {} is not free", cpu);
+    nodes.insert(node_it->first);
+  }
+  Take(home_dir, CpuPlacement{
+                     .cpus = cpus,
+                     .node = nodes.size() == 1
+                                 ? std::optional<int>(*nodes.begin())
+                                 : std::nullopt,
+                 });
+  return {};
+}
+
+void CpuPlacementAllocator::Take(const std::string& home_dir,
+                                 CpuPlacement placement) {
+  for (auto& [node, free_cpus] : free_cpus_) {
+    for (const auto cpu : placement.cpus) {
+      free_cpus.erase(cpu);
+    }
+  }
+  placements_[home_dir] = std::move(placement);
+}
+
+std::optional<CpuPlacement> CpuPlacementAllocator::AllocateOnNode(
+    const int node, const size_t num_cpus) const {
+  const auto& free_cpus = free_cpus_.at(node);
+  // the shortest run of free CPUs the group fits in
+  std::optional<std::vector<int>> best_run;
+  for (auto& run : ContiguousRuns(free_cpus)) {
+    if (run.size() >= num_cpus &&
+        (!best_run || run.size() < best_run->size())) {
+      best_run = std::move(run);
+    }
+  }
+  CpuPlacement placement{.cpus = {}, .node = node};
+  if (best_run) {
+    placement.cpus.insert(best_run->begin(), best_run->begin() + num_cpus);
+  } else {
+    placement.cpus.insert(free_cpus.begin(),
+                          std::next(free_cpus.begin(), num_cpus));
+  }
+  return placement;
+}
+
+std::optional<CpuPlacement> CpuPlacementAllocator::AllocateAcrossNodes(
+    size_t num_cpus) const {
+  // the nodes with the most free CPUs first, to span as few as possible
+  std::vector<std::pair<int, const std::set<int>*>> nodes;
+  for (const auto& [node, free_cpus] : free_cpus_) {
+    nodes.emplace_back(node, &free_cpus);
+  }
+  std::stable_sort(nodes.begin(), nodes.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.second->size() > b.second->size();
+                   });
+  CpuPlacement placement{.cpus = {}, .node = std::nullopt};
+  for (const auto& [node, free_cpus] : nodes) {
+    for (auto it = free_cpus->begin();
+         it != free_cpus->end() && num_cpus > 0; it++, num_cpus--) {
+      placement.cpus.insert(*it);
+    }
+  }
+  if (num_cpus > 0) {
+    return std::nullopt;
+  }
+  return placement;
+}
+
+void CpuPlacementAllocator::Release(const std::string& home_dir) {
+  std::lock_guard lock(mutex_);
+  auto it = placements_.find(home_dir);
+  if (it == placements_.end()) {
+    return;
+  }
+  for (const auto cpu : it->second.cpus) {
+    for (const auto& [node, cpus] : topology_.node_cpus) {
+      if (Contains(cpus, cpu)) {
+        free_cpus_[node].insert(cpu);
+      }
+    }
+  }
+  placements_.erase(it);
+}
+
+std::optional<CpuPlacement> CpuPlacementAllocator::Get(
+    const std::string& home_dir) const {
+  std::lock_guard lock(mutex_);
+  auto it = placements_.find(home_dir);
+  if (it == placements_.end()) {
+    return std::nullopt;
+  }
+  return it->second;
+}
+
+Json::Value CpuPlacementAllocator::Report() const {
+  std::lock_guard lock(mutex_);
+  Json::Value nodes(Json::arrayValue);
+  size_t num_free = 0;
+  size_t max_free_on_node = 0;
+  for (const auto& [node, free_cpus] : free_cpus_) {
+    Json::Value node_json(Json::objectValue);
+    node_json["numa_node"] = node;
+    node_json["cpus"] = FormatCpuList(topology_.node_cpus.at(node));
+    node_json["free_cpus"] = FormatCpuList(free_cpus);
+    nodes.append(node_json);
+    num_free += free_cpus.size();
+    max_free_on_node = std::max(max_free_on_node, free_cpus.size());
+  }
+  Json::Value report(Json::objectValue);
+  report["nodes"] = nodes;
+  report["num_free_cpus"] = Json::UInt64(num_free);
+  report["fragmentation"] =
+      num_free == 0 ? 0.0
+                    : 1.0 - static_cast<double>(max_free_on_node) / num_free;
+  return report;
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+
+#include <json/json.h>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+// e.g. "0-3,8,10-11", as in /sys/devices/system/node/node0/cpulist
+Result<std::set<int>> ParseCpuList(const std::string& cpu_list);
+std::string FormatCpuList(const std::set<int>& cpus);
+
+struct CpuTopology {
+  // NUMA node to its online CPUs. A single node 0 on non-NUMA hosts.
+  std::map<int, std::set<int>> node_cpus;
+
+  static Result<CpuTopology> Read(
+      const std::string& sysfs_root = "/sys/devices/system");
+};
+
+struct CpuPlacement {
+  std::set<int> cpus;
+  // nullopt when the CPUs had to be taken from several nodes
+  std::optional<int> node;
+
+  Json::Value ToJson() const;
+};
+
+/**
+ * Hands out disjoint sets of host CPUs to the instance groups, so that the
+ * vCPU threads of a group stay on one NUMA node, next to its memory, and do
+ * not compete with the other groups.
+ *
+ * A group gets the node with the fewest free CPUs that still fits it, which
+ * keeps the larger holes for the larger groups, and a contiguous range of
+ * that node if there is one. The group is only spread over several nodes
+ * when no node has enough free CPUs, and it is not placed at all when the
+ * host does not.
+ *
+ * The groups are keyed by their HOME directory.
+ */
+class CpuPlacementAllocator {
+ public:
+  CpuPlacementAllocator(CpuTopology topology);
+
+  const CpuTopology& Topology() const { return topology_; }
+
+  // nullopt if there are not `num_cpus` free CPUs left
+  std::optional<CpuPlacement> Allocate(const std::string& home_dir,
+                                       size_t num_cpus);
+  /*
+   * Takes back the CPUs of a group placed before the server restarted.
+   * Fails if any of them is taken.
+   */
+  Result<void> Reserve(const std::string& home_dir, const std::set<int>& cpus);
+  void Release(const std::string& home_dir);
+  std::optional<CpuPlacement> Get(const std::string& home_dir) const;
+
+  /*
+   * The free CPUs of every node, and the fragmentation of the host: the
+   * share of the free CPUs that are not on the node with the most free CPUs,
+   * i.e. that a single-node group could not use.
+   */
+  Json::Value Report() const;
+
+ private:
+  std::optional<CpuPlacement> AllocateOnNode(int node, size_t num_cpus) const;
+  std::optional<CpuPlacement> AllocateAcrossNodes(size_t num_cpus) const;
+  void Take(const std::string& home_dir, CpuPlacement placement);
+
+  const CpuTopology topology_;
+  mutable std::mutex mutex_;
+  // per node
+  std::map<int, std::set<int>> free_cpus_;
+  std::map<std::string, CpuPlacement> placements_;
+};
+
+}  // namespace cuttlefish
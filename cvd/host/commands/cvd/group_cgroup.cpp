@@ -0,0 +1,515 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/group_cgroup.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <sstream>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <json/json.h>
+#include <openssl/sha.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/contains.h"
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/json.h"
+#include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/lock_file.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr char kCgroupPrefix[] = "cvd-group-";
+constexpr char kServerCgroupName[] = "cvd-server";
+// cgroup.kill needs Linux 5.14, the pidfd fallback does a few rounds to
+// catch the processes forked while it was killing the others
+constexpr int kKillRounds = 10;
+// How long a round waits for the processes it killed to go away
+constexpr auto kKillRoundTimeout = std::chrono::milliseconds(500);
+
+std::string RecordsDir() {
+  return ConcatToString(TempDir(), "/cvd/", getuid(), "/cgroups");
+}
+
+// Also the name of the record. The first 64 bits of the SHA-256 of the
+// home, which unlike std::hash are the same for every build of the server.
+std::string CgroupName(const std::string& home) {
+  std::uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(reinterpret_cast<const std::uint8_t*>(home.data()), home.size(),
+         digest);
+  std::stringstream name;
+  name << kCgroupPrefix << std::hex << std::setfill('0');
+  for (int i = 0; i < 8; i++) {
+    name << std::setw(2) << static_cast<int>(digest[i]);
+  }
+  return name.str();
+}
+
+std::string RecordPath(const std::string& home) {
+  return RecordsDir() + "/" + CgroupName(home);
+}
+
+// e.g. /sys/fs/cgroup, or /sys/fs/cgroup/unified on hybrid hosts
+Result<std::string> Cgroup2MountPoint() {
+  std::string mounts;
+  CF_EXPECT(android::base::ReadFileToString("/proc/self/mounts", &mounts),
+            "Failed to read /proc/self/mounts");
+  for (const auto& line : android::base::Split(mounts, "\n")) {
+    auto fields = android::base::Split(line, " ");
+    if (fields.size() > 2 && fields[2] == "cgroup2") {
+      return fields[1];
+    }
+  }
+  return CF_ERR("cgroup v2 is not mounted");
+}
+
+// The cgroup v2 directory of the calling process
+Result<std::string> OwnCgroup() {
+  std::string cgroups;
+  CF_EXPECT(android::base::ReadFileToString("/proc/self/cgroup", &cgroups),
+            "Failed to read /proc/self/cgroup");
+  for (const auto& line : android::base::Split(cgroups, "\n")) {
+    if (!android::base::StartsWith(line, "0::")) {
+      continue;
+    }
+    auto relative_path = line.substr(3);
+    if (relative_path == "/") {
+      relative_path.clear();
+    }
+    return CF_EXPECT(Cgroup2MountPoint()) + relative_path;
+  }
+  return CF_ERR("The process is not in a cgroup v2 hierarchy");
+}
+
+// The cgroup of the server, or its parent once the server moved to a leaf
+Result<std::string> GroupCgroupsParent() {
+  auto own_cgroup = CF_EXPECT(OwnCgroup());
+  if (cpp_basename(own_cgroup) == kServerCgroupName) {
+    return cpp_dirname(own_cgroup);
+  }
+  return own_cgroup;
+}
+
+// android::base::WriteStringToFile would try to create and unlink the file
+Result<void> WriteCgroupFile(const std::string& path,
+                             const std::string& value) {
+  auto fd = SharedFD::Open(path, O_WRONLY);
+  CF_EXPECTF(fd->IsOpen(), "Failed to open \"{}\": {}", path, fd->StrError());
+  CF_EXPECTF(WriteAll(fd, value) == (ssize_t)value.size(),
+             "Failed to write \"{}\" to \"{}\": {}", value, path,
+             fd->StrError());
+  return {};
+}
+
+Result<std::string> ReadCgroupFile(const std::string& path) {
+  std::string content;
+  CF_EXPECTF(android::base::ReadFileToString(path, &content),
+             "Failed to read \"{}\": {}", path, strerror(errno));
+  return content;
+}
+
+/*
+ * Reads the "key value" lines of e.g. cpu.stat, or the "key=value" pairs of
+ * an io.stat line
+ */
+std::map<std::string, std::uint64_t> ParseKeyedValues(
+    const std::string& content, const std::string& separators) {
+  std::map<std::string, std::uint64_t> values;
+  auto tokens = android::base::Tokenize(content, separators);
+  for (size_t i = 0; i + 1 < tokens.size(); i += 2) {
+    std::uint64_t value;
+    if (android::base::ParseUint(tokens[i + 1], &value)) {
+      values[tokens[i]] = value;
+    }
+  }
+  return values;
+}
+
+Result<std::uint64_t> ReadCgroupUint(const std::string& path) {
+  const auto content = CF_EXPECT(ReadCgroupFile(path));
+  std::uint64_t value;
+  CF_EXPECTF(android::base::ParseUint(android::base::Trim(content), &value),
+             "\"{}\" does not hold a number", path);
+  return value;
+}
+
+Result<void> EnableControllers(const std::string& parent,
+                               const std::set<std::string>& controllers) {
+  const auto available = android::base::Tokenize(
+      CF_EXPECT(ReadCgroupFile(parent + "/cgroup.controllers")), " \n");
+  std::string enable;
+  for (const auto& controller : controllers) {
+    CF_EXPECTF(Contains(available, controller),
+               "The {} controller is not available in \"{}\"", controller,
+               parent);
+    enable += "+" + controller + " ";
+  }
+  const auto subtree_control = parent + "/cgroup.subtree_control";
+  if (WriteCgroupFile(subtree_control, enable).ok()) {
+    return {};
+  }
+  // EBUSY: a cgroup with processes can not enable controllers for children
+  const auto server_cgroup = parent + "/" + kServerCgroupName;
+  CF_EXPECTF(::mkdir(server_cgroup.c_str(), 0755) == 0 || errno == EEXIST,
+             "Failed to create \"{}\": {}", server_cgroup, strerror(errno));
+  CF_EXPECT(WriteCgroupFile(server_cgroup + "/cgroup.procs", "0"));
+  LOG(DEBUG) << "The cvd server moved to \"" << server_cgroup << "\"";
+  CF_EXPECT(WriteCgroupFile(subtree_control, enable),
+            "cgroup limits need a cgroup delegated to the user with no other "
+            "process than the cvd server, e.g. from "
+            "\"systemd-run --user -p Delegate=yes\"");
+  return {};
+}
+
+Result<void> WriteRecord(const GroupCgroup& cgroup) {
+  CF_EXPECT(EnsureDirectoryExists(RecordsDir(), S_IRWXU));
+  Json::Value record;
+  record["home"] = cgroup.home;
+  record["path"] = cgroup.path;
+  if (!cgroup.cpus.empty()) {
+    record["cpus"] = cgroup.cpus;
+  }
+  const auto record_path = RecordPath(cgroup.home);
+  const auto temp_path = ConcatToString(record_path, ".", getpid());
+  Json::StreamWriterBuilder builder;
+  CF_EXPECTF(android::base::WriteStringToFile(
+                 Json::writeString(builder, record), temp_path),
+             "Failed to write \"{}\": {}", temp_path, strerror(errno));
+  if (::rename(temp_path.c_str(), record_path.c_str()) != 0) {
+    const auto rename_errno = errno;
+    ::unlink(temp_path.c_str());
+    return CF_ERRF("Failed to rename \"{}\" to \"{}\": {}", temp_path,
+                   record_path, strerror(rename_errno));
+  }
+  return {};
+}
+
+Result<GroupCgroup> ReadRecord(const std::string& record_path) {
+  auto record = CF_EXPECT(LoadFromFile(record_path));
+  return GroupCgroup{
+      .home = record["home"].asString(),
+      .path = record["path"].asString(),
+      .cpus = record["cpus"].asString(),
+  };
+}
+
+void RemoveRecord(const GroupCgroup& cgroup) {
+  const auto record_path = RecordPath(cgroup.home);
+  if (::unlink(record_path.c_str()) != 0 && errno != ENOENT) {
+    LOG(ERROR) << "Failed to remove \"" << record_path
+               << "\": " << strerror(errno);
+  }
+}
+
+// Whether the pid still refers to a process of the cgroup
+bool IsInCgroup(const pid_t pid, const GroupCgroup& cgroup) {
+  std::string cgroups;
+  if (!android::base::ReadFileToString(ConcatToString("/proc/", pid, "/cgroup"),
+                                       &cgroups)) {
+    return false;
+  }
+  return Contains(cgroups, "/" + CgroupName(cgroup.home) + "\n");
+}
+
+Result<bool> IsPopulated(const GroupCgroup& cgroup) {
+  std::string events;
+  const auto events_path = cgroup.path + "/cgroup.events";
+  CF_EXPECTF(android::base::ReadFileToString(events_path, &events),
+             "Failed to read \"{}\": {}", events_path, strerror(errno));
+  return !Contains(events, "populated 0");
+}
+
+}  // namespace
+
+Result<GroupCgroup> CreateGroupCgroup(const std::string& home) {
+  GroupCgroup cgroup{.home = home, .path = ""};
+  // The names are 64 bits of a digest, so this is only a safety net
+  CF_EXPECTF(FindGroupCgroup(home) || !FileExists(RecordPath(home)),
+             "The record \"{}\" is for another HOME", RecordPath(home));
+  auto parent = GroupCgroupsParent();
+  if (!parent.ok()) {
+    LOG(DEBUG) << "No cgroup for \"" << home
+               << "\": " << parent.error().Message();
+    CF_EXPECT(WriteRecord(cgroup));
+    return cgroup;
+  }
+  const auto path = *parent + "/" + CgroupName(home);
+  if (::mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    // usually EACCES, when the cgroup was not delegated to the user
+    LOG(DEBUG) << "Failed to create the cgroup \"" << path
+               << "\": " << strerror(errno);
+    CF_EXPECT(WriteRecord(cgroup));
+    return cgroup;
+  }
+  cgroup.path = path;
+  // a leftover of an earlier group with the same HOME
+  CF_EXPECTF(CF_EXPECT(CgroupPids(cgroup)).empty(),
+             "The cgroup \"{}\" still has processes", path);
+  CF_EXPECT(WriteRecord(cgroup));
+  return cgroup;
+}
+
+Result<void> ApplyCgroupLimits(const GroupCgroup& cgroup,
+                               const CgroupLimits& limits) {
+  if (limits.Empty()) {
+    return {};
+  }
+  CF_EXPECTF(cgroup.IsTracked(), "No cgroup could be created for \"{}\"",
+             cgroup.home);
+  // interface file to value
+  std::map<std::string, std::string> settings;
+  std::set<std::string> controllers;
+  if (limits.cpu_weight) {
+    settings["cpu.weight"] = *limits.cpu_weight;
+    controllers.insert("cpu");
+  }
+  if (limits.cpu_max) {
+    settings["cpu.max"] = *limits.cpu_max;
+    controllers.insert("cpu");
+  }
+  if (limits.memory_high) {
+    settings["memory.high"] = *limits.memory_high;
+    controllers.insert("memory");
+  }
+  if (limits.io_weight) {
+    settings["io.weight"] = "default " + *limits.io_weight;
+    controllers.insert("io");
+  }
+  CF_EXPECT(EnableControllers(cpp_dirname(cgroup.path), controllers));
+  for (const auto& [file, value] : settings) {
+    CF_EXPECT(WriteCgroupFile(cgroup.path + "/" + file, value));
+  }
+  return {};
+}
+
+Result<void> RecordGroupCpus(const std::string& home,
+                             const std::string& cpus) {
+  auto cgroup = CF_EXPECTF(FindGroupCgroup(home), "\"{}\" is not recorded",
+                           home);
+  cgroup.cpus = cpus;
+  CF_EXPECT(WriteRecord(cgroup));
+  return {};
+}
+
+Result<Json::Value> CgroupStats(const GroupCgroup& cgroup) {
+  CF_EXPECT(cgroup.IsTracked(), "\"" << cgroup.home << "\" has no cgroup");
+  Json::Value stats(Json::objectValue);
+
+  // there even without the cpu controller
+  auto cpu_stat = ParseKeyedValues(
+      CF_EXPECT(ReadCgroupFile(cgroup.path + "/cpu.stat")), " \n");
+  Json::Value cpu(Json::objectValue);
+  for (const std::string key : {"usage_usec", "user_usec", "system_usec",
+                                "nr_throttled", "throttled_usec"}) {
+    if (Contains(cpu_stat, key)) {
+      cpu[key] = Json::UInt64(cpu_stat[key]);
+    }
+  }
+  stats["cpu"] = cpu;
+
+  const auto memory_current_path = cgroup.path + "/memory.current";
+  if (FileExists(memory_current_path)) {
+    Json::Value memory(Json::objectValue);
+    memory["current_bytes"] =
+        Json::UInt64(CF_EXPECT(ReadCgroupUint(memory_current_path)));
+    // Linux 5.19
+    auto peak = ReadCgroupUint(cgroup.path + "/memory.peak");
+    if (peak.ok()) {
+      memory["peak_bytes"] = Json::UInt64(*peak);
+    }
+    auto events = ReadCgroupFile(cgroup.path + "/memory.events");
+    if (events.ok()) {
+      auto memory_events = ParseKeyedValues(*events, " \n");
+      memory["high_events"] = Json::UInt64(memory_events["high"]);
+      memory["oom_kill_events"] = Json::UInt64(memory_events["oom_kill"]);
+    }
+    stats["memory"] = memory;
+  }
+
+  const auto io_stat_path = cgroup.path + "/io.stat";
+  if (FileExists(io_stat_path)) {
+    // one line per device: "8:0 rbytes=1 wbytes=2 rios=3 wios=4 ..."
+    std::map<std::string, std::uint64_t> totals;
+    for (const auto& line : android::base::Split(
+             CF_EXPECT(ReadCgroupFile(io_stat_path)), "\n")) {
+      auto first_space = line.find(' ');
+      if (first_space == std::string::npos) {
+        continue;
+      }
+      for (const auto& [key, value] :
+           ParseKeyedValues(line.substr(first_space + 1), " =")) {
+        totals[key] += value;
+      }
+    }
+    Json::Value io(Json::objectValue);
+    for (const std::string key : {"rbytes", "wbytes", "rios", "wios"}) {
+      io[key] = Json::UInt64(totals[key]);
+    }
+    stats["io"] = io;
+  }
+  return stats;
+}
+
+std::optional<GroupCgroup> FindGroupCgroup(const std::string& home) {
+  const auto record_path = RecordPath(home);
+  if (!FileExists(record_path)) {
+    return std::nullopt;
+  }
+  auto cgroup = ReadRecord(record_path);
+  if (!cgroup.ok() || cgroup->home != home) {
+    return std::nullopt;
+  }
+  return *cgroup;
+}
+
+std::vector<GroupCgroup> RecordedGroupCgroups() {
+  std::vector<GroupCgroup> cgroups;
+  auto names = DirectoryContents(RecordsDir());
+  if (!names.ok()) {
+    return cgroups;
+  }
+  for (const auto& name : *names) {
+    if (!android::base::StartsWith(name, kCgroupPrefix) ||
+        Contains(name, ".")) {
+      continue;
+    }
+    auto cgroup = ReadRecord(RecordsDir() + "/" + name);
+    if (!cgroup.ok()) {
+      LOG(DEBUG) << cgroup.error().Message();
+      continue;
+    }
+    if (cgroup->IsTracked() && !DirectoryExists(cgroup->path)) {
+      // removed behind our back, e.g. by a reboot
+      RemoveRecord(*cgroup);
+      continue;
+    }
+    cgroups.push_back(std::move(*cgroup));
+  }
+  return cgroups;
+}
+
+Result<std::vector<pid_t>> CgroupPids(const GroupCgroup& cgroup) {
+  CF_EXPECT(cgroup.IsTracked(), "\"" << cgroup.home << "\" has no cgroup");
+  std::string procs;
+  const auto procs_path = cgroup.path + "/cgroup.procs";
+  CF_EXPECTF(android::base::ReadFileToString(procs_path, &procs),
+             "Failed to read \"{}\": {}", procs_path, strerror(errno));
+  std::vector<pid_t> pids;
+  for (const auto& line : android::base::Split(procs, "\n")) {
+    pid_t pid;
+    if (android::base::ParseInt(line, &pid)) {
+      pids.push_back(pid);
+    }
+  }
+  return pids;
+}
+
+Result<void> KillCgroup(const GroupCgroup& cgroup) {
+  CF_EXPECT(cgroup.IsTracked(), "\"" << cgroup.home << "\" has no cgroup");
+  const auto kill_path = cgroup.path + "/cgroup.kill";
+  if (FileExists(kill_path)) {
+    CF_EXPECT(WriteCgroupFile(kill_path, "1"));
+    return {};
+  }
+  for (int round = 0; round < kKillRounds; round++) {
+    auto pids = CF_EXPECT(CgroupPids(cgroup));
+    if (pids.empty()) {
+      return {};
+    }
+    for (const auto pid : pids) {
+      auto pidfd = SharedFD::PidFdOpen(pid);
+      // The pid may have been recycled since cgroup.procs was read, but the
+      // process can not go away under an open pidfd.
+      if (!IsInCgroup(pid, cgroup)) {
+        continue;
+      }
+      int ret, error;
+      if (pidfd->IsOpen()) {
+        ret = pidfd->PidFdSendSignal(SIGKILL);
+        error = pidfd->GetErrno();
+      } else {
+        ret = ::kill(pid, SIGKILL);
+        error = errno;
+      }
+      if (ret != 0 && error != ESRCH) {
+        LOG(ERROR) << "Failed to kill #" << pid << ": " << strerror(error);
+      }
+    }
+    // SIGKILL is delivered asynchronously
+    if (WaitForEmptyCgroup(cgroup, kKillRoundTimeout).ok()) {
+      return {};
+    }
+  }
+  // Left to the caller's WaitForEmptyCgroup, which may wait longer
+  LOG(WARNING) << "\"" << cgroup.path << "\" still has processes after "
+               << kKillRounds << " rounds of SIGKILL";
+  return {};
+}
+
+Result<void> WaitForEmptyCgroup(const GroupCgroup& cgroup,
+                                const std::chrono::milliseconds timeout) {
+  CF_EXPECT(cgroup.IsTracked(), "\"" << cgroup.home << "\" has no cgroup");
+  // cgroup.events is modified when "populated" flips
+  auto inotify_fd = SharedFD::Inotify(IN_NONBLOCK);
+  CF_EXPECT(inotify_fd->IsOpen(), inotify_fd->StrError());
+  const auto events_path = cgroup.path + "/cgroup.events";
+  CF_EXPECT(inotify_fd->InotifyAddWatch(events_path, IN_MODIFY) >= 0,
+            inotify_fd->StrError());
+  const auto deadline = std::chrono::steady_clock::now() + timeout;
+  while (CF_EXPECT(IsPopulated(cgroup))) {
+    const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+        deadline - std::chrono::steady_clock::now());
+    CF_EXPECTF(left.count() > 0, "\"{}\" still has processes", cgroup.path);
+    std::vector<PollSharedFd> fds = {
+        {.fd = inotify_fd, .events = POLLIN, .revents = 0},
+    };
+    CF_EXPECT(SharedFD::Poll(fds, left.count()) >= 0,
+              "poll failed: " << strerror(errno));
+    char buffer[sizeof(inotify_event) + NAME_MAX + 1];
+    while (inotify_fd->Read(buffer, sizeof(buffer)) > 0) {
+    }
+  }
+  return {};
+}
+
+Result<void> ReleaseGroupCgroup(const GroupCgroup& cgroup) {
+  if (cgroup.IsTracked() && DirectoryExists(cgroup.path)) {
+    CF_EXPECT(KillCgroup(cgroup));
+    CF_EXPECT(WaitForEmptyCgroup(cgroup, std::chrono::seconds(5)));
+    CF_EXPECTF(::rmdir(cgroup.path.c_str()) == 0 || errno == ENOENT,
+               "Failed to remove \"{}\": {}", cgroup.path, strerror(errno));
+  }
+  RemoveRecord(cgroup);
+  return {};
+}
+
+}  // namespace cuttlefish
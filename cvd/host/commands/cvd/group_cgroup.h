@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <json/json.h>
+
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * The processes of an instance group launched by the cvd server: the
+ * launcher, run_cvd and all of their subprocesses.
+ *
+ * When the server may create cgroups, i.e. when its own cgroup v2 is
+ * delegated to the user, the launcher is started in a dedicated child cgroup
+ * and every process it forks stays there. The group is recorded under the
+ * cvd temp directory either way, so that "cvd reset" can find its processes
+ * without scanning /proc even when the server is gone.
+ *
+ * Resource limits need the cpu, memory or io controllers enabled for the
+ * group cgroups. As a cgroup with processes can not hand controllers down,
+ * the server then moves itself to a "cvd-server" leaf next to them.
+ */
+struct GroupCgroup {
+  std::string home;
+  // e.g. /sys/fs/cgroup/user.slice/.../cvd-group-<hash>, empty when the
+  // server could not create a cgroup for the group
+  std::string path;
+  // the host CPUs the group is pinned to, e.g. "0-3", empty if it is not
+  std::string cpus;
+
+  bool IsTracked() const { return !path.empty(); }
+};
+
+/*
+ * Records the group about to be launched from `home`, with a new cgroup
+ * under the cgroup of the calling process if possible.
+ */
+Result<GroupCgroup> CreateGroupCgroup(const std::string& home);
+
+// Unset fields are left to the kernel defaults
+struct CgroupLimits {
+  // cpu.weight, 1 to 10000, 100 by default
+  std::optional<std::string> cpu_weight;
+  // cpu.max, "$MAX $PERIOD" in microseconds, e.g. "200000 100000" for 2 CPUs
+  std::optional<std::string> cpu_max;
+  // memory.high in bytes, K, M and G suffixes allowed
+  std::optional<std::string> memory_high;
+  // io.weight, 1 to 10000, 100 by default
+  std::optional<std::string> io_weight;
+
+  bool Empty() const {
+    return !cpu_weight && !cpu_max && !memory_high && !io_weight;
+  }
+};
+
+/*
+ * Enables the controllers the limits need and writes them. Fails, rather
+ * than launching the group unconstrained, if the cgroup hierarchy was not
+ * delegated to the user.
+ */
+Result<void> ApplyCgroupLimits(const GroupCgroup& cgroup,
+                               const CgroupLimits& limits);
+
+/*
+ * Adds the host CPUs the group is pinned to to its record, for a restarted
+ * server to take them back.
+ */
+Result<void> RecordGroupCpus(const std::string& home, const std::string& cpus);
+
+/*
+ * The CPU, memory and IO usage of the group, from the interface files of
+ * its cgroup. The memory and IO figures are only there when the controller
+ * is enabled.
+ */
+Result<Json::Value> CgroupStats(const GroupCgroup& cgroup);
+
+std::optional<GroupCgroup> FindGroupCgroup(const std::string& home);
+std::vector<GroupCgroup> RecordedGroupCgroups();
+
+Result<std::vector<pid_t>> CgroupPids(const GroupCgroup& cgroup);
+// SIGKILLs all the processes of the cgroup
+Result<void> KillCgroup(const GroupCgroup& cgroup);
+Result<void> WaitForEmptyCgroup(const GroupCgroup& cgroup,
+                                std::chrono::milliseconds timeout);
+// Kills what is left in the cgroup, and removes it with its record
+Result<void> ReleaseGroupCgroup(const GroupCgroup& cgroup);
+
+}  // namespace cuttlefish
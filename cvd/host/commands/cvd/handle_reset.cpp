@@ -43,6 +43,7 @@ struct ParsedFlags {
   bool clean_runtime_dir;
   bool device_by_cvd_only;
   bool is_confirmed_by_flag;
+  std::chrono::seconds stop_timeout;
   std::optional<android::base::LogSeverity> log_level;
 };
 
@@ -56,6 +57,7 @@ static Result<ParsedFlags> ParseResetFlags(cvd_common::Args subcmd_args) {
   bool clean_runtime_dir = true;
   bool device_by_cvd_only = false;
   bool is_confirmed_by_flag = false;
+  std::int32_t stop_timeout_secs = kDefaultStopCvdTimeout.count();
   std::string verbosity_flag_value;
 
   Flag y_flag =
@@ -77,10 +79,13 @@ static Result<ParsedFlags> ParseResetFlags(cvd_common::Args subcmd_args) {
       GflagsCompatFlag("device-by-cvd-only", device_by_cvd_only),
       y_flag,
       GflagsCompatFlag("clean-runtime-dir", clean_runtime_dir),
+      GflagsCompatFlag("stop-timeout", stop_timeout_secs),
       help_flag,
       GflagsCompatFlag("verbosity", verbosity_flag_value),
       UnexpectedArgumentGuard()};
   CF_EXPECT(ParseFlags(flags, subcmd_args));
+  CF_EXPECTF(stop_timeout_secs > 0, "--stop-timeout must be positive, got {}",
+             stop_timeout_secs);
 
   std::optional<android::base::LogSeverity> verbosity;
   if (!verbosity_flag_value.empty()) {
@@ -91,6 +96,7 @@ static Result<ParsedFlags> ParseResetFlags(cvd_common::Args subcmd_args) {
                      .clean_runtime_dir = clean_runtime_dir,
                      .device_by_cvd_only = device_by_cvd_only,
                      .is_confirmed_by_flag = is_confirmed_by_flag,
+                     .stop_timeout = std::chrono::seconds(stop_timeout_secs),
                      .log_level = verbosity};
 }
 
@@ -200,7 +206,8 @@ Result<void> HandleReset(CvdClient& client,
   // cvd reset handler placeholder. identical to cvd kill-server for now.
   CF_EXPECT(KillAllCuttlefishInstances(
       {.cvd_server_children_only = options.device_by_cvd_only,
-       .clear_instance_dirs = options.clean_runtime_dir}));
+       .clear_instance_dirs = options.clean_runtime_dir,
+       .stop_timeout = options.stop_timeout}));
   return {};
 }
 
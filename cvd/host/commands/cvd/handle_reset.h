@@ -44,12 +44,16 @@ args:
                          device could be stopped by stop_cvd, the flag takes
                          effects. (default: true)
 
+  --stop-timeout         Seconds to wait for the devices to stop gracefully,
+                         all together, before killing the rest of them
+                         (default: 60)
+
   --yes                  Resets without asking the user confirmation.
    -y
 
 description:
 
-  1. Gracefully stops all devices that the cvd client can reach.
+  1. Gracefully stops all devices that the cvd client can reach, in parallel.
   2. Forcefully stops all run_cvd processes and their subprocesses.
   3. Kill the cvd server itself if unresponsive.
   4. Reset the states of the involved instance lock files
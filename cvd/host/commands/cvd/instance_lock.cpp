@@ -19,12 +19,14 @@
 #include <sys/file.h>
 
 #include <algorithm>
+#include <map>
 #include <regex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 
 #include <android-base/file.h>
+#include <android-base/logging.h>
 #include <android-base/parseint.h>
 #include <android-base/strings.h>
 #include <fruit/fruit.h>
@@ -37,8 +39,11 @@
 
 namespace cuttlefish {
 
-InstanceLockFile::InstanceLockFile(LockFile&& lock_file, const int instance_num)
-    : lock_file_(std::move(lock_file)), instance_num_(instance_num) {}
+InstanceLockFile::InstanceLockFile(LockFile&& lock_file, const int instance_num,
+                                   std::shared_ptr<InstanceNumBitmap> bitmap)
+    : lock_file_(std::move(lock_file)),
+      instance_num_(instance_num),
+      bitmap_(std::move(bitmap)) {}
 
 int InstanceLockFile::Instance() const { return instance_num_; }
 
@@ -49,6 +54,21 @@ Result<InUseState> InstanceLockFile::Status() const {
 
 Result<void> InstanceLockFile::Status(InUseState state) {
   CF_EXPECT(lock_file_.Status(state));
+  if (!bitmap_ || instance_num_ <= 0 ||
+      instance_num_ >= InstanceNumBitmap::kNumSlots) {
+    return {};
+  }
+  // the lock file is already right, and the next allocation fixes the bit
+  auto locked = bitmap_->Lock();
+  if (!locked.ok()) {
+    LOG(ERROR) << locked.error().FormatForEnv();
+    return {};
+  }
+  if (state == InUseState::kInUse) {
+    locked->Claim(instance_num_, /* provisional */ false);
+  } else {
+    locked->Release(instance_num_);
+  }
   return {};
 }
 
@@ -59,7 +79,25 @@ bool InstanceLockFile::operator<(const InstanceLockFile& other) const {
   return lock_file_ < other.lock_file_;
 }
 
-InstanceLockFileManager::InstanceLockFileManager() {}
+static Result<std::string> BitmapPath() {
+  const auto dir = TempDir() + "/acloud_cvd_temp";
+  CF_EXPECT(EnsureDirectoryExists(dir));
+  return dir + "/instance_nums.bitmap";
+}
+
+static Result<std::unique_ptr<InstanceNumBitmap>> OpenBitmap() {
+  return CF_EXPECT(InstanceNumBitmap::Open(CF_EXPECT(BitmapPath())));
+}
+
+InstanceLockFileManager::InstanceLockFileManager() {
+  auto bitmap = OpenBitmap();
+  if (bitmap.ok()) {
+    bitmap_ = std::move(*bitmap);
+  } else {
+    LOG(ERROR) << "Falling back to scanning the instance lock files: "
+               << bitmap.error().FormatForEnv();
+  }
+}
 
 Result<std::string> InstanceLockFileManager::LockFilePath(int instance_num) {
   std::stringstream path;
@@ -74,7 +112,7 @@ Result<InstanceLockFile> InstanceLockFileManager::AcquireLock(
   const auto lock_file_path = CF_EXPECT(LockFilePath(instance_num));
   LockFile lock_file =
       CF_EXPECT(lock_file_manager_.AcquireLock(lock_file_path));
-  return InstanceLockFile(std::move(lock_file), instance_num);
+  return InstanceLockFile(std::move(lock_file), instance_num, bitmap_);
 }
 
 Result<std::set<InstanceLockFile>> InstanceLockFileManager::AcquireLocks(
@@ -94,7 +132,7 @@ Result<std::optional<InstanceLockFile>> InstanceLockFileManager::TryAcquireLock(
   if (!lock_file_opt) {
     return std::nullopt;
   }
-  return InstanceLockFile(std::move(*lock_file_opt), instance_num);
+  return InstanceLockFile(std::move(*lock_file_opt), instance_num, bitmap_);
 }
 
 Result<std::set<InstanceLockFile>> InstanceLockFileManager::TryAcquireLocks(
@@ -221,17 +259,160 @@ cvd-wtap-02:       0       0    0    0    0     0          0         0        0
 
 Result<std::optional<InstanceLockFile>>
 InstanceLockFileManager::TryAcquireUnusedLock() {
+  auto locks = AcquireUnusedLocks(
+      1, [](int) { return true; }, std::nullopt);
+  if (!locks.ok()) {
+    LOG(DEBUG) << locks.error().FormatForEnv();
+    return {};
+  }
+  return std::move(locks->front());
+}
+
+Result<std::optional<InstanceLockFile>>
+InstanceLockFileManager::TryAcquireUnused(InstanceNumBitmap::Locked& locked,
+                                          const int num) {
+  auto lock = CF_EXPECT(TryAcquireLock(num));
+  if (!lock) {
+    // e.g. an older cvd allocating it, checked again by ReclaimProvisional
+    if (!locked.IsClaimed(num)) {
+      locked.Claim(num, /* provisional */ true);
+    }
+    return std::nullopt;
+  }
+  if (CF_EXPECT(lock->Status()) == InUseState::kInUse) {
+    locked.Claim(num, /* provisional */ false);
+    return std::nullopt;
+  }
+  return lock;
+}
+
+Result<void> InstanceLockFileManager::ReclaimProvisional(
+    InstanceNumBitmap::Locked& locked) {
+  for (const auto num : locked.ClaimedNums()) {
+    if (!locked.Info(num).provisional) {
+      continue;
+    }
+    if (CF_EXPECT(TryAcquireUnused(locked, num))) {
+      locked.Release(num);
+    }
+  }
+  return {};
+}
+
+Result<void> InstanceLockFileManager::Resync(
+    InstanceNumBitmap::Locked& locked) {
+  for (const auto num : locked.ClaimedNums()) {
+    if (CF_EXPECT(TryAcquireUnused(locked, num))) {
+      locked.Release(num);
+    }
+  }
+  return {};
+}
+
+Result<std::vector<InstanceLockFile>>
+InstanceLockFileManager::AcquireUnusedLocks(
+    const size_t count, std::function<bool(int)> is_available,
+    const std::optional<int> preferred_first) {
+  CF_EXPECT(count > 0);
+  if (!bitmap_) {
+    return CF_EXPECT(AcquireUnusedLocksWithoutBitmap(count, is_available,
+                                                     preferred_first));
+  }
   if (!all_instance_nums_) {
     all_instance_nums_ = CF_EXPECT(FindPotentialInstanceNumsFromNetDevices());
   }
+  auto candidates = InstanceNumBitmap::ToWords(*all_instance_nums_);
 
-  for (const auto num : *all_instance_nums_) {
+  auto locked = CF_EXPECT(bitmap_->Lock());
+  CF_EXPECT(ReclaimProvisional(locked));
+  bool resynced = false;
+  while (true) {
+    auto first = locked.FindRange(count, candidates, preferred_first);
+    if (!first) {
+      CF_EXPECTF(!resynced, "No {} consecutive instance numbers available",
+                 count);
+      CF_EXPECT(Resync(locked));
+      resynced = true;
+      continue;
+    }
+    // a number that turns out to be taken is claimed or left out, so the
+    // next search skips it
+    std::vector<InstanceLockFile> locks;
+    for (int num = *first; num < *first + static_cast<int>(count); num++) {
+      if (!is_available(num)) {
+        candidates[num / 64] &= ~(1ULL << (num % 64));
+        break;
+      }
+      auto lock = CF_EXPECT(TryAcquireUnused(locked, num));
+      if (!lock) {
+        break;
+      }
+      locks.emplace_back(std::move(*lock));
+    }
+    if (locks.size() == count) {
+      for (const auto& lock : locks) {
+        locked.Claim(lock.Instance(), /* provisional */ true);
+      }
+      return locks;
+    }
+  }
+}
+
+Result<std::vector<InstanceLockFile>>
+InstanceLockFileManager::AcquireUnusedLocks(const std::set<int>& nums) {
+  if (!all_instance_nums_) {
+    all_instance_nums_ = CF_EXPECT(FindPotentialInstanceNumsFromNetDevices());
+  }
+  std::optional<InstanceNumBitmap::Locked> locked;
+  if (bitmap_) {
+    locked.emplace(CF_EXPECT(bitmap_->Lock()));
+  }
+  std::vector<InstanceLockFile> locks;
+  for (const auto num : nums) {
+    CF_EXPECTF(Contains(*all_instance_nums_, num),
+               "Instance ID {} has no network devices", num);
     auto lock = CF_EXPECT(TryAcquireLock(num));
-    if (lock && CF_EXPECT(lock->Status()) == InUseState::kNotInUse) {
-      return std::move(*lock);
+    CF_EXPECTF(lock.has_value(), "Instance ID {} lock file can't be locked.",
+               num);
+    const auto status = CF_EXPECT(lock->Status());
+    CF_EXPECTF(status == InUseState::kNotInUse, "Instance ID {} is in use.",
+               num);
+    locks.emplace_back(std::move(*lock));
+  }
+  if (locked) {
+    for (const auto num : nums) {
+      if (num > 0 && num < InstanceNumBitmap::kNumSlots) {
+        locked->Claim(num, /* provisional */ true);
+      }
     }
   }
-  return {};
+  return locks;
+}
+
+Result<std::vector<InstanceLockFile>>
+InstanceLockFileManager::AcquireUnusedLocksWithoutBitmap(
+    const size_t count, const std::function<bool(int)>& is_available,
+    const std::optional<int> preferred_first) {
+  std::map<int, InstanceLockFile> available;
+  for (auto& lock : CF_EXPECT(LockAllAvailable())) {
+    if (is_available(lock.Instance())) {
+      const auto num = lock.Instance();
+      available.emplace(num, std::move(lock));
+    }
+  }
+  std::set<int> nums;
+  for (const auto& [num, _] : available) {
+    nums.insert(num);
+  }
+  auto first = InstanceNumBitmap::FindRange(
+      count, InstanceNumBitmap::ToWords(nums), preferred_first);
+  CF_EXPECTF(first.has_value(),
+             "No {} consecutive instance numbers available", count);
+  std::vector<InstanceLockFile> locks;
+  for (int num = *first; num < *first + static_cast<int>(count); num++) {
+    locks.emplace_back(std::move(available.at(num)));
+  }
+  return locks;
 }
 
 }  // namespace cuttlefish
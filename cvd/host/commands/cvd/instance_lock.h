@@ -15,11 +15,16 @@
  */
 #pragma once
 
+#include <functional>
+#include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <fruit/fruit.h>
 
+#include "host/commands/cvd/instance_num_bitmap.h"
 #include "host/commands/cvd/lock_file.h"
 
 namespace cuttlefish {
@@ -37,9 +42,12 @@ class InstanceLockFile {
   bool operator<(const InstanceLockFile&) const;
 
  private:
-  InstanceLockFile(LockFile&& lock_file, const int instance_num);
+  InstanceLockFile(LockFile&& lock_file, const int instance_num,
+                   std::shared_ptr<InstanceNumBitmap> bitmap);
   LockFile lock_file_;
   const int instance_num_;
+  // nullptr if the state file could not be opened
+  std::shared_ptr<InstanceNumBitmap> bitmap_;
 };
 
 class InstanceLockFileManager {
@@ -60,7 +68,36 @@ class InstanceLockFileManager {
 
   Result<std::vector<InstanceLockFile>> LockAllAvailable();
 
+  /*
+   * Locks `count` consecutive instance numbers not in use, for which
+   * `is_available` also holds. `preferred_first` is taken if that range is
+   * free, e.g. 1 for the default group.
+   */
+  Result<std::vector<InstanceLockFile>> AcquireUnusedLocks(
+      size_t count, std::function<bool(int)> is_available,
+      std::optional<int> preferred_first);
+  // Locks exactly these instance numbers, if none is in use
+  Result<std::vector<InstanceLockFile>> AcquireUnusedLocks(
+      const std::set<int>& nums);
+
  private:
+  /*
+   * The bits of the numbers claimed by allocations that did not mark them in
+   * use yet are given back when their lock files are free again.
+   */
+  Result<void> ReclaimProvisional(InstanceNumBitmap::Locked& locked);
+  // Clears the claimed bits of the numbers not in use any more
+  Result<void> Resync(InstanceNumBitmap::Locked& locked);
+  /*
+   * The lock of `num` if it is free and not in use, or else nullopt, after
+   * correcting its bit. Does not change the bit otherwise.
+   */
+  Result<std::optional<InstanceLockFile>> TryAcquireUnused(
+      InstanceNumBitmap::Locked& locked, int num);
+  Result<std::vector<InstanceLockFile>> AcquireUnusedLocksWithoutBitmap(
+      size_t count, const std::function<bool(int)>& is_available,
+      std::optional<int> preferred_first);
+
   /*
    * Generate value to initialize
    */
@@ -68,6 +105,7 @@ class InstanceLockFileManager {
   static Result<std::string> LockFilePath(int instance_num);
   std::optional<std::set<int>> all_instance_nums_;
   LockFileManager lock_file_manager_;
+  std::shared_ptr<InstanceNumBitmap> bitmap_;
 };
 
 }  // namespace cuttlefish
@@ -17,6 +17,7 @@
 #include "host/commands/cvd/instance_manager.h"
 
 #include <signal.h>
+#include <sys/eventfd.h>
 
 #include <map>
 #include <mutex>
@@ -37,6 +38,7 @@
 #include "common/libs/utils/subprocess.h"
 #include "cvd_server.pb.h"
 #include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/group_cgroup.h"
 #include "host/commands/cvd/selector/instance_database_utils.h"
 #include "host/commands/cvd/selector/selector_constants.h"
 #include "host/commands/cvd/server_constants.h"
@@ -66,9 +68,41 @@ Result<std::string> InstanceManager::GetCuttlefishConfigPath(
 
 InstanceManager::InstanceManager(
     InstanceLockFileManager& lock_manager,
-    HostToolTargetManager& host_tool_target_manager)
+    HostToolTargetManager& host_tool_target_manager, EpollPool& epoll_pool)
     : lock_manager_(lock_manager),
-      host_tool_target_manager_(host_tool_target_manager) {}
+      host_tool_target_manager_(host_tool_target_manager),
+      epoll_pool_(epoll_pool) {
+  auto cb = [this](EpollEvent ev) -> Result<void> {
+    CF_EXPECT(HandleStatusCacheEvent(ev));
+    return {};
+  };
+  auto result = epoll_pool_.Register(status_cache_.InotifyFd(), EPOLLIN, cb);
+  if (!result.ok()) {
+    LOG(ERROR) << "The fleet status cache will not be updated on changes: "
+               << result.error().FormatForEnv();
+  }
+  status_refresh_event_ = SharedFD::Event(0, EFD_SEMAPHORE);
+  auto refresh_cb = [this](EpollEvent ev) -> Result<void> {
+    CF_EXPECT(HandleStatusRefreshEvent(ev));
+    return {};
+  };
+  result = status_refresh_event_->IsOpen()
+               ? epoll_pool_.Register(status_refresh_event_, EPOLLIN,
+                                      refresh_cb)
+               : CF_ERR(status_refresh_event_->StrError());
+  if (!result.ok()) {
+    LOG(ERROR) << "The stale fleet status records will not be refreshed: "
+               << result.error().FormatForEnv();
+    status_refresh_event_ = SharedFD();
+  }
+  auto topology = CpuTopology::Read();
+  if (topology.ok()) {
+    cpu_placement_.emplace(std::move(*topology));
+  } else {
+    LOG(ERROR) << "The instance groups will not be pinned to host CPUs: "
+               << topology.error().FormatForEnv();
+  }
+}
 
 selector::InstanceDatabase& InstanceManager::GetInstanceDB(const uid_t uid) {
   if (!Contains(instance_dbs_, uid)) {
@@ -89,6 +123,17 @@ Result<void> InstanceManager::LoadFromJson(const uid_t uid,
   CF_EXPECT(!Contains(instance_dbs_, uid));
   auto& db = GetInstanceDB(uid);
   CF_EXPECT(db.LoadFromJson(db_json));
+  for (const auto& group : db.InstanceGroups()) {
+    std::vector<unsigned> ids;
+    for (const auto& instance : group->Instances()) {
+      ids.push_back(instance->InstanceId());
+    }
+    auto watch_result = status_cache_.Watch(group->HomeDir(), ids);
+    if (!watch_result.ok()) {
+      LOG(ERROR) << watch_result.error().FormatForEnv();
+    }
+    RecoverCpuPlacement(group->HomeDir());
+  }
   return {};
 }
 
@@ -164,10 +209,12 @@ Result<void> InstanceManager::SetInstanceGroup(
 
   using InstanceInfo = selector::InstanceDatabase::InstanceInfo;
   std::vector<InstanceInfo> instances_info;
+  std::vector<unsigned> instance_ids;
   for (const auto& instance : per_instance_info) {
     InstanceInfo info{.id = instance.instance_id_,
                       .name = instance.per_instance_name_};
     instances_info.push_back(info);
+    instance_ids.push_back(instance.instance_id_);
   }
   android::base::ScopeGuard action_on_failure([&instance_db, &new_group]() {
     /*
@@ -187,6 +234,11 @@ Result<void> InstanceManager::SetInstanceGroup(
              "is not added",
              group_name);
   action_on_failure.Disable();
+  auto watch_result = status_cache_.Watch(home_dir, instance_ids);
+  if (!watch_result.ok()) {
+    LOG(ERROR) << "Status of \"" << group_name << "\" will not be cached: "
+               << watch_result.error().FormatForEnv();
+  }
   return {};
 }
 
@@ -201,12 +253,95 @@ Result<void> InstanceManager::SetBuildId(const uid_t uid,
 
 void InstanceManager::RemoveInstanceGroup(const uid_t uid,
                                           const std::string& dir) {
-  std::lock_guard assemblies_lock(instance_db_mutex_);
-  auto& instance_db = GetInstanceDB(uid);
-  auto result = instance_db.FindGroup({selector::kHomeField, dir});
-  if (!result.ok()) return;
-  auto group = *result;
-  instance_db.RemoveInstanceGroup(group);
+  {
+    std::lock_guard assemblies_lock(instance_db_mutex_);
+    auto& instance_db = GetInstanceDB(uid);
+    auto result = instance_db.FindGroup({selector::kHomeField, dir});
+    if (!result.ok()) return;
+    auto group = *result;
+    instance_db.RemoveInstanceGroup(group);
+    status_cache_.Forget(dir);
+  }
+  ReleaseCgroup(dir);
+  ReleaseCpuPlacement(dir);
+}
+
+std::optional<CpuPlacement> InstanceManager::PlaceGroup(
+    const std::string& home_dir, const size_t num_cpus) {
+  if (!cpu_placement_) {
+    return std::nullopt;
+  }
+  auto placement = cpu_placement_->Allocate(home_dir, num_cpus);
+  if (placement) {
+    auto record_result =
+        RecordGroupCpus(home_dir, FormatCpuList(placement->cpus));
+    if (!record_result.ok()) {
+      LOG(ERROR) << "A restarted server will not know the CPUs of \""
+                 << home_dir << "\": " << record_result.error().FormatForEnv();
+    }
+  }
+  return placement;
+}
+
+void InstanceManager::ReleaseCpuPlacement(const std::string& home_dir) {
+  if (cpu_placement_) {
+    cpu_placement_->Release(home_dir);
+  }
+}
+
+/*
+ * The placement of a group launched by an earlier server is in the record of
+ * its cgroup, rather than in the affinity of its processes, which they may
+ * have changed.
+ */
+void InstanceManager::RecoverCpuPlacement(const std::string& home_dir) {
+  if (!cpu_placement_) {
+    return;
+  }
+  auto cgroup = FindGroupCgroup(home_dir);
+  // not pinned
+  if (!cgroup || cgroup->cpus.empty()) {
+    return;
+  }
+  auto cpus = ParseCpuList(cgroup->cpus);
+  if (!cpus.ok()) {
+    LOG(ERROR) << "Bad CPU list in the record of \"" << home_dir
+               << "\": " << cpus.error().FormatForEnv();
+    return;
+  }
+  auto reserve_result = cpu_placement_->Reserve(home_dir, *cpus);
+  if (!reserve_result.ok()) {
+    LOG(ERROR) << "Failed to recover the CPU placement of \"" << home_dir
+               << "\": " << reserve_result.error().FormatForEnv();
+  }
+}
+
+void InstanceManager::AddCpuPlacement(const std::string& home_dir,
+                                      Json::Value& group_json) const {
+  if (!cpu_placement_) {
+    return;
+  }
+  auto placement = cpu_placement_->Get(home_dir);
+  if (placement) {
+    group_json["cpu_placement"] = placement->ToJson();
+  }
+}
+
+void InstanceManager::ReleaseCgroup(const std::string& home_dir) {
+  auto cgroup = FindGroupCgroup(home_dir);
+  if (!cgroup) {
+    return;
+  }
+  // kills whatever the launcher or stop_cvd left behind
+  auto release_result = ReleaseGroupCgroup(*cgroup);
+  if (!release_result.ok()) {
+    LOG(ERROR) << "Failed to release the cgroup of \"" << home_dir
+               << "\": " << release_result.error().FormatForEnv();
+  }
+}
+
+void InstanceManager::InvalidateStatus(const std::string& home_dir) {
+  status_cache_.Invalidate(home_dir);
 }
 
 template <typename... Args>
@@ -282,6 +417,21 @@ InstanceManager::IssueStatusCommand(const selector::LocalInstanceGroup& group,
   return output;
 }
 
+// The usage of the group, when it runs in its own cgroup
+static void AddResourceUsage(const std::string& home_dir,
+                             Json::Value& group_json) {
+  auto cgroup = FindGroupCgroup(home_dir);
+  if (!cgroup || !cgroup->IsTracked()) {
+    return;
+  }
+  auto stats = CgroupStats(*cgroup);
+  if (!stats.ok()) {
+    LOG(DEBUG) << stats.error().Message();
+    return;
+  }
+  group_json["resources"] = *stats;
+}
+
 Result<cvd::Status> InstanceManager::CvdFleetImpl(const uid_t uid,
                                                   const SharedFD& out,
                                                   const SharedFD& err) {
@@ -296,6 +446,7 @@ Result<cvd::Status> InstanceManager::CvdFleetImpl(const uid_t uid,
     CF_EXPECT(group != nullptr);
     Json::Value group_json(Json::objectValue);
     group_json["group_name"] = group->GroupName();
+    const auto started_at = InstanceStatusCache::Clock::now();
     auto result = IssueStatusCommand(*group, err);
     if (!result.ok()) {
       WriteAll(err,
@@ -304,11 +455,17 @@ Result<cvd::Status> InstanceManager::CvdFleetImpl(const uid_t uid,
       status.set_code(cvd::Status::INTERNAL);
       continue;
     }
+    status_cache_.Update(group->HomeDir(), *result, started_at);
     group_json["instances"] = *result;
+    AddResourceUsage(group->HomeDir(), group_json);
+    AddCpuPlacement(group->HomeDir(), group_json);
     groups_json.append(group_json);
   }
   Json::Value output(Json::objectValue);
   output["groups"] = groups_json;
+  if (cpu_placement_) {
+    output["host_cpus"] = cpu_placement_->Report();
+  }
   // Calling toStyledString here puts the string representation of all instance
   // groups into a single string in memory. That sounds large, but the host's
   // RAM should be able to handle it if it can handle that many instances
@@ -323,18 +480,185 @@ Result<cvd::Status> InstanceManager::CvdFleet(
     const uid_t uid, const SharedFD& out, const SharedFD& err,
     const std::vector<std::string>& fleet_cmd_args) {
   bool is_help = false;
+  bool is_cached = false;
   for (const auto& arg : fleet_cmd_args) {
     if (arg == "--help" || arg == "-help") {
       is_help = true;
       break;
     }
+    if (arg == "--cached" || arg == "-cached") {
+      is_cached = true;
+    }
   }
   CF_EXPECT(!is_help,
             "cvd fleet --help should be handled by fleet handler itself.");
-  const auto status = CF_EXPECT(CvdFleetImpl(uid, out, err));
+  const auto status = is_cached ? CF_EXPECT(CvdFleetCached(uid, out, err))
+                                : CF_EXPECT(CvdFleetImpl(uid, out, err));
+  return status;
+}
+
+static Json::UInt64 MillisecondsSinceEpoch(
+    const InstanceStatusCache::Clock::time_point time_point) {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             time_point.time_since_epoch())
+      .count();
+}
+
+/*
+ * Serves "cvd fleet --cached" from the status cache.
+ *
+ * Only the groups that were never queried run the status binary here. Stale
+ * records are returned as they are, marked with the time they turned stale,
+ * and refreshed in the background for the next request.
+ */
+Result<cvd::Status> InstanceManager::CvdFleetCached(const uid_t uid,
+                                                    const SharedFD& out,
+                                                    const SharedFD& err) {
+  std::vector<LocalInstanceGroup> groups;
+  {
+    std::lock_guard assemblies_lock(instance_db_mutex_);
+    for (const auto& group : GetInstanceDB(uid).InstanceGroups()) {
+      CF_EXPECT(group != nullptr);
+      groups.push_back(*group);
+    }
+  }
+  cvd::Status status;
+  status.set_code(cvd::Status::OK);
+
+  Json::Value groups_json(Json::arrayValue);
+  for (const auto& group : groups) {
+    auto record = status_cache_.Get(group.HomeDir());
+    if (!record) {
+      auto result = RefreshStatus(group, err);
+      record = status_cache_.Get(group.HomeDir());
+      if (!result.ok() || !record) {
+        WriteAll(err, fmt::format("Group '{}' status error: '{}'",
+                                  group.GroupName(),
+                                  result.ok() ? "removed while querying"
+                                              : result.error().FormatForEnv()));
+        status.set_code(cvd::Status::INTERNAL);
+        continue;
+      }
+    } else if (record->IsStale()) {
+      ScheduleStatusRefresh(group.HomeDir());
+    }
+    Json::Value instances_json(Json::arrayValue);
+    for (auto instance_json : record->instances) {
+      instance_json["status_updated_at_ms"] =
+          MillisecondsSinceEpoch(record->updated_at);
+      instance_json["status_stale"] = record->IsStale();
+      if (record->stale_since) {
+        instance_json["status_stale_since_ms"] =
+            MillisecondsSinceEpoch(*record->stale_since);
+      }
+      instances_json.append(instance_json);
+    }
+    Json::Value group_json(Json::objectValue);
+    group_json["group_name"] = group.GroupName();
+    group_json["instances"] = instances_json;
+    // read live, as it is only a few cgroup files
+    AddResourceUsage(group.HomeDir(), group_json);
+    AddCpuPlacement(group.HomeDir(), group_json);
+    groups_json.append(group_json);
+  }
+  Json::Value output(Json::objectValue);
+  output["groups"] = groups_json;
+  if (cpu_placement_) {
+    output["host_cpus"] = cpu_placement_->Report();
+  }
+  WriteAll(out, output.toStyledString());
   return status;
 }
 
+Result<void> InstanceManager::RefreshStatus(
+    const selector::LocalInstanceGroup& group, const SharedFD& err) {
+  const auto started_at = InstanceStatusCache::Clock::now();
+  auto instances = CF_EXPECT(IssueStatusCommand(group, err));
+  status_cache_.Update(group.HomeDir(), std::move(instances), started_at);
+  return {};
+}
+
+std::optional<selector::LocalInstanceGroup> InstanceManager::FindGroupByHome(
+    const std::string& home_dir) const {
+  std::lock_guard assemblies_lock(instance_db_mutex_);
+  for (const auto& [_, instance_db] : instance_dbs_) {
+    auto group = instance_db.FindGroup({selector::kHomeField, home_dir});
+    if (group.ok()) {
+      return group->Get();
+    }
+  }
+  return std::nullopt;
+}
+
+/*
+ * Queues the status binary of the group to run on one of the epoll worker
+ * threads. At most one refresh per group is queued or in flight, which
+ * coalesces the "cvd fleet --cached" requests that find the same record
+ * stale.
+ */
+void InstanceManager::ScheduleStatusRefresh(const std::string& home_dir) {
+  std::lock_guard lock(status_refreshes_mutex_);
+  if (!status_refresh_event_->IsOpen() ||
+      !status_refreshes_.insert(home_dir).second) {
+    return;
+  }
+  queued_status_refreshes_.push_back(home_dir);
+  if (status_refresh_event_->EventfdWrite(1) != 0) {
+    LOG(ERROR) << "Failed to schedule a status refresh of \"" << home_dir
+               << "\": " << status_refresh_event_->StrError();
+    queued_status_refreshes_.pop_back();
+    status_refreshes_.erase(home_dir);
+  }
+}
+
+/*
+ * Runs one queued refresh per event, re-registering first so that the other
+ * workers run the rest in parallel.
+ */
+Result<void> InstanceManager::HandleStatusRefreshEvent(EpollEvent event) {
+  CF_EXPECT(event.events & EPOLLIN);
+  std::string home_dir;
+  {
+    std::lock_guard lock(status_refreshes_mutex_);
+    eventfd_t count;
+    CF_EXPECT(event.fd->EventfdRead(&count) == 0, event.fd->StrError());
+    CF_EXPECT(!queued_status_refreshes_.empty());
+    home_dir = std::move(queued_status_refreshes_.front());
+    queued_status_refreshes_.pop_front();
+  }
+  android::base::ScopeGuard done([this, home_dir]() {
+    std::lock_guard lock(status_refreshes_mutex_);
+    status_refreshes_.erase(home_dir);
+  });
+  auto self_cb = [this](EpollEvent ev) -> Result<void> {
+    CF_EXPECT(HandleStatusRefreshEvent(ev));
+    return {};
+  };
+  CF_EXPECT(epoll_pool_.Register(event.fd, EPOLLIN, self_cb));
+  auto group = FindGroupByHome(home_dir);
+  if (!group) {
+    return {};
+  }
+  auto dev_null = SharedFD::Open("/dev/null", O_WRONLY);
+  CF_EXPECT(RefreshStatus(*group, dev_null));
+  return {};
+}
+
+/*
+ * Only marks the records stale. They are refreshed when "cvd fleet --cached"
+ * finds them stale, so idle groups don't run their status binary.
+ */
+Result<void> InstanceManager::HandleStatusCacheEvent(EpollEvent event) {
+  CF_EXPECT(event.events & EPOLLIN);
+  status_cache_.HandleInotifyEvents();
+  auto self_cb = [this](EpollEvent ev) -> Result<void> {
+    CF_EXPECT(HandleStatusCacheEvent(ev));
+    return {};
+  };
+  CF_EXPECT(epoll_pool_.Register(event.fd, EPOLLIN, self_cb));
+  return {};
+}
+
 Result<std::string> InstanceManager::StopBin(
     const std::string& host_android_out) {
   const auto stop_bin = CF_EXPECT(host_tool_target_manager_.ExecBaseName({
@@ -408,11 +732,14 @@ cvd::Status InstanceManager::CvdClear(const SharedFD& out,
           LOG(ERROR) << stop_result.error().FormatForEnv();
         }
       }
+      ReleaseCgroup(group->HomeDir());
+      ReleaseCpuPlacement(group->HomeDir());
       RemoveFile(group->HomeDir() + "/cuttlefish_runtime");
       RemoveFile(group->HomeDir() + config_json_name);
     }
     instance_db.Clear();
   }
+  status_cache_.Clear();
   // TODO(kwstephenkim): we need a better mechanism to make sure that
   // we clear all run_cvd processes.
   instance_dbs_.clear();
@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 
+#include <deque>
 #include <mutex>
 #include <optional>
 #include <set>
@@ -32,7 +33,10 @@
 #include "common/libs/utils/result.h"
 #include "cvd_server.pb.h"
 #include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/cpu_placement.h"
+#include "host/commands/cvd/epoll_loop.h"
 #include "host/commands/cvd/instance_lock.h"
+#include "host/commands/cvd/instance_status_cache.h"
 #include "host/commands/cvd/selector/creation_analyzer.h"
 #include "host/commands/cvd/selector/group_selector.h"
 #include "host/commands/cvd/selector/instance_database.h"
@@ -56,7 +60,8 @@ class InstanceManager {
   template <typename T>
   using Set = selector::Set<T>;
 
-  INJECT(InstanceManager(InstanceLockFileManager&, HostToolTargetManager&));
+  INJECT(InstanceManager(InstanceLockFileManager&, HostToolTargetManager&,
+                         EpollPool&));
 
   // For cvd start
   Result<GroupCreationInfo> Analyze(const std::string& sub_cmd,
@@ -85,7 +90,12 @@ class InstanceManager {
                                 const selector::GroupCreationInfo& group_info);
   Result<void> SetBuildId(const uid_t uid, const std::string& group_name,
                           const std::string& build_id);
+  // nullopt if the host topology is unknown or there are not enough free CPUs
+  std::optional<CpuPlacement> PlaceGroup(const std::string& home_dir,
+                                         size_t num_cpus);
   void RemoveInstanceGroup(const uid_t uid, const std::string&);
+  // Marks the cached status of the group stale after a lifecycle operation
+  void InvalidateStatus(const std::string& home_dir);
 
   cvd::Status CvdClear(const SharedFD& out, const SharedFD& err);
   Result<cvd::Status> CvdFleet(const uid_t uid, const SharedFD& out,
@@ -114,18 +124,43 @@ class InstanceManager {
  private:
   Result<cvd::Status> CvdFleetImpl(const uid_t uid, const SharedFD& out,
                                    const SharedFD& err);
+  Result<cvd::Status> CvdFleetCached(const uid_t uid, const SharedFD& out,
+                                     const SharedFD& err);
+  Result<void> RefreshStatus(const selector::LocalInstanceGroup& group,
+                             const SharedFD& err);
+  void ScheduleStatusRefresh(const std::string& home_dir);
+  Result<void> HandleStatusRefreshEvent(EpollEvent);
+  Result<void> HandleStatusCacheEvent(EpollEvent);
+  std::optional<selector::LocalInstanceGroup> FindGroupByHome(
+      const std::string& home_dir) const;
   Result<Json::Value> IssueStatusCommand(
       const selector::LocalInstanceGroup& group, const SharedFD& err);
   Result<void> IssueStopCommand(const SharedFD& out, const SharedFD& err,
                                 const std::string& config_file_path,
                                 const selector::LocalInstanceGroup& group);
   Result<std::string> StopBin(const std::string& host_android_out);
+  static void ReleaseCgroup(const std::string& home_dir);
+  void ReleaseCpuPlacement(const std::string& home_dir);
+  void RecoverCpuPlacement(const std::string& home_dir);
+  void AddCpuPlacement(const std::string& home_dir,
+                       Json::Value& group_json) const;
 
   selector::InstanceDatabase& GetInstanceDB(const uid_t uid);
   InstanceLockFileManager& lock_manager_;
   HostToolTargetManager& host_tool_target_manager_;
+  EpollPool& epoll_pool_;
   mutable std::mutex instance_db_mutex_;
   std::unordered_map<uid_t, selector::InstanceDatabase> instance_dbs_;
+
+  InstanceStatusCache status_cache_;
+  std::mutex status_refreshes_mutex_;
+  std::set<std::string> status_refreshes_;  // HOME directories
+  // of the refreshes not started yet, counted by the semaphore eventfd
+  std::deque<std::string> queued_status_refreshes_;
+  SharedFD status_refresh_event_;
+
+  // nullopt if the topology of the host could not be read
+  std::optional<CpuPlacementAllocator> cpu_placement_;
 };
 
 }  // namespace cuttlefish
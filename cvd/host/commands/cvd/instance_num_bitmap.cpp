@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/instance_num_bitmap.h"
+
+#include <sys/file.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstring>
+
+#include <android-base/logging.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "host/commands/cvd/lock_file.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr std::uint32_t kMagic = 0x6376646e;  // "cvdn"
+constexpr std::uint32_t kVersion = 1;
+constexpr size_t kNotFound = InstanceNumBitmap::kNumSlots;
+
+// The first number at or after `from` in `nums`, or kNotFound
+size_t NextSet(const InstanceNumBitmap::Words& nums, const size_t from) {
+  if (from >= InstanceNumBitmap::kNumSlots) {
+    return kNotFound;
+  }
+  size_t word_index = from / 64;
+  std::uint64_t word = nums[word_index] & (~0ULL << (from % 64));
+  while (word == 0) {
+    if (++word_index == InstanceNumBitmap::kNumWords) {
+      return kNotFound;
+    }
+    word = nums[word_index];
+  }
+  return word_index * 64 + __builtin_ctzll(word);
+}
+
+InstanceNumBitmap::Words Complement(const InstanceNumBitmap::Words& nums) {
+  InstanceNumBitmap::Words complement;
+  for (int i = 0; i < InstanceNumBitmap::kNumWords; i++) {
+    complement[i] = ~nums[i];
+  }
+  return complement;
+}
+
+std::int64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace
+
+struct InstanceNumBitmap::State {
+  std::uint32_t magic;
+  std::uint32_t version;
+  Words claimed;
+  SlotInfo slots[kNumSlots];
+};
+
+InstanceNumBitmap::InstanceNumBitmap(SharedFD fd)
+    : fd_(std::move(fd)), state_(std::make_unique<State>()) {}
+
+InstanceNumBitmap::~InstanceNumBitmap() = default;
+
+Result<std::unique_ptr<InstanceNumBitmap>> InstanceNumBitmap::Open(
+    const std::string& path) {
+  auto fd = CF_EXPECT(cvd_impl::LockFileManager::OpenLockFile(path));
+  return std::unique_ptr<InstanceNumBitmap>(
+      new InstanceNumBitmap(std::move(fd)));
+}
+
+Result<void> InstanceNumBitmap::ReadState() {
+  CF_EXPECTF(fd_->LSeek(0, SEEK_SET) == 0, "lseek failed: {}",
+             fd_->StrError());
+  auto& state = *state_;
+  const auto read =
+      ReadExact(fd_, reinterpret_cast<char*>(&state), sizeof(State));
+  CF_EXPECTF(read >= 0, "read failed: {}", fd_->StrError());
+  if (read != sizeof(State) || state.magic != kMagic ||
+      state.version != kVersion) {
+    // The bits are only hints, the lock files will tell which are claimed
+    std::memset(&state, 0, sizeof(State));
+    state.magic = kMagic;
+    state.version = kVersion;
+  }
+  return {};
+}
+
+// Never shrinks the file, in case a larger version of it is in use
+Result<void> InstanceNumBitmap::WriteState() {
+  CF_EXPECTF(fd_->LSeek(0, SEEK_SET) == 0, "lseek failed: {}",
+             fd_->StrError());
+  const auto written =
+      WriteAll(fd_, reinterpret_cast<const char*>(state_.get()), sizeof(State));
+  CF_EXPECTF(written == sizeof(State), "write failed: {}", fd_->StrError());
+  return {};
+}
+
+Result<InstanceNumBitmap::Locked> InstanceNumBitmap::Lock() {
+  Locked locked(*this);
+  CF_EXPECT(fd_->Flock(LOCK_EX));
+  // unlocked by the destructor of `locked` on failure
+  CF_EXPECT(ReadState());
+  return locked;
+}
+
+InstanceNumBitmap::Words InstanceNumBitmap::ToWords(
+    const std::set<int>& nums) {
+  Words words{};
+  for (const auto num : nums) {
+    if (num > 0 && num < kNumSlots) {
+      words[num / 64] |= 1ULL << (num % 64);
+    }
+  }
+  return words;
+}
+
+std::optional<int> InstanceNumBitmap::FindRange(
+    const size_t count, const Words& nums,
+    const std::optional<int> preferred_first) {
+  if (count == 0) {
+    return std::nullopt;
+  }
+  const auto gaps = Complement(nums);
+  if (preferred_first && *preferred_first > 0) {
+    const size_t first = *preferred_first;
+    if (NextSet(nums, first) == first &&
+        NextSet(gaps, first) - first >= count) {
+      return preferred_first;
+    }
+  }
+  // one step per run of free numbers, rather than per number
+  size_t from = 0;
+  while (true) {
+    const auto first = NextSet(nums, from);
+    if (first == kNotFound) {
+      return std::nullopt;
+    }
+    const auto end = NextSet(gaps, first);
+    if (end - first >= count) {
+      return static_cast<int>(first);
+    }
+    from = end;
+  }
+}
+
+InstanceNumBitmap::Locked::Locked(InstanceNumBitmap& bitmap)
+    : bitmap_(&bitmap), thread_lock_(bitmap.mutex_) {}
+
+InstanceNumBitmap::Locked::~Locked() {
+  if (!thread_lock_.owns_lock()) {
+    return;
+  }
+  if (dirty_) {
+    auto write_result = bitmap_->WriteState();
+    if (!write_result.ok()) {
+      LOG(ERROR) << "Failed to save the claimed instance numbers: "
+                 << write_result.error().FormatForEnv();
+    }
+  }
+  auto unlock_result = bitmap_->fd_->Flock(LOCK_UN);
+  if (!unlock_result.ok()) {
+    LOG(ERROR) << unlock_result.error().FormatForEnv();
+  }
+}
+
+bool InstanceNumBitmap::Locked::IsClaimed(const int num) const {
+  const auto& claimed = bitmap_->state_->claimed;
+  return (claimed[num / 64] >> (num % 64)) & 1;
+}
+
+const InstanceNumBitmap::SlotInfo& InstanceNumBitmap::Locked::Info(
+    const int num) const {
+  return bitmap_->state_->slots[num];
+}
+
+std::vector<int> InstanceNumBitmap::Locked::ClaimedNums() const {
+  const auto& claimed = bitmap_->state_->claimed;
+  std::vector<int> nums;
+  for (auto num = NextSet(claimed, 0); num != kNotFound;
+       num = NextSet(claimed, num + 1)) {
+    nums.push_back(num);
+  }
+  return nums;
+}
+
+void InstanceNumBitmap::Locked::Claim(const int num, const bool provisional) {
+  auto& state = *bitmap_->state_;
+  dirty_ = true;
+  state.claimed[num / 64] |= 1ULL << (num % 64);
+  state.slots[num] = SlotInfo{
+      .owner = getpid(),
+      .provisional = provisional,
+      .claimed_at_ms = NowMs(),
+  };
+}
+
+void InstanceNumBitmap::Locked::Release(const int num) {
+  auto& state = *bitmap_->state_;
+  dirty_ = true;
+  state.claimed[num / 64] &= ~(1ULL << (num % 64));
+  state.slots[num] = SlotInfo{};
+}
+
+std::optional<int> InstanceNumBitmap::Locked::FindRange(
+    const size_t count, const Words& candidates,
+    const std::optional<int> preferred_first) const {
+  const auto& claimed = bitmap_->state_->claimed;
+  Words free;
+  for (int i = 0; i < kNumWords; i++) {
+    free[i] = candidates[i] & ~claimed[i];
+  }
+  return InstanceNumBitmap::FindRange(count, free, preferred_first);
+}
+
+}  // namespace cuttlefish
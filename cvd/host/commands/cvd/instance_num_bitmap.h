@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * Which instance numbers are taken, host-wide, in one small state file
+ * shared by all the cvd servers: a bitmap of the claimed numbers, and who
+ * claimed them.
+ *
+ * It spares the allocation from opening and flock-ing the lock file of every
+ * candidate number. The per-instance lock files stay the source of truth,
+ * e.g. for the older cvd versions that do not know this file: a claimed bit
+ * may be stale, and a free one may be wrong, so the allocator double-checks
+ * the lock files of the numbers it picks, and resynchronizes the bits from
+ * them when it runs out.
+ *
+ * Any local user may write or truncate the file, so it is read and written
+ * while locked rather than mapped: a mapping would fault once the file
+ * shrinks. A short file, or one of another version, reads as no number
+ * claimed.
+ */
+class InstanceNumBitmap {
+ public:
+  // instance numbers are 1 to kNumSlots - 1
+  static constexpr int kNumSlots = 1024;
+  static constexpr int kNumWords = kNumSlots / 64;
+  // a set of instance numbers, bit n of word n / 64 for n
+  using Words = std::array<std::uint64_t, kNumWords>;
+
+  struct SlotInfo {
+    pid_t owner;
+    // claimed by an allocation that did not mark the instance in use yet
+    std::uint32_t provisional;
+    // CLOCK_REALTIME
+    std::int64_t claimed_at_ms;
+  };
+
+  // The state file, locked for the calling thread and the other processes.
+  // The changes are written back when it is unlocked.
+  class Locked {
+   public:
+    Locked(Locked&&) = default;
+    ~Locked();
+
+    bool IsClaimed(int num) const;
+    const SlotInfo& Info(int num) const;
+    std::vector<int> ClaimedNums() const;
+    void Claim(int num, bool provisional);
+    void Release(int num);
+
+    /*
+     * The first of `count` consecutive numbers that are in `candidates` and
+     * not claimed. `preferred_first` is taken if that range is free.
+     */
+    std::optional<int> FindRange(size_t count, const Words& candidates,
+                                 std::optional<int> preferred_first) const;
+
+   private:
+    friend class InstanceNumBitmap;
+    Locked(InstanceNumBitmap& bitmap);
+
+    InstanceNumBitmap* bitmap_;
+    std::unique_lock<std::mutex> thread_lock_;
+    bool dirty_ = false;
+  };
+
+  static Result<std::unique_ptr<InstanceNumBitmap>> Open(
+      const std::string& path);
+  ~InstanceNumBitmap();
+
+  Result<Locked> Lock();
+
+  static Words ToWords(const std::set<int>& nums);
+  // The first of `count` consecutive numbers in `nums`
+  static std::optional<int> FindRange(size_t count, const Words& nums,
+                                      std::optional<int> preferred_first);
+
+ private:
+  struct State;
+
+  InstanceNumBitmap(SharedFD fd);
+
+  Result<void> ReadState();
+  Result<void> WriteState();
+
+  SharedFD fd_;
+  // flock does not exclude the threads sharing the fd
+  std::mutex mutex_;
+  // the contents of the file while it is locked, guarded by mutex_
+  std::unique_ptr<State> state_;
+};
+
+}  // namespace cuttlefish
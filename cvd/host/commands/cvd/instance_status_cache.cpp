@@ -0,0 +1,214 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/instance_status_cache.h"
+
+#include <sys/inotify.h>
+
+#include <set>
+
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+#include "common/libs/utils/contains.h"
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/inotify.h"
+
+namespace cuttlefish {
+namespace {
+
+// The HOME directory may be shared with unrelated files
+constexpr uint32_t kHomeDirMask =
+    IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO;
+// Appends to kernel.log, launcher.log etc. don't change the status, so
+// IN_MODIFY is left out and log files are skipped on IN_CLOSE_WRITE
+constexpr uint32_t kRuntimeDirMask =
+    IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_TO;
+
+bool IsCuttlefishFile(const std::string& name) {
+  return android::base::StartsWith(name, "cuttlefish") ||
+         android::base::StartsWith(name, ".cuttlefish");
+}
+
+bool IsLogFile(const std::string& name) {
+  return android::base::EndsWith(name, ".log") || name == "logcat";
+}
+
+std::string RuntimeDir(const std::string& home_dir, const unsigned id) {
+  return home_dir + "/cuttlefish_runtime." + std::to_string(id);
+}
+
+}  // namespace
+
+InstanceStatusCache::InstanceStatusCache()
+    : inotify_fd_(SharedFD::Inotify(IN_NONBLOCK)) {
+  if (!inotify_fd_->IsOpen()) {
+    LOG(ERROR) << "Failed to create the inotify fd for the status cache: "
+               << inotify_fd_->StrError();
+  }
+}
+
+Result<void> InstanceStatusCache::Watch(
+    const std::string& home_dir, const std::vector<unsigned>& instance_ids) {
+  CF_EXPECT(inotify_fd_->IsOpen(), inotify_fd_->StrError());
+  std::lock_guard lock(mutex_);
+  auto& group = groups_[home_dir];
+  group.instance_ids = instance_ids;
+  WatchDirsLocked(home_dir);
+  return {};
+}
+
+void InstanceStatusCache::AddWatchLocked(const std::string& home_dir,
+                                         const std::string& path) {
+  const auto mask = (path == home_dir) ? kHomeDirMask : kRuntimeDirMask;
+  // Watching the same inode twice returns the same watch descriptor
+  auto wd = inotify_fd_->InotifyAddWatch(path, mask);
+  if (wd < 0) {
+    LOG(DEBUG) << "Failed to watch \"" << path
+               << "\": " << inotify_fd_->StrError();
+    return;
+  }
+  watches_[wd] = WatchTarget{
+      .home_dir = home_dir,
+      .is_home_dir = (path == home_dir),
+  };
+}
+
+void InstanceStatusCache::WatchDirsLocked(const std::string& home_dir) {
+  // Nothing may exist yet when the group is registered before the launch.
+  if (DirectoryExists(home_dir)) {
+    AddWatchLocked(home_dir, home_dir);
+  }
+  for (const auto id : groups_[home_dir].instance_ids) {
+    const auto runtime_dir = RuntimeDir(home_dir, id);
+    if (DirectoryExists(runtime_dir)) {
+      AddWatchLocked(home_dir, runtime_dir);
+    }
+  }
+}
+
+void InstanceStatusCache::Forget(const std::string& home_dir) {
+  std::lock_guard lock(mutex_);
+  for (auto it = watches_.begin(); it != watches_.end();) {
+    if (it->second.home_dir != home_dir) {
+      it++;
+      continue;
+    }
+    inotify_fd_->InotifyRmWatch(it->first);
+    it = watches_.erase(it);
+  }
+  groups_.erase(home_dir);
+}
+
+void InstanceStatusCache::Clear() {
+  std::lock_guard lock(mutex_);
+  for (const auto& [wd, _] : watches_) {
+    inotify_fd_->InotifyRmWatch(wd);
+  }
+  watches_.clear();
+  groups_.clear();
+}
+
+void InstanceStatusCache::Invalidate(const std::string& home_dir) {
+  std::lock_guard lock(mutex_);
+  InvalidateLocked(home_dir, Clock::now());
+}
+
+void InstanceStatusCache::InvalidateLocked(const std::string& home_dir,
+                                           Clock::time_point when) {
+  auto it = groups_.find(home_dir);
+  if (it == groups_.end() || !it->second.record) {
+    return;
+  }
+  auto& record = *it->second.record;
+  if (!record.stale_since) {
+    record.stale_since = when;
+  }
+}
+
+void InstanceStatusCache::Update(const std::string& home_dir,
+                                 Json::Value instances,
+                                 Clock::time_point started_at) {
+  std::lock_guard lock(mutex_);
+  auto it = groups_.find(home_dir);
+  if (it == groups_.end()) {
+    // removed while the status was being collected
+    return;
+  }
+  std::optional<Clock::time_point> stale_since;
+  if (it->second.record && it->second.record->stale_since &&
+      *it->second.record->stale_since > started_at) {
+    // changed again while the status binary was running
+    stale_since = it->second.record->stale_since;
+  }
+  // picks up directories created since Watch()
+  WatchDirsLocked(home_dir);
+  it->second.record = Record{
+      .instances = std::move(instances),
+      .updated_at = started_at,
+      .stale_since = stale_since,
+  };
+}
+
+std::optional<InstanceStatusCache::Record> InstanceStatusCache::Get(
+    const std::string& home_dir) const {
+  std::lock_guard lock(mutex_);
+  auto it = groups_.find(home_dir);
+  if (it == groups_.end()) {
+    return std::nullopt;
+  }
+  return it->second.record;
+}
+
+std::vector<std::string> InstanceStatusCache::HandleInotifyEvents() {
+  auto events = GetEventsFromInotifyFd(inotify_fd_);
+  const auto now = Clock::now();
+
+  std::lock_guard lock(mutex_);
+  std::set<std::string> affected_homes;
+  for (const auto& event : events) {
+    auto it = watches_.find(event.wd);
+    if (it == watches_.end()) {
+      continue;
+    }
+    const auto [home_dir, is_home_dir] = it->second;
+    if (event.mask & IN_IGNORED) {
+      // the watched directory went away
+      watches_.erase(it);
+      affected_homes.insert(home_dir);
+      continue;
+    }
+    if (is_home_dir && !IsCuttlefishFile(event.name)) {
+      continue;
+    }
+    if (!is_home_dir && (event.mask & IN_CLOSE_WRITE) &&
+        IsLogFile(event.name)) {
+      continue;
+    }
+    if (is_home_dir && (event.mask & (IN_CREATE | IN_MOVED_TO)) &&
+        android::base::StartsWith(event.name, "cuttlefish_runtime.")) {
+      WatchDirsLocked(home_dir);
+    }
+    affected_homes.insert(home_dir);
+  }
+  for (const auto& home_dir : affected_homes) {
+    InvalidateLocked(home_dir, now);
+  }
+  return std::vector<std::string>(affected_homes.begin(),
+                                  affected_homes.end());
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <json/json.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * Remembers the last status reported by the status binary of each instance
+ * group, so that "cvd fleet --cached" does not need to run it again.
+ *
+ * The groups are keyed by their HOME directory. A record turns stale when
+ * inotify reports a change in the HOME directory (e.g. the cuttlefish config)
+ * or a file created, replaced or removed in one of the per-instance runtime
+ * directories, or when the server explicitly invalidates it after a lifecycle
+ * operation. Appends to the logs are not changes.
+ *
+ * The owner is expected to monitor InotifyFd() and call HandleInotifyEvents()
+ * when it becomes readable.
+ */
+class InstanceStatusCache {
+ public:
+  using Clock = std::chrono::system_clock;
+
+  struct Record {
+    // per-instance status json objects, as in "cvd fleet"
+    Json::Value instances;
+    Clock::time_point updated_at;
+    // the first change observed after updated_at, if any
+    std::optional<Clock::time_point> stale_since;
+    bool IsStale() const { return stale_since.has_value(); }
+  };
+
+  InstanceStatusCache();
+
+  SharedFD InotifyFd() const { return inotify_fd_; }
+
+  Result<void> Watch(const std::string& home_dir,
+                     const std::vector<unsigned>& instance_ids);
+  void Forget(const std::string& home_dir);
+  void Clear();
+
+  void Invalidate(const std::string& home_dir);
+  void Update(const std::string& home_dir, Json::Value instances,
+              Clock::time_point started_at);
+  std::optional<Record> Get(const std::string& home_dir) const;
+
+  // Returns the HOME directories of the groups whose records became stale
+  std::vector<std::string> HandleInotifyEvents();
+
+ private:
+  struct WatchedGroup {
+    std::vector<unsigned> instance_ids;
+    std::optional<Record> record;
+  };
+  struct WatchTarget {
+    std::string home_dir;
+    bool is_home_dir;
+  };
+
+  void AddWatchLocked(const std::string& home_dir, const std::string& path);
+  void WatchDirsLocked(const std::string& home_dir);
+  void InvalidateLocked(const std::string& home_dir, Clock::time_point when);
+
+  SharedFD inotify_fd_;
+  mutable std::mutex mutex_;
+  std::unordered_map<std::string, WatchedGroup> groups_;
+  // indexed by the inotify watch descriptor
+  std::unordered_map<int, WatchTarget> watches_;
+};
+
+}  // namespace cuttlefish
@@ -0,0 +1,234 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/log_follower.h"
+
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/inotify.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr size_t kReadBufferSize = 64 * 1024;
+
+// Changes in a directory that may bring the followed file into existence
+constexpr uint32_t kAncestorMask = IN_CREATE | IN_MOVED_TO | IN_ATTRIB;
+/*
+ * The file may also be removed, or the parent itself replaced. IN_DELETE_SELF
+ * is delayed while the old file is open, but IN_DELETE of the file isn't.
+ */
+constexpr uint32_t kParentMask = kAncestorMask | IN_DELETE | IN_MOVED_FROM |
+                                 IN_DELETE_SELF | IN_MOVE_SELF;
+// Bounds the dangling symlinks followed, in case they form a loop
+constexpr int kMaxSymlinks = 8;
+
+}  // namespace
+
+Result<LogFollower> LogFollower::Create(const std::string& path) {
+  auto inotify_fd = SharedFD::Inotify(IN_NONBLOCK);
+  CF_EXPECT(inotify_fd->IsOpen(), inotify_fd->StrError());
+  LogFollower follower(path, inotify_fd);
+  CF_EXPECT(follower.Arm());
+  return follower;
+}
+
+LogFollower::LogFollower(const std::string& path, SharedFD inotify_fd)
+    : path_(path), inotify_fd_(inotify_fd), buffer_(kReadBufferSize) {}
+
+/*
+ * Watches the directories, then opens the file if it exists. The watches are
+ * added first so that a file created in between is not missed.
+ */
+Result<void> LogFollower::Arm() {
+  CF_EXPECT(WatchDirectories());
+  auto file = CF_EXPECT(OpenIfReplaced());
+  if (file->IsOpen()) {
+    CF_EXPECT(Follow(file));
+  }
+  return {};
+}
+
+/*
+ * Watches the parent directory, for the file being created or replaced, and
+ * the grandparent, for the parent being replaced or repointed when it is a
+ * symlink. Until the parent exists, the closest existing ancestor is watched
+ * instead.
+ *
+ * Watching a directory again only updates the existing watch.
+ */
+Result<void> LogFollower::WatchDirectories() {
+  const auto parent = cpp_dirname(path_);
+  if (DirectoryExists(parent)) {
+    CF_EXPECT(inotify_fd_->InotifyAddWatch(parent, kParentMask) >= 0,
+              "Failed to watch \"" << parent
+                                   << "\": " << inotify_fd_->StrError());
+    CF_EXPECT(WatchClosestAncestor(cpp_dirname(parent), kMaxSymlinks));
+  } else {
+    CF_EXPECT(WatchClosestAncestor(parent, kMaxSymlinks));
+  }
+  return {};
+}
+
+/*
+ * Missing directories may be reached through a dangling symlink, e.g. a
+ * cuttlefish_runtime pointing to a runtime directory that was cleaned up.
+ * The place its target would be created in is watched as well.
+ */
+Result<void> LogFollower::WatchClosestAncestor(std::string dir,
+                                               int max_symlinks) {
+  while (!DirectoryExists(dir) && dir != "/" && dir != ".") {
+    std::string target;
+    if (max_symlinks > 0 && android::base::Readlink(dir, &target)) {
+      if (!android::base::StartsWith(target, "/")) {
+        target = cpp_dirname(dir) + "/" + target;
+      }
+      CF_EXPECT(WatchClosestAncestor(target, max_symlinks - 1));
+    }
+    dir = cpp_dirname(dir);
+  }
+  CF_EXPECT(inotify_fd_->InotifyAddWatch(dir, kAncestorMask) >= 0,
+            "Failed to watch \"" << dir << "\": " << inotify_fd_->StrError());
+  return {};
+}
+
+Result<SharedFD> LogFollower::OpenIfReplaced() {
+  auto file = SharedFD::Open(path_, O_RDONLY);
+  if (!file->IsOpen()) {
+    // removed, or not created yet
+    return SharedFD();
+  }
+  struct stat st;
+  CF_EXPECT(file->Fstat(&st) == 0,
+            "Failed to stat \"" << path_ << "\": " << file->StrError());
+  if (file_->IsOpen() && st.st_dev == file_dev_ && st.st_ino == file_ino_) {
+    return SharedFD();
+  }
+  return file;
+}
+
+Result<void> LogFollower::Follow(SharedFD file) {
+  struct stat st;
+  CF_EXPECT(file->Fstat(&st) == 0,
+            "Failed to stat \"" << path_ << "\": " << file->StrError());
+  // The new watch is added first, as it may get the old descriptor back if
+  // the old file is the same inode after all
+  const int wd = inotify_fd_->InotifyAddWatch(path_, IN_MODIFY);
+  CF_EXPECT(wd >= 0, "Failed to watch \"" << path_
+                                          << "\": " << inotify_fd_->StrError());
+  if (file_wd_ >= 0 && file_wd_ != wd) {
+    // fails harmlessly if the old file is already gone
+    inotify_fd_->InotifyRmWatch(file_wd_);
+  }
+  file_ = file;
+  file_wd_ = wd;
+  file_dev_ = st.st_dev;
+  file_ino_ = st.st_ino;
+  offset_ = 0;
+  partial_line_.clear();
+  return {};
+}
+
+Result<std::vector<std::string>> LogFollower::ReadNewLines() {
+  const auto events = GetEventsFromInotifyFd(inotify_fd_);
+  // Events from the directories mean the file may have been replaced
+  const bool maybe_replaced =
+      !file_->IsOpen() ||
+      std::any_of(events.begin(), events.end(),
+                  [this](const InotifyEvent& event) {
+                    return event.wd != file_wd_;
+                  });
+  SharedFD replacement;
+  if (maybe_replaced) {
+    CF_EXPECT(WatchDirectories());
+    replacement = CF_EXPECT(OpenIfReplaced());
+  }
+  std::vector<std::string> lines;
+  if (file_->IsOpen()) {
+    // what was appended to the old file before it was replaced
+    CF_EXPECT(ReadLines(lines));
+  }
+  if (replacement->IsOpen()) {
+    CF_EXPECT(Follow(replacement));
+    CF_EXPECT(ReadLines(lines));
+  }
+  return lines;
+}
+
+Result<void> LogFollower::ReadLines(std::vector<std::string>& lines) {
+  struct stat st;
+  CF_EXPECT(file_->Fstat(&st) == 0,
+            "Failed to stat \"" << path_ << "\": " << file_->StrError());
+  if (st.st_size < offset_) {
+    // truncated in place, e.g. by a relaunch writing to the same file
+    CF_EXPECT_EQ(file_->LSeek(0, SEEK_SET), 0, file_->StrError());
+    offset_ = 0;
+    partial_line_.clear();
+  }
+  while (true) {
+    auto n_read = file_->Read(buffer_.data(), buffer_.size());
+    CF_EXPECT(n_read >= 0, "Failed to read \"" << path_
+                                               << "\": " << file_->StrError());
+    if (n_read == 0) {
+      break;
+    }
+    offset_ += n_read;
+    auto begin = buffer_.begin();
+    const auto end = buffer_.begin() + n_read;
+    for (auto newline = std::find(begin, end, '\n'); newline != end;
+         newline = std::find(begin, end, '\n')) {
+      partial_line_.append(begin, newline);
+      lines.emplace_back(std::move(partial_line_));
+      partial_line_.clear();
+      begin = newline + 1;
+    }
+    partial_line_.append(begin, end);
+  }
+  return {};
+}
+
+Result<bool> LogFollower::WaitForChange(SharedFD interrupt) {
+  std::vector<PollSharedFd> fds = {
+      {.fd = inotify_fd_, .events = POLLIN, .revents = 0},
+      {.fd = interrupt, .events = POLLIN, .revents = 0},
+  };
+  int ret = SharedFD::Poll(fds, -1);
+  CF_EXPECT(ret > 0, "poll failed: " << strerror(errno));
+  return (fds[1].revents & POLLIN) == 0;
+}
+
+LiteralMatcher::LiteralMatcher(const std::string& literal)
+    : literal_(std::make_shared<const std::string>(literal)),
+      searcher_(literal_->cbegin(), literal_->cend()) {}
+
+std::string::size_type LiteralMatcher::MatchEnd(const std::string& line) const {
+  auto it = std::search(line.cbegin(), line.cend(), searcher_);
+  if (it == line.cend()) {
+    return std::string::npos;
+  }
+  return (it - line.cbegin()) + literal_->size();
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/**
+ * Reads a growing log file incrementally, from the beginning, one complete
+ * line at a time.
+ *
+ * Instead of polling, it sleeps on an inotify fd that becomes readable when
+ * the file is written to. The file, and even its directory, does not need to
+ * exist yet: the closest existing ancestor directory is watched until the
+ * file shows up.
+ *
+ * The file is followed by path. When another file takes its place, e.g. when
+ * a relaunch cleans the runtime directory or repoints cuttlefish_runtime, the
+ * rest of the old file is read and the new one is followed from its start.
+ */
+class LogFollower {
+ public:
+  static Result<LogFollower> Create(const std::string& path);
+
+  const std::string& Path() const { return path_; }
+  // Readable when there may be new lines. Callers may poll it themselves.
+  SharedFD WatchFd() const { return inotify_fd_; }
+
+  /*
+   * Consumes the pending inotify events, and returns the lines appended
+   * since the last call. A trailing line without '\n' is held back until it
+   * is completed.
+   */
+  Result<std::vector<std::string>> ReadNewLines();
+  // The end of the last line returned by ReadNewLines()
+  off_t ConsumedOffset() const { return offset_ - partial_line_.size(); }
+
+  /*
+   * Blocks until WatchFd() or `interrupt` is readable. Returns false if it
+   * was `interrupt`.
+   */
+  Result<bool> WaitForChange(SharedFD interrupt);
+
+ private:
+  LogFollower(const std::string& path, SharedFD inotify_fd);
+
+  Result<void> Arm();
+  Result<void> WatchDirectories();
+  Result<void> WatchClosestAncestor(std::string dir, int max_symlinks);
+  // The file now at the path, if it isn't the one being read
+  Result<SharedFD> OpenIfReplaced();
+  Result<void> Follow(SharedFD file);
+  Result<void> ReadLines(std::vector<std::string>& lines);
+
+  std::string path_;
+  SharedFD inotify_fd_;
+  SharedFD file_;
+  int file_wd_ = -1;
+  dev_t file_dev_ = 0;
+  ino_t file_ino_ = 0;
+  off_t offset_ = 0;
+  std::string partial_line_;
+  std::vector<char> buffer_;
+};
+
+/**
+ * Finds a fixed string in lines, with the search tables built only once.
+ *
+ * Copies share the literal, which the searcher refers to.
+ */
+class LiteralMatcher {
+ public:
+  LiteralMatcher(const std::string& literal);
+
+  const std::string& Literal() const { return *literal_; }
+  // Returns the position right after the match, or npos
+  std::string::size_type MatchEnd(const std::string& line) const;
+  bool Matches(const std::string& line) const {
+    return MatchEnd(line) != std::string::npos;
+  }
+
+ private:
+  std::shared_ptr<const std::string> literal_;
+  std::boyer_moore_horspool_searcher<std::string::const_iterator> searcher_;
+};
+
+}  // namespace cuttlefish
@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/log_tail_service.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+#include <algorithm>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/utils/files.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr size_t kReplayChunkSize = 64 * 1024;
+
+// The path a file resolves to, or will resolve to once created in an
+// existing directory
+std::string ResolvedPath(const std::string& path) {
+  std::string resolved;
+  if (android::base::Realpath(path, &resolved)) {
+    return resolved;
+  }
+  if (android::base::Realpath(cpp_dirname(path), &resolved)) {
+    return resolved + "/" + cpp_basename(path);
+  }
+  return path;
+}
+
+}  // namespace
+
+LogTailService::LogTailService() : wake_event_(SharedFD::Event()) {
+  auto epoll = Epoll::Create();
+  if (!epoll.ok()) {
+    // Subscribe fails on an invalid instance
+    LOG(ERROR) << "Failed to create the log tail epoll: "
+               << epoll.error().FormatForEnv();
+    return;
+  }
+  epoll_ = std::move(*epoll);
+  auto added = epoll_.Add(wake_event_, EPOLLIN);
+  if (!added.ok()) {
+    LOG(ERROR) << "Failed to watch the log tail wake event: "
+               << added.error().FormatForEnv();
+    return;
+  }
+  thread_ = std::thread([this]() { Run(); });
+}
+
+LogTailService::~LogTailService() {
+  if (thread_.joinable()) {
+    {
+      std::lock_guard files_lock(files_mutex_);
+      stopping_ = true;
+      wake_event_->EventfdWrite(1);
+    }
+    thread_.join();
+  }
+}
+
+Result<LogTailService::SubscriptionId> LogTailService::Subscribe(
+    const std::string& path, const std::vector<std::string>& patterns,
+    LogTailCallback callback) {
+  auto subscriber = std::make_shared<Subscriber>();
+  for (const auto& pattern : patterns) {
+    subscriber->matchers.emplace_back(pattern);
+  }
+  subscriber->callback = std::move(callback);
+
+  const auto key = ResolvedPath(path);
+  std::shared_ptr<TailedFile> file;
+  SubscriptionId id;
+  off_t replay_end;
+  {
+    std::lock_guard files_lock(files_mutex_);
+    std::unique_lock<std::mutex> file_lock;
+    auto it = files_.find(key);
+    if (it != files_.end()) {
+      auto existing = it->second;
+      file_lock = std::unique_lock(existing->mutex);
+      if (existing->closed) {
+        // failed, and not removed yet
+        file_lock.unlock();
+        RemoveLocked(existing);
+      } else {
+        file = existing;
+      }
+    }
+    if (!file) {
+      file = std::make_shared<TailedFile>(
+          key, CF_EXPECT(LogFollower::Create(path)));
+      CF_EXPECT(epoll_.Add(file->follower.WatchFd(), EPOLLIN));
+      files_[key] = file;
+      watched_files_[file->follower.WatchFd()] = file;
+      // An existing file has no inotify events until it is written to
+      unread_files_.push_back(file);
+      wake_event_->EventfdWrite(1);
+      file_lock = std::unique_lock(file->mutex);
+    }
+    // Holding the file lock, every line after the replayed ones is queued
+    replay_end = file->follower.ConsumedOffset();
+    if (replay_end > 0) {
+      subscriber->pending_lines.emplace();
+    }
+    id = next_id_++;
+    subscriptions_[id] = file;
+    file->subscribers[id] = subscriber;
+  }
+  if (replay_end == 0) {
+    return id;
+  }
+  // Replayed unlocked, as the start of a large log takes a while
+  auto replayed = Replay(file->follower.Path(), replay_end, *subscriber);
+  if (!replayed.ok()) {
+    Unsubscribe(id);
+    CF_EXPECT(std::move(replayed));
+  }
+  std::lock_guard file_lock(file->mutex);
+  for (const auto& line : *subscriber->pending_lines) {
+    Dispatch(file->follower.Path(), line, *subscriber);
+  }
+  subscriber->pending_lines.reset();
+  if (subscriber->pending_error) {
+    DispatchError(file->follower.Path(), *subscriber->pending_error,
+                  *subscriber);
+  }
+  return id;
+}
+
+void LogTailService::Unsubscribe(SubscriptionId id) {
+  std::lock_guard files_lock(files_mutex_);
+  auto it = subscriptions_.find(id);
+  if (it == subscriptions_.end()) {
+    return;
+  }
+  auto file = it->second;
+  subscriptions_.erase(it);
+  std::lock_guard file_lock(file->mutex);
+  file->subscribers.erase(id);
+  if (!file->subscribers.empty() || file->closed) {
+    return;
+  }
+  // The last subscriber is gone, so stop reading the file
+  file->closed = true;
+  RemoveLocked(file);
+}
+
+void LogTailService::RemoveLocked(const std::shared_ptr<TailedFile>& file) {
+  auto it = files_.find(file->key);
+  if (it != files_.end() && it->second == file) {
+    files_.erase(it);
+  }
+  watched_files_.erase(file->follower.WatchFd());
+  auto deleted = epoll_.Delete(file->follower.WatchFd());
+  if (!deleted.ok()) {
+    LOG(DEBUG) << deleted.error().FormatForEnv();
+  }
+}
+
+void LogTailService::Run() {
+  while (true) {
+    auto event = epoll_.Wait();
+    if (!event.ok()) {
+      LOG(ERROR) << "Stopped following the logs: "
+                 << event.error().FormatForEnv();
+      return;
+    }
+    if (!event->has_value()) {
+      continue;
+    }
+    std::vector<std::shared_ptr<TailedFile>> files;
+    {
+      std::lock_guard files_lock(files_mutex_);
+      if ((*event)->fd == wake_event_) {
+        eventfd_t unused;
+        wake_event_->EventfdRead(&unused);
+        if (stopping_) {
+          return;
+        }
+        files.swap(unread_files_);
+      } else {
+        auto it = watched_files_.find((*event)->fd);
+        if (it == watched_files_.end()) {
+          // removed since epoll returned it
+          continue;
+        }
+        files.push_back(it->second);
+      }
+    }
+    for (const auto& file : files) {
+      HandleEvent(file);
+    }
+  }
+}
+
+void LogTailService::HandleEvent(std::shared_ptr<TailedFile> file) {
+  {
+    std::lock_guard file_lock(file->mutex);
+    if (file->closed) {
+      return;
+    }
+    const auto& path = file->follower.Path();
+    auto lines = file->follower.ReadNewLines();
+    if (lines.ok()) {
+      for (const auto& [_, subscriber] : file->subscribers) {
+        for (const auto& line : *lines) {
+          if (subscriber->pending_lines) {
+            subscriber->pending_lines->push_back(line);
+          } else {
+            Dispatch(path, line, *subscriber);
+          }
+        }
+      }
+      return;
+    }
+    LOG(ERROR) << "Stopped following \"" << path
+               << "\": " << lines.error().FormatForEnv();
+    // The subscribers learn that no more lines will come
+    const auto error = lines.error().Message();
+    for (const auto& [_, subscriber] : file->subscribers) {
+      if (subscriber->pending_lines) {
+        subscriber->pending_error = error;
+      } else {
+        DispatchError(path, error, *subscriber);
+      }
+    }
+    file->closed = true;
+  }
+  // A new subscriber of the path gets a new follower
+  std::lock_guard files_lock(files_mutex_);
+  RemoveLocked(file);
+}
+
+void LogTailService::Dispatch(const std::string& path,
+                              const std::string& line,
+                              const Subscriber& subscriber) {
+  if (subscriber.matchers.empty()) {
+    subscriber.callback(LogTailEvent{.path = path,
+                                     .line = line,
+                                     .pattern_index = std::nullopt,
+                                     .match_end = 0});
+    return;
+  }
+  for (size_t i = 0; i < subscriber.matchers.size(); i++) {
+    auto match_end = subscriber.matchers[i].MatchEnd(line);
+    if (match_end == std::string::npos) {
+      continue;
+    }
+    subscriber.callback(LogTailEvent{.path = path,
+                                     .line = line,
+                                     .pattern_index = i,
+                                     .match_end = match_end});
+    return;
+  }
+}
+
+void LogTailService::DispatchError(const std::string& path,
+                                   const std::string& error,
+                                   const Subscriber& subscriber) {
+  const std::string line;
+  subscriber.callback(LogTailEvent{.path = path,
+                                   .line = line,
+                                   .pattern_index = std::nullopt,
+                                   .match_end = 0,
+                                   .error = error});
+}
+
+Result<void> LogTailService::Replay(const std::string& path, const off_t end,
+                                    const Subscriber& subscriber) {
+  auto fd = SharedFD::Open(path, O_RDONLY);
+  CF_EXPECT(fd->IsOpen(),
+            "Failed to open \"" << path << "\": " << fd->StrError());
+  std::vector<char> buffer(kReplayChunkSize);
+  std::string line;
+  off_t offset = 0;
+  while (offset < end) {
+    const auto to_read = std::min<off_t>(buffer.size(), end - offset);
+    auto n_read = fd->Read(buffer.data(), to_read);
+    CF_EXPECT(n_read >= 0,
+              "Failed to read \"" << path << "\": " << fd->StrError());
+    if (n_read == 0) {
+      // truncated since, in which case the follower restarts
+      break;
+    }
+    offset += n_read;
+    auto begin = buffer.begin();
+    const auto chunk_end = buffer.begin() + n_read;
+    for (auto newline = std::find(begin, chunk_end, '\n');
+         newline != chunk_end; newline = std::find(begin, chunk_end, '\n')) {
+      line.append(begin, newline);
+      Dispatch(path, line, subscriber);
+      line.clear();
+      begin = newline + 1;
+    }
+    line.append(begin, chunk_end);
+  }
+  return {};
+}
+
+fruit::Component<LogTailService> LogTailServiceComponent() {
+  return fruit::createComponent();
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fruit/fruit.h>
+
+#include "common/libs/fs/epoll.h"
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+#include "host/commands/cvd/log_follower.h"
+
+namespace cuttlefish {
+
+struct LogTailEvent {
+  const std::string& path;
+  const std::string& line;
+  // index into the subscription's patterns, nullopt if it has no patterns
+  std::optional<size_t> pattern_index;
+  // the position right after the matched pattern in the line
+  std::string::size_type match_end;
+  // Set on the last event of a subscription, when the file can't be followed
+  // anymore. The line is empty then.
+  std::optional<std::string> error = std::nullopt;
+};
+
+using LogTailCallback = std::function<void(const LogTailEvent&)>;
+
+/**
+ * Follows log files on behalf of many subscribers, e.g. the boot detection
+ * of cvd start and "cvd logs --follow".
+ *
+ * Each file is read once, by one LogFollower shared by all its subscribers.
+ * Paths are told apart by the file they resolve to, so the subscribers of
+ * aliases such as cuttlefish_runtime/kernel.log and
+ * cuttlefish_runtime.1/kernel.log share the follower of the first one.
+ *
+ * The files are read on a thread of the service rather than on the EpollPool
+ * workers, as those block on requests waiting for these lines, e.g. the boot
+ * detection of cvd start. The callbacks are invoked on that thread for every
+ * complete line matching one of the subscription's patterns, or for every
+ * line if the subscription has no patterns. Callbacks must not block, nor
+ * call Subscribe or Unsubscribe.
+ */
+class LogTailService {
+ public:
+  using SubscriptionId = std::uint64_t;
+
+  INJECT(LogTailService());
+  ~LogTailService();
+
+  /*
+   * Delivers every line of the file from its beginning. The lines already
+   * read for earlier subscribers are replayed from the file, on the calling
+   * thread, before this returns. Other subscribers get new lines meanwhile.
+   */
+  Result<SubscriptionId> Subscribe(const std::string& path,
+                                   const std::vector<std::string>& patterns,
+                                   LogTailCallback callback);
+  // The callback is not invoked anymore once this returns.
+  void Unsubscribe(SubscriptionId id);
+
+ private:
+  struct Subscriber {
+    std::vector<LiteralMatcher> matchers;
+    LogTailCallback callback;
+    // Set while the start of the file is replayed, for the lines read
+    // meanwhile
+    std::optional<std::vector<std::string>> pending_lines;
+    std::optional<std::string> pending_error;
+  };
+  struct TailedFile {
+    TailedFile(std::string key, LogFollower follower)
+        : key(std::move(key)), follower(std::move(follower)) {}
+
+    const std::string key;
+    std::mutex mutex;
+    LogFollower follower;
+    std::map<SubscriptionId, std::shared_ptr<Subscriber>> subscribers;
+    bool closed = false;
+  };
+
+  void Run();
+  void HandleEvent(std::shared_ptr<TailedFile> file);
+  void RemoveLocked(const std::shared_ptr<TailedFile>& file);
+  static void Dispatch(const std::string& path, const std::string& line,
+                       const Subscriber& subscriber);
+  static void DispatchError(const std::string& path, const std::string& error,
+                            const Subscriber& subscriber);
+  static Result<void> Replay(const std::string& path, off_t end,
+                             const Subscriber& subscriber);
+
+  Epoll epoll_;
+  // Readable when there are unread_files_, or when stopping_
+  SharedFD wake_event_;
+  std::thread thread_;
+  std::mutex files_mutex_;
+  bool stopping_ = false;
+  std::vector<std::shared_ptr<TailedFile>> unread_files_;
+  // indexed by the path the files resolve to
+  std::map<std::string, std::shared_ptr<TailedFile>> files_;
+  // indexed by LogFollower::WatchFd()
+  std::map<SharedFD, std::shared_ptr<TailedFile>> watched_files_;
+  std::map<SubscriptionId, std::shared_ptr<TailedFile>> subscriptions_;
+  SubscriptionId next_id_ = 0;
+};
+
+fruit::Component<LogTailService> LogTailServiceComponent();
+
+}  // namespace cuttlefish
@@ -60,6 +60,22 @@ ServerLogger::ScopedLogger ServerLogger::LogThreadToFd(SharedFD target) {
   return ScopedLogger(*this, std::move(target), kCvdDefaultVerbosity);
 }
 
+std::optional<ServerLogger::ScopedLogger> ServerLogger::LogThreadLike(
+    std::thread::id thread) {
+  SharedFD target;
+  LogSeverity verbosity;
+  {
+    std::shared_lock lock(thread_loggers_lock_);
+    auto logger_it = thread_loggers_.find(thread);
+    if (logger_it == thread_loggers_.end()) {
+      return std::nullopt;
+    }
+    target = logger_it->second->target_;
+    verbosity = logger_it->second->verbosity_;
+  }
+  return ScopedLogger(*this, std::move(target), verbosity);
+}
+
 ServerLogger::ScopedLogger::ScopedLogger(
     ServerLogger& server_logger, SharedFD target,
     const android::base::LogSeverity verbosity)
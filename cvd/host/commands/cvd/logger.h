@@ -15,6 +15,7 @@
 
 #pragma once
 
+#include <optional>
 #include <shared_mutex>
 #include <string>
 #include <thread>
@@ -70,6 +71,11 @@ class ServerLogger {
    */
   ScopedLogger LogThreadToFd(SharedFD, const android::base::LogSeverity);
   ScopedLogger LogThreadToFd(SharedFD);
+  /**
+   * Sends the messages of the current thread where the messages of `thread`
+   * go, e.g. for a thread doing work on behalf of a request thread.
+   */
+  std::optional<ScopedLogger> LogThreadLike(std::thread::id thread);
 
  private:
   using LogSeverity = android::base::LogSeverity;
@@ -190,4 +190,26 @@ Result<std::vector<std::string>> ParseFetchCvdConfigs(
   return GenerateFetchFlags(root, target_directory, target_subdirectories);
 }
 
+Result<std::vector<std::vector<std::string>>> ParseFetchCvdConfigsPerInstance(
+    Json::Value& root, const std::string& target_directory,
+    const std::vector<std::string>& target_subdirectories) {
+  CF_EXPECT(InitFetchCvdConfigs(root));
+  const auto& instances = root["instances"];
+  CF_EXPECT_EQ(instances.size(), target_subdirectories.size(),
+               "Mismatched sizes between number of subdirectories and number "
+               "of instances");
+  std::vector<std::vector<std::string>> result;
+  for (int i = 0; i < instances.size(); i++) {
+    Json::Value single_instance_root(root);
+    single_instance_root["instances"] = Json::Value(Json::arrayValue);
+    single_instance_root["instances"].append(instances[i]);
+    auto flags = CF_EXPECT(GenerateFetchFlags(
+        single_instance_root, target_directory, {target_subdirectories[i]}));
+    if (!flags.empty()) {
+      result.emplace_back(std::move(flags));
+    }
+  }
+  return result;
+}
+
 }  // namespace cuttlefish
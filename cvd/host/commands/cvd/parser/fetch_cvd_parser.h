@@ -29,4 +29,12 @@ Result<std::vector<std::string>> ParseFetchCvdConfigs(
     Json::Value& root, const std::string& target_directory,
     const std::vector<std::string>& target_subdirectories);
 
+/*
+ * One set of fetch_cvd flags per instance that has anything to fetch, in
+ * the order of the instances, so that the fetches can run independently.
+ */
+Result<std::vector<std::vector<std::string>>> ParseFetchCvdConfigsPerInstance(
+    Json::Value& root, const std::string& target_directory,
+    const std::vector<std::string>& target_subdirectories);
+
 };  // namespace cuttlefish
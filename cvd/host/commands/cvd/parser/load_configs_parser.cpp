@@ -212,7 +212,7 @@ Result<CvdFlags> ParseCvdConfigs(Json::Value& root,
   CF_EXPECT(ValidateCfConfigs(root), "Loaded Json validation failed");
   return CvdFlags{.launch_cvd_flags = CF_EXPECT(ParseLaunchCvdConfigs(root)),
                   .selector_flags = CF_EXPECT(ParseSelectorConfigs(root)),
-                  .fetch_cvd_flags = CF_EXPECT(ParseFetchCvdConfigs(
+                  .fetch_cvd_flags = CF_EXPECT(ParseFetchCvdConfigsPerInstance(
                       root, load_directories.target_directory,
                       load_directories.target_subdirectories))};
 }
@@ -29,7 +29,8 @@ namespace cuttlefish {
 typedef struct _CvdFlags {
   std::vector<std::string> launch_cvd_flags;
   std::vector<std::string> selector_flags;
-  std::vector<std::string> fetch_cvd_flags;
+  // a fetch per instance, for the instances that need one
+  std::vector<std::vector<std::string>> fetch_cvd_flags;
 } CvdFlags;
 
 struct LoadDirectories {
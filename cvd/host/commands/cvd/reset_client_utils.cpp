@@ -17,13 +17,17 @@
 #include "host/commands/cvd/reset_client_utils.h"
 
 #include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <algorithm>
 #include <cctype>
+#include <condition_variable>
 #include <iomanip>   // std::setw
 #include <iostream>  // std::endl
 #include <regex>
 #include <sstream>
+#include <thread>
 #include <unordered_set>
 
 #include <android-base/file.h>
@@ -34,7 +38,9 @@
 #include "common/libs/utils/proc_file_utils.h"
 #include "common/libs/utils/subprocess.h"
 #include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/group_cgroup.h"
 #include "host/commands/cvd/reset_client_utils.h"
+#include "host/commands/cvd/server_constants.h"
 #include "host/libs/config/cuttlefish_config.h"
 
 namespace cuttlefish {
@@ -126,19 +132,138 @@ static Command CreateStopCvdCommand(const std::string& stopper_path,
   for (const auto& [key, value] : envs) {
     command.AddEnvironmentVariable(key, value);
   }
+  auto dev_null = SharedFD::Open("/dev/null", O_WRONLY);
+  if (dev_null->IsOpen()) {
+    command.RedirectStdIO(Subprocess::StdIOChannel::kStdOut, dev_null);
+    command.RedirectStdIO(Subprocess::StdIOChannel::kStdErr, dev_null);
+  }
   return command;
 }
 
-Result<RunCvdProcessManager> RunCvdProcessManager::Get() {
+/*
+ * Shared by the threads running stop_cvd for the groups. A watchdog thread
+ * kills the stop_cvd processes, with their subprocesses, that are still
+ * running at the deadline.
+ *
+ * stop_cvd is not reaped before it is removed from the running list, so the
+ * watchdog never signals a recycled pid.
+ */
+class StopCvdDeadline {
+ public:
+  StopCvdDeadline(std::chrono::steady_clock::time_point deadline)
+      : deadline_(deadline), watchdog_([this]() { Watch(); }) {}
+  ~StopCvdDeadline() {
+    {
+      std::lock_guard lock(mutex_);
+      finished_ = true;
+    }
+    cv_.notify_all();
+    watchdog_.join();
+  }
+
+  bool Expired() {
+    std::lock_guard lock(mutex_);
+    return expired_;
+  }
+
+  // Returns the exit code of the command
+  Result<int> Run(Command command) {
+    auto subprocess =
+        command.Start(SubprocessOptions().Verbose(false).InGroup(true));
+    CF_EXPECT(subprocess.Started(), "Failed to start " << command.Executable());
+    const auto pid = subprocess.pid();
+    {
+      std::lock_guard lock(mutex_);
+      if (expired_) {
+        killpg(pid, SIGKILL);
+      }
+      running_.insert(pid);
+    }
+    siginfo_t infop;
+    int wait_ret;
+    do {
+      wait_ret = subprocess.Wait(&infop, WEXITED | WNOWAIT);
+    } while (wait_ret < 0 && errno == EINTR);
+    bool killed = false;
+    {
+      std::lock_guard lock(mutex_);
+      running_.erase(pid);
+      killed = expired_ && infop.si_code == CLD_KILLED;
+    }
+    auto exit_code = subprocess.Wait();
+    CF_EXPECT(!killed, command.Executable() << " timed out");
+    return exit_code;
+  }
+
+ private:
+  void Watch() {
+    std::unique_lock lock(mutex_);
+    if (cv_.wait_until(lock, deadline_, [this]() { return finished_; })) {
+      return;
+    }
+    expired_ = true;
+    for (const auto pid : running_) {
+      LOG(ERROR) << "Killing stop_cvd #" << pid << " at the deadline";
+      killpg(pid, SIGKILL);
+    }
+  }
+
+  const std::chrono::steady_clock::time_point deadline_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::set<pid_t> running_;
+  bool expired_ = false;
+  bool finished_ = false;
+  std::thread watchdog_;
+};
+
+Result<RunCvdProcessManager> RunCvdProcessManager::Get(
+    const bool cvd_server_children_only) {
   RunCvdProcessManager run_cvd_processes_manager;
-  run_cvd_processes_manager.cf_groups_ =
-      CF_EXPECT(run_cvd_processes_manager.CollectInfo());
+  run_cvd_processes_manager.cf_groups_ = CF_EXPECT(
+      run_cvd_processes_manager.CollectInfo(cvd_server_children_only));
   return run_cvd_processes_manager;
 }
 
+/*
+ * The run_cvd processes of the groups the server launched are listed from
+ * their cgroups. /proc is only scanned for the processes the server did not
+ * start, or could not put in a cgroup.
+ */
+static Result<std::set<pid_t>> CollectRunCvdPids(
+    const bool cvd_server_children_only) {
+  std::set<pid_t> run_cvd_pids;
+  const auto cgroups = RecordedGroupCgroups();
+  bool needs_proc_scan = !cvd_server_children_only || cgroups.empty();
+  for (const auto& cgroup : cgroups) {
+    if (!cgroup.IsTracked()) {
+      needs_proc_scan = true;
+      continue;
+    }
+    auto pids = CgroupPids(cgroup);
+    if (!pids.ok()) {
+      LOG(ERROR) << pids.error().FormatForEnv();
+      needs_proc_scan = true;
+      continue;
+    }
+    for (const auto pid : *pids) {
+      auto exec_path = GetExecutablePath(pid);
+      if (exec_path.ok() && cpp_basename(*exec_path) == "run_cvd") {
+        run_cvd_pids.insert(pid);
+      }
+    }
+  }
+  if (needs_proc_scan) {
+    for (const auto pid : CF_EXPECT(CollectPidsByExecName("run_cvd"))) {
+      run_cvd_pids.insert(pid);
+    }
+  }
+  return run_cvd_pids;
+}
+
 Result<std::vector<RunCvdProcessManager::GroupProcInfo>>
-RunCvdProcessManager::CollectInfo() {
-  auto run_cvd_pids = CF_EXPECT(CollectPidsByExecName("run_cvd"));
+RunCvdProcessManager::CollectInfo(const bool cvd_server_children_only) {
+  auto run_cvd_pids = CF_EXPECT(CollectRunCvdPids(cvd_server_children_only));
   std::vector<RunCvdProcInfo> run_cvd_infos;
   run_cvd_infos.reserve(run_cvd_pids.size());
   for (const auto run_cvd_pid : run_cvd_pids) {
@@ -186,7 +311,8 @@ RunCvdProcessManager::CollectInfo() {
 }
 
 Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
-                                              const bool clear_runtime_dirs) {
+                                              const bool clear_runtime_dirs,
+                                              StopCvdDeadline& deadline) {
   const auto& stopper_path = group_info.stop_cvd_path_;
   int ret_code = 0;
   cvd_common::Envs stop_cvd_envs;
@@ -207,11 +333,7 @@ Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
         stopper_path, stop_cvd_envs, {"--clear_instance_dirs=true"});
     LOG(ERROR) << "Running HOME=" << stop_cvd_envs.at("HOME") << " "
                << stopper_path << " --clear_instance_dirs=true";
-    std::string stdout_str;
-    std::string stderr_str;
-    ret_code = RunWithManagedStdio(std::move(first_stop_cvd), nullptr,
-                                   std::addressof(stdout_str),
-                                   std::addressof(stderr_str));
+    ret_code = CF_EXPECT(deadline.Run(std::move(first_stop_cvd)));
     // TODO(kwstephenkim): deletes manually if `stop_cvd --clear_instance_dirs`
     // failed.
   }
@@ -226,11 +348,7 @@ Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
         CreateStopCvdCommand(stopper_path, stop_cvd_envs, {});
     LOG(ERROR) << "Running HOME=" << stop_cvd_envs.at("HOME") << " "
                << stopper_path;
-    std::string stdout_str;
-    std::string stderr_str;
-    ret_code = RunWithManagedStdio(std::move(second_stop_cvd), nullptr,
-                                   std::addressof(stdout_str),
-                                   std::addressof(stderr_str));
+    ret_code = CF_EXPECT(deadline.Run(std::move(second_stop_cvd)));
   }
   if (ret_code != 0) {
     std::stringstream error;
@@ -243,21 +361,6 @@ Result<void> RunCvdProcessManager::RunStopCvd(const GroupProcInfo& group_info,
   return {};
 }
 
-Result<void> RunCvdProcessManager::RunStopCvdAll(
-    const bool cvd_server_children_only, const bool clear_instance_dirs) {
-  for (const auto& group_info : cf_groups_) {
-    if (cvd_server_children_only && !group_info.is_cvd_server_started_) {
-      continue;
-    }
-    auto stop_cvd_result = RunStopCvd(group_info, clear_instance_dirs);
-    if (!stop_cvd_result.ok()) {
-      LOG(ERROR) << stop_cvd_result.error().FormatForEnv();
-      continue;
-    }
-  }
-  return {};
-}
-
 static bool IsStillRunCvd(const pid_t pid) {
   std::string pid_dir = ConcatToString("/proc/", pid);
   if (!FileExists(pid_dir)) {
@@ -275,9 +378,138 @@ static bool IsStillRunCvd(const pid_t pid) {
           "run_cvd");
 }
 
+// Returns false if neither SIGKILL nor SIGHUP could be delivered
+static bool KillRunCvd(const pid_t pid) {
+  auto ret_sigkill = kill(pid, SIGKILL);
+  if (ret_sigkill == 0) {
+    LOG(ERROR) << "SIGKILL was delivered to pid #" << pid;
+  } else {
+    LOG(ERROR) << "SIGKILL was not delivered to pid #" << pid;
+  }
+  if (!IsStillRunCvd(pid)) {
+    return true;
+  }
+  LOG(ERROR) << "Will still send SIGHUP as run_cvd #" << pid
+             << " has not been terminated by SIGKILL.";
+  auto ret_sighup = kill(pid, SIGHUP);
+  if (ret_sighup != 0) {
+    LOG(ERROR) << "SIGHUP sent to process #" << pid << " but all failed.";
+  }
+  return ret_sigkill == 0 || ret_sighup == 0;
+}
+
+RunCvdProcessManager::GroupStopReport RunCvdProcessManager::StopGroup(
+    const GroupProcInfo& group_info, const bool clear_runtime_dirs,
+    StopCvdDeadline& deadline) {
+  const auto started_at = std::chrono::steady_clock::now();
+  GroupStopReport report{
+      .home_ = group_info.home_,
+      .latency_ = {},
+      .stopped_ = false,
+      .timed_out_ = false,
+      .sigkilled_ = false,
+  };
+  auto stop_cvd_result = RunStopCvd(group_info, clear_runtime_dirs, deadline);
+  if (stop_cvd_result.ok()) {
+    report.stopped_ = true;
+  } else {
+    LOG(ERROR) << stop_cvd_result.error().FormatForEnv();
+    report.timed_out_ = deadline.Expired();
+    // escalates right away rather than after all the other groups
+    auto cgroup = FindGroupCgroup(group_info.home_);
+    if (cgroup && cgroup->IsTracked()) {
+      auto kill_result = KillCgroup(*cgroup);
+      if (kill_result.ok()) {
+        report.sigkilled_ = true;
+        report.latency_ = std::chrono::steady_clock::now() - started_at;
+        return report;
+      }
+      LOG(ERROR) << kill_result.error().FormatForEnv();
+    }
+    for (const auto& [_, instance] : group_info.instances_) {
+      for (const auto pid : instance.pids_) {
+        if (IsStillRunCvd(pid)) {
+          KillRunCvd(pid);
+          report.sigkilled_ = true;
+        }
+      }
+    }
+  }
+  report.latency_ = std::chrono::steady_clock::now() - started_at;
+  return report;
+}
+
+static std::string GroupStopOutcome(const bool stopped, const bool timed_out,
+                                    const bool sigkilled) {
+  std::string outcome = stopped     ? "stopped"
+                        : timed_out ? "timed out"
+                                    : "stop_cvd failed";
+  if (sigkilled) {
+    outcome += ", SIGKILL sent";
+  }
+  return outcome;
+}
+
+Result<void> RunCvdProcessManager::RunStopCvdAll(
+    const bool cvd_server_children_only, const bool clear_instance_dirs,
+    const std::chrono::seconds stop_timeout) {
+  std::vector<const GroupProcInfo*> targets;
+  for (const auto& group_info : cf_groups_) {
+    if (cvd_server_children_only && !group_info.is_cvd_server_started_) {
+      continue;
+    }
+    targets.push_back(&group_info);
+  }
+  if (targets.empty()) {
+    return {};
+  }
+
+  const auto started_at = std::chrono::steady_clock::now();
+  std::vector<GroupStopReport> reports(targets.size());
+  {
+    StopCvdDeadline deadline(started_at + stop_timeout);
+    std::vector<std::thread> stoppers;
+    stoppers.reserve(targets.size());
+    for (size_t i = 0; i < targets.size(); i++) {
+      stoppers.emplace_back(
+          [i, &targets, &reports, &deadline, clear_instance_dirs]() {
+            reports[i] = StopGroup(*targets[i], clear_instance_dirs, deadline);
+          });
+    }
+    for (auto& stopper : stoppers) {
+      stopper.join();
+    }
+  }
+  const auto elapsed = std::chrono::steady_clock::now() - started_at;
+
+  // the slowest groups first
+  std::sort(reports.begin(), reports.end(),
+            [](const GroupStopReport& a, const GroupStopReport& b) {
+              return a.latency_ > b.latency_;
+            });
+  size_t home_width = 0;
+  for (const auto& report : reports) {
+    home_width = std::max(home_width, report.home_.size());
+  }
+  using FloatSeconds = std::chrono::duration<double>;
+  std::stringstream summary;
+  summary << std::fixed << std::setprecision(1) << "Stopping "
+          << reports.size() << " device group(s) took "
+          << FloatSeconds(elapsed).count() << "s:";
+  for (const auto& report : reports) {
+    summary << "\n  HOME=" << std::left
+            << std::setw(static_cast<int>(home_width)) << report.home_
+            << std::right << std::setw(8)
+            << FloatSeconds(report.latency_).count() << "s  "
+            << GroupStopOutcome(report.stopped_, report.timed_out_,
+                                report.sigkilled_);
+  }
+  LOG(ERROR) << summary.str();
+  return {};
+}
+
 Result<void> RunCvdProcessManager::SendSignals(
     const bool cvd_server_children_only) {
-  auto recollected_run_cvd_pids = CF_EXPECT(CollectPidsByExecName("run_cvd"));
   std::unordered_set<pid_t> failed_pids;
   for (const auto& group_info : cf_groups_) {
     if (cvd_server_children_only && !group_info.is_cvd_server_started_) {
@@ -286,35 +518,24 @@ Result<void> RunCvdProcessManager::SendSignals(
     for (const auto& [_, instance] : group_info.instances_) {
       const auto& pids = instance.pids_;
       for (const auto pid : pids) {
-        if (!Contains(recollected_run_cvd_pids, pid)) {
-          // pid is alive but reassigned to non-run_cvd process
-          continue;
-        }
         if (!IsStillRunCvd(pid)) {
           // pid is now assigned to a different process
           continue;
         }
-        auto ret_sigkill = kill(pid, SIGKILL);
-        if (ret_sigkill == 0) {
-          LOG(ERROR) << "SIGKILL was delivered to pid #" << pid;
-        } else {
-          LOG(ERROR) << "SIGKILL was not delivered to pid #" << pid;
-        }
-        if (!IsStillRunCvd(pid)) {
-          continue;
-        }
-        LOG(ERROR) << "Will still send SIGHUP as run_cvd #" << pid
-                   << " has not been terminated by SIGKILL.";
-        auto ret_sighup = kill(pid, SIGHUP);
-        if (ret_sighup != 0) {
-          LOG(ERROR) << "SIGHUP sent to process #" << pid << " but all failed.";
-        }
-        if (ret_sigkill != 0 && ret_sighup != 0) {
+        if (!KillRunCvd(pid)) {
           failed_pids.insert(pid);
         }
       }
     }
   }
+  // Every group in a cgroup was launched by a cvd server. Releasing them also
+  // kills the subprocesses run_cvd may have left behind.
+  for (const auto& cgroup : RecordedGroupCgroups()) {
+    auto release_result = ReleaseGroupCgroup(cgroup);
+    if (!release_result.ok()) {
+      LOG(ERROR) << release_result.error().FormatForEnv();
+    }
+  }
   std::stringstream error_msg_stream;
   error_msg_stream << "Some run_cvd processes were not killed: {";
   for (const auto& pid : failed_pids) {
@@ -385,13 +606,85 @@ void RunCvdProcessManager::DeleteLockFiles(
 }
 
 Result<void> KillAllCuttlefishInstances(const DeviceClearOptions& options) {
-  RunCvdProcessManager manager = CF_EXPECT(RunCvdProcessManager::Get());
+  RunCvdProcessManager manager = CF_EXPECT(
+      RunCvdProcessManager::Get(options.cvd_server_children_only));
   CF_EXPECT(manager.KillAllCuttlefishInstances(options.cvd_server_children_only,
-                                               options.clear_instance_dirs));
+                                               options.clear_instance_dirs,
+                                               options.stop_timeout));
+  return {};
+}
+
+static bool IsCvdServer(const pid_t pid) {
+  auto proc_info_result = ExtractProcInfo(pid);
+  if (!proc_info_result.ok()) {
+    LOG(ERROR) << "Failed to extract process info for pid " << pid;
+    return false;
+  }
+  auto owner_uid_result = OwnerUid(pid);
+  if (!owner_uid_result.ok()) {
+    LOG(ERROR) << "Failed to find the uid for pid " << pid;
+    return false;
+  }
+  if (getuid() != *owner_uid_result) {
+    return false;
+  }
+  for (const auto& arg : proc_info_result->args_) {
+    if (Contains(arg, "INTERNAL_server_fd")) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/*
+ * Finds the server from the credentials of its listening socket, which the
+ * kernel keeps even when the server does not accept connections anymore.
+ * Returns nullopt if nothing listens on the socket.
+ */
+static Result<std::optional<pid_t>> ListeningServerPid() {
+  auto connection = SharedFD::SocketLocalClient(
+      ServerSocketPath(), /*is_abstract=*/true, SOCK_SEQPACKET);
+  if (!connection->IsOpen() && connection->GetErrno() == ECONNREFUSED) {
+    return std::nullopt;
+  }
+  CF_EXPECT(connection->IsOpen(), connection->StrError());
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+  CF_EXPECT(connection->GetSockOpt(SOL_SOCKET, SO_PEERCRED, &credentials,
+                                   &length) == 0,
+            connection->StrError());
+  CF_EXPECT_EQ(credentials.uid, getuid());
+  return credentials.pid;
+}
+
+static Result<void> KillWithPidFd(const pid_t pid) {
+  auto pidfd = SharedFD::PidFdOpen(pid);
+  CF_EXPECT(pidfd->IsOpen(), pidfd->StrError());
+  // verified after the pidfd is taken, so the pid can not be recycled since
+  CF_EXPECT(IsCvdServer(pid), "#" << pid << " is not a cvd server");
+  CF_EXPECT(pidfd->PidFdSendSignal(SIGKILL) == 0, pidfd->StrError());
   return {};
 }
 
 Result<void> KillCvdServerProcess() {
+  auto listening_server = ListeningServerPid();
+  if (listening_server.ok() && !listening_server->has_value()) {
+    LOG(ERROR) << "cvd server is not running.";
+    return {};
+  }
+  if (listening_server.ok()) {
+    const auto pid = listening_server->value();
+    auto kill_result = KillWithPidFd(pid);
+    if (kill_result.ok()) {
+      LOG(ERROR) << "Cvd server process #" << pid << " is killed.";
+      return {};
+    }
+    LOG(ERROR) << kill_result.error().FormatForEnv();
+  } else {
+    LOG(ERROR) << listening_server.error().FormatForEnv();
+  }
+  LOG(ERROR) << "Looking for the cvd server in /proc";
+
   std::vector<pid_t> self_exe_pids =
       CF_EXPECT(CollectPidsByArgv0(kServerExecPath));
   if (self_exe_pids.empty()) {
@@ -405,24 +698,8 @@ Result<void> KillCvdServerProcess() {
    * in the arguments list.
    */
   for (const auto pid : self_exe_pids) {
-    auto proc_info_result = ExtractProcInfo(pid);
-    if (!proc_info_result.ok()) {
-      LOG(ERROR) << "Failed to extract process info for pid " << pid;
-      continue;
-    }
-    auto owner_uid_result = OwnerUid(pid);
-    if (!owner_uid_result.ok()) {
-      LOG(ERROR) << "Failed to find the uid for pid " << pid;
-      continue;
-    }
-    if (getuid() != *owner_uid_result) {
-      continue;
-    }
-    for (const auto& arg : proc_info_result->args_) {
-      if (Contains(arg, "INTERNAL_server_fd")) {
-        cvd_server_pids.push_back(pid);
-        break;
-      }
+    if (IsCvdServer(pid)) {
+      cvd_server_pids.push_back(pid);
     }
   }
   if (cvd_server_pids.empty()) {
@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 
+#include <chrono>
 #include <memory>
 #include <mutex>
 #include <set>
@@ -29,6 +30,8 @@
 
 namespace cuttlefish {
 
+class StopCvdDeadline;
+
 class RunCvdProcessManager {
   struct RunCvdProcInfo {
     pid_t pid_;
@@ -58,14 +61,26 @@ class RunCvdProcessManager {
     std::unordered_map<unsigned, InstanceInfo> instances_;
   };
 
+  struct GroupStopReport {
+    std::string home_;
+    std::chrono::steady_clock::duration latency_;
+    // stop_cvd returned 0
+    bool stopped_;
+    // stop_cvd was still running at the deadline
+    bool timed_out_;
+    // the run_cvd processes were sent SIGKILL as stop_cvd did not stop them
+    bool sigkilled_;
+  };
+
  public:
-  static Result<RunCvdProcessManager> Get();
+  static Result<RunCvdProcessManager> Get(const bool cvd_server_children_only);
   RunCvdProcessManager(const RunCvdProcessManager&) = delete;
   RunCvdProcessManager(RunCvdProcessManager&&) = default;
-  Result<void> KillAllCuttlefishInstances(const bool cvd_server_children_only,
-                                          const bool clear_runtime_dirs) {
-    auto stop_cvd_result =
-        RunStopCvdAll(cvd_server_children_only, clear_runtime_dirs);
+  Result<void> KillAllCuttlefishInstances(
+      const bool cvd_server_children_only, const bool clear_runtime_dirs,
+      const std::chrono::seconds stop_timeout) {
+    auto stop_cvd_result = RunStopCvdAll(cvd_server_children_only,
+                                         clear_runtime_dirs, stop_timeout);
     if (!stop_cvd_result.ok()) {
       LOG(ERROR) << stop_cvd_result.error().FormatForEnv();
     }
@@ -75,7 +90,7 @@ class RunCvdProcessManager {
     }
     DeleteLockFiles(cvd_server_children_only);
     cf_groups_.clear();
-    auto recollect_info_result = CollectInfo();
+    auto recollect_info_result = CollectInfo(cvd_server_children_only);
     if (!recollect_info_result.ok()) {
       LOG(ERROR) << "Recollecting run_cvd processes information failed.";
       LOG(ERROR) << recollect_info_result.error().FormatForEnv();
@@ -86,24 +101,39 @@ class RunCvdProcessManager {
  private:
   RunCvdProcessManager() = default;
   static Result<void> RunStopCvd(const GroupProcInfo& run_cvd_info,
-                                 const bool clear_runtime_dirs);
+                                 const bool clear_runtime_dirs,
+                                 StopCvdDeadline& deadline);
+  static GroupStopReport StopGroup(const GroupProcInfo& group_info,
+                                   const bool clear_runtime_dirs,
+                                   StopCvdDeadline& deadline);
+  /*
+   * Runs stop_cvd for all the groups at the same time. stop_cvd processes
+   * still running after stop_timeout are killed, and so are the run_cvd
+   * processes of any group stop_cvd failed to stop.
+   */
   Result<void> RunStopCvdAll(const bool cvd_server_children_only,
-                             const bool clear_runtime_dirs);
+                             const bool clear_runtime_dirs,
+                             const std::chrono::seconds stop_timeout);
   Result<void> SendSignals(const bool cvd_server_children_only);
   Result<RunCvdProcInfo> AnalyzeRunCvdProcess(const pid_t pid);
   void DeleteLockFiles(const bool cvd_server_children_only);
-  Result<std::vector<GroupProcInfo>> CollectInfo();
+  Result<std::vector<GroupProcInfo>> CollectInfo(
+      const bool cvd_server_children_only);
   std::vector<GroupProcInfo> cf_groups_;
 };
 
+inline constexpr std::chrono::seconds kDefaultStopCvdTimeout{60};
+
 struct DeviceClearOptions {
   bool cvd_server_children_only;
   bool clear_instance_dirs;
+  // for all the stop_cvd processes together
+  std::chrono::seconds stop_timeout = kDefaultStopCvdTimeout;
 };
 
 /*
- * Runs stop_cvd for all cuttlefish instances found based on run_cvd processes,
- * and send SIGKILL to the run_cvd processes.
+ * Runs stop_cvd concurrently for all cuttlefish instances found based on
+ * run_cvd processes, and send SIGKILL to the run_cvd processes.
  *
  * If cvd_server_children_only is set, it kills the run_cvd processes that were
  * started by a cvd server process.
@@ -76,17 +76,6 @@ CreationAnalyzer::CreationAnalyzer(
       instance_database_{instance_database},
       instance_file_lock_manager_{instance_file_lock_manager} {}
 
-static std::unordered_map<unsigned, InstanceLockFile> ConstructIdLockFileMap(
-    std::vector<InstanceLockFile>&& lock_files) {
-  std::unordered_map<unsigned, InstanceLockFile> mapping;
-  for (auto& lock_file : lock_files) {
-    const unsigned id = static_cast<unsigned>(lock_file.Instance());
-    mapping.insert({id, std::move(lock_file)});
-  }
-  lock_files.clear();
-  return mapping;
-}
-
 static Result<void> IsIdAvailable(const InstanceDatabase& instance_database,
                                   const unsigned id) {
   auto subset =
@@ -128,32 +117,17 @@ CreationAnalyzer::AnalyzeInstanceIdsInternal(
     }
     return instance_info;
   }
-  auto acquired_all_file_locks =
-      CF_EXPECT(instance_file_lock_manager_.LockAllAvailable());
-  auto id_to_lockfile_map =
-      ConstructIdLockFileMap(std::move(acquired_all_file_locks));
-  for (const auto& [id, instance_name] : id_name_pairs) {
-    CF_EXPECT(Contains(id_to_lockfile_map, id),
-              "Instance ID " << id << " lock file can't be locked.");
-    auto& lock_file = id_to_lockfile_map.at(id);
-    instance_info.emplace_back(id, instance_name, std::move(lock_file));
+  std::set<int> requested_nums;
+  for (const auto& [id, _] : id_name_pairs) {
+    requested_nums.insert(static_cast<int>(id));
   }
-  return instance_info;
-}
-
-/*
- * Filters out the ids in id_pool that already exist in instance_database
- */
-static Result<std::vector<unsigned>> CollectUnusedIds(
-    const InstanceDatabase& instance_database,
-    std::vector<unsigned>&& id_pool) {
-  std::vector<unsigned> collected_ids;
-  for (const auto id : id_pool) {
-    if (IsIdAvailable(instance_database, id).ok()) {
-      collected_ids.push_back(id);
-    }
+  auto lock_files =
+      CF_EXPECT(instance_file_lock_manager_.AcquireUnusedLocks(requested_nums));
+  for (auto& lock_file : lock_files) {
+    const unsigned id = static_cast<unsigned>(lock_file.Instance());
+    instance_info.emplace_back(id, id_name_pairs.at(id), std::move(lock_file));
   }
-  return collected_ids;
+  return instance_info;
 }
 
 struct NameLockFilePair {
@@ -168,60 +142,40 @@ CreationAnalyzer::AnalyzeInstanceIdsInternal() {
 
   // As this test was done earlier, this line must not fail
   const auto n_instances = selector_options_parser_.RequestedNumInstances();
-  auto acquired_all_file_locks =
-      CF_EXPECT(instance_file_lock_manager_.LockAllAvailable());
-  auto id_to_lockfile_map =
-      ConstructIdLockFileMap(std::move(acquired_all_file_locks));
 
   /* generate n_instances consecutive ids. For backward compatibility,
    * we prefer n consecutive ids for now.
+   *
+   * auto-generation means the user did not specify much: e.g. "cvd start"
+   * In this case, the user may expect the instance id to be 1+
    */
-  std::vector<unsigned> id_pool;
-  id_pool.reserve(id_to_lockfile_map.size());
-  for (const auto& [id, _] : id_to_lockfile_map) {
-    id_pool.push_back(id);
-  }
-  auto unused_id_pool =
-      CF_EXPECT(CollectUnusedIds(instance_database_, std::move(id_pool)));
-  auto unique_id_allocator = std::move(IdAllocator::New(unused_id_pool));
-  CF_EXPECT(unique_id_allocator != nullptr,
-            "Memory allocation for UniqueResourceAllocator failed.");
-
-  // auto-generation means the user did not specify much: e.g. "cvd start"
-  // In this case, the user may expect the instance id to be 1+
-  using ReservationSet = UniqueResourceAllocator<unsigned>::ReservationSet;
-  std::optional<ReservationSet> allocated_ids_opt;
+  std::optional<int> preferred_first;
   if (selector_options_parser_.IsMaybeDefaultGroup()) {
-    allocated_ids_opt = unique_id_allocator->TakeRange(1, 1 + n_instances);
-  }
-  if (!allocated_ids_opt) {
-    allocated_ids_opt =
-        unique_id_allocator->UniqueConsecutiveItems(n_instances);
-  }
-  CF_EXPECT(allocated_ids_opt != std::nullopt, "Unique ID allocation failed.");
-
-  std::vector<unsigned> allocated_ids;
-  allocated_ids.reserve(allocated_ids_opt->size());
-  for (const auto& reservation : *allocated_ids_opt) {
-    allocated_ids.push_back(reservation.Get());
+    preferred_first = 1;
   }
-  std::sort(allocated_ids.begin(), allocated_ids.end());
+  auto not_in_database = [this](const int id) {
+    return IsIdAvailable(instance_database_, id).ok();
+  };
+  auto lock_files =
+      CF_EXPECT(instance_file_lock_manager_.AcquireUnusedLocks(
+                    n_instances, not_in_database, preferred_first),
+                "Unique ID allocation failed.");
 
   const auto per_instance_names_opt =
       selector_options_parser_.PerInstanceNames();
   if (per_instance_names_opt) {
-    CF_EXPECT(per_instance_names_opt->size() == allocated_ids.size());
+    CF_EXPECT(per_instance_names_opt->size() == lock_files.size());
   }
   std::vector<PerInstanceInfo> instance_info;
-  for (size_t i = 0; i != allocated_ids.size(); i++) {
-    const auto id = allocated_ids.at(i);
+  for (size_t i = 0; i != lock_files.size(); i++) {
+    const unsigned id = static_cast<unsigned>(lock_files[i].Instance());
 
     std::string name = std::to_string(id);
     // Use the user provided instance name only if it's not empty.
     if (per_instance_names_opt && !(*per_instance_names_opt)[i].empty()) {
       name = (*per_instance_names_opt)[i];
     }
-    instance_info.emplace_back(id, name, std::move(id_to_lockfile_map.at(id)));
+    instance_info.emplace_back(id, name, std::move(lock_files[i]));
   }
   return instance_info;
 }
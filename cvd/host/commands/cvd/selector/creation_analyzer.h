@@ -25,7 +25,6 @@
 #include <vector>
 
 #include "common/libs/utils/result.h"
-#include "common/libs/utils/unique_resource_allocator.h"
 #include "host/commands/cvd/instance_lock.h"
 #include "host/commands/cvd/selector/instance_database.h"
 #include "host/commands/cvd/selector/start_selector_parser.h"
@@ -107,8 +106,6 @@ class CreationAnalyzer {
       InstanceLockFileManager& instance_lock_file_manager);
 
  private:
-  using IdAllocator = UniqueResourceAllocator<unsigned>;
-
   CreationAnalyzer(const CreationAnalyzerParam& param, const ucred& credential,
                    StartSelectorParser&& selector_options_parser,
                    const InstanceDatabase& instance_database,
@@ -47,6 +47,8 @@
 #include "host/commands/cvd/common_utils.h"
 #include "host/commands/cvd/demo_multi_vd.h"
 #include "host/commands/cvd/epoll_loop.h"
+#include "host/commands/cvd/admission_controller.h"
+#include "host/commands/cvd/log_tail_service.h"
 #include "host/commands/cvd/logger.h"
 #include "host/commands/cvd/selector/selector_constants.h"
 #include "host/commands/cvd/server_command/acloud.h"
@@ -56,6 +58,7 @@
 #include "host/commands/cvd/server_command/generic.h"
 #include "host/commands/cvd/server_command/handler_proxy.h"
 #include "host/commands/cvd/server_command/load_configs.h"
+#include "host/commands/cvd/server_command/logs.h"
 #include "host/commands/cvd/server_command/power.h"
 #include "host/commands/cvd/server_command/reset.h"
 #include "host/commands/cvd/server_command/snapshot.h"
@@ -75,11 +78,15 @@ static constexpr int kNumThreads = 10;
 CvdServer::CvdServer(BuildApi& build_api, EpollPool& epoll_pool,
                      InstanceManager& instance_manager,
                      HostToolTargetManager& host_tool_target_manager,
+                     LogTailService& log_tail_service,
+                     AdmissionController& admission_controller,
                      ServerLogger& server_logger)
     : build_api_(build_api),
       epoll_pool_(epoll_pool),
       instance_manager_(instance_manager),
       host_tool_target_manager_(host_tool_target_manager),
+      log_tail_service_(log_tail_service),
+      admission_controller_(admission_controller),
       server_logger_(server_logger),
       running_(true),
       optout_(false) {
@@ -112,6 +119,9 @@ fruit::Component<> CvdServer::RequestComponent(CvdServer* server) {
       .bindInstance(server->instance_manager_)
       .bindInstance(server->build_api_)
       .bindInstance(server->host_tool_target_manager_)
+      .bindInstance(server->log_tail_service_)
+      .bindInstance(server->admission_controller_)
+      .bindInstance(server->server_logger_)
       .bindInstance<
           fruit::Annotated<AcloudTranslatorOptOut, std::atomic<bool>>>(
           server->optout_)
@@ -125,6 +135,7 @@ fruit::Component<> CvdServer::RequestComponent(CvdServer* server) {
       .install(cvdGenericCommandComponent)
       .install(CvdHandlerProxyComponent)
       .install(CvdHelpComponent)
+      .install(CvdLogsComponent)
       .install(CvdResetComponent)
       .install(CvdRestartComponent)
       .install(CvdSnapshotComponent)
@@ -457,13 +468,8 @@ Result<cvd::Response> CvdServer::HandleRequest(RequestWithStdio orig_request,
       CF_EXPECT(Verbosity(request, request.Message().verbosity()));
   server_logger_.SetSeverity(verbosity);
 
-  fruit::Injector<> injector(RequestComponent, this);
-
-  for (auto& late_injected : injector.getMultibindings<LateInjected>()) {
-    CF_EXPECT(late_injected->LateInject(injector));
-  }
-
-  auto possible_handlers = injector.getMultibindings<CvdServerHandler>();
+  auto injector = CF_EXPECT(RequestInjector());
+  auto possible_handlers = injector->getMultibindings<CvdServerHandler>();
 
   // Even if the interrupt callback outlives the request handler, it'll only
   // hold on to this struct which will be cleaned out when the request handler
@@ -506,6 +512,14 @@ Result<cvd::Response> CvdServer::HandleRequest(RequestWithStdio orig_request,
   return response;
 }
 
+Result<std::unique_ptr<fruit::Injector<>>> CvdServer::RequestInjector() {
+  auto injector = std::make_unique<fruit::Injector<>>(RequestComponent, this);
+  for (auto& late_injected : injector->getMultibindings<LateInjected>()) {
+    CF_EXPECT(late_injected->LateInject(*injector));
+  }
+  return injector;
+}
+
 Result<void> CvdServer::InstanceDbFromJson(const std::string& json_string) {
   const uid_t uid = getuid();
   auto json = CF_EXPECT(ParseJson(json_string));
@@ -519,7 +533,9 @@ static fruit::Component<> ServerComponent(ServerLogger* server_logger) {
       .bindInstance(*server_logger)
       .install(BuildApiModule)
       .install(EpollLoopComponent)
-      .install(HostToolTargetManagerComponent);
+      .install(HostToolTargetManagerComponent)
+      .install(LogTailServiceComponent)
+      .install(AdmissionControllerComponent);
 }
 
 Result<int> CvdServerMain(ServerMainParam&& param) {
@@ -18,6 +18,7 @@
 
 #include <atomic>
 #include <map>
+#include <memory>
 #include <optional>
 #include <shared_mutex>
 #include <string>
@@ -33,6 +34,8 @@
 #include "common/libs/utils/unix_sockets.h"
 #include "host/commands/cvd/epoll_loop.h"
 #include "host/commands/cvd/instance_manager.h"
+#include "host/commands/cvd/admission_controller.h"
+#include "host/commands/cvd/log_tail_service.h"
 #include "host/commands/cvd/logger.h"
 // including "server_command/subcmd.h" causes cyclic dependency
 #include "host/commands/cvd/server_command/host_tool_target_manager.h"
@@ -64,7 +67,8 @@ class CvdServer {
 
  public:
   INJECT(CvdServer(BuildApi&, EpollPool&, InstanceManager&,
-                   HostToolTargetManager&, ServerLogger&));
+                   HostToolTargetManager&, LogTailService&,
+                   AdmissionController&, ServerLogger&));
   ~CvdServer();
 
   Result<void> StartServer(SharedFD server);
@@ -81,6 +85,11 @@ class CvdServer {
   void Stop();
   void Join();
   Result<void> InstanceDbFromJson(const std::string& json_string);
+  /*
+   * A new set of request handlers, e.g. to run a request concurrently with
+   * one that already uses the handlers of the current request.
+   */
+  Result<std::unique_ptr<fruit::Injector<>>> RequestInjector();
 
  private:
   struct OngoingRequest {
@@ -102,6 +111,8 @@ class CvdServer {
   EpollPool& epoll_pool_;
   InstanceManager& instance_manager_;
   HostToolTargetManager& host_tool_target_manager_;
+  LogTailService& log_tail_service_;
+  AdmissionController& admission_controller_;
   ServerLogger& server_logger_;
   std::atomic_bool running_ = true;
 
@@ -17,10 +17,12 @@
 #include "host/commands/cvd/server_client.h"
 
 #include <atomic>
+#include <limits>
 #include <condition_variable>
 #include <memory>
 #include <optional>
 #include <queue>
+#include <string>
 #include <thread>
 
 #include "cvd_server.pb.h"
@@ -28,9 +30,55 @@
 #include "common/libs/fs/shared_fd.h"
 #include "common/libs/fs/shared_select.h"
 #include "common/libs/utils/result.h"
+#include "common/libs/utils/sealed_memfd.h"
 #include "common/libs/utils/unix_sockets.h"
 
 namespace cuttlefish {
+namespace {
+
+/*
+ * Responses at least this large are sent in a sealed memfd. Their message
+ * only holds the response size, and the memfd is its only file descriptor.
+ *
+ * Writing them to the socket would copy them into and out of the socket
+ * buffers, and a SOCK_SEQPACKET message can't be larger than SO_SNDBUF.
+ */
+constexpr size_t kSharedMemoryResponseSize = 64 * 1024;
+
+Result<UnixSocketMessage> SharedMemoryResponse(const cvd::Response& response,
+                                               size_t size) {
+  auto serialize = [&response, size](char* data) -> Result<void> {
+    CF_EXPECT(response.SerializeToArray(data, size),
+              "Unable to serialize response proto.");
+    return {};
+  };
+  auto memfd = CF_EXPECT(SealedMemfd("cvd_response", size, serialize));
+  UnixSocketMessage message;
+  auto size_str = std::to_string(size);
+  message.data = std::vector<char>(size_str.begin(), size_str.end());
+  message.control.emplace_back(
+      CF_EXPECT(ControlMessage::FromFileDescriptors({memfd})));
+  return message;
+}
+
+Result<cvd::Response> ParseSharedMemoryResponse(UnixSocketMessage& message) {
+  auto fds = CF_EXPECT(message.FileDescriptors());
+  CF_EXPECT(fds.size() == 1, "Wrong number of FDs, received "
+                                 << fds.size() << ", wanted 1");
+  auto mapping = CF_EXPECT(MapSealedMemfd(fds[0]));
+  std::string size_str(message.data.begin(), message.data.end());
+  CF_EXPECT(size_str == std::to_string(mapping.len()),
+            "The response is " << mapping.len() << " bytes, expected "
+                               << size_str);
+  CF_EXPECT(mapping.len() <= std::numeric_limits<int>::max(),
+            "The response is too large: " << mapping.len() << " bytes");
+  cvd::Response response;
+  CF_EXPECT(response.ParseFromArray(mapping.get(), mapping.len()),
+            "Unable to parse serialized response proto.");
+  return response;
+}
+
+}  // namespace
 
 Result<UnixMessageSocket> GetClient(const SharedFD& client) {
   UnixMessageSocket result(client);
@@ -76,11 +124,16 @@ Result<std::optional<RequestWithStdio>> GetRequest(const SharedFD& client) {
 
 Result<void> SendResponse(const SharedFD& client,
                           const cvd::Response& response) {
-  std::string serialized;
-  CF_EXPECT(response.SerializeToString(&serialized),
-            "Unable to serialize response proto.");
   UnixSocketMessage message;
-  message.data = std::vector<char>(serialized.begin(), serialized.end());
+  auto size = response.ByteSizeLong();
+  if (size >= kSharedMemoryResponseSize) {
+    message = CF_EXPECT(SharedMemoryResponse(response, size));
+  } else {
+    std::string serialized;
+    CF_EXPECT(response.SerializeToString(&serialized),
+              "Unable to serialize response proto.");
+    message.data = std::vector<char>(serialized.begin(), serialized.end());
+  }
 
   UnixMessageSocket writer =
       CF_EXPECT(GetClient(client), "Couldn't get client");
@@ -88,6 +141,18 @@ Result<void> SendResponse(const SharedFD& client,
   return {};
 }
 
+Result<cvd::Response> ReadResponse(UnixMessageSocket& server) {
+  auto read_result = CF_EXPECT(server.ReadMessage());
+  if (read_result.HasFileDescriptors()) {
+    return CF_EXPECT(ParseSharedMemoryResponse(read_result));
+  }
+  std::string serialized(read_result.data.begin(), read_result.data.end());
+  cvd::Response response;
+  CF_EXPECT(response.ParseFromString(serialized),
+            "Unable to parse serialized response proto.");
+  return response;
+}
+
 RequestWithStdio::RequestWithStdio(SharedFD client_fd, cvd::Request message,
                                    std::vector<SharedFD> fds,
                                    std::optional<ucred> creds)
@@ -53,7 +53,12 @@ class RequestWithStdio {
 
 Result<UnixMessageSocket> GetClient(const SharedFD& client);
 Result<std::optional<RequestWithStdio>> GetRequest(const SharedFD& client);
+/*
+ * Large responses are passed in a sealed memfd, so clients read them with
+ * ReadResponse rather than parsing the message themselves.
+ */
 Result<void> SendResponse(const SharedFD& client,
                           const cvd::Response& response);
+Result<cvd::Response> ReadResponse(UnixMessageSocket& server);
 
 }  // namespace cuttlefish
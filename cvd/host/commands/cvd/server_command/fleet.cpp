@@ -122,7 +122,7 @@ bool CvdFleetCommandHandler::IsHelp(const cvd_common::Args& args) const {
 
 Result<cvd::Status> CvdFleetCommandHandler::CvdFleetHelp(
     const SharedFD& out) const {
-  WriteAll(out, "Simply run \"cvd fleet\" as it has no other flags.\n");
+  WriteAll(out, "Usage: cvd fleet [--cached]\n");
   WriteAll(out, "\n");
   WriteAll(out, "\"cvd fleet\" will:\n");
   WriteAll(out,
@@ -130,6 +130,23 @@ Result<cvd::Status> CvdFleetCommandHandler::CvdFleetHelp(
            "active.\n");
   WriteAll(out,
            "      2. optionally list the active devices with information.\n");
+  WriteAll(out, "\n");
+  WriteAll(out,
+           "--cached returns the status the server last collected instead of "
+           "running\n"
+           "the status tools. Each instance then has \"status_updated_at_ms\" "
+           "and\n"
+           "\"status_stale\", plus \"status_stale_since_ms\" if the device "
+           "changed since.\n");
+  WriteAll(out, "\n");
+  WriteAll(out,
+           "Groups running in their own cgroup also report their \"cpu\", "
+           "\"memory\"\nand \"io\" usage under \"resources\", see the "
+           "--cgroup_* flags of cvd start.\n");
+  WriteAll(out,
+           "Groups started with --pin_cpus report their host CPUs under\n"
+           "\"cpu_placement\", the other groups run on any CPU. "
+           "\"host_cpus\" lists the\nfree CPUs of each NUMA node.\n");
   cvd::Status status;
   status.set_code(cvd::Status::OK);
   return status;
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/server_command/helpxml_cache.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <functional>
+#include <sstream>
+#include <thread>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <json/json.h>
+
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/json.h"
+#include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/lock_file.h"
+
+namespace cuttlefish {
+namespace {
+
+// bump when the entry format changes
+constexpr int kEntryVersion = 1;
+
+Json::Value ToJson(const HelpxmlCache::BinaryStamp& stamp) {
+  Json::Value json;
+  json["dev"] = Json::UInt64(stamp.dev);
+  json["ino"] = Json::UInt64(stamp.ino);
+  json["size"] = Json::Int64(stamp.size);
+  json["mtime_ns"] = Json::Int64(stamp.mtime_ns);
+  return json;
+}
+
+// Integers are typed by their value when parsed, so json == is not usable
+HelpxmlCache::BinaryStamp StampFromJson(const Json::Value& json) {
+  return HelpxmlCache::BinaryStamp{
+      .dev = json["dev"].asUInt64(),
+      .ino = json["ino"].asUInt64(),
+      .size = json["size"].asInt64(),
+      .mtime_ns = json["mtime_ns"].asInt64(),
+  };
+}
+
+}  // namespace
+
+bool HelpxmlCache::BinaryStamp::operator==(const BinaryStamp& other) const {
+  return dev == other.dev && ino == other.ino && size == other.size &&
+         mtime_ns == other.mtime_ns;
+}
+
+std::string HelpxmlCache::DefaultDir() {
+  return ConcatToString(TempDir(), "/cvd/", getuid(), "/helpxml_cache");
+}
+
+Result<HelpxmlCache::BinaryStamp> HelpxmlCache::Stamp(
+    const std::string& bin_path) {
+  struct stat st;
+  CF_EXPECTF(::stat(bin_path.c_str(), &st) == 0, "Failed to stat \"{}\": {}",
+             bin_path, strerror(errno));
+  return BinaryStamp{
+      .dev = static_cast<std::uint64_t>(st.st_dev),
+      .ino = static_cast<std::uint64_t>(st.st_ino),
+      .size = static_cast<std::int64_t>(st.st_size),
+      .mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 +
+                  st.st_mtim.tv_nsec,
+  };
+}
+
+HelpxmlCache::HelpxmlCache(const std::string& cache_dir)
+    : cache_dir_(cache_dir) {}
+
+std::string HelpxmlCache::EntryPath(const std::string& bin_path) const {
+  std::stringstream path;
+  path << cache_dir_ << "/" << std::hex << std::hash<std::string>{}(bin_path)
+       << ".json";
+  return path.str();
+}
+
+std::optional<std::vector<FlagInfoPtr>> HelpxmlCache::Load(
+    const std::string& bin_path, const BinaryStamp& stamp) const {
+  const auto entry_path = EntryPath(bin_path);
+  if (!FileExists(entry_path)) {
+    return std::nullopt;
+  }
+  auto entry = LoadFromFile(entry_path);
+  if (!entry.ok()) {
+    LOG(DEBUG) << "Ignoring " << entry_path << ": "
+               << entry.error().Message();
+    return std::nullopt;
+  }
+  // a different binary with the same hash, or an outdated entry
+  if ((*entry)["version"].asInt() != kEntryVersion ||
+      (*entry)["bin_path"].asString() != bin_path ||
+      !(StampFromJson((*entry)["stamp"]) == stamp)) {
+    return std::nullopt;
+  }
+  std::vector<FlagInfoPtr> flags;
+  for (const auto& flag_json : (*entry)["flags"]) {
+    auto flag = FlagInfo::Create({
+        {"name", flag_json["name"].asString()},
+        {"type", flag_json["type"].asString()},
+    });
+    if (!flag) {
+      return std::nullopt;
+    }
+    flags.emplace_back(std::move(flag));
+  }
+  return flags;
+}
+
+Result<void> HelpxmlCache::Store(const std::string& bin_path,
+                                 const BinaryStamp& stamp,
+                                 const std::vector<FlagInfoPtr>& flags) const {
+  CF_EXPECT(EnsureDirectoryExists(cache_dir_, S_IRWXU));
+  Json::Value entry;
+  entry["version"] = kEntryVersion;
+  entry["bin_path"] = bin_path;
+  entry["stamp"] = ToJson(stamp);
+  Json::Value flags_json(Json::arrayValue);
+  for (const auto& flag : flags) {
+    Json::Value flag_json;
+    flag_json["name"] = flag->Name();
+    flag_json["type"] = flag->Type();
+    flags_json.append(flag_json);
+  }
+  entry["flags"] = flags_json;
+
+  // written aside and renamed, so that readers never see a partial entry
+  const auto entry_path = EntryPath(bin_path);
+  const auto temp_path = ConcatToString(
+      entry_path, ".", getpid(), ".",
+      std::hash<std::thread::id>{}(std::this_thread::get_id()));
+  Json::StreamWriterBuilder builder;
+  CF_EXPECTF(android::base::WriteStringToFile(
+                 Json::writeString(builder, entry), temp_path),
+             "Failed to write \"{}\": {}", temp_path, strerror(errno));
+  if (::rename(temp_path.c_str(), entry_path.c_str()) != 0) {
+    const auto rename_errno = errno;
+    ::unlink(temp_path.c_str());
+    return CF_ERRF("Failed to rename \"{}\" to \"{}\": {}", temp_path,
+                   entry_path, strerror(rename_errno));
+  }
+  return {};
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common/libs/utils/result.h"
+#include "host/commands/cvd/server_command/flags_collector.h"
+
+namespace cuttlefish {
+
+/**
+ * Keeps the flags parsed from "<binary> --helpxml" on disk, so that they
+ * survive cvd server restarts.
+ *
+ * An entry is only valid for the exact file it was collected from: the
+ * binary's device, inode, size and modification time are stored with it.
+ * Rebuilding or replacing the binary changes at least one of them.
+ */
+class HelpxmlCache {
+ public:
+  struct BinaryStamp {
+    std::uint64_t dev;
+    std::uint64_t ino;
+    std::int64_t size;
+    std::int64_t mtime_ns;
+    bool operator==(const BinaryStamp&) const;
+  };
+
+  // TempDir()/cvd/<uid>/helpxml_cache
+  static std::string DefaultDir();
+  static Result<BinaryStamp> Stamp(const std::string& bin_path);
+
+  HelpxmlCache(const std::string& cache_dir);
+
+  // std::nullopt if there is no entry for this version of the binary
+  std::optional<std::vector<FlagInfoPtr>> Load(const std::string& bin_path,
+                                               const BinaryStamp& stamp) const;
+  // `stamp` should be taken before running the binary
+  Result<void> Store(const std::string& bin_path, const BinaryStamp& stamp,
+                     const std::vector<FlagInfoPtr>& flags) const;
+
+ private:
+  std::string EntryPath(const std::string& bin_path) const;
+
+  std::string cache_dir_;
+};
+
+}  // namespace cuttlefish
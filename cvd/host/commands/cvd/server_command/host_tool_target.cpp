@@ -18,7 +18,10 @@
 
 #include <sys/stat.h>
 
+#include <future>
 #include <map>
+#include <optional>
+#include <set>
 
 #include <fruit/fruit.h>
 
@@ -28,6 +31,7 @@
 #include "common/libs/utils/subprocess.h"
 #include "host/commands/cvd/common_utils.h"
 #include "host/commands/cvd/server_command/flags_collector.h"
+#include "host/commands/cvd/server_command/helpxml_cache.h"
 
 namespace cuttlefish {
 namespace {
@@ -46,6 +50,49 @@ const std::map<std::string, std::vector<std::string>>& OpToBinsMap() {
   return map;
 }
 
+std::optional<std::vector<FlagInfoPtr>> RunHelpxml(
+    const std::string& bin_path, const std::string& artifacts_path) {
+  Command command(bin_path);
+  command.AddParameter("--helpxml");
+  // b/276497044
+  command.UnsetFromEnvironment(kAndroidHostOut);
+  command.AddEnvironmentVariable(kAndroidHostOut, artifacts_path);
+  command.UnsetFromEnvironment(kAndroidSoongHostOut);
+  command.AddEnvironmentVariable(kAndroidSoongHostOut, artifacts_path);
+
+  std::string xml_str;
+  RunWithManagedStdio(std::move(command), nullptr, std::addressof(xml_str),
+                      nullptr);
+  auto flags_opt = CollectFlagsFromHelpxml(xml_str);
+  if (!flags_opt) {
+    LOG(ERROR) << bin_path << " --helpxml failed.";
+  }
+  return flags_opt;
+}
+
+std::optional<std::vector<FlagInfoPtr>> CollectFlags(
+    const HelpxmlCache& cache, const std::string& bin_path,
+    const std::string& artifacts_path) {
+  auto stamp = HelpxmlCache::Stamp(bin_path);
+  if (!stamp.ok()) {
+    return RunHelpxml(bin_path, artifacts_path);
+  }
+  if (auto cached = cache.Load(bin_path, *stamp)) {
+    return cached;
+  }
+  auto flags = RunHelpxml(bin_path, artifacts_path);
+  if (!flags) {
+    // could be a transient failure, so not remembered
+    return flags;
+  }
+  auto stored = cache.Store(bin_path, *stamp, *flags);
+  if (!stored.ok()) {
+    LOG(DEBUG) << "Failed to cache the flags of " << bin_path << ": "
+               << stored.error().Message();
+  }
+  return flags;
+}
+
 }  // namespace
 
 Result<HostToolTarget> HostToolTarget::Create(
@@ -63,28 +110,36 @@ Result<HostToolTarget> HostToolTarget::Create(
     }
   }
 
-  for (auto& [op, op_impl] : op_to_impl_map) {
+  // e.g. snapshot_util_cvd implements several operations
+  std::set<std::string> bin_names;
+  for (const auto& [_, op_impl] : op_to_impl_map) {
+    bin_names.insert(op_impl.bin_name_);
+  }
+  // The probes run the binaries, so they are done concurrently
+  const HelpxmlCache cache(HelpxmlCache::DefaultDir());
+  std::map<std::string, std::future<std::optional<std::vector<FlagInfoPtr>>>>
+      probes;
+  for (const auto& bin_name : bin_names) {
     const std::string bin_path =
-        ConcatToString(artifacts_path, "/bin/", op_impl.bin_name_);
-    Command command(bin_path);
-    command.AddParameter("--helpxml");
-    // b/276497044
-    command.UnsetFromEnvironment(kAndroidHostOut);
-    command.AddEnvironmentVariable(kAndroidHostOut, artifacts_path);
-    command.UnsetFromEnvironment(kAndroidSoongHostOut);
-    command.AddEnvironmentVariable(kAndroidSoongHostOut, artifacts_path);
-
-    std::string xml_str;
-    RunWithManagedStdio(std::move(command), nullptr, std::addressof(xml_str),
-                        nullptr);
-    auto flags_opt = CollectFlagsFromHelpxml(xml_str);
-    if (!flags_opt) {
-      LOG(ERROR) << bin_path << " --helpxml failed.";
+        ConcatToString(artifacts_path, "/bin/", bin_name);
+    probes[bin_name] =
+        std::async(std::launch::async, [&cache, bin_path, artifacts_path]() {
+          return CollectFlags(cache, bin_path, artifacts_path);
+        });
+  }
+  std::map<std::string, std::optional<std::vector<FlagInfoPtr>>> bin_flags;
+  for (auto& [bin_name, probe] : probes) {
+    bin_flags[bin_name] = probe.get();
+  }
+
+  for (auto& [op, op_impl] : op_to_impl_map) {
+    const auto& flags = bin_flags[op_impl.bin_name_];
+    if (!flags) {
       continue;
     }
-    auto flags = std::move(*flags_opt);
-    for (auto& flag : flags) {
-      op_impl.supported_flags_[flag->Name()] = std::move(flag);
+    for (const auto& flag : *flags) {
+      op_impl.supported_flags_[flag->Name()] =
+          std::make_unique<FlagInfo>(*flag);
     }
   }
 
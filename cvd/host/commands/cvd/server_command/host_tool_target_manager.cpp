@@ -16,8 +16,13 @@
 
 #include "host/commands/cvd/server_command/host_tool_target_manager.h"
 
-#include "common/libs/utils/contains.h"
-#include "common/libs/utils/files.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+#include <android-base/logging.h>
+
 #include "host/commands/cvd/common_utils.h"
 
 namespace cuttlefish {
@@ -31,54 +36,83 @@ class HostToolTargetManagerImpl : public HostToolTargetManager {
       const HostToolExecNameRequestForm& request) override;
 
  private:
-  Result<void> EnsureExistence(const std::string& artifacts_path);
-  Result<void> UpdateOutdated(const std::string& artifacts_path);
+  /*
+   * One per artifacts path. The target is replaced as a whole, so readers
+   * only copy the pointer, and never wait for load_mutex unless the target
+   * is missing or outdated.
+   */
+  struct Entry {
+    std::mutex load_mutex;
+    // accessed with std::atomic_load/std::atomic_store
+    std::shared_ptr<const HostToolTarget> target;
+  };
 
-  using HostToolTargetMap = std::unordered_map<std::string, HostToolTarget>;
+  std::shared_ptr<Entry> GetEntry(const std::string& artifacts_path);
+  Result<std::shared_ptr<const HostToolTarget>> GetTarget(
+      const std::string& artifacts_path, const bool update_outdated);
 
   // map from artifact dir to host tool target information object
-  HostToolTargetMap host_target_table_;
-  // predefined mapping from an operation to potential executable binary names
-  // e.g. "start" -> {"cvd_internal_start", "launch_cvd"}
-  std::mutex table_mutex_;
+  std::unordered_map<std::string, std::shared_ptr<Entry>> host_target_table_;
+  // only guards the table; HostToolTarget::Create runs without it
+  std::shared_mutex table_mutex_;
 };
 
-// use this only after acquiring the table_mutex_
-Result<void> HostToolTargetManagerImpl::EnsureExistence(
-    const std::string& artifacts_path) {
-  if (!Contains(host_target_table_, artifacts_path)) {
-    HostToolTarget new_host_tool_target =
-        CF_EXPECT(HostToolTarget::Create(artifacts_path));
-    host_target_table_.emplace(artifacts_path, std::move(new_host_tool_target));
+std::shared_ptr<HostToolTargetManagerImpl::Entry>
+HostToolTargetManagerImpl::GetEntry(const std::string& artifacts_path) {
+  {
+    std::shared_lock lock(table_mutex_);
+    auto it = host_target_table_.find(artifacts_path);
+    if (it != host_target_table_.end()) {
+      return it->second;
+    }
   }
-  return {};
+  std::unique_lock lock(table_mutex_);
+  auto& entry = host_target_table_[artifacts_path];
+  if (!entry) {
+    entry = std::make_shared<Entry>();
+  }
+  return entry;
 }
 
-Result<void> HostToolTargetManagerImpl::UpdateOutdated(
-    const std::string& artifacts_path) {
-  CF_EXPECT(Contains(host_target_table_, artifacts_path));
-  auto& host_target = host_target_table_.at(artifacts_path);
-  if (!host_target.IsDirty()) {
-    return {};
+/*
+ * Concurrent requests for the same artifacts path wait for a single
+ * HostToolTarget::Create, while the other paths are not blocked.
+ */
+Result<std::shared_ptr<const HostToolTarget>>
+HostToolTargetManagerImpl::GetTarget(const std::string& artifacts_path,
+                                     const bool update_outdated) {
+  auto entry = GetEntry(artifacts_path);
+  auto is_usable = [update_outdated](
+                       const std::shared_ptr<const HostToolTarget>& target) {
+    return target && !(update_outdated && target->IsDirty());
+  };
+  auto target = std::atomic_load(&entry->target);
+  if (is_usable(target)) {
+    return target;
+  }
+  std::lock_guard load_lock(entry->load_mutex);
+  // loaded by another request while waiting for the lock
+  target = std::atomic_load(&entry->target);
+  if (is_usable(target)) {
+    return target;
+  }
+  if (target) {
+    LOG(ERROR) << artifacts_path << " is new, so updating HostToolTarget";
   }
-  LOG(ERROR) << artifacts_path << " is new, so updating HostToolTarget";
-  host_target_table_.erase(artifacts_path);
-  HostToolTarget new_host_tool_target =
-      CF_EXPECT(HostToolTarget::Create(artifacts_path));
-  host_target_table_.emplace(artifacts_path, std::move(new_host_tool_target));
-  return {};
+  target = std::make_shared<const HostToolTarget>(
+      CF_EXPECT(HostToolTarget::Create(artifacts_path),
+                "Could not create HostToolTarget object for "
+                    << artifacts_path));
+  std::atomic_store(&entry->target, target);
+  return target;
 }
 
 Result<FlagInfo> HostToolTargetManagerImpl::ReadFlag(
     const HostToolFlagRequestForm& request) {
-  std::lock_guard<std::mutex> lock(table_mutex_);
-  CF_EXPECT(
-      EnsureExistence(request.artifacts_path),
-      "Could not create HostToolTarget object for " << request.artifacts_path);
-  CF_EXPECT(UpdateOutdated(request.artifacts_path));
-  auto& host_target = host_target_table_.at(request.artifacts_path);
+  auto host_target = CF_EXPECT(
+      GetTarget(request.artifacts_path, /* update_outdated = */ true));
   auto flag_info =
-      CF_EXPECT(host_target.GetFlagInfo(HostToolTarget::FlagInfoRequest{
+      CF_EXPECT(host_target->GetFlagInfo(HostToolTarget::FlagInfoRequest{
           .operation_ = request.op,
           .flag_name_ = request.flag_name,
       }));
@@ -87,12 +121,9 @@ Result<FlagInfo> HostToolTargetManagerImpl::ReadFlag(
 
 Result<std::string> HostToolTargetManagerImpl::ExecBaseName(
     const HostToolExecNameRequestForm& request) {
-  std::lock_guard<std::mutex> lock(table_mutex_);
-  CF_EXPECT(
-      EnsureExistence(request.artifacts_path),
-      "Could not create HostToolTarget object for " << request.artifacts_path);
-  auto& host_target = host_target_table_.at(request.artifacts_path);
-  auto base_name = CF_EXPECT(host_target.GetBinName(request.op));
+  auto host_target = CF_EXPECT(
+      GetTarget(request.artifacts_path, /* update_outdated = */ false));
+  auto base_name = CF_EXPECT(host_target->GetBinName(request.op));
   return base_name;
 }
 
@@ -135,7 +135,7 @@ class LoadConfigsCommand : public CvdServerHandler {
 
     auto commands = CF_EXPECT(CreateCommandSequence(request));
     interrupt_lock.unlock();
-    CF_EXPECT(executor_.Execute(commands, request.Err()));
+    CF_EXPECT(executor_.ExecuteGraph(commands, request.Err()));
 
     cvd::Response response;
     response.mutable_command_response();
@@ -151,7 +151,12 @@ class LoadConfigsCommand : public CvdServerHandler {
 
   cvd_common::Args CmdList() const override { return {kLoadSubCmd}; }
 
-  Result<std::vector<RequestWithStdio>> CreateCommandSequence(
+  /*
+   * The instances are fetched concurrently, each into its own subdirectory,
+   * along with the creation of the HOME directory. The launch of the group
+   * needs all of them.
+   */
+  Result<std::vector<CommandGraphNode>> CreateCommandSequence(
       const RequestWithStdio& request) {
     const auto flags = CF_EXPECT(GetFlags(request));
 
@@ -172,12 +177,12 @@ class LoadConfigsCommand : public CvdServerHandler {
     std::vector<cvd::Request> req_protos;
     const auto& client_env = request.Message().command_request().env();
 
-    if (!cvd_flags.fetch_cvd_flags.empty()) {
+    for (const auto& fetch_flags : cvd_flags.fetch_cvd_flags) {
       auto& fetch_cmd = *req_protos.emplace_back().mutable_command_request();
       *fetch_cmd.mutable_env() = client_env;
       fetch_cmd.add_args("cvd");
       fetch_cmd.add_args("fetch");
-      for (const auto& flag : cvd_flags.fetch_cvd_flags) {
+      for (const auto& flag : fetch_flags) {
         fetch_cmd.add_args(flag);
       }
     }
@@ -225,11 +230,17 @@ class LoadConfigsCommand : public CvdServerHandler {
     auto dev_null = SharedFD::Open("/dev/null", O_RDWR);
     CF_EXPECT(dev_null->IsOpen(), dev_null->StrError());
     std::vector<SharedFD> fds = {dev_null, dev_null, dev_null};
-    std::vector<RequestWithStdio> ret;
+    std::vector<CommandGraphNode> ret;
 
     for (auto& request_proto : req_protos) {
-      ret.emplace_back(RequestWithStdio(request.Client(), request_proto, fds,
-                                        request.Credentials()));
+      ret.emplace_back(CommandGraphNode{
+          .request = RequestWithStdio(request.Client(), request_proto, fds,
+                                      request.Credentials()),
+      });
+    }
+    // the launch is the last one
+    for (std::size_t i = 0; i + 1 < ret.size(); i++) {
+      ret.back().dependencies.push_back(i);
     }
 
     return ret;
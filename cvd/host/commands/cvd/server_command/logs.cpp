@@ -0,0 +1,259 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/commands/cvd/server_command/logs.h"
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/scopeguard.h>
+#include <fmt/format.h>
+
+#include "common/libs/fs/shared_buf.h"
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/contains.h"
+#include "common/libs/utils/files.h"
+#include "common/libs/utils/result.h"
+#include "host/commands/cvd/flag.h"
+#include "host/commands/cvd/selector/selector_constants.h"
+#include "host/commands/cvd/server_command/server_handler.h"
+#include "host/commands/cvd/server_command/utils.h"
+#include "host/commands/cvd/types.h"
+#include "host/libs/config/cuttlefish_config.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr char kLogsSubcmd[] = "logs";
+constexpr char kDefaultLog[] = "kernel.log";
+// Of the lines not written to the client yet, past which the oldest ones
+// are dropped
+constexpr size_t kMaxPendingBytes = 4 << 20;
+
+constexpr char kLogsHelp[] =
+    R"(Usage: cvd logs [--follow] [--instance_num=N] [log name]
+
+Prints a log file of the selected instance, kernel.log by default. Other
+names are e.g. launcher.log or logcat.
+
+--follow keeps printing the lines appended to the log until interrupted. The
+file does not need to exist yet, e.g. right after "cvd start --daemon".
+)";
+
+/*
+ * The logs are in the "logs" directory of the instance, with links to them
+ * in the instance directory itself. The latter is used if neither exists
+ * yet, as the boot detection of cvd start does.
+ */
+std::string LogPath(const std::string& home, const unsigned instance_id,
+                    const std::string& name) {
+  const auto instance_dir =
+      ConcatToString(home, "/cuttlefish_runtime.", instance_id);
+  const auto log_dir_path =
+      ConcatToString(instance_dir, "/", kLogDirName, "/", name);
+  if (FileExists(log_dir_path)) {
+    return log_dir_path;
+  }
+  return ConcatToString(instance_dir, "/", name);
+}
+
+}  // namespace
+
+class CvdLogsCommandHandler : public CvdServerHandler {
+ public:
+  INJECT(CvdLogsCommandHandler(InstanceManager& instance_manager,
+                               LogTailService& log_tail_service))
+      : instance_manager_(instance_manager),
+        log_tail_service_(log_tail_service),
+        interrupt_event_(SharedFD::Event()) {}
+
+  Result<bool> CanHandle(const RequestWithStdio& request) const override {
+    auto invocation = ParseInvocation(request.Message());
+    return invocation.command == kLogsSubcmd;
+  }
+
+  Result<cvd::Response> Handle(const RequestWithStdio& request) override {
+    std::unique_lock interrupt_lock(interruptible_);
+    CF_EXPECT(!interrupted_, "Interrupted");
+    CF_EXPECT(CanHandle(request));
+    CF_EXPECT(request.Credentials() != std::nullopt);
+    CF_EXPECT(interrupt_event_->IsOpen(), interrupt_event_->StrError());
+    const uid_t uid = request.Credentials()->uid;
+
+    cvd::Response response;
+    response.mutable_command_response();
+    response.mutable_status()->set_code(cvd::Status::OK);
+
+    auto [_, subcmd_args] = ParseInvocation(request.Message());
+    if (IsHelpSubcmd(subcmd_args)) {
+      WriteAll(request.Out(), kLogsHelp);
+      return response;
+    }
+
+    CvdFlag<bool> follow_flag("follow", false);
+    CvdFlag<std::int32_t> instance_num_flag("instance_num");
+    const bool follow = CF_EXPECT(follow_flag.CalculateFlag(subcmd_args));
+    auto instance_num_opt =
+        CF_EXPECT(instance_num_flag.FilterFlag(subcmd_args));
+    CF_EXPECT(subcmd_args.size() <= 1,
+              "Expected at most one log name, got " << subcmd_args.size());
+    const std::string log_name =
+        subcmd_args.empty() ? kDefaultLog : subcmd_args.front();
+    CF_EXPECT(log_name.find('/') == std::string::npos,
+              "Invalid log name \"" << log_name << "\"");
+
+    selector::Queries extra_queries;
+    if (instance_num_opt) {
+      extra_queries.emplace_back(selector::kInstanceIdField, *instance_num_opt);
+    }
+    const auto& selector_opts =
+        request.Message().command_request().selector_opts();
+    const auto selector_args = cvd_common::ConvertToArgs(selector_opts.args());
+    auto envs =
+        cvd_common::ConvertToEnvs(request.Message().command_request().env());
+    auto instance = CF_EXPECT(instance_manager_.SelectInstance(
+        selector_args, extra_queries, envs, uid));
+    const auto path = LogPath(instance.ParentGroup().HomeDir(),
+                              instance.InstanceId(), log_name);
+
+    if (!follow) {
+      interrupt_lock.unlock();
+      CF_EXPECT(PrintLog(path, request.Out()));
+      return response;
+    }
+    interrupt_lock.unlock();
+    CF_EXPECT(FollowLog(path, request.Out()));
+    return response;
+  }
+
+  Result<void> Interrupt() override {
+    std::scoped_lock interrupt_lock(interruptible_);
+    interrupted_ = true;
+    CF_EXPECT_EQ(interrupt_event_->EventfdWrite(1), 0,
+                 interrupt_event_->StrError());
+    return {};
+  }
+
+  cvd_common::Args CmdList() const override { return {kLogsSubcmd}; }
+
+ private:
+  Result<void> PrintLog(const std::string& path, SharedFD out) {
+    auto log = SharedFD::Open(path, O_RDONLY);
+    CF_EXPECT(log->IsOpen(),
+              "Failed to open \"" << path << "\": " << log->StrError());
+    std::string contents;
+    CF_EXPECT(ReadAll(log, &contents) >= 0,
+              "Failed to read \"" << path << "\": " << log->StrError());
+    CF_EXPECT_EQ(WriteAll(out, contents), (ssize_t)contents.size(),
+                 out->StrError());
+    return {};
+  }
+
+  /*
+   * The lines are queued on the thread of the LogTailService, and written out
+   * on the request thread so that a slow client does not hold up other
+   * subscribers of the same file. The service can not wait for the client,
+   * so the oldest lines are dropped when too many are queued.
+   */
+  Result<void> FollowLog(const std::string& path, SharedFD out) {
+    auto lines_event = SharedFD::Event();
+    CF_EXPECT(lines_event->IsOpen(), lines_event->StrError());
+    std::mutex lines_mutex;
+    std::deque<std::string> lines;
+    size_t lines_bytes = 0;
+    size_t dropped_lines = 0;
+    std::optional<std::string> error;
+    auto on_line = [&lines_mutex, &lines, &lines_bytes, &dropped_lines, &error,
+                    lines_event](const LogTailEvent& event) {
+      std::lock_guard lines_lock(lines_mutex);
+      if (event.error) {
+        error = event.error;
+      } else {
+        lines_bytes += event.line.size();
+        lines.emplace_back(event.line);
+        while (lines_bytes > kMaxPendingBytes && lines.size() > 1) {
+          lines_bytes -= lines.front().size();
+          lines.pop_front();
+          dropped_lines++;
+        }
+      }
+      lines_event->EventfdWrite(1);
+    };
+    auto subscription =
+        CF_EXPECT(log_tail_service_.Subscribe(path, {}, on_line));
+    android::base::ScopeGuard unsubscribe([this, subscription]() {
+      log_tail_service_.Unsubscribe(subscription);
+    });
+
+    std::vector<PollSharedFd> fds = {
+        {.fd = lines_event, .events = POLLIN, .revents = 0},
+        {.fd = interrupt_event_, .events = POLLIN, .revents = 0},
+    };
+    while (true) {
+      int ret = SharedFD::Poll(fds, -1);
+      CF_EXPECT(ret > 0, "poll failed: " << strerror(errno));
+      if (fds[1].revents & POLLIN) {
+        return {};
+      }
+      eventfd_t unused;
+      lines_event->EventfdRead(&unused);
+      std::deque<std::string> pending;
+      size_t pending_dropped = 0;
+      std::optional<std::string> pending_error;
+      {
+        std::lock_guard lines_lock(lines_mutex);
+        pending.swap(lines);
+        lines_bytes = 0;
+        std::swap(pending_dropped, dropped_lines);
+        pending_error = error;
+      }
+      std::string chunk;
+      if (pending_dropped > 0) {
+        chunk = fmt::format("[{} lines dropped, not read fast enough]\n",
+                            pending_dropped);
+      }
+      for (const auto& line : pending) {
+        chunk.append(line).append("\n");
+      }
+      // fails once the client goes away
+      CF_EXPECT_EQ(WriteAll(out, chunk), (ssize_t)chunk.size(),
+                   out->StrError());
+      CF_EXPECTF(!pending_error, "Stopped following \"{}\": {}", path,
+                 *pending_error);
+    }
+  }
+
+  InstanceManager& instance_manager_;
+  LogTailService& log_tail_service_;
+  std::mutex interruptible_;
+  bool interrupted_ = false;
+  SharedFD interrupt_event_;
+};
+
+fruit::Component<fruit::Required<InstanceManager, LogTailService>>
+CvdLogsComponent() {
+  return fruit::createComponent()
+      .addMultibinding<CvdServerHandler, CvdLogsCommandHandler>();
+}
+
+}  // namespace cuttlefish
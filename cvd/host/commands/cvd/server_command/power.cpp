@@ -85,6 +85,9 @@ class CvdDevicePowerCommandHandler : public CvdServerHandler {
     interrupt_lock.unlock();
 
     auto infop = CF_EXPECT(subprocess_waiter_.Wait());
+    if (target_home_) {
+      instance_manager_.InvalidateStatus(*target_home_);
+    }
     return ResponseFromSiginfo(infop);
   }
 
@@ -169,6 +172,7 @@ class CvdDevicePowerCommandHandler : public CvdServerHandler {
         selector_args, extra_queries, envs, uid));
     const auto& instance_group = instance.ParentGroup();
     const auto& home = instance_group.HomeDir();
+    target_home_ = home;
 
     const auto& android_host_out = instance_group.HostArtifactsPath();
     const auto bin_base = CF_EXPECT(GetBin(op, android_host_out));
@@ -229,6 +233,8 @@ class CvdDevicePowerCommandHandler : public CvdServerHandler {
   SubprocessWaiter& subprocess_waiter_;
   std::mutex interruptible_;
   bool interrupted_ = false;
+  // HOME of the group the operation is applied to, unless it is --help
+  std::optional<std::string> target_home_;
   using BinGetter = std::function<Result<std::string>(const std::string&)>;
   std::unordered_map<std::string, BinGetter> cvd_power_operations_;
 };
@@ -20,6 +20,7 @@
 
 #include <chrono>
 #include <mutex>
+#include <optional>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -64,7 +65,7 @@ std::vector<cvd::Request> AppendRequestVectors(
 
 struct DemoCommandSequence {
   std::vector<InstanceLockFile> instance_locks;
-  std::vector<RequestWithStdio> requests;
+  std::vector<CommandGraphNode> requests;
 };
 
 /** Returns a `Flag` object that accepts comma-separated unsigned integers. */
@@ -127,7 +128,7 @@ class SerialLaunchCommand : public CvdServerHandler {
 
     auto commands = CF_EXPECT(CreateCommandSequence(request));
     interrupt_lock.unlock();
-    CF_EXPECT(executor_.Execute(commands.requests, request.Err()));
+    CF_EXPECT(executor_.ExecuteGraph(commands.requests, request.Err()));
 
     for (auto& lock : commands.instance_locks) {
       CF_EXPECT(lock.Status(InUseState::kInUse));
@@ -266,6 +267,17 @@ class SerialLaunchCommand : public CvdServerHandler {
                                                        ParentDir(client_uid)));
     req_protos = AppendRequestVectors(std::move(req_protos),
                                       std::move(mkdir_ancestors_requests));
+    // The devices are fetched concurrently. Only the launches of the other
+    // devices wait for the first one, as they share its hwsim and rootcanal.
+    std::vector<std::vector<std::size_t>> dependencies(req_protos.size());
+    for (std::size_t i = 1; i < req_protos.size(); i++) {
+      dependencies[i].push_back(i - 1);
+    }
+    std::optional<std::size_t> last_ancestor;
+    if (!req_protos.empty()) {
+      last_ancestor = req_protos.size() - 1;
+    }
+    std::optional<std::size_t> first_launch;
 
     bool is_first = true;
 
@@ -276,6 +288,10 @@ class SerialLaunchCommand : public CvdServerHandler {
       mkdir_cmd.add_args("cvd");
       mkdir_cmd.add_args("mkdir");
       mkdir_cmd.add_args(device.home_dir);
+      auto& mkdir_dependencies = dependencies.emplace_back();
+      if (last_ancestor) {
+        mkdir_dependencies.push_back(*last_ancestor);
+      }
 
       auto& fetch_cmd = *req_protos.emplace_back().mutable_command_request();
       *fetch_cmd.mutable_env() = client_env;
@@ -285,6 +301,7 @@ class SerialLaunchCommand : public CvdServerHandler {
       fetch_cmd.add_args("--directory=" + device.home_dir);
       fetch_cmd.add_args("-default_build=" + device.build);
       fetch_cmd.add_args("-credential_source=" + credentials);
+      dependencies.push_back({req_protos.size() - 2});
 
       auto& launch_cmd = *req_protos.emplace_back().mutable_command_request();
       *launch_cmd.mutable_env() = client_env;
@@ -293,6 +310,13 @@ class SerialLaunchCommand : public CvdServerHandler {
       (*launch_cmd.mutable_env())["ANDROID_HOST_OUT"] = device.home_dir;
       (*launch_cmd.mutable_env())["ANDROID_PRODUCT_OUT"] = device.home_dir;
       launch_cmd.add_args("cvd");
+      auto& launch_dependencies = dependencies.emplace_back();
+      launch_dependencies.push_back(req_protos.size() - 2);
+      if (first_launch) {
+        launch_dependencies.push_back(*first_launch);
+      } else {
+        first_launch = req_protos.size() - 1;
+      }
       /* TODO(kwstephenkim): remove kAcquireFileLockOpt flag when
        * SerialLaunchCommand is re-implemented so that it does not have to
        * acquire a file lock.
@@ -360,9 +384,12 @@ class SerialLaunchCommand : public CvdServerHandler {
     for (auto& device : devices) {
       ret.instance_locks.emplace_back(std::move(device.ins_lock));
     }
-    for (auto& request_proto : req_protos) {
-      ret.requests.emplace_back(request.Client(), request_proto, fds,
-                                request.Credentials());
+    for (std::size_t i = 0; i < req_protos.size(); i++) {
+      ret.requests.emplace_back(CommandGraphNode{
+          .request = RequestWithStdio(request.Client(), req_protos[i], fds,
+                                      request.Credentials()),
+          .dependencies = std::move(dependencies[i]),
+      });
     }
 
     return ret;
@@ -16,32 +16,39 @@
 
 #include "host/commands/cvd/server_command/start.h"
 
+#include <poll.h>
 #include <sys/types.h>
 
 #include <array>
 #include <atomic>
 #include <cstdint>
 #include <cstdlib>
-#include <fstream>
 #include <iostream>
 #include <map>
 #include <mutex>
 #include <optional>
-#include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
 
 #include <android-base/parseint.h>
+#include <android-base/scopeguard.h>
 #include <android-base/strings.h>
+#include <fmt/format.h>
 
+#include "common/libs/fs/shared_buf.h"
 #include "common/libs/fs/shared_fd.h"
 #include "common/libs/utils/contains.h"
 #include "common/libs/utils/files.h"
 #include "common/libs/utils/flag_parser.h"
 #include "common/libs/utils/result.h"
 #include "cvd_server.pb.h"
+#include "host/commands/assemble_cvd/flags_defaults.h"
+#include "host/commands/cvd/admission_controller.h"
 #include "host/commands/cvd/command_sequence.h"
 #include "host/commands/cvd/common_utils.h"
+#include "host/commands/cvd/group_cgroup.h"
+#include "host/commands/cvd/log_tail_service.h"
 #include "host/commands/cvd/server_command/server_handler.h"
 #include "host/commands/cvd/server_command/start_impl.h"
 #include "host/commands/cvd/server_command/subprocess_waiter.h"
@@ -64,6 +71,126 @@ std::optional<std::string> GetConfigPath(cvd_common::Args& args) {
   return config_file;
 }
 
+Result<void> VerifyCgroupWeight(const std::string& flag,
+                                const std::string& value) {
+  int weight;
+  CF_EXPECTF(android::base::ParseInt(value, &weight, 1, 10000),
+             "--{} should be from 1 to 10000, but is \"{}\"", flag, value);
+  return {};
+}
+
+/*
+ * Consumes the --cgroup_* flags, which are for the server rather than for
+ * the launcher
+ */
+Result<CgroupLimits> GetCgroupLimits(cvd_common::Args& args) {
+  std::string cpu_weight;
+  std::string cpu_max;
+  std::string memory_high;
+  std::string io_weight;
+  std::vector<Flag> cgroup_flags = {
+      GflagsCompatFlag("cgroup_cpu_weight", cpu_weight),
+      GflagsCompatFlag("cgroup_cpu_max", cpu_max),
+      GflagsCompatFlag("cgroup_memory_high", memory_high),
+      GflagsCompatFlag("cgroup_io_weight", io_weight)};
+  CF_EXPECT(ParseFlags(cgroup_flags, args));
+
+  CgroupLimits limits;
+  if (!cpu_weight.empty()) {
+    CF_EXPECT(VerifyCgroupWeight("cgroup_cpu_weight", cpu_weight));
+    limits.cpu_weight = cpu_weight;
+  }
+  if (!cpu_max.empty()) {
+    // "$MAX" or "$MAX,$PERIOD", as flag values can not have spaces
+    auto fields = android::base::Split(cpu_max, ",");
+    std::uint64_t usec;
+    CF_EXPECTF(fields.size() <= 2 &&
+                   (fields[0] == "max" ||
+                    android::base::ParseUint(fields[0], &usec)) &&
+                   (fields.size() == 1 ||
+                    android::base::ParseUint(fields[1], &usec)),
+               "--cgroup_cpu_max should be \"max\" or microseconds per "
+               "period, optionally followed by \",$PERIOD_USEC\", but is "
+               "\"{}\"",
+               cpu_max);
+    limits.cpu_max = android::base::Join(fields, " ");
+  }
+  if (!memory_high.empty()) {
+    std::uint64_t bytes;
+    CF_EXPECTF(memory_high == "max" ||
+                   android::base::ParseByteCount(memory_high, &bytes),
+               "--cgroup_memory_high should be \"max\" or bytes, with an "
+               "optional K, M or G suffix, but is \"{}\"",
+               memory_high);
+    // the kernel does not take the "b" suffix
+    limits.memory_high =
+        memory_high == "max" ? memory_high : std::to_string(bytes);
+  }
+  if (!io_weight.empty()) {
+    CF_EXPECT(VerifyCgroupWeight("cgroup_io_weight", io_weight));
+    limits.io_weight = io_weight;
+  }
+  return limits;
+}
+
+/*
+ * --pin_cpus gives the group host CPUs of its own, on one NUMA node if
+ * possible. Off by default, as the groups started without it still run on
+ * every CPU.
+ */
+Result<bool> GetPinCpusFlag(cvd_common::Args& args) {
+  bool pin_cpus = false;
+  std::vector<Flag> pin_flags = {GflagsCompatFlag("pin_cpus", pin_cpus)};
+  CF_EXPECT(ParseFlags(pin_flags, args));
+  return pin_cpus;
+}
+
+// The memory and disk size defaults of the launcher depend on the images
+constexpr std::uint64_t kMemoryMbEstimate = 4096;
+// the overlays, the userdata image and the runtime files of one instance
+constexpr std::uint64_t kDiskMbEstimate = 8192;
+
+/*
+ * The sum over the instances of a launcher flag that is either one value for
+ * every instance or a list of per-instance values. 0 if a value is invalid.
+ */
+std::uint64_t SumPerInstanceFlag(const selector::GroupCreationInfo& group_info,
+                                 const std::string& name,
+                                 const std::uint64_t default_value) {
+  auto args = group_info.args;
+  std::string flag_value;
+  std::vector<Flag> flags = {GflagsCompatFlag(name, flag_value)};
+  if (!ParseFlags(flags, args).ok()) {
+    return 0;
+  }
+  std::vector<std::string> values = android::base::Split(flag_value, ",");
+  std::uint64_t sum = 0;
+  for (size_t i = 0; i < group_info.instances.size(); i++) {
+    // the instances without a value of their own get the first one
+    const auto& value = i < values.size() ? values[i] : values[0];
+    std::uint64_t instance_value = default_value;
+    if (!value.empty() && !android::base::ParseUint(value, &instance_value)) {
+      return 0;
+    }
+    sum += instance_value;
+  }
+  return sum;
+}
+
+size_t NumGroupVcpus(const selector::GroupCreationInfo& group_info) {
+  return SumPerInstanceFlag(group_info, "cpus", CF_DEFAULTS_CPUS);
+}
+
+ResourceDemand EstimateDemand(const selector::GroupCreationInfo& group_info) {
+  return ResourceDemand{
+      .memory_mb =
+          SumPerInstanceFlag(group_info, "memory_mb", kMemoryMbEstimate),
+      .cpus = NumGroupVcpus(group_info),
+      .disk_mb = kDiskMbEstimate * group_info.instances.size(),
+      .disk_path = group_info.home,
+  };
+}
+
 RequestWithStdio CreateLoadCommand(const RequestWithStdio& request,
                                    cvd_common::Args& args,
                                    const std::string& config_file) {
@@ -88,12 +215,16 @@ class CvdStartCommandHandler : public CvdServerHandler {
  public:
   INJECT(CvdStartCommandHandler(InstanceManager& instance_manager,
                                 HostToolTargetManager& host_tool_target_manager,
-                                CommandSequenceExecutor& command_executor))
+                                CommandSequenceExecutor& command_executor,
+                                LogTailService& log_tail_service,
+                                AdmissionController& admission_controller))
       : instance_manager_(instance_manager),
         host_tool_target_manager_(host_tool_target_manager),
         // TODO: b/300476262 - Migrate to using local instances rather than
         // constructor-injected ones
         command_executor_(command_executor),
+        log_tail_service_(log_tail_service),
+        admission_controller_(admission_controller),
         sub_action_ended_(false) {}
 
   Result<bool> CanHandle(const RequestWithStdio& request) const;
@@ -104,7 +235,8 @@ class CvdStartCommandHandler : public CvdServerHandler {
  private:
   Result<void> UpdateInstanceDatabase(
       const uid_t uid, const selector::GroupCreationInfo& group_creation_info);
-  Result<void> FireCommand(Command&& command, const bool wait);
+  Result<void> FireCommand(Command&& command, const bool wait,
+                           SubprocessOptions options = SubprocessOptions());
   bool HasHelpOpts(const cvd_common::Args& args) const;
 
   Result<Command> ConstructCvdNonHelpCommand(
@@ -152,22 +284,32 @@ class CvdStartCommandHandler : public CvdServerHandler {
 
   Result<void> HandleNoDaemonWorker(
       const selector::GroupCreationInfo& group_creation_info,
-      std::atomic<bool>* interrupted, const uid_t uid);
+      std::atomic<bool>* interrupted, SharedFD interrupt_event,
+      const uid_t uid);
 
+  // The ticket is released once the devices booted, or failed to
   Result<cvd::Response> HandleNoDaemon(
       const std::optional<selector::GroupCreationInfo>& group_creation_info,
-      const uid_t uid);
+      const uid_t uid,
+      std::optional<AdmissionController::Ticket> admission_ticket);
   Result<cvd::Response> HandleDaemon(
       std::optional<selector::GroupCreationInfo>& group_creation_info,
-      const uid_t uid);
+      const uid_t uid,
+      std::optional<AdmissionController::Ticket> admission_ticket);
   Result<void> AcloudCompatActions(
       const selector::GroupCreationInfo& group_creation_info,
       const RequestWithStdio& request);
+  // Blocks while the host has no room for the group
+  Result<AdmissionController::Ticket> WaitForAdmission(
+      const selector::GroupCreationInfo& group_creation_info,
+      const RequestWithStdio& request);
 
   InstanceManager& instance_manager_;
   SubprocessWaiter subprocess_waiter_;
   HostToolTargetManager& host_tool_target_manager_;
   CommandSequenceExecutor& command_executor_;
+  LogTailService& log_tail_service_;
+  AdmissionController& admission_controller_;
   std::mutex interruptible_;
   bool interrupted_ = false;
   /*
@@ -670,13 +812,49 @@ Result<cvd::Response> CvdStartCommandHandler::Handle(
   CF_EXPECT(Contains(supported_commands_, subcmd),
             "subcmd should be start but is " << subcmd);
   const bool is_help = HasHelpOpts(subcmd_args);
+  const auto cgroup_limits = CF_EXPECT(GetCgroupLimits(subcmd_args));
+  const bool pin_cpus = CF_EXPECT(GetPinCpusFlag(subcmd_args));
   const bool is_daemon = CF_EXPECT(IsDaemonModeFlag(subcmd_args));
 
   std::optional<selector::GroupCreationInfo> group_creation_info;
+  // held until the devices booted, or failed to
+  std::optional<AdmissionController::Ticket> admission_ticket;
+  std::optional<GroupCgroup> cgroup;
+  bool database_updated = false;
+  // undoes what was set up for the group if the launcher is not started
+  android::base::ScopeGuard roll_back([this, uid, &group_creation_info,
+                                       &cgroup, &database_updated]() {
+    if (database_updated) {
+      // releases the cgroup and the CPU placement too
+      instance_manager_.RemoveInstanceGroup(uid, group_creation_info->home);
+    } else if (cgroup) {
+      auto release_result = ReleaseGroupCgroup(*cgroup);
+      if (!release_result.ok()) {
+        LOG(ERROR) << release_result.error().FormatForEnv();
+      }
+    }
+  });
   if (!is_help) {
     group_creation_info = CF_EXPECT(
         GetGroupCreationInfo(bin, subcmd, subcmd_args, envs, request));
+    interrupt_lock.unlock();
+    auto ticket = WaitForAdmission(*group_creation_info, request);
+    interrupt_lock.lock();
+    admission_ticket.emplace(CF_EXPECT(std::move(ticket)));
+    CF_EXPECT(!interrupted_, "Interrupted");
+    // run_cvd and the rest inherit the cgroup of the launcher
+    auto cgroup_result = CreateGroupCgroup(group_creation_info->home);
+    if (cgroup_result.ok()) {
+      cgroup = *cgroup_result;
+      CF_EXPECT(ApplyCgroupLimits(*cgroup, cgroup_limits));
+    } else {
+      CF_EXPECT(cgroup_limits.Empty(), cgroup_result.error().FormatForEnv());
+      LOG(ERROR) << "The processes of \"" << group_creation_info->group_name
+                 << "\" will not be tracked by cgroup: "
+                 << cgroup_result.error().FormatForEnv();
+    }
     CF_EXPECT(UpdateInstanceDatabase(uid, *group_creation_info));
+    database_updated = true;
     response = CF_EXPECT(
         FillOutNewInstanceInfo(std::move(response), *group_creation_info));
   }
@@ -693,15 +871,37 @@ Result<cvd::Response> CvdStartCommandHandler::Handle(
         "group_creation_info should be nullopt only when --help is given.");
   }
 
+  SubprocessOptions launch_options;
   if (is_help) {
     ShowLaunchCommand(command.Executable(), subcmd_args, envs);
   } else {
     ShowLaunchCommand(command.Executable(), *group_creation_info);
     CF_EXPECT(request.Message().command_request().wait_behavior() !=
               cvd::WAIT_BEHAVIOR_START);
+    if (cgroup) {
+      launch_options.Cgroup(cgroup->path);
+    }
+    if (pin_cpus) {
+      const auto num_vcpus = NumGroupVcpus(*group_creation_info);
+      auto placement =
+          instance_manager_.PlaceGroup(group_creation_info->home, num_vcpus);
+      // rather than running on the CPUs of the other pinned groups
+      CF_EXPECTF(placement.has_value(),
+                 "No room for the {} vCPUs of \"{}\" on dedicated host CPUs, "
+                 "or the host CPU topology is unknown. Start it without "
+                 "--pin_cpus to run it on any CPU.",
+                 num_vcpus, group_creation_info->group_name);
+      launch_options.CpuAffinity(placement->cpus);
+      if (placement->node) {
+        launch_options.NumaNode(*placement->node);
+      }
+    }
   }
 
-  FireCommand(std::move(command), /*should_wait*/ true);
+  CF_EXPECT(FireCommand(std::move(command), /*should_wait*/ true,
+                        std::move(launch_options)));
+  // from here on, the handlers of the launcher exit clean up the group
+  roll_back.Disable();
   interrupt_lock.unlock();
 
   if (is_help) {
@@ -718,88 +918,103 @@ Result<cvd::Response> CvdStartCommandHandler::Handle(
     LOG(ERROR) << "AcloudCompatActions() failed"
                << " but continue as they are minor errors.";
   }
-  return is_daemon ? HandleDaemon(group_creation_info, uid)
-                   : HandleNoDaemon(group_creation_info, uid);
+  return is_daemon ? HandleDaemon(group_creation_info, uid,
+                                  std::move(admission_ticket))
+                   : HandleNoDaemon(group_creation_info, uid,
+                                    std::move(admission_ticket));
 }
 
 Result<void> CvdStartCommandHandler::HandleNoDaemonWorker(
     const selector::GroupCreationInfo& group_creation_info,
-    std::atomic<bool>* interrupted, const uid_t uid) {
+    std::atomic<bool>* interrupted, SharedFD interrupt_event, const uid_t uid) {
   const std::string home_dir = group_creation_info.home;
   const std::string group_name = group_creation_info.group_name;
   std::string kernel_log_path =
       ConcatToString(home_dir, "/cuttlefish_runtime/kernel.log");
-  std::regex finger_pattern(
-      "\\[\\s*[0-9]*\\.[0-9]+\\]\\s*GUEST_BUILD_FINGERPRINT:");
-  std::regex boot_pattern("VIRTUAL_DEVICE_BOOT_COMPLETED");
-  std::streampos last_pos;
-  bool first_iteration = true;
-  while (*interrupted == false) {
-    if (!FileExists(kernel_log_path)) {
-      LOG(ERROR) << kernel_log_path << " does not yet exist, so wait for 5s";
-      using namespace std::chrono_literals;
-      std::this_thread::sleep_for(5s);
-      continue;
+  // The lines look like "[    1.234567] GUEST_BUILD_FINGERPRINT: ..."
+  const std::vector<std::string> patterns = {"GUEST_BUILD_FINGERPRINT:",
+                                             "VIRTUAL_DEVICE_BOOT_COMPLETED"};
+  auto boot_event = SharedFD::Event();
+  CF_EXPECT(boot_event->IsOpen(), boot_event->StrError());
+  std::mutex follow_error_mutex;
+  std::optional<std::string> follow_error;
+  auto on_match = [this, uid, group_name, boot_event, &follow_error_mutex,
+                   &follow_error](const LogTailEvent& event) {
+    if (event.error) {
+      std::lock_guard lock(follow_error_mutex);
+      follow_error = event.error;
+    } else if (event.pattern_index == 0) {
+      std::string build_id = event.line.substr(event.match_end);
+      auto set_build_id =
+          instance_manager_.SetBuildId(uid, group_name, build_id);
+      if (!set_build_id.ok()) {
+        LOG(ERROR) << set_build_id.error().FormatForEnv();
+      }
+      return;
     }
-    std::ifstream kernel_log_file(kernel_log_path);
-    CF_EXPECT(kernel_log_file.is_open(),
-              "The kernel log file exists but it cannot be open.");
-    if (!first_iteration) {
-      kernel_log_file.seekg(last_pos);
-    } else {
-      first_iteration = false;
-      last_pos = kernel_log_file.tellg();
+    boot_event->EventfdWrite(1);
+  };
+  // kernel.log may not exist yet, in which case the service waits for it
+  auto subscription = CF_EXPECT(
+      log_tail_service_.Subscribe(kernel_log_path, patterns, on_match));
+  android::base::ScopeGuard unsubscribe(
+      [this, subscription]() { log_tail_service_.Unsubscribe(subscription); });
+  std::vector<PollSharedFd> fds = {
+      {.fd = boot_event, .events = POLLIN, .revents = 0},
+      {.fd = interrupt_event, .events = POLLIN, .revents = 0},
+  };
+  while (*interrupted == false) {
+    int ret = SharedFD::Poll(fds, -1);
+    CF_EXPECT(ret > 0, "poll failed: " << strerror(errno));
+    if (fds[1].revents & POLLIN) {
+      break;
     }
-    for (std::string line; std::getline(kernel_log_file, line);) {
-      last_pos = kernel_log_file.tellg();
-      // if the line broke before a newline, this will end up reading the
-      // previous line one more time but only with '\n'. That's okay
-      last_pos -= line.size();
-      if (last_pos != std::ios_base::beg) {
-        last_pos -= std::string("\n").size();
-      }
-      std::smatch matched;
-      if (std::regex_search(line, matched, finger_pattern)) {
-        std::string build_id = matched.suffix().str();
-        CF_EXPECT(instance_manager_.SetBuildId(uid, group_name, build_id));
-        continue;
-      }
-      if (std::regex_search(line, matched, boot_pattern)) {
-        return {};
-      }
+    if (fds[0].revents & POLLIN) {
+      std::lock_guard lock(follow_error_mutex);
+      CF_EXPECTF(!follow_error, "Stopped following \"{}\": {}",
+                 kernel_log_path, *follow_error);
+      return {};
     }
-    using namespace std::chrono_literals;
-    std::this_thread::sleep_for(2s);
   }
   return CF_ERR("Cvd start kernel monitor interrupted.");
 }
 
 Result<cvd::Response> CvdStartCommandHandler::HandleNoDaemon(
     const std::optional<selector::GroupCreationInfo>& group_creation_info,
-    const uid_t uid) {
+    const uid_t uid,
+    std::optional<AdmissionController::Ticket> admission_ticket) {
   std::atomic<bool> interrupted;
   std::atomic<bool> worker_success;
   interrupted = false;
   worker_success = false;
+  auto interrupt_event = SharedFD::Event();
+  CF_EXPECT(interrupt_event->IsOpen(), interrupt_event->StrError());
   const auto* group_info = std::addressof(*group_creation_info);
   auto* interrupted_ptr = std::addressof(interrupted);
   auto* worker_success_ptr = std::addressof(worker_success);
-  std::thread worker = std::thread(
-      [this, group_info, interrupted_ptr, worker_success_ptr, uid]() {
-        LOG(ERROR) << "worker thread started.";
-        auto result = HandleNoDaemonWorker(*group_info, interrupted_ptr, uid);
-        *worker_success_ptr = result.ok();
-        if (*worker_success_ptr == false) {
-          LOG(ERROR) << result.error().FormatForEnv();
-        }
-      });
+  auto* ticket_ptr = std::addressof(admission_ticket);
+  std::thread worker = std::thread([this, group_info, interrupted_ptr,
+                                    interrupt_event, worker_success_ptr,
+                                    ticket_ptr, uid]() {
+    LOG(ERROR) << "worker thread started.";
+    auto result = HandleNoDaemonWorker(*group_info, interrupted_ptr,
+                                       interrupt_event, uid);
+    // booted or not, the devices don't need more room than they use now
+    ticket_ptr->reset();
+    *worker_success_ptr = result.ok();
+    if (*worker_success_ptr == false) {
+      LOG(ERROR) << result.error().FormatForEnv();
+    }
+  });
   auto infop = CF_EXPECT(subprocess_waiter_.Wait());
   if (infop.si_code != CLD_EXITED || infop.si_status != EXIT_SUCCESS) {
     // perhaps failed in launch
     instance_manager_.RemoveInstanceGroup(uid, group_creation_info->home);
     interrupted = true;
+    interrupt_event->EventfdWrite(1);
   }
   worker.join();
+  instance_manager_.InvalidateStatus(group_creation_info->home);
   auto final_response = ResponseFromSiginfo(infop);
   if (!final_response.has_status() ||
       final_response.status().code() != cvd::Status::OK) {
@@ -812,11 +1027,15 @@ Result<cvd::Response> CvdStartCommandHandler::HandleNoDaemon(
 
 Result<cvd::Response> CvdStartCommandHandler::HandleDaemon(
     std::optional<selector::GroupCreationInfo>& group_creation_info,
-    const uid_t uid) {
+    const uid_t uid,
+    std::optional<AdmissionController::Ticket> admission_ticket) {
   auto infop = CF_EXPECT(subprocess_waiter_.Wait());
+  // the daemonized launcher returns once the devices booted, or failed to
+  admission_ticket.reset();
   if (infop.si_code != CLD_EXITED || infop.si_status != EXIT_SUCCESS) {
     instance_manager_.RemoveInstanceGroup(uid, group_creation_info->home);
   }
+  instance_manager_.InvalidateStatus(group_creation_info->home);
 
   auto final_response = ResponseFromSiginfo(infop);
   if (!final_response.has_status() ||
@@ -848,6 +1067,25 @@ Result<void> CvdStartCommandHandler::SetBuildId(const uid_t uid,
   return {};
 }
 
+Result<AdmissionController::Ticket> CvdStartCommandHandler::WaitForAdmission(
+    const selector::GroupCreationInfo& group_creation_info,
+    const RequestWithStdio& request) {
+  auto interrupted = [this]() {
+    std::lock_guard interrupt_lock(interruptible_);
+    return interrupted_;
+  };
+  auto on_queued = [&group_creation_info,
+                    &request](const AdmissionController::QueueStatus& status) {
+    WriteAll(request.Err(),
+             fmt::format("Starting \"{}\" is queued until the host has room "
+                         "for it ({}): position {}, expected wait {}s\n",
+                         group_creation_info.group_name, status.reason,
+                         status.position, status.expected_wait.count()));
+  };
+  return CF_EXPECT(admission_controller_.Admit(
+      EstimateDemand(group_creation_info), interrupted, on_queued));
+}
+
 Result<void> CvdStartCommandHandler::Interrupt() {
   std::scoped_lock interrupt_lock(interruptible_);
   interrupted_ = true;
@@ -888,8 +1126,8 @@ Result<void> CvdStartCommandHandler::UpdateInstanceDatabase(
 }
 
 Result<void> CvdStartCommandHandler::FireCommand(Command&& command,
-                                                 const bool wait) {
-  SubprocessOptions options;
+                                                 const bool wait,
+                                                 SubprocessOptions options) {
   if (!wait) {
     options.ExitWithParent(false);
   }
@@ -914,8 +1152,10 @@ std::vector<std::string> CvdStartCommandHandler::CmdList() const {
 const std::array<std::string, 2> CvdStartCommandHandler::supported_commands_{
     "start", "launch_cvd"};
 
-fruit::Component<fruit::Required<InstanceManager, HostToolTargetManager,
-                                 CommandSequenceExecutor>>
+fruit::Component<
+    fruit::Required<InstanceManager, HostToolTargetManager,
+                    CommandSequenceExecutor, LogTailService,
+                    AdmissionController>>
 CvdStartCommandComponent() {
   return fruit::createComponent()
       .addMultibinding<CvdServerHandler, CvdStartCommandHandler>();
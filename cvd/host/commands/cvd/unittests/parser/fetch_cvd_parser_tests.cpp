@@ -49,6 +49,14 @@ Result<std::vector<std::string>> FetchCvdParserTestHelper(
   return ParseFetchCvdConfigs(root, target_directory, target_subdirectories);
 }
 
+Result<std::vector<std::vector<std::string>>> FetchCvdPerInstanceTestHelper(
+    Json::Value& root, const std::string& target_directory,
+    const std::vector<std::string>& target_subdirectories) {
+  CF_EXPECT(ValidateCfConfigs(root), "Loaded Json validation failed");
+  return ParseFetchCvdConfigsPerInstance(root, target_directory,
+                                         target_subdirectories);
+}
+
 }  // namespace
 
 TEST(FetchCvdParserTests, SingleFetch) {
@@ -222,4 +230,53 @@ TEST(FetchCvdParserTests, MultiFetch) {
       Contains("--bootloader_build=git_master/cf_x86_64_phone-userdebug,"));
 }
 
+TEST(FetchCvdParserTests, MultiFetchPerInstance) {
+  const char* raw_json = R""""(
+{
+  "instances" : [
+    {
+      "@import" : "phone",
+      "disk" : {
+        "default_build" : "@ab/git_master/cf_x86_64_phone-userdebug",
+        "host_package" : "@ab/git_master/cf_x86_64_phone-userdebug"
+      }
+    },
+    {
+      "@import" : "phone",
+      "disk" : {
+        "default_build" : "/local/path/without/prefix"
+      }
+    },
+    {
+      "@import" : "wearable",
+      "disk" : {
+        "default_build" : "@ab/git_master/cf_gwear_x86-userdebug"
+      }
+    }
+  ]
+}
+  )"""";
+  Json::Value json_config = GetTestJson(raw_json);
+
+  auto result_flags =
+      FetchCvdPerInstanceTestHelper(json_config, "/target", {"0", "1", "2"});
+  ASSERT_THAT(result_flags, IsOk())
+      << "Parsing config failed:  " << result_flags.error().Trace();
+
+  // the second instance has nothing to fetch
+  const auto per_instance = result_flags.value();
+  ASSERT_EQ(per_instance.size(), 2);
+  EXPECT_THAT(per_instance[0], Contains("--target_directory=/target"));
+  EXPECT_THAT(per_instance[0], Contains("--target_subdirectory=0"));
+  EXPECT_THAT(per_instance[0],
+              Contains("--default_build=git_master/cf_x86_64_phone-userdebug"));
+  EXPECT_THAT(
+      per_instance[0],
+      Contains("--host_package_build=git_master/cf_x86_64_phone-userdebug"));
+  EXPECT_THAT(per_instance[1], Contains("--target_directory=/target"));
+  EXPECT_THAT(per_instance[1], Contains("--target_subdirectory=2"));
+  EXPECT_THAT(per_instance[1],
+              Contains("--default_build=git_master/cf_gwear_x86-userdebug"));
+}
+
 }  // namespace cuttlefish
@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <atomic>
+#include <future>
+#include <optional>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result_matchers.h"
+#include "host/commands/cvd/admission_controller.h"
+
+namespace cuttlefish {
+namespace {
+
+// more than any host has
+ResourceDemand HugeDemand() {
+  return ResourceDemand{
+      .memory_mb = 1ULL << 40, .cpus = 1, .disk_mb = 1, .disk_path = "/"};
+}
+
+bool NotInterrupted() { return false; }
+
+}  // namespace
+
+TEST(AdmissionController, FirstRequestAlwaysAdmitted) {
+  AdmissionController controller;
+  auto ticket = controller.Admit(
+      HugeDemand(), NotInterrupted,
+      [](const AdmissionController::QueueStatus&) { FAIL(); });
+  ASSERT_THAT(ticket, IsOk());
+}
+
+TEST(AdmissionController, QueuedUntilRelease) {
+  AdmissionController controller;
+  std::optional<AdmissionController::Ticket> first;
+  first.emplace(*controller.Admit(HugeDemand(), NotInterrupted,
+                                  [](const auto&) {}));
+
+  std::promise<AdmissionController::QueueStatus> queued;
+  auto second = std::async(std::launch::async, [&]() {
+    return controller.Admit(HugeDemand(), NotInterrupted,
+                            [&queued](const auto& status) {
+                              queued.set_value(status);
+                            });
+  });
+  auto status = queued.get_future().get();
+  ASSERT_EQ(status.position, 1);
+  ASSERT_FALSE(status.reason.empty());
+
+  first.reset();
+  ASSERT_THAT(second.get(), IsOk());
+}
+
+TEST(AdmissionController, Interrupted) {
+  AdmissionController controller;
+  auto first = controller.Admit(HugeDemand(), NotInterrupted,
+                                [](const auto&) {});
+  ASSERT_THAT(first, IsOk());
+
+  std::atomic<bool> interrupted = false;
+  auto second = std::async(std::launch::async, [&]() {
+    return controller.Admit(
+        HugeDemand(), [&interrupted]() { return interrupted.load(); },
+        [&interrupted](const auto&) { interrupted = true; });
+  });
+  ASSERT_THAT(second.get(), IsError());
+}
+
+TEST(AdmissionController, QueueFull) {
+  AdmissionController controller;
+  auto first = controller.Admit(HugeDemand(), NotInterrupted,
+                                [](const auto&) {});
+  ASSERT_THAT(first, IsOk());
+
+  std::atomic<bool> interrupted = false;
+  std::vector<std::promise<void>> queued(4);
+  std::vector<std::future<Result<AdmissionController::Ticket>>> waiting;
+  for (auto& request_queued : queued) {
+    auto* promise = &request_queued;
+    waiting.emplace_back(std::async(std::launch::async, [&, promise]() {
+      return controller.Admit(
+          HugeDemand(), [&interrupted]() { return interrupted.load(); },
+          [promise, reported = false](const auto&) mutable {
+            // again when a request ahead leaves
+            if (!reported) {
+              reported = true;
+              promise->set_value();
+            }
+          });
+    }));
+    request_queued.get_future().get();
+  }
+
+  auto turned_away = controller.Admit(
+      HugeDemand(), NotInterrupted,
+      [](const AdmissionController::QueueStatus&) { FAIL(); });
+  ASSERT_THAT(turned_away, IsError());
+
+  interrupted = true;
+  for (auto& request : waiting) {
+    ASSERT_THAT(request.get(), IsError());
+  }
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,118 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <sys/stat.h>
+
+#include <set>
+#include <string>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result_matchers.h"
+#include "host/commands/cvd/cpu_placement.h"
+
+namespace cuttlefish {
+namespace {
+
+// two nodes of 4 CPUs
+CpuTopology TwoNodes() {
+  return CpuTopology{.node_cpus = {{0, {0, 1, 2, 3}}, {1, {4, 5, 6, 7}}}};
+}
+
+}  // namespace
+
+TEST(CpuPlacement, CpuList) {
+  auto cpus = ParseCpuList("0-3,8,10-11");
+  ASSERT_THAT(cpus, IsOk());
+  ASSERT_EQ(*cpus, (std::set<int>{0, 1, 2, 3, 8, 10, 11}));
+  ASSERT_EQ(FormatCpuList(*cpus), "0-3,8,10-11");
+  ASSERT_THAT(ParseCpuList("3-1"), IsError());
+}
+
+TEST(CpuPlacement, ReadTopology) {
+  TemporaryDir sysfs;
+  const std::string root = sysfs.path;
+  ASSERT_EQ(mkdir((root + "/cpu").c_str(), 0755), 0);
+  ASSERT_EQ(mkdir((root + "/node").c_str(), 0755), 0);
+  ASSERT_EQ(mkdir((root + "/node/node0").c_str(), 0755), 0);
+  ASSERT_EQ(mkdir((root + "/node/node1").c_str(), 0755), 0);
+  ASSERT_TRUE(android::base::WriteStringToFile("0-6\n", root + "/cpu/online"));
+  ASSERT_TRUE(
+      android::base::WriteStringToFile("0-1\n", root + "/node/online"));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "0-3\n", root + "/node/node0/cpulist"));
+  ASSERT_TRUE(android::base::WriteStringToFile(
+      "4-7\n", root + "/node/node1/cpulist"));
+
+  auto topology = CpuTopology::Read(root);
+  ASSERT_THAT(topology, IsOk());
+  ASSERT_EQ(topology->node_cpus.size(), 2);
+  ASSERT_EQ(topology->node_cpus[0], (std::set<int>{0, 1, 2, 3}));
+  // CPU 7 is offline
+  ASSERT_EQ(topology->node_cpus[1], (std::set<int>{4, 5, 6}));
+}
+
+TEST(CpuPlacement, StaysOnOneNode) {
+  CpuPlacementAllocator allocator(TwoNodes());
+
+  auto first = allocator.Allocate("/home/a", 3);
+  ASSERT_TRUE(first);
+  ASSERT_EQ(first->node, 0);
+  ASSERT_EQ(first->cpus, (std::set<int>{0, 1, 2}));
+
+  // node 0 has only one CPU left
+  auto second = allocator.Allocate("/home/b", 2);
+  ASSERT_TRUE(second);
+  ASSERT_EQ(second->node, 1);
+  ASSERT_EQ(second->cpus, (std::set<int>{4, 5}));
+
+  // best fit: the last CPU of node 0 rather than splitting node 1 further
+  auto third = allocator.Allocate("/home/c", 1);
+  ASSERT_TRUE(third);
+  ASSERT_EQ(third->cpus, (std::set<int>{3}));
+}
+
+TEST(CpuPlacement, SpansNodesOnlyWhenNeeded) {
+  CpuPlacementAllocator allocator(TwoNodes());
+  ASSERT_TRUE(allocator.Allocate("/home/a", 2));
+
+  auto wide = allocator.Allocate("/home/b", 6);
+  ASSERT_TRUE(wide);
+  ASSERT_EQ(wide->node, std::nullopt);
+  ASSERT_EQ(wide->cpus.size(), 6);
+
+  ASSERT_FALSE(allocator.Allocate("/home/c", 1));
+  allocator.Release("/home/a");
+  ASSERT_TRUE(allocator.Allocate("/home/c", 1));
+}
+
+TEST(CpuPlacement, ReserveAndReport) {
+  CpuPlacementAllocator allocator(TwoNodes());
+  ASSERT_THAT(allocator.Reserve("/home/a", {4, 5, 6}), IsOk());
+  ASSERT_THAT(allocator.Reserve("/home/b", {5}), IsError());
+
+  auto placement = allocator.Get("/home/a");
+  ASSERT_TRUE(placement);
+  ASSERT_EQ(placement->node, 1);
+
+  auto report = allocator.Report();
+  ASSERT_EQ(report["num_free_cpus"].asUInt64(), 5);
+  ASSERT_EQ(report["nodes"][1]["free_cpus"].asString(), "7");
+  // 1 of the 5 free CPUs is not on node 0
+  ASSERT_DOUBLE_EQ(report["fragmentation"].asDouble(), 0.2);
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,85 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <string>
+#include <vector>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result_matchers.h"
+#include "host/commands/cvd/server_command/helpxml_cache.h"
+
+namespace cuttlefish {
+namespace {
+
+std::vector<FlagInfoPtr> TestFlags() {
+  std::vector<FlagInfoPtr> flags;
+  flags.emplace_back(FlagInfo::Create({{"name", "daemon"}, {"type", "bool"}}));
+  flags.emplace_back(
+      FlagInfo::Create({{"name", "num_instances"}, {"type", "int32"}}));
+  return flags;
+}
+
+}  // namespace
+
+TEST(HelpxmlCache, StoreAndLoad) {
+  TemporaryDir cache_dir;
+  TemporaryFile bin;
+  HelpxmlCache cache(cache_dir.path);
+
+  auto stamp = HelpxmlCache::Stamp(bin.path);
+  ASSERT_THAT(stamp, IsOk());
+  ASSERT_FALSE(cache.Load(bin.path, *stamp));
+  ASSERT_THAT(cache.Store(bin.path, *stamp, TestFlags()), IsOk());
+
+  auto loaded = cache.Load(bin.path, *stamp);
+  ASSERT_TRUE(loaded);
+  ASSERT_EQ(loaded->size(), 2);
+  ASSERT_EQ((*loaded)[0]->Name(), "daemon");
+  ASSERT_EQ((*loaded)[0]->Type(), "bool");
+  ASSERT_EQ((*loaded)[1]->Name(), "num_instances");
+  ASSERT_EQ((*loaded)[1]->Type(), "int32");
+}
+
+TEST(HelpxmlCache, ModifiedBinaryMisses) {
+  TemporaryDir cache_dir;
+  TemporaryFile bin;
+  HelpxmlCache cache(cache_dir.path);
+
+  auto stamp = HelpxmlCache::Stamp(bin.path);
+  ASSERT_THAT(stamp, IsOk());
+  ASSERT_THAT(cache.Store(bin.path, *stamp, TestFlags()), IsOk());
+  ASSERT_TRUE(android::base::WriteStringToFile("rebuilt", bin.path));
+
+  auto new_stamp = HelpxmlCache::Stamp(bin.path);
+  ASSERT_THAT(new_stamp, IsOk());
+  ASSERT_FALSE(*new_stamp == *stamp);
+  ASSERT_FALSE(cache.Load(bin.path, *new_stamp));
+}
+
+TEST(HelpxmlCache, OtherBinaryMisses) {
+  TemporaryDir cache_dir;
+  TemporaryFile bin;
+  HelpxmlCache cache(cache_dir.path);
+
+  auto stamp = HelpxmlCache::Stamp(bin.path);
+  ASSERT_THAT(stamp, IsOk());
+  ASSERT_THAT(cache.Store(bin.path, *stamp, TestFlags()), IsOk());
+
+  ASSERT_FALSE(cache.Load(std::string(bin.path) + "_other", *stamp));
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <gtest/gtest.h>
+
+#include "common/libs/utils/result_matchers.h"
+#include "host/commands/cvd/instance_num_bitmap.h"
+
+namespace cuttlefish {
+
+TEST(InstanceNumBitmap, FindRange) {
+  auto nums = InstanceNumBitmap::ToWords({1, 3, 4, 5, 70, 71, 72, 127, 128});
+
+  ASSERT_EQ(InstanceNumBitmap::FindRange(1, nums, std::nullopt), 1);
+  ASSERT_EQ(InstanceNumBitmap::FindRange(2, nums, std::nullopt), 3);
+  ASSERT_EQ(InstanceNumBitmap::FindRange(3, nums, std::nullopt), 3);
+  ASSERT_EQ(InstanceNumBitmap::FindRange(2, nums, 70), 70);
+  // across a word boundary
+  ASSERT_EQ(InstanceNumBitmap::FindRange(2, nums, 127), 127);
+  ASSERT_EQ(InstanceNumBitmap::FindRange(4, nums, std::nullopt), std::nullopt);
+  ASSERT_EQ(InstanceNumBitmap::FindRange(2, nums, 5), 3);
+}
+
+TEST(InstanceNumBitmap, ClaimAndRelease) {
+  TemporaryDir dir;
+  auto bitmap = InstanceNumBitmap::Open(std::string(dir.path) + "/bitmap");
+  ASSERT_THAT(bitmap, IsOk());
+  const auto candidates = InstanceNumBitmap::ToWords({1, 2, 3, 4});
+
+  auto locked = (*bitmap)->Lock();
+  ASSERT_THAT(locked, IsOk());
+  ASSERT_EQ(locked->FindRange(2, candidates, 1), 1);
+  locked->Claim(2, /* provisional */ true);
+  ASSERT_TRUE(locked->IsClaimed(2));
+  ASSERT_TRUE(locked->Info(2).provisional);
+  ASSERT_EQ(locked->FindRange(2, candidates, 1), 3);
+  ASSERT_EQ(locked->FindRange(3, candidates, 1), std::nullopt);
+
+  locked->Release(2);
+  ASSERT_FALSE(locked->IsClaimed(2));
+  ASSERT_EQ(locked->FindRange(4, candidates, 1), 1);
+}
+
+TEST(InstanceNumBitmap, SharedAcrossOpens) {
+  TemporaryDir dir;
+  const auto path = std::string(dir.path) + "/bitmap";
+  auto first = InstanceNumBitmap::Open(path);
+  ASSERT_THAT(first, IsOk());
+  {
+    auto locked = (*first)->Lock();
+    ASSERT_THAT(locked, IsOk());
+    locked->Claim(5, /* provisional */ false);
+    locked->Claim(700, /* provisional */ false);
+  }
+
+  auto second = InstanceNumBitmap::Open(path);
+  ASSERT_THAT(second, IsOk());
+  auto locked = (*second)->Lock();
+  ASSERT_THAT(locked, IsOk());
+  ASSERT_EQ(locked->ClaimedNums(), (std::vector<int>{5, 700}));
+  ASSERT_EQ(locked->Info(5).owner, getpid());
+}
+
+TEST(InstanceNumBitmap, TruncatedByAnotherProcess) {
+  TemporaryDir dir;
+  const auto path = std::string(dir.path) + "/bitmap";
+  auto bitmap = InstanceNumBitmap::Open(path);
+  ASSERT_THAT(bitmap, IsOk());
+  {
+    auto locked = (*bitmap)->Lock();
+    ASSERT_THAT(locked, IsOk());
+    locked->Claim(5, /* provisional */ false);
+  }
+
+  ASSERT_EQ(truncate(path.c_str(), 0), 0);
+
+  auto locked = (*bitmap)->Lock();
+  ASSERT_THAT(locked, IsOk());
+  ASSERT_EQ(locked->ClaimedNums(), (std::vector<int>{}));
+  locked->Claim(6, /* provisional */ false);
+  ASSERT_TRUE(locked->IsClaimed(6));
+}
+
+}  // namespace cuttlefish
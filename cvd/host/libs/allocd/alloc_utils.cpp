@@ -15,14 +15,149 @@
  */
 #include "host/libs/allocd/alloc_utils.h"
 
+#include <atomic>
 #include <cstdint>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <vector>
 
 #include "android-base/logging.h"
+#include "host/libs/allocd/netlink.h"
+#include "host/libs/allocd/nftables.h"
 
 namespace cuttlefish {
+namespace {
+
+std::atomic<bool> use_netlink = true;
+std::atomic<bool> use_nftables = true;
+
+/*
+ * iptables and ebtables fail rather than wait when another instance holds the
+ * xtables lock, so the requests handled concurrently take turns running them.
+ */
+std::mutex netfilter_mutex;
+
+bool IsNetfilterCommand(const std::string& command) {
+  return command.rfind("iptables", 0) == 0 ||
+         command.rfind("ip6tables", 0) == 0 ||
+         command.rfind("ebtables", 0) == 0;
+}
+
+/*
+ * Runs the rtnetlink equivalent of an "ip" command. On failure, it is up to
+ * the caller to run the command, as before.
+ */
+bool TryNetlink(const std::string& what,
+                const std::function<Result<void>()>& request) {
+  if (!use_netlink) {
+    return false;
+  }
+  auto result = request();
+  if (!result.ok()) {
+    LOG(WARNING) << "Failed to " << what << " through rtnetlink, falling back "
+                 << "to the ip command: " << result.error().Message();
+    return false;
+  }
+  LOG(INFO) << "Done through rtnetlink: " << what;
+  return true;
+}
+
+/*
+ * Whether allocd's table of that family is set up, which is tried once: a
+ * kernel that does not support it will not later.
+ */
+bool NftablesTableReady(const bool bridge) {
+  static std::mutex mutex;
+  static std::optional<bool> bridge_ready;
+  static std::optional<bool> ip_ready;
+  std::lock_guard lock(mutex);
+  auto& ready = bridge ? bridge_ready : ip_ready;
+  if (!ready) {
+    NftablesBatch batch;
+    if (bridge) {
+      batch.SetUpBridgeTable();
+    } else {
+      batch.SetUpIpTable();
+    }
+    auto result = batch.Send();
+    if (!result.ok()) {
+      LOG(WARNING) << "Not using nftables for the " << (bridge ? "bridge" : "ip")
+                   << " rules: " << result.error().Message();
+    }
+    ready = result.ok();
+  }
+  return *ready;
+}
+
+/*
+ * Commits the nftables equivalent of ebtables or iptables commands, in one
+ * transaction. On failure nothing was changed, and it is up to the caller to
+ * run the commands, as before.
+ */
+bool TryNftables(const std::string& what, const bool bridge,
+                 const std::function<void(NftablesBatch&)>& build) {
+  if (!use_nftables || !NftablesTableReady(bridge)) {
+    return false;
+  }
+  NftablesBatch batch;
+  build(batch);
+  auto result = batch.Send();
+  if (!result.ok()) {
+    LOG(WARNING) << "Failed to " << what << " through nftables, falling back "
+                 << "to the commands: " << result.error().Message();
+    return false;
+  }
+  LOG(INFO) << "Done through nftables: " << what;
+  return true;
+}
+
+// The ebtables rules of CreateEbtables, for the protocols not bridged
+void EthernetRules(NftablesBatch& batch, const std::string& name,
+                   const bool has_ipv4_bridge, const bool has_ipv6_bridge,
+                   const bool add) {
+  if (!has_ipv4_bridge) {
+    batch.Broute(name, true, add).ForwardDrop(name, true, add);
+  }
+  if (!has_ipv6_bridge) {
+    batch.Broute(name, false, add).ForwardDrop(name, false, add);
+  }
+}
+
+Result<void> SetLinkThroughNetlink(const std::string& name,
+                                   const std::optional<bool> up,
+                                   const std::optional<int> master_index) {
+  CF_EXPECT(RtnetlinkBatch().SetLink(name, up, master_index).Send());
+  return {};
+}
+
+Result<void> AddressThroughNetlink(const std::string& name,
+                                   const std::string& gateway,
+                                   const std::string& netmask, const bool add) {
+  const auto index = CF_EXPECT(InterfaceIndex(name));
+  const auto address = CF_EXPECT(ParseIpv4(gateway));
+  const auto prefix_length = CF_EXPECT(ParsePrefixLength(netmask));
+  RtnetlinkBatch batch;
+  if (add) {
+    batch.AddAddress(index, address, prefix_length);
+  } else {
+    batch.DeleteAddress(index, address, prefix_length);
+  }
+  CF_EXPECT(batch.Send());
+  return {};
+}
+
+}  // namespace
+
+void SetUseNetlink(const bool use) { use_netlink = use; }
+
+void SetUseNftables(const bool use) { use_nftables = use; }
 
 int RunExternalCommand(const std::string& command) {
+  std::unique_lock<std::mutex> netfilter_lock(netfilter_mutex, std::defer_lock);
+  if (IsNetfilterCommand(command)) {
+    netfilter_lock.lock();
+  }
   FILE* fp;
   LOG(INFO) << "Running external command: " << command;
   fp = popen(command.c_str(), "r");
@@ -50,8 +185,14 @@ int RunExternalCommand(const std::string& command) {
 }
 
 bool AddTapIface(const std::string& name) {
+  if (TryNetlink("create tap " + name, [&name]() {
+        return CreatePersistentTap(name, kCvdNetworkGroup);
+      })) {
+    return true;
+  }
   std::stringstream ss;
-  ss << "ip tuntap add dev " << name << " mode tap group cvdnetwork vnet_hdr";
+  ss << "ip tuntap add dev " << name << " mode tap group " << kCvdNetworkGroup
+     << " vnet_hdr";
   auto add_command = ss.str();
   LOG(INFO) << "Create tap interface: " << add_command;
   int status = RunExternalCommand(add_command);
@@ -59,6 +200,11 @@ bool AddTapIface(const std::string& name) {
 }
 
 bool ShutdownIface(const std::string& name) {
+  if (TryNetlink("shutdown " + name, [&name]() {
+        return SetLinkThroughNetlink(name, false, std::nullopt);
+      })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip link set dev " << name << " down";
   auto link_command = ss.str();
@@ -69,6 +215,11 @@ bool ShutdownIface(const std::string& name) {
 }
 
 bool BringUpIface(const std::string& name) {
+  if (TryNetlink("bring up " + name, [&name]() {
+        return SetLinkThroughNetlink(name, true, std::nullopt);
+      })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip link set dev " << name << " up";
   auto link_command = ss.str();
@@ -80,22 +231,34 @@ bool BringUpIface(const std::string& name) {
 
 bool CreateEthernetIface(const std::string& name, const std::string& bridge_name,
                          bool has_ipv4_bridge, bool has_ipv6_bridge,
-                         bool use_ebtables_legacy) {
+                         bool use_ebtables_legacy, bool has_tap) {
   // assume bridge exists
 
   EthernetNetworkConfig config{false, false, false};
 
-  if (!CreateTap(name)) {
+  if (!has_tap && !CreateTap(name)) {
     return false;
   }
 
   config.has_tap = true;
 
-  if (!LinkTapToBridge(name, bridge_name)) {
+  if (!has_tap && !LinkTapToBridge(name, bridge_name)) {
     CleanupEthernetIface(name, config);
     return false;
   }
 
+  if (has_ipv4_bridge && has_ipv6_bridge) {
+    return true;
+  }
+  // all the rules at once, or none
+  if (TryNftables("add the bridge rules of " + name, true,
+                  [&](NftablesBatch& batch) {
+                    EthernetRules(batch, name, has_ipv4_bridge,
+                                  has_ipv6_bridge, true);
+                  })) {
+    return true;
+  }
+
   if (!has_ipv4_bridge) {
     if (!CreateEbtables(name, true, use_ebtables_legacy)) {
       CleanupEthernetIface(name, config);
@@ -105,7 +268,7 @@ bool CreateEthernetIface(const std::string& name, const std::string& bridge_name
   }
 
   if (!has_ipv6_bridge) {
-    if (CreateEbtables(name, false, use_ebtables_legacy)) {
+    if (!CreateEbtables(name, false, use_ebtables_legacy)) {
       CleanupEthernetIface(name, config);
       return false;
     }
@@ -129,7 +292,7 @@ std::string MobileNetworkName(const std::string& ipaddr,
 }
 
 bool CreateMobileIface(const std::string& name, uint16_t id,
-                       const std::string& ipaddr) {
+                       const std::string& ipaddr, bool has_tap) {
   if (id > kMaxIfaceNameId) {
     LOG(ERROR) << "ID exceeds maximum value to assign a netmask: " << id;
     return false;
@@ -139,7 +302,7 @@ bool CreateMobileIface(const std::string& name, uint16_t id,
   auto gateway = MobileGatewayName(ipaddr, id);
   auto network = MobileNetworkName(ipaddr, netmask, id);
 
-  if (!CreateTap(name)) {
+  if (!has_tap && !CreateTap(name)) {
     return false;
   }
 
@@ -174,6 +337,11 @@ bool DestroyMobileIface(const std::string& name, uint16_t id,
 
 bool AddGateway(const std::string& name, const std::string& gateway,
                 const std::string& netmask) {
+  if (TryNetlink("add " + gateway + netmask + " to " + name, [&]() {
+        return AddressThroughNetlink(name, gateway, netmask, true);
+      })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip addr add " << gateway << netmask << " broadcast + dev " << name;
   auto command = ss.str();
@@ -185,6 +353,11 @@ bool AddGateway(const std::string& name, const std::string& gateway,
 
 bool DestroyGateway(const std::string& name, const std::string& gateway,
                     const std::string& netmask) {
+  if (TryNetlink("remove " + gateway + netmask + " from " + name, [&]() {
+        return AddressThroughNetlink(name, gateway, netmask, false);
+      })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip addr del " << gateway << netmask << " broadcast + dev " << name;
   auto command = ss.str();
@@ -196,6 +369,17 @@ bool DestroyGateway(const std::string& name, const std::string& gateway,
 
 bool DestroyEthernetIface(const std::string& name, bool has_ipv4_bridge,
                           bool has_ipv6_bridge, bool use_ebtables_legacy) {
+  if (has_ipv4_bridge && has_ipv6_bridge) {
+    return DestroyIface(name);
+  }
+  if (TryNftables("delete the bridge rules of " + name, true,
+                  [&](NftablesBatch& batch) {
+                    EthernetRules(batch, name, has_ipv4_bridge,
+                                  has_ipv6_bridge, false);
+                  })) {
+    return DestroyIface(name);
+  }
+
   if (!has_ipv6_bridge) {
     DestroyEbtables(name, false, use_ebtables_legacy);
   }
@@ -224,12 +408,26 @@ void CleanupEthernetIface(const std::string& name,
 
 bool CreateEbtables(const std::string& name, bool use_ipv4,
                     bool use_ebtables_legacy) {
+  if (TryNftables("add the bridge rules of " + name, true,
+                  [&](NftablesBatch& batch) {
+                    batch.Broute(name, use_ipv4, true)
+                        .ForwardDrop(name, use_ipv4, true);
+                  })) {
+    return true;
+  }
   return EbtablesBroute(name, use_ipv4, true, use_ebtables_legacy) &&
          EbtablesFilter(name, use_ipv4, true, use_ebtables_legacy);
 }
 
 bool DestroyEbtables(const std::string& name, bool use_ipv4,
                      bool use_ebtables_legacy) {
+  if (TryNftables("delete the bridge rules of " + name, true,
+                  [&](NftablesBatch& batch) {
+                    batch.Broute(name, use_ipv4, false)
+                        .ForwardDrop(name, use_ipv4, false);
+                  })) {
+    return true;
+  }
   return EbtablesBroute(name, use_ipv4, false, use_ebtables_legacy) &&
          EbtablesFilter(name, use_ipv4, false, use_ebtables_legacy);
 }
@@ -273,6 +471,15 @@ bool EbtablesFilter(const std::string& name, bool use_ipv4, bool add,
 
 bool LinkTapToBridge(const std::string& tap_name,
                      const std::string& bridge_name) {
+  if (TryNetlink("link " + tap_name + " to " + bridge_name,
+                 [&]() -> Result<void> {
+                   const auto bridge = CF_EXPECT(InterfaceIndex(bridge_name));
+                   CF_EXPECT(SetLinkThroughNetlink(tap_name, std::nullopt,
+                                                   bridge));
+                   return {};
+                 })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip link set dev " << tap_name << " master " << bridge_name;
   auto command = ss.str();
@@ -283,6 +490,22 @@ bool LinkTapToBridge(const std::string& tap_name,
 
 bool CreateTap(const std::string& name) {
   LOG(INFO) << "Attempt to create tap interface: " << name;
+  // created and brought up with one ioctl sequence and one rtnetlink message
+  if (TryNetlink("create tap " + name + " and bring it up",
+                 [&name]() -> Result<void> {
+                   CF_EXPECT(CreatePersistentTap(name, kCvdNetworkGroup));
+                   auto up = SetLinkThroughNetlink(name, true, std::nullopt);
+                   if (!up.ok()) {
+                     // so that the fallback can create it again
+                     auto deleted = RtnetlinkBatch().DeleteLink(name).Send();
+                     if (!deleted.ok()) {
+                       LOG(WARNING) << deleted.error().Message();
+                     }
+                   }
+                   return up;
+                 })) {
+    return true;
+  }
   if (!AddTapIface(name)) {
     LOG(WARNING) << "Failed to create tap interface: " << name;
     return false;
@@ -297,7 +520,35 @@ bool CreateTap(const std::string& name) {
   return true;
 }
 
+bool RenameTapAndBringUp(const std::string& name,
+                         const std::string& new_name) {
+  if (TryNetlink("rename " + name + " to " + new_name + " and bring it up",
+                 [&]() -> Result<void> {
+                   const auto index = CF_EXPECT(InterfaceIndex(name));
+                   CF_EXPECT(RtnetlinkBatch()
+                                 .RenameLink(index, new_name)
+                                 .SetLink(new_name, true, std::nullopt)
+                                 .Send());
+                   return {};
+                 })) {
+    return true;
+  }
+  std::stringstream ss;
+  ss << "ip link set dev " << name << " name " << new_name;
+  auto command = ss.str();
+  LOG(INFO) << "Rename tap interface: " << command;
+  if (RunExternalCommand(command) != 0) {
+    return false;
+  }
+  return BringUpIface(new_name);
+}
+
 bool DeleteIface(const std::string& name) {
+  if (TryNetlink("delete " + name, [&name]() {
+        return RtnetlinkBatch().DeleteLink(name).Send();
+      })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip link delete " << name;
   auto link_command = ss.str();
@@ -308,6 +559,12 @@ bool DeleteIface(const std::string& name) {
 }
 
 bool DestroyIface(const std::string& name) {
+  // deleting the link takes it down first
+  if (TryNetlink("delete " + name, [&name]() {
+        return RtnetlinkBatch().DeleteLink(name).Send();
+      })) {
+    return true;
+  }
   if (!ShutdownIface(name)) {
     LOG(WARNING) << "Failed to shutdown tap interface: " << name;
     // the interface might have already shutdown ... so ignore and try to remove
@@ -324,7 +581,11 @@ bool DestroyIface(const std::string& name) {
 }
 
 std::optional<std::string> GetUserName(uid_t uid) {
-  passwd* pw = getpwuid(uid);
+  // getpwuid shares its result between the threads
+  std::vector<char> buffer(4096);
+  passwd entry;
+  passwd* pw = nullptr;
+  getpwuid_r(uid, &entry, buffer.data(), buffer.size(), &pw);
   if (pw) {
     std::string ret(pw->pw_name);
     return ret;
@@ -333,6 +594,12 @@ std::optional<std::string> GetUserName(uid_t uid) {
 }
 
 bool CreateBridge(const std::string& name) {
+  // created up, in one rtnetlink message
+  if (TryNetlink("create bridge " + name, [&name]() {
+        return RtnetlinkBatch().NewBridge(name).Send();
+      })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "ip link add name " << name
      << " type bridge forward_delay 0 stp_state 0";
@@ -458,6 +725,18 @@ bool StopDnsmasq(const std::string& name) {
 }
 
 bool IptableConfig(const std::string& network, bool add) {
+  const auto slash = network.find('/');
+  auto address = ParseIpv4(network.substr(0, slash));
+  auto prefix_length = ParsePrefixLength(
+      slash == std::string::npos ? "" : network.substr(slash));
+  if (address.ok() && prefix_length.ok() &&
+      TryNftables(std::string(add ? "add" : "delete") + " the masquerade of " +
+                      network,
+                  false, [&](NftablesBatch& batch) {
+                    batch.Masquerade(*address, *prefix_length, add);
+                  })) {
+    return true;
+  }
   std::stringstream ss;
   ss << "iptables -t nat " << (add ? "-A" : "-D") << " POSTROUTING -s "
      << network << " -j MASQUERADE";
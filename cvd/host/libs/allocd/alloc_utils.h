@@ -29,6 +29,7 @@
 
 namespace cuttlefish {
 
+constexpr char kCvdNetworkGroup[] = "cvdnetwork";
 constexpr char kEbtablesName[] = "ebtables";
 constexpr char kEbtablesLegacyName[] = "ebtables-legacy";
 
@@ -63,10 +64,19 @@ struct GatewayConfig {
 };
 
 int RunExternalCommand(const std::string& command);
+
+// Whether the taps, bridges and addresses are managed through rtnetlink, or
+// through the "ip" command. A failed rtnetlink request falls back to the
+// command anyway.
+void SetUseNetlink(bool use_netlink);
+// Likewise for the ebtables and iptables rules, through nftables
+void SetUseNftables(bool use_nftables);
 std::optional<std::string> GetUserName(uid_t uid);
 
 bool AddTapIface(const std::string& name);
 bool CreateTap(const std::string& name);
+// Renames a tap that is down, and brings it up
+bool RenameTapAndBringUp(const std::string& name, const std::string& new_name);
 
 bool BringUpIface(const std::string& name);
 bool ShutdownIface(const std::string& name);
@@ -86,14 +96,16 @@ bool EbtablesBroute(const std::string& name, bool use_ipv4, bool add,
 bool EbtablesFilter(const std::string& name, bool use_ipv4, bool add,
                     bool use_ebtables_legacy);
 
+// has_tap: the tap exists and is up, e.g. taken from the TapPool
 bool CreateMobileIface(const std::string& name, uint16_t id,
-                       const std::string& ipaddr);
+                       const std::string& ipaddr, bool has_tap = false);
 bool DestroyMobileIface(const std::string& name, uint16_t id,
                         const std::string& ipaddr);
 
+// has_tap: the tap exists, is up and is linked to the bridge
 bool CreateEthernetIface(const std::string& name, const std::string& bridge_name,
                          bool has_ipv4_bridge, bool has_ipv6_bridge,
-                         bool use_ebtables_legacy);
+                         bool use_ebtables_legacy, bool has_tap = false);
 bool DestroyEthernetIface(const std::string& name,
                           bool has_ipv4_bridge, bool use_ipv6,
                           bool use_ebtables_legacy);
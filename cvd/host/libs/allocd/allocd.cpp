@@ -41,17 +41,32 @@
 
 DEFINE_string(socket_path, cuttlefish::kDefaultLocation, "Socket path");
 DEFINE_bool(ebtables_legacy, false, "use ebtables-legacy instead of ebtables");
+DEFINE_bool(use_netlink, true,
+            "manage the network interfaces through rtnetlink rather than the "
+            "ip command");
+DEFINE_bool(use_nftables, true,
+            "commit the firewall rules of a request as one nftables "
+            "transaction rather than running ebtables and iptables");
+DEFINE_uint32(num_workers, 4,
+              "number of requests handled concurrently, the others wait");
+DEFINE_uint32(tap_pool_size, 2,
+              "number of taps created ahead of the requests, for each bridge "
+              "and for the mobile interfaces, 0 to create them on demand");
 
 int main(int argc, char* argv[]) {
   ::android::base::InitLogging(argv, android::base::StderrLogger);
 
   google::ParseCommandLineFlags(&argc, &argv, true);
+  cuttlefish::SetUseNetlink(FLAGS_use_netlink);
+  cuttlefish::SetUseNftables(FLAGS_use_nftables);
 
   cuttlefish::SharedFD FinalFD;
   {
     cuttlefish::ResourceManager m;
     m.SetSocketLocation(FLAGS_socket_path);
     m.SetUseEbtablesLegacy(FLAGS_ebtables_legacy);
+    m.SetNumWorkers(FLAGS_num_workers);
+    m.SetTapPoolSize(FLAGS_tap_pool_size);
     m.JsonServer();
   }
 
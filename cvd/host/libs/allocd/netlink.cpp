@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/libs/allocd/netlink.h"
+
+#include <linux/if_ether.h>
+// See common/libs/utils/network.cpp
+#define ethhdr __kernel_ethhdr
+#include <linux/if_tun.h>
+#undef ethhdr
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cstring>
+
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <fmt/format.h>
+
+#include "common/libs/fs/shared_fd.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr size_t kReceiveBufferSize = 8192;
+// The kernel answers right away, unless the netlink protocol is not there
+constexpr struct timeval kAckTimeout = {.tv_sec = 5, .tv_usec = 0};
+
+Result<gid_t> GroupId(const std::string& group) {
+  std::vector<char> buffer(4096);
+  struct group entry;
+  struct group* found = nullptr;
+  const int error = getgrnam_r(group.c_str(), &entry, buffer.data(),
+                               buffer.size(), &found);
+  CF_EXPECTF(error == 0 && found != nullptr, "No group \"{}\": {}", group,
+             strerror(error));
+  return found->gr_gid;
+}
+
+}  // namespace
+
+Result<void> CreatePersistentTap(const std::string& name,
+                                 const std::string& group) {
+  CF_EXPECTF(name.size() < IFNAMSIZ, "\"{}\" is too long", name);
+  const auto gid = CF_EXPECT(GroupId(group));
+
+  auto tun = SharedFD::Open("/dev/net/tun", O_RDWR | O_CLOEXEC);
+  CF_EXPECTF(tun->IsOpen(), "Failed to open /dev/net/tun: {}",
+             tun->StrError());
+  struct ifreq ifr;
+  memset(&ifr, 0, sizeof(ifr));
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+  strncpy(ifr.ifr_name, name.c_str(), IFNAMSIZ - 1);
+  CF_EXPECTF(tun->Ioctl(TUNSETIFF, &ifr) == 0, "TUNSETIFF \"{}\": {}", name,
+             tun->StrError());
+  // the tap goes away with the fd until it is persistent
+  CF_EXPECTF(tun->Ioctl(TUNSETGROUP, reinterpret_cast<void*>(gid)) == 0,
+             "TUNSETGROUP \"{}\": {}", name, tun->StrError());
+  CF_EXPECTF(tun->Ioctl(TUNSETPERSIST, reinterpret_cast<void*>(1)) == 0,
+             "TUNSETPERSIST \"{}\": {}", name, tun->StrError());
+  return {};
+}
+
+Result<int> InterfaceIndex(const std::string& name) {
+  const unsigned index = if_nametoindex(name.c_str());
+  CF_EXPECTF(index != 0, "No interface \"{}\": {}", name, strerror(errno));
+  return static_cast<int>(index);
+}
+
+Result<in_addr> ParseIpv4(const std::string& address) {
+  in_addr parsed;
+  CF_EXPECTF(inet_pton(AF_INET, address.c_str(), &parsed) == 1,
+             "\"{}\" is not an IPv4 address", address);
+  return parsed;
+}
+
+Result<int> ParsePrefixLength(const std::string& netmask) {
+  int prefix_length = 0;
+  CF_EXPECTF(android::base::StartsWith(netmask, "/") &&
+                 android::base::ParseInt(netmask.substr(1), &prefix_length, 0,
+                                         32),
+             "\"{}\" is not a prefix length", netmask);
+  return prefix_length;
+}
+
+RtnetlinkBatch::RtnetlinkBatch() : NetlinkBatch(NETLINK_ROUTE) {}
+
+RtnetlinkBatch& RtnetlinkBatch::NewBridge(const std::string& name) {
+  BeginMessage(RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL,
+               "create bridge " + name);
+  auto& info = Append<ifinfomsg>();
+  info.ifi_family = AF_UNSPEC;
+  info.ifi_flags = IFF_UP;
+  info.ifi_change = IFF_UP;
+  Attribute(IFLA_IFNAME, name);
+  const auto link_info = BeginNested(IFLA_LINKINFO);
+  Attribute(IFLA_INFO_KIND, "bridge", sizeof("bridge"));
+  const auto data = BeginNested(IFLA_INFO_DATA);
+  const std::uint32_t zero = 0;
+  Attribute(IFLA_BR_FORWARD_DELAY, &zero, sizeof(zero));
+  Attribute(IFLA_BR_STP_STATE, &zero, sizeof(zero));
+  EndNested(data);
+  EndNested(link_info);
+  EndMessage();
+  return *this;
+}
+
+RtnetlinkBatch& RtnetlinkBatch::SetLink(const std::string& name,
+                                        const std::optional<bool> up,
+                                        const std::optional<int> master_index) {
+  BeginMessage(RTM_NEWLINK, 0, "configure " + name);
+  auto& info = Append<ifinfomsg>();
+  info.ifi_family = AF_UNSPEC;
+  if (up) {
+    info.ifi_flags = *up ? IFF_UP : 0;
+    info.ifi_change = IFF_UP;
+  }
+  // found by name when ifi_index is 0
+  Attribute(IFLA_IFNAME, name);
+  if (master_index) {
+    const std::uint32_t master = *master_index;
+    Attribute(IFLA_MASTER, &master, sizeof(master));
+  }
+  EndMessage();
+  return *this;
+}
+
+RtnetlinkBatch& RtnetlinkBatch::DeleteLink(const std::string& name) {
+  BeginMessage(RTM_DELLINK, 0, "delete " + name);
+  auto& info = Append<ifinfomsg>();
+  info.ifi_family = AF_UNSPEC;
+  Attribute(IFLA_IFNAME, name);
+  EndMessage();
+  return *this;
+}
+
+RtnetlinkBatch& RtnetlinkBatch::RenameLink(const int index,
+                                           const std::string& new_name) {
+  BeginMessage(RTM_NEWLINK, 0,
+               fmt::format("rename interface #{} to {}", index, new_name));
+  auto& info = Append<ifinfomsg>();
+  info.ifi_family = AF_UNSPEC;
+  info.ifi_index = index;
+  Attribute(IFLA_IFNAME, new_name);
+  EndMessage();
+  return *this;
+}
+
+RtnetlinkBatch& RtnetlinkBatch::AddAddress(const int index,
+                                           const in_addr address,
+                                           const int prefix_length) {
+  return Address(RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, index, address,
+                 prefix_length);
+}
+
+RtnetlinkBatch& RtnetlinkBatch::DeleteAddress(const int index,
+                                              const in_addr address,
+                                              const int prefix_length) {
+  return Address(RTM_DELADDR, 0, index, address, prefix_length);
+}
+
+RtnetlinkBatch& RtnetlinkBatch::Address(const std::uint16_t type,
+                                        const std::uint16_t flags,
+                                        const int index, const in_addr address,
+                                        const int prefix_length) {
+  char address_str[INET_ADDRSTRLEN] = {};
+  inet_ntop(AF_INET, &address, address_str, sizeof(address_str));
+  BeginMessage(type, flags,
+               fmt::format("{} {}/{} on interface #{}",
+                           type == RTM_NEWADDR ? "add" : "delete", address_str,
+                           prefix_length, index));
+  auto& info = Append<ifaddrmsg>();
+  info.ifa_family = AF_INET;
+  info.ifa_prefixlen = prefix_length;
+  info.ifa_scope = RT_SCOPE_UNIVERSE;
+  info.ifa_index = index;
+  Attribute(IFA_LOCAL, &address, sizeof(address));
+  Attribute(IFA_ADDRESS, &address, sizeof(address));
+  if (prefix_length < 31) {
+    const std::uint32_t host_mask =
+        prefix_length == 0 ? ~0U : (1U << (32 - prefix_length)) - 1;
+    in_addr broadcast{.s_addr = address.s_addr | htonl(host_mask)};
+    Attribute(IFA_BROADCAST, &broadcast, sizeof(broadcast));
+  }
+  EndMessage();
+  return *this;
+}
+
+void NetlinkBatch::BeginMessage(const std::uint16_t type,
+                                const std::uint16_t flags,
+                                std::string description) {
+  descriptions_.emplace_back(std::move(description));
+  BeginUnackedMessage(type, NLM_F_ACK | flags);
+  reinterpret_cast<nlmsghdr*>(buffer_.data() + message_offset_)->nlmsg_seq =
+      descriptions_.size();
+}
+
+void NetlinkBatch::BeginUnackedMessage(const std::uint16_t type,
+                                       const std::uint16_t flags) {
+  message_offset_ = buffer_.size();
+  auto& header = Append<nlmsghdr>();
+  header.nlmsg_type = type;
+  header.nlmsg_flags = NLM_F_REQUEST | flags;
+}
+
+void NetlinkBatch::Attribute(const std::uint16_t type, const void* data,
+                             const size_t size) {
+  const auto offset = buffer_.size();
+  buffer_.resize(offset + RTA_SPACE(size), 0);
+  auto attribute = reinterpret_cast<rtattr*>(buffer_.data() + offset);
+  attribute->rta_type = type;
+  attribute->rta_len = RTA_LENGTH(size);
+  if (size > 0) {
+    memcpy(RTA_DATA(attribute), data, size);
+  }
+}
+
+void NetlinkBatch::Attribute(const std::uint16_t type,
+                             const std::string& value) {
+  Attribute(type, value.c_str(), value.size() + 1);
+}
+
+void NetlinkBatch::AttributeBe32(const std::uint16_t type,
+                                 const std::uint32_t value) {
+  const std::uint32_t be_value = htonl(value);
+  Attribute(type, &be_value, sizeof(be_value));
+}
+
+size_t NetlinkBatch::BeginNested(const std::uint16_t type) {
+  const auto offset = buffer_.size();
+  Attribute(type | NLA_F_NESTED, nullptr, 0);
+  return offset;
+}
+
+void NetlinkBatch::EndNested(const size_t offset) {
+  auto attribute = reinterpret_cast<rtattr*>(buffer_.data() + offset);
+  attribute->rta_len = buffer_.size() - offset;
+}
+
+void NetlinkBatch::EndMessage() {
+  auto header = reinterpret_cast<nlmsghdr*>(buffer_.data() + message_offset_);
+  header->nlmsg_len = buffer_.size() - message_offset_;
+}
+
+Result<void> NetlinkBatch::SendAndWaitForAcks() {
+  if (Empty()) {
+    return {};
+  }
+  auto socket = SharedFD::Socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, protocol_);
+  CF_EXPECTF(socket->IsOpen(), "Failed to open a netlink socket: {}",
+             socket->StrError());
+  // the acks do not need to carry the requests back
+  const int one = 1;
+  socket->SetSockOpt(SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+  const auto sent = socket->Send(buffer_.data(), buffer_.size(), 0);
+  CF_EXPECTF(sent == static_cast<ssize_t>(buffer_.size()),
+             "Failed to send the netlink requests: {}", socket->StrError());
+  CF_EXPECT(WaitForAcks(socket));
+  return {};
+}
+
+Result<void> NetlinkBatch::WaitForAcks(SharedFD socket) {
+  CF_EXPECTF(socket->SetSockOpt(SOL_SOCKET, SO_RCVTIMEO, &kAckTimeout,
+                                sizeof(kAckTimeout)) == 0,
+             "Failed to set the netlink ack timeout: {}", socket->StrError());
+  std::optional<std::string> first_error;
+  size_t acked = 0;
+  std::vector<char> reply(kReceiveBufferSize);
+  while (acked < descriptions_.size()) {
+    auto size = socket->Recv(reply.data(), reply.size(), 0);
+    CF_EXPECTF(size > 0, "Failed to receive the netlink acks: {}",
+               socket->GetErrno() == EAGAIN ? "timed out"
+                                            : socket->StrError());
+    for (auto header = reinterpret_cast<nlmsghdr*>(reply.data());
+         NLMSG_OK(header, size); header = NLMSG_NEXT(header, size)) {
+      if (header->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+      const auto error = reinterpret_cast<nlmsgerr*>(NLMSG_DATA(header))->error;
+      const auto seq = header->nlmsg_seq;
+      if (seq == 0 || seq > descriptions_.size()) {
+        // e.g. on the nfnetlink batch begin message, no ack is coming then
+        CF_EXPECTF(error == 0, "The kernel rejected the netlink requests: {}",
+                   strerror(-error));
+        continue;
+      }
+      acked++;
+      if (error != 0 && !first_error) {
+        first_error = fmt::format("Failed to {}: {}", descriptions_[seq - 1],
+                                  strerror(-error));
+      }
+    }
+  }
+  CF_EXPECT(!first_error, *first_error);
+  return {};
+}
+
+}  // namespace cuttlefish
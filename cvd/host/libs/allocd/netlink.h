@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <linux/netlink.h>
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result.h"
+
+namespace cuttlefish {
+
+/*
+ * Creates a persistent tap interface, down, as
+ * "ip tuntap add dev <name> mode tap group <group> vnet_hdr" does
+ */
+Result<void> CreatePersistentTap(const std::string& name,
+                                 const std::string& group);
+
+Result<int> InterfaceIndex(const std::string& name);
+
+// "192.168.96.1" and "/30"
+Result<in_addr> ParseIpv4(const std::string& address);
+Result<int> ParsePrefixLength(const std::string& netmask);
+
+/**
+ * Netlink requests sent to the kernel in one message, and their acks.
+ */
+class NetlinkBatch {
+ public:
+  bool Empty() const { return descriptions_.empty(); }
+
+ protected:
+  explicit NetlinkBatch(int protocol) : protocol_(protocol) {}
+
+  // An acked request, the description is for the error it may fail with
+  void BeginMessage(std::uint16_t type, std::uint16_t flags,
+                    std::string description);
+  // A message the kernel does not ack, e.g. the nfnetlink batch delimiters
+  void BeginUnackedMessage(std::uint16_t type, std::uint16_t flags);
+  template <typename T>
+  T& Append();
+  void Attribute(std::uint16_t type, const void* data, size_t size);
+  void Attribute(std::uint16_t type, const std::string& value);
+  // nftables expects its integers in network byte order
+  void AttributeBe32(std::uint16_t type, std::uint32_t value);
+  size_t BeginNested(std::uint16_t type);
+  void EndNested(size_t offset);
+  void EndMessage();
+
+  // Fails with the first request the kernel rejected
+  Result<void> SendAndWaitForAcks();
+  /*
+   * Also fails when the kernel rejects the batch as a whole, e.g. nfnetlink
+   * without CAP_NET_ADMIN, or when it does not answer in time.
+   */
+  Result<void> WaitForAcks(SharedFD socket);
+
+ private:
+  int protocol_;
+  std::vector<char> buffer_;
+  size_t message_offset_ = 0;
+  // one per acked request, for the errors
+  std::vector<std::string> descriptions_;
+};
+
+/**
+ * rtnetlink requests sent to the kernel in one message, replacing as many
+ * "ip" commands.
+ *
+ * The kernel handles the requests in order, and goes on after a failed one,
+ * so the later requests must not depend on the earlier ones succeeding.
+ */
+class RtnetlinkBatch : public NetlinkBatch {
+ public:
+  RtnetlinkBatch();
+
+  // A bridge with STP off and no forwarding delay, up
+  RtnetlinkBatch& NewBridge(const std::string& name);
+  RtnetlinkBatch& SetLink(const std::string& name, std::optional<bool> up,
+                          std::optional<int> master_index);
+  RtnetlinkBatch& DeleteLink(const std::string& name);
+  // The link must be down, the index does not change with the name
+  RtnetlinkBatch& RenameLink(int index, const std::string& new_name);
+  // With the broadcast address of the network, as "broadcast +" does
+  RtnetlinkBatch& AddAddress(int index, in_addr address, int prefix_length);
+  RtnetlinkBatch& DeleteAddress(int index, in_addr address, int prefix_length);
+
+  // Fails with the first request the kernel rejected
+  Result<void> Send() { return SendAndWaitForAcks(); }
+
+ private:
+  RtnetlinkBatch& Address(std::uint16_t type, std::uint16_t flags, int index,
+                          in_addr address, int prefix_length);
+};
+
+template <typename T>
+T& NetlinkBatch::Append() {
+  const auto offset = buffer_.size();
+  buffer_.resize(offset + NLMSG_ALIGN(sizeof(T)), 0);
+  return *reinterpret_cast<T*>(buffer_.data() + offset);
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,100 @@
+//
+// Copyright (C) 2023 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "host/libs/allocd/netlink.h"
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "common/libs/fs/shared_fd.h"
+#include "common/libs/utils/result_matchers.h"
+
+namespace cuttlefish {
+namespace {
+
+// Two acked requests, answered through a socket pair instead of the kernel
+class TestBatch : public NetlinkBatch {
+ public:
+  TestBatch() : NetlinkBatch(NETLINK_ROUTE) {
+    BeginUnackedMessage(NLMSG_NOOP, 0);
+    EndMessage();
+    BeginMessage(RTM_NEWLINK, 0, "do the first thing");
+    EndMessage();
+    BeginMessage(RTM_NEWLINK, 0, "do the second thing");
+    EndMessage();
+  }
+
+  using NetlinkBatch::WaitForAcks;
+};
+
+std::vector<char> Ack(std::uint32_t seq, int error) {
+  std::vector<char> message(NLMSG_SPACE(sizeof(nlmsgerr)), 0);
+  auto header = reinterpret_cast<nlmsghdr*>(message.data());
+  header->nlmsg_len = NLMSG_LENGTH(sizeof(nlmsgerr));
+  header->nlmsg_type = NLMSG_ERROR;
+  header->nlmsg_seq = seq;
+  reinterpret_cast<nlmsgerr*>(NLMSG_DATA(header))->error = -error;
+  return message;
+}
+
+class NetlinkBatchTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(SharedFD::SocketPair(AF_UNIX, SOCK_DGRAM, 0, &kernel_,
+                                     &socket_));
+  }
+
+  void Reply(const std::vector<char>& message) {
+    ASSERT_EQ(kernel_->Send(message.data(), message.size(), 0),
+              static_cast<ssize_t>(message.size()));
+  }
+
+  SharedFD kernel_;
+  SharedFD socket_;
+};
+
+}  // namespace
+
+TEST_F(NetlinkBatchTest, Acked) {
+  Reply(Ack(1, 0));
+  Reply(Ack(2, 0));
+  ASSERT_THAT(TestBatch().WaitForAcks(socket_), IsOk());
+}
+
+TEST_F(NetlinkBatchTest, RequestRejected) {
+  Reply(Ack(1, 0));
+  Reply(Ack(2, EEXIST));
+  auto result = TestBatch().WaitForAcks(socket_);
+  ASSERT_THAT(result, IsError());
+  ASSERT_NE(result.error().Message().find("do the second thing"),
+            std::string::npos);
+}
+
+TEST_F(NetlinkBatchTest, BatchRejected) {
+  // as nfnetlink does without CAP_NET_ADMIN, and then acks nothing else
+  Reply(Ack(0, EPERM));
+  auto result = TestBatch().WaitForAcks(socket_);
+  ASSERT_THAT(result, IsError());
+  ASSERT_NE(result.error().Message().find(strerror(EPERM)), std::string::npos);
+}
+
+}  // namespace cuttlefish
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/libs/allocd/nftables.h"
+
+#include <arpa/inet.h>
+#include <linux/if.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter_bridge.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#include <fmt/format.h>
+
+namespace cuttlefish {
+namespace {
+
+constexpr char kTable[] = "cuttlefish_allocd";
+constexpr char kBroutingChain[] = "brouting";
+constexpr char kForwardChain[] = "forward";
+constexpr char kPostroutingChain[] = "postrouting";
+constexpr char kBrouteIpv4Set[] = "broute_ipv4";
+constexpr char kBrouteIpv6Set[] = "broute_ipv6";
+constexpr char kForwardDropIpv4Set[] = "forward_drop_ipv4";
+constexpr char kForwardDropIpv6Set[] = "forward_drop_ipv6";
+constexpr char kMasqueradeSet[] = "masquerade";
+
+// The set key types as nft knows them, for it to print the elements
+constexpr std::uint32_t kIpv4AddrType = 7;
+constexpr std::uint32_t kIfnameType = 41;
+
+// NFT_META_BRI_BROUTE, from Linux 5.15, after the keys older headers have
+constexpr std::uint32_t kMetaBriBroute = NFT_META_SDIFNAME + 1;
+
+// the priorities of the ebtables broute and filter tables, and of SNAT
+constexpr std::int32_t kBroutingPriority = -300;
+constexpr std::int32_t kForwardPriority = NF_BR_PRI_FILTER_BRIDGED;
+constexpr std::int32_t kPostroutingPriority = 100;
+
+// iifname and oifname are compared as IFNAMSIZ bytes, zero padded
+std::vector<char> IfnameKey(const std::string& iface) {
+  std::vector<char> key(IFNAMSIZ, 0);
+  memcpy(key.data(), iface.data(), std::min<size_t>(iface.size(), IFNAMSIZ));
+  return key;
+}
+
+}  // namespace
+
+NftablesBatch::NftablesBatch() : NetlinkBatch(NETLINK_NETFILTER) {
+  BeginUnackedMessage(NFNL_MSG_BATCH_BEGIN, 0);
+  auto& header = Append<nfgenmsg>();
+  header.nfgen_family = AF_UNSPEC;
+  header.version = NFNETLINK_V0;
+  header.res_id = htons(NFNL_SUBSYS_NFTABLES);
+  EndMessage();
+}
+
+NftablesBatch& NftablesBatch::SetUpBridgeTable() {
+  BeginNftMessage(NFT_MSG_NEWTABLE, NLM_F_CREATE, NFPROTO_BRIDGE,
+                  fmt::format("create bridge table {}", kTable));
+  Attribute(NFTA_TABLE_NAME, kTable);
+  EndMessage();
+  NewChain(NFPROTO_BRIDGE, kBroutingChain, "filter", NF_BR_PRE_ROUTING,
+           kBroutingPriority);
+  NewChain(NFPROTO_BRIDGE, kForwardChain, "filter", NF_BR_FORWARD,
+           kForwardPriority);
+  for (const auto set : {kBrouteIpv4Set, kBrouteIpv6Set, kForwardDropIpv4Set,
+                         kForwardDropIpv6Set}) {
+    NewSet(NFPROTO_BRIDGE, set, kIfnameType, IFNAMSIZ, 0);
+  }
+  // the rules are replaced, in case they were changed
+  BeginNftMessage(NFT_MSG_DELRULE, 0, NFPROTO_BRIDGE,
+                  fmt::format("flush bridge table {}", kTable));
+  Attribute(NFTA_RULE_TABLE, kTable);
+  EndMessage();
+
+  for (const auto& [set, ethertype] :
+       {std::pair{kBrouteIpv4Set, ETH_P_IP}, {kBrouteIpv6Set, ETH_P_IPV6}}) {
+    auto expressions =
+        BeginInterfaceRule(kBroutingChain, NFT_META_IIFNAME, set, ethertype);
+    const std::uint8_t one = 1;
+    auto immediate = BeginExpression("immediate");
+    AttributeBe32(NFTA_IMMEDIATE_DREG, NFT_REG_1);
+    auto data = BeginNested(NFTA_IMMEDIATE_DATA);
+    Attribute(NFTA_DATA_VALUE, &one, sizeof(one));
+    EndNested(data);
+    EndExpression(immediate);
+    auto meta = BeginExpression("meta");
+    AttributeBe32(NFTA_META_KEY, kMetaBriBroute);
+    AttributeBe32(NFTA_META_SREG, NFT_REG_1);
+    EndExpression(meta);
+    EndNested(expressions);
+    EndMessage();
+  }
+  for (const auto& [set, ethertype] : {std::pair{kForwardDropIpv4Set, ETH_P_IP},
+                                       {kForwardDropIpv6Set, ETH_P_IPV6}}) {
+    auto expressions =
+        BeginInterfaceRule(kForwardChain, NFT_META_OIFNAME, set, ethertype);
+    auto immediate = BeginExpression("immediate");
+    AttributeBe32(NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+    auto data = BeginNested(NFTA_IMMEDIATE_DATA);
+    auto verdict = BeginNested(NFTA_DATA_VERDICT);
+    AttributeBe32(NFTA_VERDICT_CODE, NF_DROP);
+    EndNested(verdict);
+    EndNested(data);
+    EndExpression(immediate);
+    EndNested(expressions);
+    EndMessage();
+  }
+  return *this;
+}
+
+NftablesBatch& NftablesBatch::SetUpIpTable() {
+  BeginNftMessage(NFT_MSG_NEWTABLE, NLM_F_CREATE, NFPROTO_IPV4,
+                  fmt::format("create ip table {}", kTable));
+  Attribute(NFTA_TABLE_NAME, kTable);
+  EndMessage();
+  NewChain(NFPROTO_IPV4, kPostroutingChain, "nat", NF_INET_POST_ROUTING,
+           kPostroutingPriority);
+  NewSet(NFPROTO_IPV4, kMasqueradeSet, kIpv4AddrType, sizeof(in_addr),
+         NFT_SET_INTERVAL);
+  BeginNftMessage(NFT_MSG_DELRULE, 0, NFPROTO_IPV4,
+                  fmt::format("flush ip table {}", kTable));
+  Attribute(NFTA_RULE_TABLE, kTable);
+  EndMessage();
+
+  BeginNftMessage(NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND, NFPROTO_IPV4,
+                  "add the masquerade rule");
+  Attribute(NFTA_RULE_TABLE, kTable);
+  Attribute(NFTA_RULE_CHAIN, kPostroutingChain);
+  auto expressions = BeginNested(NFTA_RULE_EXPRESSIONS);
+  auto payload = BeginExpression("payload");
+  AttributeBe32(NFTA_PAYLOAD_DREG, NFT_REG_1);
+  AttributeBe32(NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+  AttributeBe32(NFTA_PAYLOAD_OFFSET, offsetof(iphdr, saddr));
+  AttributeBe32(NFTA_PAYLOAD_LEN, sizeof(in_addr));
+  EndExpression(payload);
+  auto lookup = BeginExpression("lookup");
+  Attribute(NFTA_LOOKUP_SET, std::string(kMasqueradeSet));
+  AttributeBe32(NFTA_LOOKUP_SREG, NFT_REG_1);
+  EndExpression(lookup);
+  Expression("masq");
+  EndNested(expressions);
+  EndMessage();
+  return *this;
+}
+
+NftablesBatch& NftablesBatch::Broute(const std::string& iface, const bool ipv4,
+                                     const bool add) {
+  const auto key = IfnameKey(iface);
+  SetElements(add, NFPROTO_BRIDGE, ipv4 ? kBrouteIpv4Set : kBrouteIpv6Set,
+              key.data(), key.size(),
+              fmt::format("{} the {} broute rule of {}",
+                          add ? "add" : "delete", ipv4 ? "ipv4" : "ipv6",
+                          iface));
+  return *this;
+}
+
+NftablesBatch& NftablesBatch::ForwardDrop(const std::string& iface,
+                                          const bool ipv4, const bool add) {
+  const auto key = IfnameKey(iface);
+  SetElements(add, NFPROTO_BRIDGE,
+              ipv4 ? kForwardDropIpv4Set : kForwardDropIpv6Set, key.data(),
+              key.size(),
+              fmt::format("{} the {} forward rule of {}",
+                          add ? "add" : "delete", ipv4 ? "ipv4" : "ipv6",
+                          iface));
+  return *this;
+}
+
+NftablesBatch& NftablesBatch::Masquerade(const in_addr network,
+                                         const int prefix_length,
+                                         const bool add) {
+  char network_str[INET_ADDRSTRLEN] = {};
+  inet_ntop(AF_INET, &network, network_str, sizeof(network_str));
+  const auto description =
+      fmt::format("{} the masquerade rule of {}/{}", add ? "add" : "delete",
+                  network_str, prefix_length);
+  // an interval set holds a range as its first address, and the address
+  // after its last one, flagged as the end
+  const std::uint32_t mask =
+      prefix_length == 0 ? 0 : ~0U << (32 - prefix_length);
+  const std::uint32_t first = ntohl(network.s_addr) & mask;
+  const std::uint32_t end = first + ~mask + 1;
+  const std::uint32_t first_be = htonl(first);
+  const std::uint32_t end_be = htonl(end);
+
+  BeginNftMessage(add ? NFT_MSG_NEWSETELEM : NFT_MSG_DELSETELEM,
+                  add ? NLM_F_CREATE : 0, NFPROTO_IPV4, description);
+  Attribute(NFTA_SET_ELEM_LIST_TABLE, kTable);
+  Attribute(NFTA_SET_ELEM_LIST_SET, std::string(kMasqueradeSet));
+  auto elements = BeginNested(NFTA_SET_ELEM_LIST_ELEMENTS);
+  auto element = BeginNested(NFTA_LIST_ELEM);
+  auto key = BeginNested(NFTA_SET_ELEM_KEY);
+  Attribute(NFTA_DATA_VALUE, &first_be, sizeof(first_be));
+  EndNested(key);
+  EndNested(element);
+  // up to the last address, there is no end
+  if (end != 0) {
+    element = BeginNested(NFTA_LIST_ELEM);
+    key = BeginNested(NFTA_SET_ELEM_KEY);
+    Attribute(NFTA_DATA_VALUE, &end_be, sizeof(end_be));
+    EndNested(key);
+    AttributeBe32(NFTA_SET_ELEM_FLAGS, NFT_SET_ELEM_INTERVAL_END);
+    EndNested(element);
+  }
+  EndNested(elements);
+  EndMessage();
+  return *this;
+}
+
+Result<void> NftablesBatch::Send() {
+  if (!ended_) {
+    BeginUnackedMessage(NFNL_MSG_BATCH_END, 0);
+    auto& header = Append<nfgenmsg>();
+    header.nfgen_family = AF_UNSPEC;
+    header.version = NFNETLINK_V0;
+    header.res_id = htons(NFNL_SUBSYS_NFTABLES);
+    EndMessage();
+    ended_ = true;
+  }
+  CF_EXPECT(SendAndWaitForAcks());
+  return {};
+}
+
+void NftablesBatch::BeginNftMessage(const std::uint16_t type,
+                                    const std::uint16_t flags,
+                                    const std::uint8_t family,
+                                    std::string description) {
+  BeginMessage((NFNL_SUBSYS_NFTABLES << 8) | type, flags,
+               std::move(description));
+  auto& header = Append<nfgenmsg>();
+  header.nfgen_family = family;
+  header.version = NFNETLINK_V0;
+  header.res_id = 0;
+}
+
+void NftablesBatch::NewChain(const std::uint8_t family, const std::string& name,
+                             const std::string& type, const std::uint32_t hook,
+                             const std::int32_t priority) {
+  BeginNftMessage(NFT_MSG_NEWCHAIN, NLM_F_CREATE, family,
+                  fmt::format("create chain {}", name));
+  Attribute(NFTA_CHAIN_TABLE, kTable);
+  Attribute(NFTA_CHAIN_NAME, name);
+  auto hook_attribute = BeginNested(NFTA_CHAIN_HOOK);
+  AttributeBe32(NFTA_HOOK_HOOKNUM, hook);
+  AttributeBe32(NFTA_HOOK_PRIORITY, static_cast<std::uint32_t>(priority));
+  EndNested(hook_attribute);
+  AttributeBe32(NFTA_CHAIN_POLICY, NF_ACCEPT);
+  Attribute(NFTA_CHAIN_TYPE, type);
+  EndMessage();
+}
+
+void NftablesBatch::NewSet(const std::uint8_t family, const std::string& name,
+                           const std::uint32_t key_type,
+                           const std::uint32_t key_length,
+                           const std::uint32_t flags) {
+  BeginNftMessage(NFT_MSG_NEWSET, NLM_F_CREATE, family,
+                  fmt::format("create set {}", name));
+  Attribute(NFTA_SET_TABLE, kTable);
+  Attribute(NFTA_SET_NAME, name);
+  AttributeBe32(NFTA_SET_FLAGS, flags);
+  AttributeBe32(NFTA_SET_KEY_TYPE, key_type);
+  AttributeBe32(NFTA_SET_KEY_LEN, key_length);
+  // identifies the set within the batch, required by the kernel
+  AttributeBe32(NFTA_SET_ID, ++next_set_id_);
+  EndMessage();
+}
+
+size_t NftablesBatch::BeginInterfaceRule(const std::string& chain,
+                                         const std::uint32_t meta_key,
+                                         const std::string& set,
+                                         const std::uint16_t ethertype) {
+  BeginNftMessage(NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND, NFPROTO_BRIDGE,
+                  fmt::format("add the rule of set {}", set));
+  Attribute(NFTA_RULE_TABLE, kTable);
+  Attribute(NFTA_RULE_CHAIN, chain);
+  const auto expressions = BeginNested(NFTA_RULE_EXPRESSIONS);
+
+  auto ifname = BeginExpression("meta");
+  AttributeBe32(NFTA_META_KEY, meta_key);
+  AttributeBe32(NFTA_META_DREG, NFT_REG_1);
+  EndExpression(ifname);
+  auto lookup = BeginExpression("lookup");
+  Attribute(NFTA_LOOKUP_SET, set);
+  AttributeBe32(NFTA_LOOKUP_SREG, NFT_REG_1);
+  EndExpression(lookup);
+
+  auto protocol = BeginExpression("meta");
+  AttributeBe32(NFTA_META_KEY, NFT_META_PROTOCOL);
+  AttributeBe32(NFTA_META_DREG, NFT_REG_1);
+  EndExpression(protocol);
+  const std::uint16_t ethertype_be = htons(ethertype);
+  auto cmp = BeginExpression("cmp");
+  AttributeBe32(NFTA_CMP_SREG, NFT_REG_1);
+  AttributeBe32(NFTA_CMP_OP, NFT_CMP_EQ);
+  auto data = BeginNested(NFTA_CMP_DATA);
+  Attribute(NFTA_DATA_VALUE, &ethertype_be, sizeof(ethertype_be));
+  EndNested(data);
+  EndExpression(cmp);
+  return expressions;
+}
+
+void NftablesBatch::Expression(const std::string& name) {
+  auto element = BeginNested(NFTA_LIST_ELEM);
+  Attribute(NFTA_EXPR_NAME, name);
+  EndNested(element);
+}
+
+NftablesBatch::NestedExpression NftablesBatch::BeginExpression(
+    const std::string& name) {
+  NestedExpression expression;
+  expression.element = BeginNested(NFTA_LIST_ELEM);
+  Attribute(NFTA_EXPR_NAME, name);
+  expression.data = BeginNested(NFTA_EXPR_DATA);
+  return expression;
+}
+
+void NftablesBatch::EndExpression(const NestedExpression& expression) {
+  EndNested(expression.data);
+  EndNested(expression.element);
+}
+
+void NftablesBatch::SetElements(const bool add, const std::uint8_t family,
+                                const std::string& set, const void* key,
+                                const size_t key_size,
+                                const std::string& description) {
+  BeginNftMessage(add ? NFT_MSG_NEWSETELEM : NFT_MSG_DELSETELEM,
+                  add ? NLM_F_CREATE : 0, family, description);
+  Attribute(NFTA_SET_ELEM_LIST_TABLE, kTable);
+  Attribute(NFTA_SET_ELEM_LIST_SET, set);
+  auto elements = BeginNested(NFTA_SET_ELEM_LIST_ELEMENTS);
+  auto element = BeginNested(NFTA_LIST_ELEM);
+  auto key_attribute = BeginNested(NFTA_SET_ELEM_KEY);
+  Attribute(NFTA_DATA_VALUE, key, key_size);
+  EndNested(key_attribute);
+  EndNested(element);
+  EndNested(elements);
+  EndMessage();
+}
+
+}  // namespace cuttlefish
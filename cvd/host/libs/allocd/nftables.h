@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <string>
+
+#include "common/libs/utils/result.h"
+#include "host/libs/allocd/netlink.h"
+
+namespace cuttlefish {
+
+/**
+ * nftables changes committed by the kernel as one transaction: all of them
+ * are applied, or none.
+ *
+ * The rules allocd needs are set up once, in a "cuttlefish_allocd" table of
+ * the bridge and ip families, and match the interfaces and networks against
+ * sets. Adding the rules of an interface is adding it to the sets, so a batch
+ * is only set element changes, which need no rule handles to be undone.
+ *
+ * Equivalent rules, in nft syntax:
+ *   table bridge cuttlefish_allocd {
+ *     chain brouting { type filter hook prerouting priority -300;
+ *       iifname @broute_ipv4 ether type ip meta broute set 1
+ *       iifname @broute_ipv6 ether type ip6 meta broute set 1 }
+ *     chain forward { type filter hook forward priority -200;
+ *       oifname @forward_drop_ipv4 ether type ip drop
+ *       oifname @forward_drop_ipv6 ether type ip6 drop }
+ *   }
+ *   table ip cuttlefish_allocd {
+ *     chain postrouting { type nat hook postrouting priority 100;
+ *       ip saddr @masquerade masquerade }
+ *   }
+ */
+class NftablesBatch : public NetlinkBatch {
+ public:
+  NftablesBatch();
+
+  /*
+   * Create the table, its chains and sets if needed, and replace its rules.
+   * The set elements, i.e. the interfaces and networks, are kept.
+   *
+   * The bridge table needs "meta broute", i.e. CONFIG_NFT_BRIDGE_META.
+   */
+  NftablesBatch& SetUpBridgeTable();
+  NftablesBatch& SetUpIpTable();
+
+  // "ebtables -t broute -A BROUTING -p <ipv4|ipv6> --in-if <iface> -j DROP"
+  NftablesBatch& Broute(const std::string& iface, bool ipv4, bool add);
+  // "ebtables -t filter -A FORWARD -p <ipv4|ipv6> --out-if <iface> -j DROP"
+  NftablesBatch& ForwardDrop(const std::string& iface, bool ipv4, bool add);
+  // "iptables -t nat -A POSTROUTING -s <network> -j MASQUERADE"
+  NftablesBatch& Masquerade(in_addr network, int prefix_length, bool add);
+
+  // Commits the changes, or fails with the first one the kernel rejected
+  Result<void> Send();
+
+ private:
+  void BeginNftMessage(std::uint16_t type, std::uint16_t flags,
+                       std::uint8_t family, std::string description);
+  void NewChain(std::uint8_t family, const std::string& name,
+                const std::string& type, std::uint32_t hook,
+                std::int32_t priority);
+  void NewSet(std::uint8_t family, const std::string& name,
+              std::uint32_t key_type, std::uint32_t key_length,
+              std::uint32_t flags);
+  struct NestedExpression {
+    size_t element;
+    size_t data;
+  };
+
+  /*
+   * A rule matching iifname or oifname in the set, with that ethertype, that
+   * the caller completes. Returns the expressions list for EndNested.
+   */
+  size_t BeginInterfaceRule(const std::string& chain, std::uint32_t meta_key,
+                            const std::string& set, std::uint16_t ethertype);
+  // An expression that takes no attributes
+  void Expression(const std::string& name);
+  NestedExpression BeginExpression(const std::string& name);
+  void EndExpression(const NestedExpression& expression);
+  void SetElements(bool add, std::uint8_t family, const std::string& set,
+                   const void* key, size_t key_size,
+                   const std::string& description);
+
+  bool ended_ = false;
+  std::uint32_t next_set_id_ = 0;
+};
+
+}  // namespace cuttlefish
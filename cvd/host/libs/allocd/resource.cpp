@@ -23,7 +23,7 @@
 namespace cuttlefish {
 
 bool MobileIface::AcquireResource() {
-  return CreateMobileIface(GetName(), iface_id_, ipaddr_);
+  return CreateMobileIface(GetName(), iface_id_, ipaddr_, has_tap_);
 }
 
 bool MobileIface::ReleaseResource() {
@@ -32,7 +32,7 @@ bool MobileIface::ReleaseResource() {
 
 bool EthernetIface::AcquireResource() {
   return CreateEthernetIface(GetName(), GetBridgeName(), has_ipv4_, has_ipv6_,
-                             use_ebtables_legacy_);
+                             use_ebtables_legacy_, has_tap_);
 }
 
 bool EthernetIface::ReleaseResource() {
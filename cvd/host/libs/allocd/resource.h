@@ -68,11 +68,15 @@ class MobileIface : public StaticResource {
   uint16_t GetIfaceId() { return iface_id_; }
   std::string GetIpAddr() { return ipaddr_; }
 
+  // The tap already exists and is up
+  void SetHasTap(bool has_tap) { has_tap_ = has_tap; }
+
   static constexpr char kNetmask[] = "/30";
 
  private:
   uint16_t iface_id_;
   std::string ipaddr_;
+  bool has_tap_ = false;
 };
 
 class EthernetIface : public StaticResource {
@@ -101,6 +105,8 @@ class EthernetIface : public StaticResource {
   void SetUseEbtablesLegacy(bool use_legacy) {
     use_ebtables_legacy_ = use_legacy;
   }
+  // The tap already exists, is up and is linked to the bridge
+  void SetHasTap(bool has_tap) { has_tap_ = has_tap; }
 
   bool GetHasIpv4() { return has_ipv4_; }
   bool GetHasIpv6() { return has_ipv6_; }
@@ -114,6 +120,7 @@ class EthernetIface : public StaticResource {
   bool has_ipv4_ = true;
   bool has_ipv6_ = true;
   bool use_ebtables_legacy_ = false;
+  bool has_tap_ = false;
 };
 
 }  // namespace cuttlefish
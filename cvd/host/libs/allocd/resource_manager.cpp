@@ -17,21 +17,27 @@
 #include "host/libs/allocd/resource_manager.h"
 
 #include <android-base/logging.h>
+#include <fcntl.h>
 #include <pwd.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iomanip>
 #include <memory>
 #include <optional>
 #include <sstream>
 #include <string>
 
+#include "common/libs/fs/epoll.h"
 #include "common/libs/fs/shared_fd.h"
 #include "host/libs/allocd/alloc_utils.h"
 #include "host/libs/allocd/request.h"
@@ -41,6 +47,31 @@
 #include "json/writer.h"
 
 namespace cuttlefish {
+namespace {
+
+// for a client to send its request, and to read the response
+constexpr auto kClientTimeout = std::chrono::seconds(10);
+// the clients connecting while the loop is busy wait in the backlog
+constexpr int kListenBacklog = 64;
+
+// Ticks every second, for the epoll loop to close the timed out connections
+Result<SharedFD> SweepTimer() {
+  const int timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  CF_EXPECTF(timer >= 0, "timerfd_create failed: {}", strerror(errno));
+  itimerspec period{
+      .it_interval = {.tv_sec = 1, .tv_nsec = 0},
+      .it_value = {.tv_sec = 1, .tv_nsec = 0},
+  };
+  const int set = timerfd_settime(timer, 0, &period, nullptr);
+  const int set_errno = errno;
+  auto timer_fd = SharedFD::Dup(timer);
+  close(timer);
+  CF_EXPECTF(set == 0, "timerfd_settime failed: {}", strerror(set_errno));
+  CF_EXPECTF(timer_fd->IsOpen(), "dup failed: {}", timer_fd->StrError());
+  return timer_fd;
+}
+
+}  // namespace
 
 uid_t GetUserIDFromSock(SharedFD client_socket);
 
@@ -76,11 +107,17 @@ uint32_t ResourceManager::AllocateSessionID() {
 }
 
 bool ResourceManager::AddInterface(const std::string& iface, IfaceType ty,
-                                   uint32_t resource_id, uid_t uid) {
+                                   uint32_t resource_id, uid_t uid,
+                                   PendingResources& pending) {
   bool allocatedIface = false;
   std::shared_ptr<StaticResource> res = nullptr;
 
-  bool didInsert = active_interfaces_.insert(iface).second;
+  // the name is claimed while the interface is being set up, outside the lock
+  bool didInsert = false;
+  {
+    std::lock_guard lock(state_mutex_);
+    didInsert = active_interfaces_.insert(iface).second;
+  }
   if (didInsert) {
     const char* idp = iface.c_str() + (iface.size() - 3);
     int small_id = atoi(idp);
@@ -88,23 +125,25 @@ bool ResourceManager::AddInterface(const std::string& iface, IfaceType ty,
       case IfaceType::wifiap:
         // TODO(seungjaeyoo) : Support AddInterface for wifiap
         break;
-      case IfaceType::mtap:
+      case IfaceType::mtap: {
         // TODO(seungjaeyoo) : Support AddInterface for mtap uses IP prefix
         // different from kMobileIp.
-        res = std::make_shared<MobileIface>(iface, uid, small_id, resource_id,
-                                            kMobileIp);
+        auto m = std::make_shared<MobileIface>(iface, uid, small_id,
+                                               resource_id, kMobileIp);
+        m->SetHasTap(TakePooledTap("", iface));
+        res = m;
         allocatedIface = res->AcquireResource();
-        pending_add_.insert({resource_id, res});
         break;
+      }
       case IfaceType::wtap: {
         auto w = std::make_shared<EthernetIface>(
             iface, uid, small_id, resource_id, "cvd-wbr", kWirelessIp);
         w->SetUseEbtablesLegacy(use_ebtables_legacy_);
         w->SetHasIpv4(use_ipv4_bridge_);
         w->SetHasIpv6(use_ipv6_bridge_);
+        w->SetHasTap(TakePooledTap("cvd-wbr", iface));
         res = w;
         allocatedIface = res->AcquireResource();
-        pending_add_.insert({resource_id, res});
         break;
       }
       case IfaceType::etap: {
@@ -113,9 +152,9 @@ bool ResourceManager::AddInterface(const std::string& iface, IfaceType ty,
         w->SetUseEbtablesLegacy(use_ebtables_legacy_);
         w->SetHasIpv4(use_ipv4_bridge_);
         w->SetHasIpv6(use_ipv6_bridge_);
+        w->SetHasTap(TakePooledTap("cvd-ebr", iface));
         res = w;
         allocatedIface = res->AcquireResource();
-        pending_add_.insert({resource_id, res});
         break;
       }
       case IfaceType::wbr:
@@ -131,10 +170,13 @@ bool ResourceManager::AddInterface(const std::string& iface, IfaceType ty,
 
   if (didInsert && !allocatedIface) {
     LOG(WARNING) << "Failed to allocate interface: " << iface;
+    if (res) {
+      res->ReleaseResource();
+    }
+    std::lock_guard lock(state_mutex_);
     active_interfaces_.erase(iface);
-    auto it = pending_add_.find(resource_id);
-    it->second->ReleaseResource();
-    pending_add_.erase(it);
+  } else if (allocatedIface && res) {
+    pending.insert({resource_id, res});
   }
 
   LOG(INFO) << "Finish CreateInterface Request";
@@ -142,8 +184,17 @@ bool ResourceManager::AddInterface(const std::string& iface, IfaceType ty,
   return allocatedIface;
 }
 
+bool ResourceManager::TakePooledTap(const std::string& bridge,
+                                    const std::string& iface) {
+  return tap_pool_ && tap_pool_->Take(bridge, iface);
+}
+
 bool ResourceManager::RemoveInterface(const std::string& iface, IfaceType ty) {
-  bool isManagedIface = active_interfaces_.erase(iface) > 0;
+  bool isManagedIface = false;
+  {
+    std::lock_guard lock(state_mutex_);
+    isManagedIface = active_interfaces_.erase(iface) > 0;
+  }
   bool removedIface = false;
   if (isManagedIface) {
     switch (ty) {
@@ -229,142 +280,385 @@ bool ResourceManager::ValidateRequest(const Json::Value& request) {
   return true;
 }
 
+struct ResourceManager::Connection {
+  enum class State {
+    kReadingHeader,
+    kReadingPayload,
+    kExecuting,
+    kWritingResponse,
+  };
+
+  explicit Connection(SharedFD socket)
+      : socket(std::move(socket)), deadline(Clock::now() + kClientTimeout) {}
+
+  SharedFD socket;
+  State state = State::kReadingHeader;
+  // what was received of the header or of the payload
+  std::string received;
+  size_t expected = sizeof(RequestHeader);
+  Json::Value request;
+  std::optional<Json::Value> response;
+  std::string to_send;
+  size_t sent = 0;
+  // for the client to send its request, or to read the response
+  Clock::time_point deadline;
+};
+
+bool ResourceManager::ReadRequest(Connection& connection) {
+  while (connection.received.size() < connection.expected) {
+    const auto offset = connection.received.size();
+    connection.received.resize(connection.expected);
+    auto bytes = connection.socket->Recv(connection.received.data() + offset,
+                                         connection.expected - offset,
+                                         kRecvFlags);
+    connection.received.resize(offset + std::max<ssize_t>(bytes, 0));
+    if (bytes < 0 && connection.socket->GetErrno() == EAGAIN) {
+      return true;
+    }
+    if (bytes <= 0) {
+      LOG(WARNING) << "Client hung up before sending a whole request";
+      return false;
+    }
+  }
+  if (connection.state == Connection::State::kReadingHeader) {
+    RequestHeader header;
+    memcpy(&header, connection.received.data(), sizeof(header));
+    if (header.version < kMinHeaderVersion) {
+      LOG(WARNING) << "bad request header version: " << header.version;
+      return false;
+    }
+    connection.state = Connection::State::kReadingPayload;
+    connection.received.clear();
+    connection.expected = header.len;
+    return ReadRequest(connection);
+  }
+  auto req_opt = JsonRequestReader().parse(std::move(connection.received));
+  if (!req_opt) {
+    LOG(WARNING) << "Invalid JSON Request, closing connection";
+    return false;
+  }
+  connection.request = std::move(*req_opt);
+  connection.state = Connection::State::kExecuting;
+  return true;
+}
+
+bool ResourceManager::WriteResponse(Connection& connection) {
+  while (connection.sent < connection.to_send.size()) {
+    auto bytes = connection.socket->Send(
+        connection.to_send.data() + connection.sent,
+        connection.to_send.size() - connection.sent, MSG_NOSIGNAL);
+    if (bytes < 0 && connection.socket->GetErrno() == EAGAIN) {
+      return true;
+    }
+    if (bytes <= 0) {
+      LOG(WARNING) << "Failed to send the response: "
+                   << connection.socket->StrError();
+      return false;
+    }
+    connection.sent += bytes;
+  }
+  LOG(INFO) << "Closing connection to client";
+  return false;
+}
+
+void ResourceManager::SetTapPoolSize(size_t size) { tap_pool_size_ = size; }
+
+void ResourceManager::SetNumWorkers(size_t num_workers) {
+  num_workers_ = std::max<size_t>(num_workers, 1);
+}
+
+void ResourceManager::RunWorker() {
+  while (true) {
+    std::shared_ptr<Connection> connection;
+    {
+      std::unique_lock lock(queue_mutex_);
+      queue_cv_.wait(lock,
+                     [this]() { return stop_workers_ || !requests_.empty(); });
+      if (requests_.empty()) {
+        return;
+      }
+      connection = std::move(requests_.front());
+      requests_.pop_front();
+    }
+    connection->response =
+        HandleConfigRequest(connection->socket, connection->request);
+    {
+      std::lock_guard lock(queue_mutex_);
+      completed_.emplace_back(std::move(connection));
+    }
+    completions_event_->EventfdWrite(1);
+  }
+}
+
 void ResourceManager::JsonServer() {
   LOG(INFO) << "Starting server on " << kDefaultLocation;
   auto server = SharedFD::SocketLocalServer(kDefaultLocation, false,
                                             SOCK_STREAM, kSocketMode);
   CHECK(server->IsOpen()) << "Could not start server at " << kDefaultLocation;
-  LOG(INFO) << "Accepting client connections";
-
-  while (true) {
-    auto client_socket = SharedFD::Accept(*server);
-    CHECK(client_socket->IsOpen()) << "Error creating client socket";
-
-    struct timeval timeout;
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+  // SocketLocalServer listens with a backlog of 1
+  CHECK(server->Listen(kListenBacklog) == 0) << server->StrError();
+  server->Fcntl(F_SETFL, server->Fcntl(F_GETFL, 0) | O_NONBLOCK);
+
+  auto epoll = Epoll::Create();
+  CHECK(epoll.ok()) << epoll.error().FormatForEnv();
+  completions_event_ = SharedFD::Event(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  CHECK(completions_event_->IsOpen()) << completions_event_->StrError();
+  auto sweep_timer = SweepTimer();
+  CHECK(sweep_timer.ok()) << sweep_timer.error().FormatForEnv();
+  CHECK(epoll->Add(server, EPOLLIN).ok());
+  CHECK(epoll->Add(completions_event_, EPOLLIN).ok());
+  CHECK(epoll->Add(*sweep_timer, EPOLLIN).ok());
+
+  if (tap_pool_size_ > 0) {
+    tap_pool_ = std::make_unique<TapPool>(
+        tap_pool_size_, std::vector<std::string>{"", "cvd-wbr", "cvd-ebr"});
+  }
+  for (size_t i = 0; i < num_workers_; i++) {
+    workers_.emplace_back([this]() { RunWorker(); });
+  }
 
-    int err = client_socket->SetSockOpt(SOL_SOCKET, SO_RCVTIMEO, &timeout,
-                                        sizeof(timeout));
-    if (err < 0) {
-      LOG(WARNING) << "Could not set socket timeout";
-      continue;
+  std::map<SharedFD, std::shared_ptr<Connection>> connections;
+  size_t executing = 0;
+  auto close_connection = [&](const SharedFD& socket) {
+    auto it = connections.find(socket);
+    // not watched while the request runs
+    if (it != connections.end() &&
+        it->second->state != Connection::State::kExecuting) {
+      auto deleted = epoll->Delete(socket);
+      if (!deleted.ok()) {
+        LOG(WARNING) << deleted.error().Message();
+      }
     }
-
-    auto req_opt = RecvJsonMsg(client_socket);
-
-    if (!req_opt) {
-      LOG(WARNING) << "Invalid JSON Request, closing connection";
-      continue;
+    connections.erase(socket);
+    std::lock_guard lock(state_mutex_);
+    if (socket != shutdown_socket_) {
+      socket->Close();
     }
+  };
 
-    Json::Value req = req_opt.value();
-
-    if (!ValidateConfigRequest(req)) {
+  LOG(INFO) << "Accepting client connections";
+  while (!shutdown_requested_ || executing > 0) {
+    auto event = epoll->Wait();
+    if (!event.ok()) {
+      LOG(ERROR) << event.error().FormatForEnv();
+      break;
+    }
+    if (!*event) {
       continue;
     }
+    const auto fd = (*event)->fd;
 
-    Json::Value req_list = req["config_request"]["request_list"];
-
-    Json::Value config_response;
-    Json::Value response_list;
-    Json::ArrayIndex req_list_size = req_list.size();
-
-    // sentinel value, so we can populate the list of responses correctly
-    // without trying to satisfy requests that will be aborted
-    bool transaction_failed = false;
-
-    for (Json::ArrayIndex i = 0; i < req_list_size; ++i) {
-      LOG(INFO) << "Processing Request: " << i;
-      auto req = req_list[i];
-      auto req_ty_str = req["request_type"].asString();
-      auto req_ty = StrToReqTy(req_ty_str);
-
-      Json::Value response;
-      if (transaction_failed) {
-        response["request_type"] = req_ty_str;
-        response["request_status"] = "pending";
-        response["error"] = "";
-        response_list.append(response);
+    if (fd == server) {
+      auto client_socket = SharedFD::Accept(*server);
+      if (!client_socket->IsOpen()) {
+        LOG(WARNING) << "Error creating client socket: "
+                     << client_socket->StrError();
         continue;
       }
-
-      switch (req_ty) {
-        case RequestType::ID: {
-          response = JsonHandleIdRequest();
-          break;
-        }
-        case RequestType::Shutdown: {
-          if (i != 0 || req_list_size != 1) {
-            response["request_type"] = req_ty_str;
-            response["request_status"] = "failed";
-            response["error"] =
-                "Shutdown requests cannot be processed with other "
-                "configuration requests";
-            response_list.append(response);
-            break;
-          } else {
-            response = JsonHandleShutdownRequest(client_socket);
-            response_list.append(response);
-            return;
-          }
-        }
-        case RequestType::CreateInterface: {
-          response = JsonHandleCreateInterfaceRequest(client_socket, req);
-          break;
+      client_socket->Fcntl(F_SETFL,
+                           client_socket->Fcntl(F_GETFL, 0) | O_NONBLOCK);
+      auto added = epoll->Add(client_socket, EPOLLIN);
+      if (!added.ok()) {
+        LOG(WARNING) << added.error().Message();
+        continue;
+      }
+      connections[client_socket] = std::make_shared<Connection>(client_socket);
+
+    } else if (fd == completions_event_) {
+      eventfd_t count;
+      completions_event_->EventfdRead(&count);
+      std::deque<std::shared_ptr<Connection>> completed;
+      {
+        std::lock_guard lock(queue_mutex_);
+        completed.swap(completed_);
+      }
+      for (auto& connection : completed) {
+        executing--;
+        if (!connection->response) {
+          close_connection(connection->socket);
+          continue;
         }
-        case RequestType::DestroyInterface: {
-          response = JsonHandleDestroyInterfaceRequest(req);
-          break;
+        connection->state = Connection::State::kWritingResponse;
+        connection->to_send = SerializeJsonMsg(*connection->response);
+        connection->deadline = Clock::now() + kClientTimeout;
+        auto added = epoll->Add(connection->socket, EPOLLOUT);
+        if (!added.ok()) {
+          LOG(WARNING) << added.error().Message();
+          close_connection(connection->socket);
         }
-        case RequestType::StopSession: {
-          response = JsonHandleStopSessionRequest(
-              req, GetUserIDFromSock(client_socket));
-          break;
+      }
+      if (shutdown_requested_ && server->IsOpen()) {
+        LOG(INFO) << "Not accepting clients any more";
+        auto deleted = epoll->Delete(server);
+        if (!deleted.ok()) {
+          LOG(WARNING) << deleted.error().Message();
         }
-        case RequestType::Invalid: {
-          LOG(WARNING) << "Invalid Request Type: " << req["request_type"];
-          break;
+        server->Close();
+      }
+
+    } else if (fd == *sweep_timer) {
+      std::uint64_t expirations;
+      (*sweep_timer)->Read(&expirations, sizeof(expirations));
+      const auto now = Clock::now();
+      std::vector<SharedFD> expired;
+      for (const auto& [socket, connection] : connections) {
+        if (connection->state != Connection::State::kExecuting &&
+            connection->deadline < now) {
+          expired.push_back(socket);
         }
       }
+      for (const auto& socket : expired) {
+        LOG(WARNING) << "Client timed out, closing connection";
+        close_connection(socket);
+      }
 
-      response_list.append(response);
-      if (!(response["request_status"].asString() ==
-            StatusToStr(RequestStatus::Success))) {
-        LOG(INFO) << "Request failed:" << req;
-        transaction_failed = true;
+    } else {
+      auto it = connections.find(fd);
+      if (it == connections.end()) {
         continue;
       }
+      auto connection = it->second;
+      const bool keep = connection->state == Connection::State::kWritingResponse
+                            ? WriteResponse(*connection)
+                            : ReadRequest(*connection);
+      if (!keep) {
+        close_connection(fd);
+        continue;
+      }
+      if (connection->state == Connection::State::kExecuting) {
+        // the socket is not watched while the request runs
+        auto deleted = epoll->Delete(fd);
+        if (!deleted.ok()) {
+          LOG(WARNING) << deleted.error().Message();
+        }
+        executing++;
+        {
+          std::lock_guard lock(queue_mutex_);
+          requests_.emplace_back(std::move(connection));
+        }
+        queue_cv_.notify_one();
+      }
     }
+  }
 
-    config_response["response_list"] = response_list;
+  {
+    std::lock_guard lock(queue_mutex_);
+    stop_workers_ = true;
+  }
+  queue_cv_.notify_all();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+  workers_.clear();
+  server->Close();
+  // the pooled taps are not handed out any more
+  tap_pool_.reset();
+}
 
-    auto status =
-        transaction_failed ? RequestStatus::Failure : RequestStatus::Success;
-    config_response["config_status"] = StatusToStr(status);
+std::optional<Json::Value> ResourceManager::HandleConfigRequest(
+    SharedFD client_socket, const Json::Value& req) {
+  if (!ValidateConfigRequest(req)) {
+    return std::nullopt;
+  }
 
-    if (!transaction_failed) {
-      auto session_id = AllocateSessionID();
-      config_response["session_id"] = session_id;
-      auto s = std::make_shared<Session>(session_id,
-                                         GetUserIDFromSock(client_socket));
+  Json::Value req_list = req["config_request"]["request_list"];
+
+  Json::Value config_response;
+  Json::Value response_list;
+  Json::ArrayIndex req_list_size = req_list.size();
+
+  // sentinel value, so we can populate the list of responses correctly
+  // without trying to satisfy requests that will be aborted
+  bool transaction_failed = false;
+  // the resources acquired by this transaction, committed if all succeed
+  PendingResources pending_add;
+
+  for (Json::ArrayIndex i = 0; i < req_list_size; ++i) {
+    LOG(INFO) << "Processing Request: " << i;
+    auto req = req_list[i];
+    auto req_ty_str = req["request_type"].asString();
+    auto req_ty = StrToReqTy(req_ty_str);
+
+    Json::Value response;
+    if (transaction_failed) {
+      response["request_type"] = req_ty_str;
+      response["request_status"] = "pending";
+      response["error"] = "";
+      response_list.append(response);
+      continue;
+    }
 
-      // commit the resources
-      s->Insert(pending_add_);
-      pending_add_.clear();
-      managed_sessions_.insert({session_id, s});
-    } else {
-      // be sure to release anything we've acquired if the transaction failed
-      for (auto& droped_resource : pending_add_) {
-        droped_resource.second->ReleaseResource();
+    switch (req_ty) {
+      case RequestType::ID: {
+        response = JsonHandleIdRequest();
+        break;
+      }
+      case RequestType::Shutdown: {
+        if (i != 0 || req_list_size != 1) {
+          response["request_type"] = req_ty_str;
+          response["request_status"] = "failed";
+          response["error"] =
+              "Shutdown requests cannot be processed with other "
+              "configuration requests";
+          response_list.append(response);
+          break;
+        } else {
+          JsonHandleShutdownRequest(client_socket);
+          return std::nullopt;
+        }
+      }
+      case RequestType::CreateInterface: {
+        response =
+            JsonHandleCreateInterfaceRequest(client_socket, req, pending_add);
+        break;
       }
+      case RequestType::DestroyInterface: {
+        response = JsonHandleDestroyInterfaceRequest(req);
+        break;
+      }
+      case RequestType::StopSession: {
+        response = JsonHandleStopSessionRequest(
+            req, GetUserIDFromSock(client_socket));
+        break;
+      }
+      case RequestType::Invalid: {
+        LOG(WARNING) << "Invalid Request Type: " << req["request_type"];
+        break;
+      }
+    }
+
+    response_list.append(response);
+    if (!(response["request_status"].asString() ==
+          StatusToStr(RequestStatus::Success))) {
+      LOG(INFO) << "Request failed:" << req;
+      transaction_failed = true;
+      continue;
     }
+  }
+
+  config_response["response_list"] = response_list;
 
-    SendJsonMsg(client_socket, config_response);
-    LOG(INFO) << "Closing connection to client";
-    client_socket->Close();
+  auto status =
+      transaction_failed ? RequestStatus::Failure : RequestStatus::Success;
+  config_response["config_status"] = StatusToStr(status);
+
+  if (!transaction_failed) {
+    auto session_id = AllocateSessionID();
+    config_response["session_id"] = session_id;
+    auto s = std::make_shared<Session>(session_id,
+                                       GetUserIDFromSock(client_socket));
+
+    // commit the resources
+    s->Insert(pending_add);
+    std::lock_guard lock(state_mutex_);
+    managed_sessions_.insert({session_id, s});
+  } else {
+    // be sure to release anything we've acquired if the transaction failed
+    for (auto& droped_resource : pending_add) {
+      droped_resource.second->ReleaseResource();
+    }
   }
-  server->Close();
+  return config_response;
 }
 
 uid_t GetUserIDFromSock(SharedFD client_socket) {
@@ -406,7 +700,13 @@ Json::Value ResourceManager::JsonHandleIdRequest() {
 
 Json::Value ResourceManager::JsonHandleShutdownRequest(SharedFD client_socket) {
   LOG(INFO) << "Received Shutdown Request";
-  shutdown_socket_ = client_socket;
+  // answered by the destructor, after the epoll loop
+  client_socket->Fcntl(F_SETFL, client_socket->Fcntl(F_GETFL, 0) & ~O_NONBLOCK);
+  {
+    std::lock_guard lock(state_mutex_);
+    shutdown_socket_ = client_socket;
+  }
+  shutdown_requested_ = true;
 
   Json::Value resp;
   resp["request_type"] = "shutdown";
@@ -417,7 +717,8 @@ Json::Value ResourceManager::JsonHandleShutdownRequest(SharedFD client_socket) {
 }
 
 Json::Value ResourceManager::JsonHandleCreateInterfaceRequest(
-    SharedFD client_socket, const Json::Value& request) {
+    SharedFD client_socket, const Json::Value& request,
+    PendingResources& pending) {
   LOG(INFO) << "Received CreateInterface Request";
 
   Json::Value resp;
@@ -466,9 +767,10 @@ Json::Value ResourceManager::JsonHandleCreateInterfaceRequest(
     do {
       auto id = AllocateResourceID();
       resp["resource_id"] = id;
+      ss.str("");
       ss << "cvd-" << iface_ty_name << "-" << user_opt.value().substr(0, 4)
          << std::setfill('0') << std::setw(2) << (id % kMaxIfaceNameId);
-      addedIface = AddInterface(ss.str(), iface_type, id, uid);
+      addedIface = AddInterface(ss.str(), iface_type, id, uid, pending);
       --attempts;
     } while (!addedIface && (attempts > 0));
   }
@@ -496,7 +798,11 @@ Json::Value ResourceManager::JsonHandleDestroyInterfaceRequest(
 
   auto iface_name = request["iface_name"].asString();
 
-  bool isManagedIface = active_interfaces_.erase(iface_name) > 0;
+  bool isManagedIface = false;
+  {
+    std::lock_guard lock(state_mutex_);
+    isManagedIface = active_interfaces_.erase(iface_name) > 0;
+  }
 
   if (!isManagedIface) {
     auto msg = "Interface not managed: " + iface_name;
@@ -569,15 +875,16 @@ Json::Value ResourceManager::JsonHandleStopSessionRequest(
   auto session_id = request["session_id"].asUInt();
   LOG(INFO) << "Received StopSession Request for Session ID: " << session_id;
 
-  auto it = managed_sessions_.find(session_id);
-  if (it == managed_sessions_.end()) {
+  auto sess_opt = FindSession(session_id);
+  if (!sess_opt) {
     auto msg = "Session not managed: " + std::to_string(session_id);
     LOG(WARNING) << msg;
     resp["error"] = msg;
     return resp;
   }
+  auto session = *sess_opt;
 
-  if (it->second->GetUID() != uid) {
+  if (session->GetUID() != uid) {
     auto msg = "Effective user ID does not match session owner. socket uid: " +
                std::to_string(uid);
     LOG(WARNING) << msg;
@@ -591,15 +898,16 @@ Json::Value ResourceManager::JsonHandleStopSessionRequest(
   // method for aborting the transaction. Instead, we try to release the
   // resource and then can signal to the rest of the transaction the failure
   // state
-  auto success = it->second->ReleaseAllResources();
+  auto success = session->ReleaseAllResources();
 
+  std::lock_guard lock(state_mutex_);
   // release the names from the global list for reuse in future requests
-  for (auto& iface : it->second->GetActiveInterfaces()) {
+  for (auto& iface : session->GetActiveInterfaces()) {
     active_interfaces_.erase(iface);
   }
 
   if (success) {
-    managed_sessions_.erase(it);
+    managed_sessions_.erase(session_id);
     resp["request_status"] = StatusToStr(RequestStatus::Success);
   } else {
     resp["error"] =
@@ -612,6 +920,7 @@ Json::Value ResourceManager::JsonHandleStopSessionRequest(
 
 std::optional<std::shared_ptr<Session>> ResourceManager::FindSession(
     uint32_t id) {
+  std::lock_guard lock(state_mutex_);
   auto it = managed_sessions_.find(id);
   if (it == managed_sessions_.end()) {
     return std::nullopt;
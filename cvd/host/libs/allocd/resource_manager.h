@@ -19,20 +19,28 @@
 #include <sys/types.h>
 
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <deque>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <set>
+#include <thread>
+#include <vector>
 
 #include "common/libs/fs/shared_fd.h"
 #include "host/libs/allocd/alloc_utils.h"
 #include "host/libs/allocd/request.h"
 #include "host/libs/allocd/resource.h"
+#include "host/libs/allocd/tap_pool.h"
 #include "host/libs/allocd/utils.h"
 
 namespace cuttlefish {
 
+// Thread safe, the requests on one session are serialized
 class Session {
  public:
   explicit Session(uint32_t session_id, uid_t uid)
@@ -48,10 +56,12 @@ class Session {
 
   void Insert(
       const std::map<uint32_t, std::shared_ptr<StaticResource>>& resources) {
+    std::lock_guard lock(mutex_);
     managed_resources_.insert(resources.begin(), resources.end());
   }
 
   bool ReleaseAllResources() {
+    std::lock_guard lock(mutex_);
     bool success = true;
     for (auto& res : managed_resources_) {
       success &= res.second->ReleaseResource();
@@ -62,6 +72,7 @@ class Session {
   }
 
   bool ReleaseResource(uint32_t resource_id) {
+    std::lock_guard lock(mutex_);
     auto it = managed_resources_.find(resource_id);
     if (it == managed_resources_.end()) {
       return false;
@@ -80,6 +91,7 @@ class Session {
   uid_t uid_{};
   std::set<std::string> active_interfaces_;
   std::map<uint32_t, std::shared_ptr<StaticResource>> managed_resources_;
+  std::mutex mutex_;
 };
 
 /* Manages static resources while the daemon is running.
@@ -91,6 +103,11 @@ class Session {
  *
  * Clients can request new resources by connecting to a socket, and sending a
  * JSON request, detailing the type of resource required.
+ *
+ * The connections are served by one epoll loop, and their requests are run by
+ * a pool of worker threads, so that a slow client or a slow request does not
+ * hold up the others. The interfaces are claimed by name and the sessions are
+ * locked one by one, so the independent requests run in parallel.
  */
 struct ResourceManager {
  public:
@@ -102,14 +119,38 @@ struct ResourceManager {
 
   void SetUseEbtablesLegacy(bool use_legacy);
 
+  void SetNumWorkers(size_t num_workers);
+
+  // Taps kept ready per bridge, see TapPool. 0 disables the pool.
+  void SetTapPoolSize(size_t size);
+
   void JsonServer();
 
  private:
+  struct Connection;
+  using Clock = std::chrono::steady_clock;
+  using PendingResources = std::map<uint32_t, std::shared_ptr<StaticResource>>;
+
+  // Reads what it can, false if the connection is to be closed
+  bool ReadRequest(Connection& connection);
+  // Writes what it can, false once done or if the connection failed
+  bool WriteResponse(Connection& connection);
+  void RunWorker();
+  /*
+   * Runs the whole transaction of a request. Nothing is sent back if the
+   * request is invalid, or if it is a shutdown request, answered on shutdown.
+   */
+  std::optional<Json::Value> HandleConfigRequest(SharedFD client_socket,
+                                                 const Json::Value& req);
+
   uint32_t AllocateResourceID();
   uint32_t AllocateSessionID();
 
   bool AddInterface(const std::string& iface, IfaceType ty, uint32_t id,
-                    uid_t uid);
+                    uid_t uid, PendingResources& pending);
+
+  // Whether a tap of the pool of `bridge` was handed out as `iface`
+  bool TakePooledTap(const std::string& bridge, const std::string& iface);
 
   bool RemoveInterface(const std::string& iface, IfaceType ty);
 
@@ -124,7 +165,8 @@ struct ResourceManager {
   Json::Value JsonHandleShutdownRequest(SharedFD client_socket);
 
   Json::Value JsonHandleCreateInterfaceRequest(SharedFD client_socket,
-                                               const Json::Value& request);
+                                               const Json::Value& request,
+                                               PendingResources& pending);
 
   Json::Value JsonHandleDestroyInterfaceRequest(const Json::Value& request);
 
@@ -142,14 +184,29 @@ struct ResourceManager {
  private:
   std::atomic_uint32_t global_resource_id_ = 0;
   std::atomic_uint32_t session_id_ = 0;
+  // guards active_interfaces_, managed_sessions_ and shutdown_socket_, which
+  // the slow work is done out of
+  std::mutex state_mutex_;
   std::set<std::string> active_interfaces_;
   std::map<uint32_t, std::shared_ptr<Session>> managed_sessions_;
-  std::map<uint32_t, std::shared_ptr<StaticResource>> pending_add_;
   std::string location = kDefaultLocation;
   bool use_ipv4_bridge_ = true;
   bool use_ipv6_bridge_ = true;
   bool use_ebtables_legacy_ = false;
   cuttlefish::SharedFD shutdown_socket_;
+  size_t tap_pool_size_ = 0;
+  std::unique_ptr<TapPool> tap_pool_;
+  std::atomic<bool> shutdown_requested_ = false;
+
+  size_t num_workers_ = 4;
+  std::vector<std::thread> workers_;
+  std::mutex queue_mutex_;
+  std::condition_variable queue_cv_;
+  bool stop_workers_ = false;
+  std::deque<std::shared_ptr<Connection>> requests_;
+  // the requests run, handed back to the epoll loop through completions_event_
+  std::deque<std::shared_ptr<Connection>> completed_;
+  SharedFD completions_event_;
 };
 
 }  // namespace cuttlefish
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "host/libs/allocd/tap_pool.h"
+
+#include <iomanip>
+#include <sstream>
+
+#include <android-base/logging.h>
+
+#include "host/libs/allocd/alloc_utils.h"
+
+namespace cuttlefish {
+namespace {
+
+constexpr auto kRetryDelay = std::chrono::seconds(5);
+
+}  // namespace
+
+TapPool::TapPool(const size_t size, std::vector<std::string> bridges)
+    : size_(size) {
+  for (auto& bridge : bridges) {
+    pools_[std::move(bridge)];
+  }
+  if (size_ > 0) {
+    refill_thread_ = std::thread([this]() { Refill(); });
+  }
+}
+
+TapPool::~TapPool() {
+  {
+    std::lock_guard lock(mutex_);
+    stop_ = true;
+  }
+  refill_cv_.notify_all();
+  if (refill_thread_.joinable()) {
+    refill_thread_.join();
+  }
+  for (auto& [bridge, pool] : pools_) {
+    for (const auto& tap : pool.taps) {
+      DestroyIface(tap);
+    }
+  }
+  const auto stats = Stats();
+  LOG(INFO) << "Tap pool: " << stats.hits << " hits, " << stats.misses
+            << " misses, " << stats.refills << " refills taking "
+            << (stats.refills ? stats.total_refill_time.count() / stats.refills
+                              : 0)
+            << "us on average and " << stats.max_refill_time.count()
+            << "us at most, " << stats.failed_refills << " failed refills";
+}
+
+bool TapPool::Take(const std::string& bridge, const std::string& name) {
+  std::string tap;
+  {
+    std::lock_guard lock(mutex_);
+    auto it = pools_.find(bridge);
+    if (it == pools_.end() || it->second.taps.empty()) {
+      stats_.misses++;
+      LOG(INFO) << "Tap pool miss for " << name;
+      return false;
+    }
+    tap = std::move(it->second.taps.front());
+    it->second.taps.pop_front();
+  }
+  refill_cv_.notify_one();
+
+  const bool renamed = RenameTapAndBringUp(tap, name);
+  if (!renamed) {
+    LOG(WARNING) << "Failed to hand out pooled tap " << tap << " as " << name;
+    DestroyIface(tap);
+  }
+  std::lock_guard lock(mutex_);
+  if (!renamed) {
+    stats_.misses++;
+    return false;
+  }
+  stats_.hits++;
+  LOG(INFO) << "Tap pool hit: " << tap << " is now " << name;
+  return true;
+}
+
+TapPoolStats TapPool::Stats() const {
+  std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+std::string TapPool::NextName() {
+  // fits in IFNAMSIZ, unlike the names derived from the user name
+  std::stringstream ss;
+  ss << "cvd-pool-" << std::setfill('0') << std::setw(5)
+     << (next_id_++ % 100000);
+  return ss.str();
+}
+
+void TapPool::Refill() {
+  std::unique_lock lock(mutex_);
+  while (!stop_) {
+    // the pool that is the most short of taps, and may be retried
+    const auto now = std::chrono::steady_clock::now();
+    auto next_retry = std::chrono::steady_clock::time_point::max();
+    Pool* pool = nullptr;
+    std::string bridge;
+    for (auto& [pool_bridge, candidate] : pools_) {
+      if (candidate.taps.size() >= size_) {
+        continue;
+      }
+      if (candidate.retry_after > now) {
+        next_retry = std::min(next_retry, candidate.retry_after);
+        continue;
+      }
+      if (!pool || candidate.taps.size() < pool->taps.size()) {
+        pool = &candidate;
+        bridge = pool_bridge;
+      }
+    }
+    if (!pool) {
+      if (next_retry == std::chrono::steady_clock::time_point::max()) {
+        refill_cv_.wait(lock);
+      } else {
+        refill_cv_.wait_until(lock, next_retry);
+      }
+      continue;
+    }
+
+    const auto name = NextName();
+    lock.unlock();
+    const auto start = std::chrono::steady_clock::now();
+    // the ethernet taps are linked to the bridge while down
+    bool created = AddTapIface(name);
+    if (created && !bridge.empty() && !LinkTapToBridge(name, bridge)) {
+      DestroyIface(name);
+      created = false;
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start);
+    lock.lock();
+
+    if (!created) {
+      LOG(WARNING) << "Failed to add a tap to the pool of bridge \"" << bridge
+                   << "\", retrying in " << kRetryDelay.count() << "s";
+      stats_.failed_refills++;
+      pool->retry_after = std::chrono::steady_clock::now() + kRetryDelay;
+      continue;
+    }
+    pool->taps.push_back(name);
+    stats_.refills++;
+    stats_.total_refill_time += elapsed;
+    stats_.max_refill_time = std::max(stats_.max_refill_time, elapsed);
+    LOG(DEBUG) << "Added " << name << " to the tap pool in " << elapsed.count()
+               << "us";
+  }
+}
+
+}  // namespace cuttlefish
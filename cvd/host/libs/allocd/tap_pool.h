@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2023 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cuttlefish {
+
+struct TapPoolStats {
+  std::uint64_t hits = 0;
+  std::uint64_t misses = 0;
+  std::uint64_t refills = 0;
+  std::uint64_t failed_refills = 0;
+  std::chrono::microseconds total_refill_time{0};
+  std::chrono::microseconds max_refill_time{0};
+};
+
+/*
+ * Taps created ahead of the requests, down, and already linked to their
+ * bridge for the ethernet and wireless ones. Handing one out is a rename and
+ * a link up instead of creating the tap and linking it.
+ *
+ * What depends on the final name of the interface, i.e. the gateway address,
+ * the iptables and the ebtables rules, is still set up by the request.
+ *
+ * A background thread refills the pool after every take.
+ */
+class TapPool {
+ public:
+  // One pool per bridge, "" for the taps that are not linked to any
+  TapPool(size_t size, std::vector<std::string> bridges);
+  ~TapPool();
+
+  TapPool(const TapPool&) = delete;
+  TapPool& operator=(const TapPool&) = delete;
+
+  // Whether a pooled tap was renamed to `name` and brought up
+  bool Take(const std::string& bridge, const std::string& name);
+
+  TapPoolStats Stats() const;
+
+ private:
+  struct Pool {
+    std::deque<std::string> taps;
+    // do not retry too often when the bridge does not exist yet
+    std::chrono::steady_clock::time_point retry_after;
+  };
+
+  void Refill();
+  std::string NextName();
+
+  const size_t size_;
+  mutable std::mutex mutex_;
+  std::condition_variable refill_cv_;
+  bool stop_ = false;
+  std::map<std::string, Pool> pools_;
+  std::uint32_t next_id_ = 0;
+  TapPoolStats stats_;
+  std::thread refill_thread_;
+};
+
+}  // namespace cuttlefish
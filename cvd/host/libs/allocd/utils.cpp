@@ -25,19 +25,6 @@
 
 namespace cuttlefish {
 
-// While the JSON schema and payload structure are designed to be extensible,
-// and avoid version incompatibility. However, should project requirements
-// change, it is necessary that we have a mechanism to handle incompatibilities
-// that arise over time. If an incompatibility should come about, the
-// kMinHeaderVersion constant should be increased to match the new minimal set
-// of features that are supported.
-
-/// Current supported Header version number
-constexpr uint16_t kCurHeaderVersion = 1;
-
-/// Oldest compatible header version number
-constexpr uint16_t kMinHeaderVersion = 1;
-
 const std::map<RequestType, const char*> RequestTyToStrMap = {
     {RequestType::ID, "alloc_id"},
     {RequestType::CreateInterface, "create_interface"},
@@ -80,6 +67,10 @@ const std::map<std::string, RequestStatus> StrToReqStatusMap = {
 
 bool SendJsonMsg(SharedFD client_socket, const Json::Value& resp) {
   LOG(INFO) << "Sending JSON message";
+  return SendAll(client_socket, SerializeJsonMsg(resp));
+}
+
+std::string SerializeJsonMsg(const Json::Value& resp) {
   Json::StreamWriterBuilder factory;
   auto resp_str = Json::writeString(factory, resp);
 
@@ -90,9 +81,7 @@ bool SendJsonMsg(SharedFD client_socket, const Json::Value& resp) {
   header->len = resp_str.size();
   header->version = kCurHeaderVersion;
 
-  auto payload = header_buff + resp_str;
-
-  return SendAll(client_socket, payload);
+  return header_buff + resp_str;
 }
 
 std::optional<Json::Value> RecvJsonMsg(SharedFD client_socket) {
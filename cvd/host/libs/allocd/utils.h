@@ -35,12 +35,28 @@ constexpr char kDefaultLocation[] =
 static constexpr int kSendFlags = 0;
 static constexpr int kRecvFlags = 0;
 
+// While the JSON schema and payload structure are designed to be extensible,
+// and avoid version incompatibility. However, should project requirements
+// change, it is necessary that we have a mechanism to handle incompatibilities
+// that arise over time. If an incompatibility should come about, the
+// kMinHeaderVersion constant should be increased to match the new minimal set
+// of features that are supported.
+
+/// Current supported Header version number
+constexpr uint16_t kCurHeaderVersion = 1;
+
+/// Oldest compatible header version number
+constexpr uint16_t kMinHeaderVersion = 1;
+
 /// Sends a Json value over client_socket
 ///
 /// returns true if successfully sent the whole JSON object
 /// returns false otherwise
 bool SendJsonMsg(cuttlefish::SharedFD client_socket, const Json::Value& resp);
 
+/// The header and payload SendJsonMsg sends for resp
+std::string SerializeJsonMsg(const Json::Value& resp);
+
 /// Receives a single Json value over client_socket
 ///
 /// The returned option will contain the JSON object when successful,